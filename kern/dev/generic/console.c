@@ -39,6 +39,11 @@
  * supported, although such support could be added without undue
  * difficulty.
  *
+ * Otherwise, output goes into a ring buffer that the device's
+ * write-done interrupt drains a character at a time, so printing only
+ * waits when the ring is full. Polled output doesn't wait for the
+ * ring, so it can come out ahead of characters still queued there.
+ *
  * Note that nothing happens until we have a device to write to. A
  * buffer of size DELAYBUFSIZE is used to hold output that is
  * generated before this point. This means that (1) using kprintf for
@@ -55,6 +60,7 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
@@ -122,6 +128,71 @@ putch_polled(struct con_softc *cs, int ch)
 
 //////////////////////////////////////////////////
 
+/*
+ * If the device is idle and there's output queued, send the next
+ * character. The interrupt when it's done sends the one after that.
+ */
+static
+void
+con_txkick(struct con_softc *cs)
+{
+	unsigned char ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_txlock));
+
+	if (cs->cs_txbusy || cs->cs_txchars_head == cs->cs_txchars_tail) {
+		return;
+	}
+	ch = cs->cs_txchars[cs->cs_txchars_tail];
+	cs->cs_txchars_tail =
+		(cs->cs_txchars_tail + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	cs->cs_txbusy = true;
+	cs->cs_send(cs->cs_devdata, ch);
+}
+
+/*
+ * Queue a character for output, waiting if the ring is full. (As
+ * with the input buffer, one slot is left empty to tell full from
+ * empty.)
+ */
+static
+void
+con_txput(struct con_softc *cs, int ch)
+{
+	unsigned nexthead;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_txlock));
+
+	nexthead = (cs->cs_txchars_head + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	while (nexthead == cs->cs_txchars_tail) {
+		con_txkick(cs);
+		wchan_sleep(cs->cs_txwchan, &cs->cs_txlock);
+	}
+	cs->cs_txchars[cs->cs_txchars_head] = ch;
+	cs->cs_txchars_head = nexthead;
+}
+
+/*
+ * Print a buffer, using interrupts to wait for I/O completion. If
+ * CRLF is set, newlines are sent as CR-LF.
+ */
+static
+void
+con_write_intr(struct con_softc *cs, const char *buf, size_t len, bool crlf)
+{
+	size_t i;
+
+	spinlock_acquire(&cs->cs_txlock);
+	for (i=0; i<len; i++) {
+		if (crlf && buf[i]=='\n') {
+			con_txput(cs, '\r');
+		}
+		con_txput(cs, buf[i]);
+	}
+	con_txkick(cs);
+	spinlock_release(&cs->cs_txlock);
+}
+
 /*
  * Print a character, using interrupts to wait for I/O completion.
  */
@@ -129,8 +200,9 @@ static
 void
 putch_intr(struct con_softc *cs, int ch)
 {
-	P(cs->cs_wsem);
-	cs->cs_send(cs->cs_devdata, ch);
+	char c = ch;
+
+	con_write_intr(cs, &c, 1, false);
 }
 
 /*
@@ -178,13 +250,25 @@ con_input(void *vcs, int ch)
 
 /*
  * Called from underlying device when a write-done interrupt occurs.
+ * Send the next queued character, and once the ring is half empty
+ * let any waiting writers go.
  */
 void
 con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
+	unsigned used;
 
-	V(cs->cs_wsem);
+	spinlock_acquire(&cs->cs_txlock);
+	cs->cs_txbusy = false;
+	con_txkick(cs);
+
+	used = (cs->cs_txchars_head + CONSOLE_OUTPUT_BUFFER_SIZE
+		- cs->cs_txchars_tail) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	if (used <= CONSOLE_OUTPUT_BUFFER_SIZE / 2) {
+		wchan_wakeall(cs->cs_txwchan, &cs->cs_txlock);
+	}
+	spinlock_release(&cs->cs_txlock);
 }
 
 //////////////////////////////////////////////////
@@ -215,6 +299,32 @@ putch(int ch)
 	}
 }
 
+/*
+ * Send what's still in the output ring, by polling. For shutdown,
+ * with interrupts off, when the write-done interrupts that would
+ * drain it aren't coming any more.
+ */
+void
+putch_flush(void)
+{
+	struct con_softc *cs = the_console;
+	unsigned char ch;
+
+	if (cs == NULL) {
+		return;
+	}
+	KASSERT(curthread->t_curspl > 0);
+
+	spinlock_acquire(&cs->cs_txlock);
+	while (cs->cs_txchars_tail != cs->cs_txchars_head) {
+		ch = cs->cs_txchars[cs->cs_txchars_tail];
+		cs->cs_txchars_tail =
+			(cs->cs_txchars_tail + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+		putch_polled(cs, ch);
+	}
+	spinlock_release(&cs->cs_txlock);
+}
+
 int
 getch(void)
 {
@@ -244,12 +354,12 @@ static
 int
 con_io(struct device *dev, struct uio *uio)
 {
+	struct con_softc *cs = dev->d_data;
 	int result;
 	char ch;
+	size_t len;
 	struct lock *lk;
 
-	(void)dev;  // unused
-
 	if (uio->uio_rw==UIO_READ) {
 		lk = con_userlock_read;
 	}
@@ -276,15 +386,17 @@ con_io(struct device *dev, struct uio *uio)
 			}
 		}
 		else {
-			result = uiomove(&ch, 1, uio);
+			/* Take as much as fits in one go */
+			len = uio->uio_resid;
+			if (len > sizeof(cs->cs_userbuf)) {
+				len = sizeof(cs->cs_userbuf);
+			}
+			result = uiomove(cs->cs_userbuf, len, uio);
 			if (result) {
 				lock_release(lk);
 				return result;
 			}
-			if (ch=='\n') {
-				putch('\r');
-			}
-			putch(ch);
+			con_write_intr(cs, cs->cs_userbuf, len, true);
 		}
 	}
 	lock_release(lk);
@@ -343,7 +455,8 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
+	struct semaphore *rsem;
+	struct wchan *txwchan;
 	struct lock *rlk, *wlk;
 
 	/*
@@ -363,30 +476,35 @@ config_con(struct con_softc *cs, int unit)
 	if (rsem == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
-	if (wsem == NULL) {
+	txwchan = wchan_create("console write");
+	if (txwchan == NULL) {
 		sem_destroy(rsem);
 		return ENOMEM;
 	}
 	rlk = lock_create("console-lock-read");
 	if (rlk == NULL) {
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(txwchan);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
 		lock_destroy(rlk);
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(txwchan);
 		return ENOMEM;
 	}
 
 	cs->cs_rsem = rsem;
-	cs->cs_wsem = wsem;
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
 
+	spinlock_init(&cs->cs_txlock);
+	cs->cs_txwchan = txwchan;
+	cs->cs_txbusy = false;
+	cs->cs_txchars_head = 0;
+	cs->cs_txchars_tail = 0;
+
 	the_console = cs;
 	con_userlock_read = rlk;
 	con_userlock_write = wlk;
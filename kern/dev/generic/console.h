@@ -37,7 +37,10 @@
  * device, and are to be initialized by the attach routine.
  */
 
+#include <spinlock.h>
+
 #define CONSOLE_INPUT_BUFFER_SIZE 32
+#define CONSOLE_OUTPUT_BUFFER_SIZE 1024
 
 struct con_softc {
 	/* initialized by attach routine */
@@ -47,10 +50,20 @@ struct con_softc {
 
 	/* initialized by config routine */
 	struct semaphore *cs_rsem;
-	struct semaphore *cs_wsem;
 	unsigned char cs_gotchars[CONSOLE_INPUT_BUFFER_SIZE];
 	unsigned cs_gotchars_head;	/* next slot to put a char in */
 	unsigned cs_gotchars_tail;	/* next slot to take a char out */
+
+	/* output ring, drained by the write-done interrupt */
+	struct spinlock cs_txlock;	/* protects the ring and cs_txbusy */
+	struct wchan *cs_txwchan;	/* writers waiting for room */
+	bool cs_txbusy;			/* device is sending a char */
+	unsigned char cs_txchars[CONSOLE_OUTPUT_BUFFER_SIZE];
+	unsigned cs_txchars_head;	/* next slot to put a char in */
+	unsigned cs_txchars_tail;	/* next slot to take a char out */
+
+	/* staging for user writes; protected by the user write lock */
+	char cs_userbuf[CONSOLE_OUTPUT_BUFFER_SIZE];
 };
 
 /*
@@ -176,16 +176,20 @@ emu_waitdone(struct emu_softc *sc)
  * for VOP_EACHOPEN. At the hardware level, we need to "open" files in
  * order to look at them, so by the time VOP_EACHOPEN is called the
  * files are already open.
+ *
+ * The caller holds e_lock.
  */
 static
 int
-emu_open(struct emu_softc *sc, uint32_t handle, const char *name,
-	 bool create, bool excl, mode_t mode,
-	 uint32_t *newhandle, int *newisdir)
+emu_doopen(struct emu_softc *sc, uint32_t handle, const char *name,
+	   bool create, bool excl, mode_t mode,
+	   uint32_t *newhandle, int *newisdir)
 {
 	uint32_t op;
 	int result;
 
+	KASSERT(lock_do_i_hold(sc->e_lock));
+
 	if (strlen(name)+1 > EMU_MAXIO) {
 		return ENAMETOOLONG;
 	}
@@ -203,8 +207,6 @@ emu_open(struct emu_softc *sc, uint32_t handle, const char *name,
 	/* mode isn't supported (yet?) */
 	(void)mode;
 
-	lock_acquire(sc->e_lock);
-
 	strcpy(sc->e_iobuf, name);
 	membar_store_store();
 	emu_wreg(sc, REG_IOLEN, strlen(name));
@@ -217,6 +219,20 @@ emu_open(struct emu_softc *sc, uint32_t handle, const char *name,
 		*newisdir = emu_rreg(sc, REG_IOLEN)>0;
 	}
 
+	return result;
+}
+
+static
+int
+emu_open(struct emu_softc *sc, uint32_t handle, const char *name,
+	 bool create, bool excl, mode_t mode,
+	 uint32_t *newhandle, int *newisdir)
+{
+	int result;
+
+	lock_acquire(sc->e_lock);
+	result = emu_doopen(sc, handle, name, create, excl, mode,
+			    newhandle, newisdir);
 	lock_release(sc->e_lock);
 	return result;
 }
@@ -231,13 +247,9 @@ int
 emu_close(struct emu_softc *sc, uint32_t handle)
 {
 	int result;
-	bool mine;
 	int retries = 0;
 
-	mine = lock_do_i_hold(sc->e_lock);
-	if (!mine) {
-		lock_acquire(sc->e_lock);
-	}
+	lock_acquire(sc->e_lock);
 
 	while (1) {
 		/* Retry operation up to 10 times */
@@ -255,29 +267,44 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 		break;
 	}
 
-	if (!mine) {
-		lock_release(sc->e_lock);
-	}
+	lock_release(sc->e_lock);
 	return result;
 }
 
 /*
  * Common code for read and readdir.
+ *
+ * The device only does one thing at a time, so e_lock is held from
+ * loading the registers until the data has been copied out of the
+ * buffer. Copying to user memory can fault and sleep; that happens
+ * after letting go of the device, by way of a bounce buffer.
  */
 static
 int
 emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	   uint32_t op, struct uio *uio)
 {
+	char *bounce;
+	uint32_t got;
+	off_t newoffset;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_READ);
+	KASSERT(len <= EMU_MAXIO);
 
 	if (uio->uio_offset > (off_t)0xffffffff) {
 		/* beyond the largest size the file can have; generate EOF */
 		return 0;
 	}
 
+	bounce = NULL;
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		bounce = kmalloc(len);
+		if (bounce == NULL) {
+			return ENOMEM;
+		}
+	}
+
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
@@ -290,12 +317,27 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	}
 
 	membar_load_load();
-	result = uiomove(sc->e_iobuf, emu_rreg(sc, REG_IOLEN), uio);
-
-	uio->uio_offset = emu_rreg(sc, REG_OFFSET);
+	got = emu_rreg(sc, REG_IOLEN);
+	newoffset = emu_rreg(sc, REG_OFFSET);
+	if (bounce == NULL) {
+		result = uiomove(sc->e_iobuf, got, uio);
+	}
+	else {
+		memcpy(bounce, sc->e_iobuf, got);
+	}
 
  out:
 	lock_release(sc->e_lock);
+
+	if (bounce != NULL) {
+		if (result == 0) {
+			result = uiomove(bounce, got, uio);
+		}
+		kfree(bounce);
+	}
+	if (result == 0) {
+		uio->uio_offset = newoffset;
+	}
 	return result;
 }
 
@@ -322,28 +364,53 @@ emu_readdir(struct emu_softc *sc, uint32_t handle, uint32_t len,
 }
 
 /*
- * Write to a hardware-level file handle.
+ * Write to a hardware-level file handle. As with reads, user data
+ * goes through a bounce buffer so as not to hold the device while
+ * touching user memory.
  */
 static
 int
 emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	  struct uio *uio)
 {
+	char *bounce;
+	off_t offset;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_WRITE);
+	KASSERT(len <= EMU_MAXIO);
 
 	if (uio->uio_offset > (off_t)0xffffffff) {
 		return EFBIG;
 	}
 
+	offset = uio->uio_offset;
+	bounce = NULL;
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		bounce = kmalloc(len);
+		if (bounce == NULL) {
+			return ENOMEM;
+		}
+		result = uiomove(bounce, len, uio);
+		if (result) {
+			kfree(bounce);
+			return result;
+		}
+	}
+
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_IOLEN, len);
-	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
+	emu_wreg(sc, REG_OFFSET, offset);
 
-	result = uiomove(sc->e_iobuf, len, uio);
+	if (bounce == NULL) {
+		result = uiomove(sc->e_iobuf, len, uio);
+	}
+	else {
+		memcpy(sc->e_iobuf, bounce, len);
+		result = 0;
+	}
 	membar_store_store();
 	if (result) {
 		goto out;
@@ -354,6 +421,9 @@ emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 
  out:
 	lock_release(sc->e_lock);
+	if (bounce != NULL) {
+		kfree(bounce);
+	}
 	return result;
 }
 
@@ -404,6 +474,849 @@ emu_trunc(struct emu_softc *sc, uint32_t handle, off_t len)
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////
+//
+// Sharing the work among units
+//
+// Each emu unit only does one operation at a time. If System/161 has
+// several units looking at the same host directory, an emufs can hand
+// out its file reads and writes to whichever of them is least busy
+// (see emufs_pool). A file only has a handle on the unit it was
+// looked up through, so the first time its data goes through another
+// unit it is opened there by its path from the root. Everything else
+// (lookups, directories, sizes, truncate, close) stays on the emufs's
+// own unit.
+//
+
+/* Protects ef_nchans, e_pending, and the list of volumes */
+static struct spinlock emufs_chanlock = SPINLOCK_INITIALIZER;
+static struct emufs_fs *emufs_list;
+
+/*
+ * Done with a unit from emufs_chan_get.
+ */
+static
+void
+emufs_chan_put(struct emu_softc *sc)
+{
+	spinlock_acquire(&emufs_chanlock);
+	KASSERT(sc->e_pending > 0);
+	sc->e_pending--;
+	spinlock_release(&emufs_chanlock);
+}
+
+/*
+ * Choose a unit to move EV's data with: the one with the fewest
+ * operations pending, as long as EV can be opened there. Returns the
+ * unit and EV's handle on it.
+ */
+static
+void
+emufs_chan_get(struct emufs_fs *ef, struct emufs_vnode *ev,
+	       struct emu_softc **retsc, uint32_t *rethandle)
+{
+	struct emu_softc *sc;
+	unsigned i, best;
+	int isdir, result;
+
+	spinlock_acquire(&emufs_chanlock);
+	best = 0;
+	for (i=1; i<ef->ef_nchans; i++) {
+		if (ev->ev_chanstate[i] != EMUFS_CHAN_FAILED &&
+		    ef->ef_chans[i]->e_pending <
+		    ef->ef_chans[best]->e_pending) {
+			best = i;
+		}
+	}
+	sc = ef->ef_chans[best];
+	sc->e_pending++;
+	spinlock_release(&emufs_chanlock);
+
+	if (best > 0 && ev->ev_chanstate[best] != EMUFS_CHAN_OPEN) {
+		lock_acquire(sc->e_lock);
+		if (ev->ev_chanstate[best] == EMUFS_CHAN_CLOSED) {
+			result = emu_doopen(sc, EMU_ROOTHANDLE, ev->ev_path,
+					    false, false, 0,
+					    &ev->ev_chanhandle[best], &isdir);
+			ev->ev_chanstate[best] = result ?
+				EMUFS_CHAN_FAILED : EMUFS_CHAN_OPEN;
+		}
+		lock_release(sc->e_lock);
+
+		if (ev->ev_chanstate[best] != EMUFS_CHAN_OPEN) {
+			/* Use our own unit instead */
+			emufs_chan_put(sc);
+			best = 0;
+			sc = ef->ef_chans[0];
+			spinlock_acquire(&emufs_chanlock);
+			sc->e_pending++;
+			spinlock_release(&emufs_chanlock);
+		}
+	}
+
+	*retsc = sc;
+	*rethandle = ev->ev_chanhandle[best];
+}
+
+/*
+ * Close EV's handles on units other than its own, for reclaim.
+ */
+static
+void
+emufs_chan_closeall(struct emufs_fs *ef, struct emufs_vnode *ev)
+{
+	unsigned i, num;
+
+	spinlock_acquire(&emufs_chanlock);
+	num = ef->ef_nchans;
+	spinlock_release(&emufs_chanlock);
+
+	for (i=1; i<num; i++) {
+		if (ev->ev_chanstate[i] == EMUFS_CHAN_OPEN) {
+			/* emu_close retries on I/O error; ignore failure */
+			emu_close(ef->ef_chans[i], ev->ev_chanhandle[i]);
+		}
+		ev->ev_chanstate[i] = EMUFS_CHAN_CLOSED;
+	}
+}
+
+/*
+ * Find an emufs by device name. Call with emufs_chanlock held.
+ */
+static
+struct emufs_fs *
+emufs_byname(const char *name)
+{
+	struct emufs_fs *ef;
+	char buf[32];
+
+	for (ef = emufs_list; ef != NULL; ef = ef->ef_next) {
+		snprintf(buf, sizeof(buf), "emu%d", ef->ef_emu->e_unit);
+		if (!strcmp(buf, name)) {
+			return ef;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Let the emufs NAMES[0] use the units of NAMES[1..NUM-1] as well as
+ * its own. Either all of them are added or none are.
+ *
+ * Nothing here can check that the units see the same host directory;
+ * that's up to whoever configured System/161.
+ */
+int
+emufs_pool(unsigned num, char **names)
+{
+	struct emufs_fs *ef, *other;
+	struct emu_softc *add[EMUFS_MAXCHANS];
+	unsigned i, j, nadd;
+	int result;
+
+	result = 0;
+	spinlock_acquire(&emufs_chanlock);
+
+	ef = emufs_byname(names[0]);
+	if (ef == NULL) {
+		result = ENODEV;
+		goto out;
+	}
+
+	nadd = 0;
+	for (i=1; i<num; i++) {
+		other = emufs_byname(names[i]);
+		if (other == NULL) {
+			result = ENODEV;
+			goto out;
+		}
+		for (j=0; j<ef->ef_nchans; j++) {
+			if (ef->ef_chans[j] == other->ef_emu) {
+				result = EINVAL;
+				goto out;
+			}
+		}
+		for (j=0; j<nadd; j++) {
+			if (add[j] == other->ef_emu) {
+				result = EINVAL;
+				goto out;
+			}
+		}
+		if (ef->ef_nchans + nadd >= EMUFS_MAXCHANS) {
+			result = ENOSPC;
+			goto out;
+		}
+		add[nadd++] = other->ef_emu;
+	}
+
+	for (i=0; i<nadd; i++) {
+		ef->ef_chans[ef->ef_nchans++] = add[i];
+	}
+
+ out:
+	spinlock_release(&emufs_chanlock);
+	return result;
+}
+
+//
+////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////
+//
+// File data cache
+//
+// Reading and writing through the emulator is slow: each operation
+// is a trip out to the host. So file data is kept in a cache of
+// pages, shared by all the files on the emufs, and written back
+// lazily. Consecutive dirty pages are written back together, so a
+// stream of small writes goes out in EMU_MAXIO-sized operations.
+// Likewise, filling the cache for a read fetches as many of the
+// following pages as fit in one operation. File sizes are cached too,
+// so reads don't need EMU_OP_GETSIZE.
+//
+// This assumes nothing else changes the files behind our back on the
+// host side while they're loaded.
+//
+// Everything here is done with ef_cachelock held, except the trips
+// to the host: pages being read or written are marked busy and the
+// lock is let go meanwhile, so that other files (and other pages of
+// the same file) aren't held up. Nobody touches a busy page; wait on
+// ef_cachecv for it instead. Anything that lets go of the lock may
+// return EAGAIN to mean "things changed; look again".
+//
+// Cached data is written back by VOP_FSYNC, FSOP_SYNC, VOP_RECLAIM,
+// and when pages are reused; an error writing back is reported by
+// whichever of those caused it.
+//
+
+/* Max pages moved in one operation, plus one for a partial page */
+#define EMUFS_IOPAGES	(EMU_MAXIO / EMUFS_PAGESIZE + 1)
+
+/*
+ * Make sure the file's size is known.
+ */
+static
+int
+emufs_cache_getsize(struct emufs_fs *ef, struct emufs_vnode *ev)
+{
+	off_t size;
+	int result;
+
+	KASSERT(lock_do_i_hold(ef->ef_cachelock));
+
+	if (!ev->ev_sizevalid) {
+		lock_release(ef->ef_cachelock);
+		result = emu_getsize(ev->ev_emu, ev->ev_handle, &size);
+		lock_acquire(ef->ef_cachelock);
+		if (result) {
+			return result;
+		}
+		/* Someone else may have got there first */
+		if (!ev->ev_sizevalid) {
+			ev->ev_size = size;
+			ev->ev_sizevalid = true;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Move data for the busy pages described by UIO between the cache
+ * and the host. Reads stop early at EOF.
+ */
+static
+int
+emufs_cache_io(struct emufs_fs *ef, struct emufs_vnode *ev, struct uio *uio)
+{
+	struct emu_softc *sc;
+	uint32_t handle;
+	size_t resid;
+	int result;
+
+	KASSERT(uio->uio_resid <= EMU_MAXIO);
+
+	lock_release(ef->ef_cachelock);
+	emufs_chan_get(ef, ev, &sc, &handle);
+
+	if (uio->uio_rw == UIO_WRITE) {
+		result = emu_write(sc, handle, uio->uio_resid, uio);
+	}
+	else {
+		/* Read until full or EOF */
+		do {
+			resid = uio->uio_resid;
+			result = emu_read(sc, handle, resid, uio);
+		} while (result == 0 && uio->uio_resid > 0 &&
+			 uio->uio_resid < resid);
+	}
+
+	emufs_chan_put(sc);
+	lock_acquire(ef->ef_cachelock);
+	return result;
+}
+
+/*
+ * Find the page holding OFFSET of file EV, if there is one.
+ */
+static
+struct emufs_page *
+emufs_page_find(struct emufs_fs *ef, struct emufs_vnode *ev, off_t offset)
+{
+	struct emufs_page *ep;
+	unsigned i;
+
+	for (i=0; i<EMUFS_CACHEPAGES; i++) {
+		ep = &ef->ef_pages[i];
+		if (ep->ep_vnode == ev && ep->ep_offset == offset) {
+			ep->ep_lastuse = ++ef->ef_clock;
+			return ep;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Same, but if the page is busy wait until it isn't (or is gone).
+ */
+static
+struct emufs_page *
+emufs_page_lookup(struct emufs_fs *ef, struct emufs_vnode *ev, off_t offset)
+{
+	struct emufs_page *ep;
+
+	while ((ep = emufs_page_find(ef, ev, offset)) != NULL &&
+	       ep->ep_busy) {
+		cv_wait(ef->ef_cachecv, ef->ef_cachelock);
+	}
+	return ep;
+}
+
+static
+bool
+emufs_page_isdirty(struct emufs_page *ep)
+{
+	return ep->ep_dirtystart < ep->ep_dirtyend;
+}
+
+/*
+ * Write back the dirty part of EP, along with as many of the dirty
+ * pages after it as can go in the same operation.
+ */
+static
+int
+emufs_page_flush(struct emufs_fs *ef, struct emufs_page *ep)
+{
+	struct emufs_vnode *ev = ep->ep_vnode;
+	struct emufs_page *run[EMUFS_IOPAGES];
+	struct iovec iov[EMUFS_IOPAGES];
+	struct uio u;
+	unsigned i, n;
+	uint32_t len;
+	int result;
+
+	KASSERT(lock_do_i_hold(ef->ef_cachelock));
+	KASSERT(!ep->ep_busy);
+	KASSERT(emufs_page_isdirty(ep));
+
+	/* Collect the run */
+	run[0] = ep;
+	iov[0].iov_kbase = ep->ep_data + ep->ep_dirtystart;
+	iov[0].iov_len = ep->ep_dirtyend - ep->ep_dirtystart;
+	len = iov[0].iov_len;
+	for (n=1; n<EMUFS_IOPAGES; n++) {
+		if (run[n-1]->ep_dirtyend != EMUFS_PAGESIZE) {
+			break;
+		}
+		ep = emufs_page_find(ef, ev,
+				     run[n-1]->ep_offset + EMUFS_PAGESIZE);
+		if (ep == NULL || ep->ep_busy || ep->ep_dirtystart != 0 ||
+		    !emufs_page_isdirty(ep) ||
+		    len + ep->ep_dirtyend > EMU_MAXIO) {
+			break;
+		}
+		run[n] = ep;
+		iov[n].iov_kbase = ep->ep_data;
+		iov[n].iov_len = ep->ep_dirtyend;
+		len += iov[n].iov_len;
+	}
+
+	u.uio_iov = iov;
+	u.uio_iovcnt = n;
+	u.uio_offset = run[0]->ep_offset + run[0]->ep_dirtystart;
+	u.uio_resid = len;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = UIO_WRITE;
+	u.uio_space = NULL;
+
+	for (i=0; i<n; i++) {
+		run[i]->ep_busy = true;
+	}
+	result = emufs_cache_io(ef, ev, &u);
+	for (i=0; i<n; i++) {
+		if (result == 0) {
+			run[i]->ep_dirtystart = run[i]->ep_dirtyend = 0;
+		}
+		run[i]->ep_busy = false;
+	}
+	cv_broadcast(ef->ef_cachecv, ef->ef_cachelock);
+
+	return result;
+}
+
+/*
+ * Take EP away from its file. It should be clean, unless the data
+ * is being thrown away.
+ */
+static
+void
+emufs_page_drop(struct emufs_page *ep)
+{
+	KASSERT(ep->ep_vnode != NULL);
+	KASSERT(ep->ep_vnode->ev_npages > 0);
+	KASSERT(!ep->ep_busy);
+
+	ep->ep_vnode->ev_npages--;
+	ep->ep_vnode = NULL;
+	ep->ep_dirtystart = ep->ep_dirtyend = 0;
+}
+
+/*
+ * Get a page to hold OFFSET of file EV, reusing the least recently
+ * used one if none is free. Its contents are not set up.
+ *
+ * If the page to reuse is dirty, or every page is busy, this either
+ * waits (flushing the page if need be) and returns EAGAIN, or if
+ * WAIT is false returns EAGAIN without letting go of the lock.
+ */
+static
+int
+emufs_page_get(struct emufs_fs *ef, struct emufs_vnode *ev, off_t offset,
+	       bool wait, struct emufs_page **ret)
+{
+	struct emufs_page *ep, *victim;
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(ef->ef_cachelock));
+
+	victim = NULL;
+	for (i=0; i<EMUFS_CACHEPAGES; i++) {
+		ep = &ef->ef_pages[i];
+		if (ep->ep_vnode == NULL) {
+			victim = ep;
+			break;
+		}
+		if (ep->ep_busy || (!wait && emufs_page_isdirty(ep))) {
+			continue;
+		}
+		if (victim == NULL || ep->ep_lastuse < victim->ep_lastuse) {
+			victim = ep;
+		}
+	}
+
+	if (victim == NULL) {
+		if (wait) {
+			cv_wait(ef->ef_cachecv, ef->ef_cachelock);
+		}
+		return EAGAIN;
+	}
+	if (victim->ep_vnode != NULL && emufs_page_isdirty(victim)) {
+		KASSERT(wait);
+		result = emufs_page_flush(ef, victim);
+		return result ? result : EAGAIN;
+	}
+
+	if (victim->ep_data == NULL) {
+		/* Not used before; pages are kept once allocated */
+		victim->ep_data = kmalloc(EMUFS_PAGESIZE);
+		if (victim->ep_data == NULL) {
+			return ENOMEM;
+		}
+	}
+	if (victim->ep_vnode != NULL) {
+		emufs_page_drop(victim);
+	}
+
+	victim->ep_vnode = ev;
+	victim->ep_offset = offset;
+	victim->ep_dirtystart = victim->ep_dirtyend = 0;
+	victim->ep_lastuse = ++ef->ef_clock;
+	ev->ev_npages++;
+
+	*ret = victim;
+	return 0;
+}
+
+/*
+ * Load the page holding OFFSET of file EV, and as many of the pages
+ * after it (up to ENDOFFSET) as fit in one read and aren't already
+ * cached. Returns the first page.
+ */
+static
+int
+emufs_page_fill(struct emufs_fs *ef, struct emufs_vnode *ev,
+		off_t offset, off_t endoffset, struct emufs_page **ret)
+{
+	struct emufs_page *run[EMUFS_IOPAGES];
+	struct iovec iov[EMUFS_IOPAGES];
+	struct uio u;
+	unsigned i, n;
+	int result;
+
+	KASSERT(lock_do_i_hold(ef->ef_cachelock));
+	KASSERT(offset % EMUFS_PAGESIZE == 0);
+
+	/*
+	 * Only wait for the first page: waiting while holding busy
+	 * pages could leave everyone waiting for each other.
+	 */
+	for (n=0; n < EMU_MAXIO / EMUFS_PAGESIZE; n++) {
+		if (n > 0 && (offset >= endoffset ||
+			      emufs_page_find(ef, ev, offset) != NULL)) {
+			break;
+		}
+		result = emufs_page_get(ef, ev, offset, n == 0, &run[n]);
+		if (result && n > 0) {
+			/* Just read what we have */
+			break;
+		}
+		if (result) {
+			return result;
+		}
+		run[n]->ep_busy = true;
+		iov[n].iov_kbase = run[n]->ep_data;
+		iov[n].iov_len = EMUFS_PAGESIZE;
+		offset += EMUFS_PAGESIZE;
+	}
+
+	u.uio_iov = iov;
+	u.uio_iovcnt = n;
+	u.uio_offset = run[0]->ep_offset;
+	u.uio_resid = n * EMUFS_PAGESIZE;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = UIO_READ;
+	u.uio_space = NULL;
+
+	result = emufs_cache_io(ef, ev, &u);
+	for (i=0; i<n; i++) {
+		run[i]->ep_busy = false;
+		if (result) {
+			emufs_page_drop(run[i]);
+		}
+	}
+	cv_broadcast(ef->ef_cachecv, ef->ef_cachelock);
+	if (result) {
+		return result;
+	}
+
+	/* Anything past EOF reads as zeros */
+	for (i=0; i<n; i++) {
+		if (iov[i].iov_len > 0) {
+			bzero(iov[i].iov_kbase, iov[i].iov_len);
+		}
+	}
+
+	*ret = run[0];
+	return 0;
+}
+
+/*
+ * Write back all of EV's dirty pages, or if EV is NULL, everything.
+ * This includes waiting for writes already under way.
+ */
+static
+int
+emufs_cache_flush(struct emufs_fs *ef, struct emufs_vnode *ev)
+{
+	struct emufs_page *ep;
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(ef->ef_cachelock));
+
+	i = 0;
+	while (i < EMUFS_CACHEPAGES) {
+		if (ev != NULL && ev->ev_npages == 0) {
+			break;
+		}
+		ep = &ef->ef_pages[i];
+		if (ep->ep_vnode == NULL ||
+		    (ev != NULL && ep->ep_vnode != ev)) {
+			i++;
+		}
+		else if (ep->ep_busy) {
+			/* Then look at this slot again */
+			cv_wait(ef->ef_cachecv, ef->ef_cachelock);
+		}
+		else if (emufs_page_isdirty(ep)) {
+			result = emufs_page_flush(ef, ep);
+			if (result) {
+				return result;
+			}
+		}
+		else {
+			i++;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Cached read.
+ */
+static
+int
+emufs_cache_read(struct emufs_fs *ef, struct emufs_vnode *ev,
+		 struct uio *uio)
+{
+	struct emufs_page *ep;
+	off_t pageoff, end;
+	size_t skip, amt;
+	int result;
+
+	lock_acquire(ef->ef_cachelock);
+
+	result = emufs_cache_getsize(ef, ev);
+	if (result) {
+		goto out;
+	}
+
+	while (1) {
+		/* The size can change whenever the lock is let go */
+		end = uio->uio_offset + uio->uio_resid;
+		if (end > ev->ev_size) {
+			end = ev->ev_size;
+		}
+		if (uio->uio_offset >= end) {
+			break;
+		}
+
+		skip = uio->uio_offset % EMUFS_PAGESIZE;
+		pageoff = uio->uio_offset - skip;
+		amt = EMUFS_PAGESIZE - skip;
+		if (amt > end - uio->uio_offset) {
+			amt = end - uio->uio_offset;
+		}
+
+		ep = emufs_page_lookup(ef, ev, pageoff);
+		if (ep == NULL) {
+			result = emufs_page_fill(ef, ev, pageoff, end, &ep);
+			if (result == EAGAIN) {
+				continue;
+			}
+			if (result) {
+				goto out;
+			}
+		}
+
+		result = uiomove(ep->ep_data + skip, amt, uio);
+		if (result) {
+			goto out;
+		}
+	}
+
+ out:
+	lock_release(ef->ef_cachelock);
+	return result;
+}
+
+/*
+ * Cached write.
+ */
+static
+int
+emufs_cache_write(struct emufs_fs *ef, struct emufs_vnode *ev,
+		  struct uio *uio)
+{
+	struct emufs_page *ep;
+	off_t pageoff;
+	size_t skip, amt, oldresid;
+	bool fresh;
+	int result;
+
+	if (uio->uio_offset + uio->uio_resid > (off_t)0xffffffff) {
+		/* beyond the largest size the file can have */
+		return EFBIG;
+	}
+
+	lock_acquire(ef->ef_cachelock);
+
+	result = emufs_cache_getsize(ef, ev);
+	if (result) {
+		goto out;
+	}
+
+	while (uio->uio_resid > 0) {
+		skip = uio->uio_offset % EMUFS_PAGESIZE;
+		pageoff = uio->uio_offset - skip;
+		amt = EMUFS_PAGESIZE - skip;
+		if (amt > uio->uio_resid) {
+			amt = uio->uio_resid;
+		}
+
+		fresh = false;
+		ep = emufs_page_lookup(ef, ev, pageoff);
+		if (ep == NULL && amt < EMUFS_PAGESIZE &&
+		    pageoff < ev->ev_size) {
+			/* Need the old contents of the rest of the page */
+			result = emufs_page_fill(ef, ev, pageoff, pageoff,
+						 &ep);
+			if (result == EAGAIN) {
+				continue;
+			}
+			if (result) {
+				goto out;
+			}
+		}
+		else if (ep == NULL) {
+			/* Will be entirely overwritten, or is past EOF */
+			result = emufs_page_get(ef, ev, pageoff, true, &ep);
+			if (result == EAGAIN) {
+				continue;
+			}
+			if (result) {
+				goto out;
+			}
+			bzero(ep->ep_data, EMUFS_PAGESIZE);
+			fresh = true;
+		}
+
+		oldresid = uio->uio_resid;
+		result = uiomove(ep->ep_data + skip, amt, uio);
+		if (result && fresh) {
+			/* Don't leave a page that doesn't match the file */
+			emufs_page_drop(ep);
+			goto out;
+		}
+
+		/* Even on failure, what got copied needs writing back */
+		amt = oldresid - uio->uio_resid;
+		if (!emufs_page_isdirty(ep)) {
+			ep->ep_dirtystart = skip;
+			ep->ep_dirtyend = skip + amt;
+		}
+		else if (amt > 0) {
+			if (skip < ep->ep_dirtystart) {
+				ep->ep_dirtystart = skip;
+			}
+			if (skip + amt > ep->ep_dirtyend) {
+				ep->ep_dirtyend = skip + amt;
+			}
+		}
+		if (pageoff + skip + amt > ev->ev_size) {
+			ev->ev_size = pageoff + skip + amt;
+		}
+
+		if (result) {
+			goto out;
+		}
+	}
+
+ out:
+	lock_release(ef->ef_cachelock);
+	return result;
+}
+
+/*
+ * Truncate: drop cached data past the new end, then tell the host.
+ */
+static
+int
+emufs_cache_truncate(struct emufs_fs *ef, struct emufs_vnode *ev, off_t len)
+{
+	struct emufs_page *ep;
+	uint32_t keep;
+	unsigned i;
+	int result;
+
+	lock_acquire(ef->ef_cachelock);
+
+	i = 0;
+	while (i < EMUFS_CACHEPAGES) {
+		ep = &ef->ef_pages[i];
+		if (ep->ep_vnode != ev ||
+		    ep->ep_offset + EMUFS_PAGESIZE <= len) {
+			i++;
+			continue;
+		}
+		if (ep->ep_busy) {
+			/* Then look at this slot again */
+			cv_wait(ef->ef_cachecv, ef->ef_cachelock);
+			continue;
+		}
+		i++;
+		if (ep->ep_offset >= len) {
+			emufs_page_drop(ep);
+			continue;
+		}
+		keep = len - ep->ep_offset;
+		bzero(ep->ep_data + keep, EMUFS_PAGESIZE - keep);
+		if (ep->ep_dirtyend > keep) {
+			ep->ep_dirtyend = keep;
+		}
+		if (ep->ep_dirtystart >= ep->ep_dirtyend) {
+			ep->ep_dirtystart = ep->ep_dirtyend = 0;
+		}
+	}
+
+	/* Keep the lock so the size doesn't change underneath */
+	result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	if (result == 0) {
+		ev->ev_size = len;
+		ev->ev_sizevalid = true;
+	}
+	else {
+		ev->ev_sizevalid = false;
+	}
+
+	lock_release(ef->ef_cachelock);
+	return result;
+}
+
+/*
+ * Write back and drop all of EV's pages, for reclaim.
+ */
+static
+int
+emufs_cache_release(struct emufs_fs *ef, struct emufs_vnode *ev)
+{
+	struct emufs_page *ep;
+	unsigned i;
+	int result;
+
+	lock_acquire(ef->ef_cachelock);
+
+	result = 0;
+	i = 0;
+	while (i < EMUFS_CACHEPAGES && ev->ev_npages > 0) {
+		ep = &ef->ef_pages[i];
+		if (ep->ep_vnode != ev) {
+			i++;
+		}
+		else if (ep->ep_busy) {
+			/* Then look at this slot again */
+			cv_wait(ef->ef_cachecv, ef->ef_cachelock);
+		}
+		else if (emufs_page_isdirty(ep)) {
+			result = emufs_page_flush(ef, ep);
+			if (result) {
+				break;
+			}
+		}
+		else {
+			emufs_page_drop(ep);
+			i++;
+		}
+	}
+	KASSERT(result != 0 || ev->ev_npages == 0);
+
+	lock_release(ef->ef_cachelock);
+	return result;
+}
+
+//
+////////////////////////////////////////////////////////////
+
 ////////////////////////////////////////////////////////////
 //
 // vnode functions
@@ -412,6 +1325,7 @@ emu_trunc(struct emu_softc *sc, uint32_t handle, off_t len)
 // at bottom of this section
 
 static int emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
+			   struct emufs_vnode *dir, const char *name,
 			   struct emufs_vnode **ret);
 
 /*
@@ -472,14 +1386,23 @@ emufs_reclaim(struct vnode *v)
 	unsigned ix, i, num;
 	int result;
 
+ again:
 	/*
-	 * Need all of these locks, e_lock to protect the device,
-	 * vfs_biglock to protect the fs-related material, and
-	 * vn_countlock for the reference count.
+	 * Write back and drop the cached data first; the cache lock
+	 * can't be taken while holding the others.
 	 */
+	result = emufs_cache_release(ef, ev);
+	if (result) {
+		return result;
+	}
 
-	vfs_biglock_acquire();
-	lock_acquire(ef->ef_emu->e_lock);
+	/*
+	 * Need both of these locks, ef_vnlock to protect the vnode
+	 * table and the host handle, and vn_countlock for the reference
+	 * count. (e_lock only covers single device operations.)
+	 */
+
+	lock_acquire(ef->ef_vnlock);
 	spinlock_acquire(&ev->ev_v.vn_countlock);
 
 	if (ev->ev_v.vn_refcount > 1) {
@@ -487,25 +1410,35 @@ emufs_reclaim(struct vnode *v)
 		ev->ev_v.vn_refcount--;
 
 		spinlock_release(&ev->ev_v.vn_countlock);
-		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
+		lock_release(ef->ef_vnlock);
 		return EBUSY;
 	}
 	KASSERT(ev->ev_v.vn_refcount == 1);
 
 	/*
-	 * Since we hold e_lock and are the last ref, nobody can increment
-	 * the refcount, so we can release vn_countlock.
+	 * Since we hold ef_vnlock (which lookups hold from emu_open
+	 * through emufs_loadvnode) and are the last ref, nobody can
+	 * increment the refcount, so we can release vn_countlock.
 	 */
 	spinlock_release(&ev->ev_v.vn_countlock);
 
+	/*
+	 * For the same reason nobody can add pages for this file now.
+	 * But someone might have briefly had a reference and read it
+	 * since we emptied the cache; if so, go around again.
+	 */
+	if (ev->ev_npages > 0) {
+		lock_release(ef->ef_vnlock);
+		goto again;
+	}
+
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
 	if (result) {
-		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
+		lock_release(ef->ef_vnlock);
 		return result;
 	}
+	emufs_chan_closeall(ef, ev);
 
 	num = vnodearray_num(ef->ef_vnodes);
 	ix = num;
@@ -526,9 +1459,9 @@ emufs_reclaim(struct vnode *v)
 	vnodearray_remove(ef->ef_vnodes, ix);
 	vnode_cleanup(&ev->ev_v);
 
-	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
+	lock_release(ef->ef_vnlock);
 
+	kfree(ev->ev_path);
 	kfree(ev);
 	return 0;
 }
@@ -541,32 +1474,11 @@ int
 emufs_read(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	uint32_t amt;
-	size_t oldresid;
-	int result;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	while (uio->uio_resid > 0) {
-		amt = uio->uio_resid;
-		if (amt > EMU_MAXIO) {
-			amt = EMU_MAXIO;
-		}
-
-		oldresid = uio->uio_resid;
-
-		result = emu_read(ev->ev_emu, ev->ev_handle, amt, uio);
-		if (result) {
-			return result;
-		}
-
-		if (uio->uio_resid == oldresid) {
-			/* nothing read - EOF */
-			break;
-		}
-	}
-
-	return 0;
+	return emufs_cache_read(ef, ev, uio);
 }
 
 /*
@@ -597,32 +1509,11 @@ int
 emufs_write(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	uint32_t amt;
-	size_t oldresid;
-	int result;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	while (uio->uio_resid > 0) {
-		amt = uio->uio_resid;
-		if (amt > EMU_MAXIO) {
-			amt = EMU_MAXIO;
-		}
-
-		oldresid = uio->uio_resid;
-
-		result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
-		if (result) {
-			return result;
-		}
-
-		if (uio->uio_resid == oldresid) {
-			/* nothing written...? */
-			break;
-		}
-	}
-
-	return 0;
+	return emufs_cache_write(ef, ev, uio);
 }
 
 /*
@@ -651,19 +1542,31 @@ int
 emufs_stat(struct vnode *v, struct stat *statbuf)
 {
 	struct emufs_vnode *ev = v->vn_data;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
 	int result;
 
 	bzero(statbuf, sizeof(struct stat));
 
-	result = emu_getsize(ev->ev_emu, ev->ev_handle, &statbuf->st_size);
+	result = VOP_GETTYPE(v, &statbuf->st_mode);
 	if (result) {
 		return result;
 	}
 
-	result = VOP_GETTYPE(v, &statbuf->st_mode);
+	if (statbuf->st_mode == S_IFREG) {
+		/* Files may have cached writes */
+		lock_acquire(ef->ef_cachelock);
+		result = emufs_cache_getsize(ef, ev);
+		statbuf->st_size = ev->ev_size;
+		lock_release(ef->ef_cachelock);
+	}
+	else {
+		result = emu_getsize(ev->ev_emu, ev->ev_handle,
+				     &statbuf->st_size);
+	}
 	if (result) {
 		return result;
 	}
+
 	statbuf->st_mode |= 0644; /* possibly a lie */
 	statbuf->st_nlink = 1;    /* might be a lie, but doesn't matter much */
 	statbuf->st_blocks = 0;   /* almost certainly a lie */
@@ -713,8 +1616,14 @@ static
 int
 emufs_fsync(struct vnode *v)
 {
-	(void)v;
-	return 0;
+	struct emufs_vnode *ev = v->vn_data;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+	int result;
+
+	lock_acquire(ef->ef_cachelock);
+	result = emufs_cache_flush(ef, ev);
+	lock_release(ef->ef_cachelock);
+	return result;
 }
 
 /*
@@ -725,7 +1634,9 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+
+	return emufs_cache_truncate(ef, ev, len);
 }
 
 /*
@@ -743,20 +1654,22 @@ emufs_creat(struct vnode *dir, const char *name, bool excl, mode_t mode,
 	int result;
 	int isdir;
 
-	vfs_biglock_acquire();
+	/* See emufs_lookup */
+	lock_acquire(ef->ef_vnlock);
 	result = emu_open(ev->ev_emu, ev->ev_handle, name, true, excl, mode,
 			  &handle, &isdir);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(ef->ef_vnlock);
 		return result;
 	}
 
-	result = emufs_loadvnode(ef, handle, isdir, &newguy);
-	vfs_biglock_release();
+	result = emufs_loadvnode(ef, handle, isdir, ev, name, &newguy);
 	if (result) {
 		emu_close(ev->ev_emu, handle);
+		lock_release(ef->ef_vnlock);
 		return result;
 	}
+	lock_release(ef->ef_vnlock);
 
 	*ret = &newguy->ev_v;
 	return 0;
@@ -776,20 +1689,26 @@ emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
 	int result;
 	int isdir;
 
-	vfs_biglock_acquire();
+	/*
+	 * Hold ef_vnlock from getting the handle until its vnode is
+	 * found or made, so reclaim can't close the handle in between.
+	 * This is per volume, so emufs lookups don't need the big lock.
+	 */
+	lock_acquire(ef->ef_vnlock);
 	result = emu_open(ev->ev_emu, ev->ev_handle, pathname, false, false, 0,
 			  &handle, &isdir);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(ef->ef_vnlock);
 		return result;
 	}
 
-	result = emufs_loadvnode(ef, handle, isdir, &newguy);
-	vfs_biglock_release();
+	result = emufs_loadvnode(ef, handle, isdir, ev, pathname, &newguy);
 	if (result) {
 		emu_close(ev->ev_emu, handle);
+		lock_release(ef->ef_vnlock);
 		return result;
 	}
+	lock_release(ef->ef_vnlock);
 
 	*ret = &newguy->ev_v;
 	return 0;
@@ -1144,11 +2063,37 @@ static const struct vnode_ops emufs_dirops = {
 };
 
 /*
- * Function to load a vnode into memory.
+ * Make the path from the root for NAME in directory DIR (or for the
+ * root itself, if DIR is NULL).
+ */
+static
+char *
+emufs_mkpath(struct emufs_vnode *dir, const char *name)
+{
+	char *path;
+
+	if (dir == NULL || dir->ev_path[0] == 0) {
+		return kstrdup(name);
+	}
+	path = kmalloc(strlen(dir->ev_path) + strlen(name) + 2);
+	if (path == NULL) {
+		return NULL;
+	}
+	strcpy(path, dir->ev_path);
+	strcat(path, "/");
+	strcat(path, name);
+	return path;
+}
+
+/*
+ * Function to load a vnode into memory. DIR and NAME say how it was
+ * found, so it can be opened again on other units. The caller holds
+ * ef_vnlock, and has since getting HANDLE.
  */
 static
 int
 emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
+		struct emufs_vnode *dir, const char *name,
 		struct emufs_vnode **ret)
 {
 	struct vnode *v;
@@ -1156,8 +2101,7 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
-	lock_acquire(ef->ef_emu->e_lock);
+	KASSERT(lock_do_i_hold(ef->ef_vnlock));
 
 	num = vnodearray_num(ef->ef_vnodes);
 	for (i=0; i<num; i++) {
@@ -1168,8 +2112,6 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 			VOP_INCREF(&ev->ev_v);
 
-			lock_release(ef->ef_emu->e_lock);
-			vfs_biglock_release();
 			*ret = ev;
 			return 0;
 		}
@@ -1179,18 +2121,30 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 	ev = kmalloc(sizeof(struct emufs_vnode));
 	if (ev==NULL) {
-		lock_release(ef->ef_emu->e_lock);
+		return ENOMEM;
+	}
+
+	ev->ev_path = emufs_mkpath(dir, name);
+	if (ev->ev_path == NULL) {
+		kfree(ev);
 		return ENOMEM;
 	}
 
 	ev->ev_emu = ef->ef_emu;
 	ev->ev_handle = handle;
+	for (i=0; i<EMUFS_MAXCHANS; i++) {
+		ev->ev_chanstate[i] = EMUFS_CHAN_CLOSED;
+	}
+	ev->ev_chanhandle[0] = handle;
+	ev->ev_chanstate[0] = EMUFS_CHAN_OPEN;
+	ev->ev_size = 0;
+	ev->ev_sizevalid = false;
+	ev->ev_npages = 0;
 
 	result = vnode_init(&ev->ev_v, isdir ? &emufs_dirops : &emufs_fileops,
 			    &ef->ef_fs, ev);
 	if (result) {
-		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
+		kfree(ev->ev_path);
 		kfree(ev);
 		return result;
 	}
@@ -1199,15 +2153,11 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 	if (result) {
 		/* note: vnode_cleanup undoes vnode_init - it does not kfree */
 		vnode_cleanup(&ev->ev_v);
-		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
+		kfree(ev->ev_path);
 		kfree(ev);
 		return result;
 	}
 
-	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
-
 	*ret = ev;
 	return 0;
 }
@@ -1227,8 +2177,13 @@ static
 int
 emufs_sync(struct fs *fs)
 {
-	(void)fs;
-	return 0;
+	struct emufs_fs *ef = fs->fs_data;
+	int result;
+
+	lock_acquire(ef->ef_cachelock);
+	result = emufs_cache_flush(ef, NULL);
+	lock_release(ef->ef_cachelock);
+	return result;
 }
 
 /*
@@ -1315,9 +2270,42 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 		kfree(ef);
 		return ENOMEM;
 	}
+	ef->ef_vnlock = lock_create("emufs-vnodes");
+	if (ef->ef_vnlock == NULL) {
+		vnodearray_destroy(ef->ef_vnodes);
+		kfree(ef);
+		return ENOMEM;
+	}
+
+	ef->ef_nchans = 1;
+	ef->ef_chans[0] = sc;
 
-	result = emufs_loadvnode(ef, EMU_ROOTHANDLE, 1, &ef->ef_root);
+	ef->ef_cachelock = lock_create("emufs-cache");
+	if (ef->ef_cachelock == NULL) {
+		lock_destroy(ef->ef_vnlock);
+		vnodearray_destroy(ef->ef_vnodes);
+		kfree(ef);
+		return ENOMEM;
+	}
+	ef->ef_cachecv = cv_create("emufs-cache");
+	if (ef->ef_cachecv == NULL) {
+		lock_destroy(ef->ef_cachelock);
+		lock_destroy(ef->ef_vnlock);
+		vnodearray_destroy(ef->ef_vnodes);
+		kfree(ef);
+		return ENOMEM;
+	}
+	ef->ef_clock = 0;
+	bzero(ef->ef_pages, sizeof(ef->ef_pages));
+
+	lock_acquire(ef->ef_vnlock);
+	result = emufs_loadvnode(ef, EMU_ROOTHANDLE, 1, NULL, "", &ef->ef_root);
+	lock_release(ef->ef_vnlock);
 	if (result) {
+		cv_destroy(ef->ef_cachecv);
+		lock_destroy(ef->ef_cachelock);
+		lock_destroy(ef->ef_vnlock);
+		vnodearray_destroy(ef->ef_vnodes);
 		kfree(ef);
 		return result;
 	}
@@ -1326,10 +2314,21 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 
 	result = vfs_addfs(devname, &ef->ef_fs);
 	if (result) {
+		/* This reclaims the root, leaving ef_vnodes empty */
 		VOP_DECREF(&ef->ef_root->ev_v);
+		cv_destroy(ef->ef_cachecv);
+		lock_destroy(ef->ef_cachelock);
+		lock_destroy(ef->ef_vnlock);
+		vnodearray_destroy(ef->ef_vnodes);
 		kfree(ef);
+		return result;
 	}
-	return result;
+
+	spinlock_acquire(&emufs_chanlock);
+	ef->ef_next = emufs_list;
+	emufs_list = ef;
+	spinlock_release(&emufs_chanlock);
+	return 0;
 }
 
 //
@@ -1356,6 +2355,7 @@ config_emu(struct emu_softc *sc, int emuno)
 		return ENOMEM;
 	}
 	sc->e_iobuf = bus_map_area(sc->e_busdata, sc->e_buspos, EMU_BUFFER);
+	sc->e_pending = 0;
 
 	snprintf(name, sizeof(name), "emu%d", emuno);
 
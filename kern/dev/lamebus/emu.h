@@ -53,6 +53,9 @@ struct emu_softc {
 
 	/* Written by the interrupt handler */
 	uint32_t e_result;
+
+	/* Operations waiting for or using the device (see emu.c) */
+	unsigned e_pending;
 };
 
 /* Functions called by lower-level drivers */
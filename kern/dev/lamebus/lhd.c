@@ -36,7 +36,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <spinlock.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -96,27 +96,72 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the transfer of the next sector of the active request.
+ * Called with lh_lock held.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_startsect(struct lhd_softc *lh)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct devreq *req = lh->lh_active;
+	uint32_t statval = LHD_WORKING;
+	uint32_t i;
+
+	/*
+	 * Are we writing? If so, transfer the data to the on-card
+	 * buffer.
+	 */
+	if (req->dr_write) {
+		i = lh->lh_activesect - req->dr_block;
+		memcpy(lh->lh_buf, (char *)req->dr_buf + i * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, lh->lh_activesect);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * If the device is idle, start the next queued request.
+ * Called with lh_lock held.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh)
+{
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_active != NULL) {
+		return;
+	}
+	lh->lh_active = devqueue_remove(&lh->lh_queue);
+	if (lh->lh_active != NULL) {
+		lh->lh_activesect = lh->lh_active->dr_block;
+		lhd_startsect(lh);
+	}
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, and move on to the next sector of the active request. If
+ * that was the last one (or it failed), report completion and start
+ * the next request.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
-	uint32_t val;
+	struct devreq *done = NULL;
+	uint32_t val, i;
+	int result;
+
+	spinlock_acquire(&lh->lh_lock);
 
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
@@ -128,9 +173,59 @@ lhd_irq(void *vlh)
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
+		if (lh->lh_active == NULL) {
+			/* Not ours; nothing to do */
+			break;
+		}
+		result = lhd_code_to_errno(lh, val);
+
+		/*
+		 * Are we reading? If so, and if we succeeded,
+		 * transfer the data out of the on-card buffer.
+		 */
+		if (result == 0 && !lh->lh_active->dr_write) {
+			i = lh->lh_activesect - lh->lh_active->dr_block;
+			membar_load_load();
+			memcpy((char *)lh->lh_active->dr_buf +
+			       i * LHD_SECTSIZE, lh->lh_buf, LHD_SECTSIZE);
+		}
+
+		lh->lh_activesect++;
+		if (result == 0 && lh->lh_activesect <
+		    lh->lh_active->dr_block + lh->lh_active->dr_nblocks) {
+			lhd_startsect(lh);
+			break;
+		}
+
+		done = lh->lh_active;
+		done->dr_result = result;
+		lh->lh_active = NULL;
+		lhd_start(lh);
 		break;
 	}
+
+	spinlock_release(&lh->lh_lock);
+
+	if (done != NULL) {
+		done->dr_done(done);
+	}
+}
+
+/*
+ * Queue a request, and start it if the device is idle.
+ */
+static
+int
+lhd_submit(struct device *d, struct devreq *req)
+{
+	struct lhd_softc *lh = d->d_data;
+
+	spinlock_acquire(&lh->lh_lock);
+	devqueue_add(&lh->lh_queue, req);
+	lhd_start(lh);
+	spinlock_release(&lh->lh_lock);
+
+	return 0;
 }
 
 /*
@@ -186,88 +281,14 @@ static
 int
 lhd_io(struct device *d, struct uio *uio)
 {
-	struct lhd_softc *lh = d->d_data;
-
-	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
-	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
-	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
-	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
-	int result;
-
-	/* Don't allow I/O that isn't sector-aligned. */
-	if (sectoff != 0 || lenoff != 0) {
-		return EINVAL;
-	}
-
-	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
-		return EINVAL;
-	}
-
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
-	}
-
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
-			if (result) {
-				V(lh->lh_clear);
-				return result;
-			}
-		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
-		}
-	}
-
-	return 0;
+	return devreq_uio(d, uio);
 }
 
 static const struct device_ops lhd_devops = {
 	.devop_eachopen = lhd_eachopen,
 	.devop_io = lhd_io,
 	.devop_ioctl = lhd_ioctl,
+	.devop_submit = lhd_submit,
 };
 
 /*
@@ -277,6 +298,7 @@ int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
 	char name[32];
+	int result;
 
 	/* Figure out what our name is. */
 	snprintf(name, sizeof(name), "lhd%d", lhdno);
@@ -284,17 +306,11 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
-	}
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	devqueue_init(&lh->lh_queue, name);
+	lh->lh_active = NULL;
+	lh->lh_activesect = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
@@ -304,5 +320,11 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	lh->lh_dev.d_data = lh;
 
 	/* Add the VFS device structure to the VFS device list. */
-	return vfs_adddev(name, &lh->lh_dev, 1);
+	result = vfs_adddev(name, &lh->lh_dev, 1);
+	if (result) {
+		devqueue_cleanup(&lh->lh_queue);
+		spinlock_cleanup(&lh->lh_lock);
+		return result;
+	}
+	return 0;
 }
@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -51,9 +52,10 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the fields below */
+	struct devqueue lh_queue;	/* Requests waiting to start */
+	struct devreq *lh_active;	/* Request in progress, or NULL */
+	uint32_t lh_activesect;		/* Sector of it in progress */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -33,6 +33,7 @@
  * Block allocation.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <sfs.h>
@@ -46,23 +47,208 @@ int
 sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 {
 	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
+	static char zeros[SFS_MAXBLOCKSIZE];
 
-	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
+	return sfs_writeblock(sfs, block, zeros, SFS_FS_BLOCKSIZE(sfs));
 }
 
 /*
- * Allocate a block.
+ * Freemap loading.
+ *
+ * On volumes with SFS_FEATURE_FREESUM, freemap blocks are read only
+ * when something first needs a bit in them; until then their part of
+ * sfs_freemap is not meaningful, and the allocator goes by the free
+ * counts in the superblock instead. Other volumes have the whole
+ * freemap read at mount time.
+ */
+
+/* Freemap block that covers disk block B */
+#define SFS_FREEMAPBLOCK(sfs, b) \
+	((b) / SFS_BITSPERBLOCK(SFS_FS_BLOCKSIZE(sfs)))
+
+/* Number of freemap blocks per sb_freesum entry */
+#define SFS_FS_FREESUMGROUP(sfs) \
+	SFS_FREESUMGROUP((sfs)->sfs_sb.sb_nblocks, SFS_FS_BLOCKSIZE(sfs))
+
+/* Whether the volume keeps free counts */
+#define SFS_FS_HASFREESUM(sfs) \
+	(((sfs)->sfs_sb.sb_features & SFS_FEATURE_FREESUM) != 0)
+
+/*
+ * Recount the free blocks in free count group GROUP, if all its
+ * freemap blocks are loaded, so the count is exact from then on.
+ */
+static
+void
+sfs_freesum_recount(struct sfs_fs *sfs, uint32_t group)
+{
+	uint32_t bitsperblock = SFS_BITSPERBLOCK(SFS_FS_BLOCKSIZE(sfs));
+	uint32_t groupsize = SFS_FS_FREESUMGROUP(sfs);
+	uint32_t mapblocks = SFS_FREEMAPBLOCKS(sfs->sfs_sb.sb_nblocks,
+					       SFS_FS_BLOCKSIZE(sfs));
+	uint32_t first, last, m, nfree;
+
+	first = group * groupsize;
+	last = first + groupsize;
+	if (last > mapblocks) {
+		last = mapblocks;
+	}
+	nfree = 0;
+	for (m = first; m < last; m++) {
+		if (!bitmap_isset(sfs->sfs_freemaploaded, m)) {
+			return;
+		}
+		nfree += bitmap_count_clear(sfs->sfs_freemap,
+					    m * bitsperblock, bitsperblock);
+	}
+	if (sfs->sfs_sb.sb_freesum[group] != nfree) {
+		sfs->sfs_sb.sb_freesum[group] = nfree;
+		sfs->sfs_superdirty = true;
+	}
+}
+
+/*
+ * Adjust the free count for the group that disk block BLOCK is in.
+ */
+static
+void
+sfs_freesum_adjust(struct sfs_fs *sfs, daddr_t block, int32_t delta)
+{
+	uint32_t group, *count;
+
+	if (!SFS_FS_HASFREESUM(sfs)) {
+		return;
+	}
+	group = SFS_FREEMAPBLOCK(sfs, block) / SFS_FS_FREESUMGROUP(sfs);
+	KASSERT(group < SFS_NFREESUM);
+	count = &sfs->sfs_sb.sb_freesum[group];
+
+	/* The count may be stale until the whole group is loaded */
+	if (delta < 0 && *count < (uint32_t)-delta) {
+		*count = 0;
+	}
+	else {
+		*count += delta;
+	}
+	sfs->sfs_superdirty = true;
+}
+
+/*
+ * Read freemap block MAPBLOCK into sfs_freemap, if it isn't already.
  */
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_freemap_load(struct sfs_fs *sfs, uint32_t mapblock)
 {
+	uint32_t blocksize = SFS_FS_BLOCKSIZE(sfs);
+	char *freemapdata;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	if (bitmap_isset(sfs->sfs_freemaploaded, mapblock)) {
+		return 0;
+	}
+
+	/* The freemap starts at block 2. */
+	freemapdata = bitmap_getdata(sfs->sfs_freemap);
+	result = sfs_readblock(sfs, SFS_FREEMAP_START + mapblock,
+			       freemapdata + mapblock * blocksize, blocksize);
 	if (result) {
 		return result;
 	}
+	bitmap_mark(sfs->sfs_freemaploaded, mapblock);
+
+	if (SFS_FS_HASFREESUM(sfs)) {
+		sfs_freesum_recount(sfs, mapblock / SFS_FS_FREESUMGROUP(sfs));
+	}
+	return 0;
+}
+
+/*
+ * Make sure the freemap bit for disk block BLOCK is loaded. For the
+ * callers that can't fail, complain if it can't be.
+ */
+static
+int
+sfs_freemap_need(struct sfs_fs *sfs, daddr_t block)
+{
+	int result;
+
+	result = sfs_freemap_load(sfs, SFS_FREEMAPBLOCK(sfs, block));
+	if (result) {
+		kprintf("sfs: %s: freemap block %u: %s\n",
+			sfs->sfs_sb.sb_volname, SFS_FREEMAPBLOCK(sfs, block),
+			strerror(result));
+	}
+	return result;
+}
+
+/*
+ * Find a free block and mark it in use. With free counts, look only
+ * in groups whose count says they have room, loading their freemap
+ * blocks as we go; the counts might be stale, so if that fails, try
+ * whatever hasn't been loaded yet.
+ */
+static
+int
+sfs_freemap_alloc(struct sfs_fs *sfs, daddr_t *diskblock)
+{
+	uint32_t bitsperblock = SFS_BITSPERBLOCK(SFS_FS_BLOCKSIZE(sfs));
+	uint32_t groupsize, mapblocks, m;
+	unsigned pass;
+	int result;
+
+	if (!SFS_FS_HASFREESUM(sfs)) {
+		return bitmap_alloc(sfs->sfs_freemap, diskblock);
+	}
+
+	groupsize = SFS_FS_FREESUMGROUP(sfs);
+	mapblocks = SFS_FREEMAPBLOCKS(sfs->sfs_sb.sb_nblocks,
+				      SFS_FS_BLOCKSIZE(sfs));
+	for (pass = 0; pass < 2; pass++) {
+		for (m = 0; m < mapblocks; m++) {
+			if (pass == 0 ?
+			    sfs->sfs_sb.sb_freesum[m / groupsize] == 0 :
+			    bitmap_isset(sfs->sfs_freemaploaded, m)) {
+				continue;
+			}
+			result = sfs_freemap_load(sfs, m);
+			if (result) {
+				return result;
+			}
+			result = bitmap_alloc_range(sfs->sfs_freemap,
+						    m * bitsperblock,
+						    bitsperblock, diskblock);
+			if (result == 0) {
+				sfs_freesum_adjust(sfs, *diskblock, -1);
+				return 0;
+			}
+		}
+	}
+	return ENOSPC;
+}
+
+/*
+ * Allocate a block, preferring block GOAL if it is free (0 for no
+ * preference). Callers that extend a file pass the block after the
+ * file's last one, so that files tend to come out contiguous on disk.
+ */
+int
+sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock)
+{
+	int result;
+
+	if (goal != 0 && goal < sfs->sfs_sb.sb_nblocks &&
+	    sfs_freemap_load(sfs, SFS_FREEMAPBLOCK(sfs, goal)) == 0 &&
+	    !bitmap_isset(sfs->sfs_freemap, goal)) {
+		bitmap_mark(sfs->sfs_freemap, goal);
+		sfs_freesum_adjust(sfs, goal, -1);
+		*diskblock = goal;
+	}
+	else {
+		result = sfs_freemap_alloc(sfs, diskblock);
+		if (result) {
+			return result;
+		}
+	}
 	sfs->sfs_freemapdirty = true;
 
 	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
@@ -74,20 +260,119 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
 	result = sfs_clearblock(sfs, *diskblock);
 	if (result) {
 		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		sfs_freesum_adjust(sfs, *diskblock, 1);
 	}
 	return result;
 }
 
 /*
- * Free a block.
+ * Blocks from START for COUNT couldn't be marked free because their
+ * freemap block couldn't be read. They stay allocated with nothing
+ * using them; mark the volume as needing sfsck, which will find them.
+ */
+static
+void
+sfs_bleaked(struct sfs_fs *sfs, daddr_t start, uint32_t count)
+{
+	kprintf("sfs: %s: blocks %u-%u leaked; volume needs sfsck\n",
+		sfs->sfs_sb.sb_volname, start, start + count - 1);
+	sfs->sfs_sb.sb_state |= SFS_STATE_ERRORS;
+	sfs->sfs_superdirty = true;
+}
+
+/*
+ * Free a block. Freeing happens on paths that have nothing to do
+ * about an error (often cleaning up after another one), so if the
+ * freemap block can't be read, the block is recorded as leaked.
  */
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	if (sfs_freemap_need(sfs, diskblock)) {
+		sfs_bleaked(sfs, diskblock, 1);
+		return;
+	}
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
+	sfs_freesum_adjust(sfs, diskblock, 1);
 	sfs->sfs_freemapdirty = true;
 }
 
+/*
+ * Free COUNT blocks starting at START.
+ */
+void
+sfs_bfree_range(struct sfs_fs *sfs, daddr_t start, uint32_t count)
+{
+	uint32_t bitsperblock = SFS_BITSPERBLOCK(SFS_FS_BLOCKSIZE(sfs));
+	uint32_t n;
+
+	if (count == 0) {
+		return;
+	}
+	if (start + count < start || start + count > sfs->sfs_sb.sb_nblocks) {
+		panic("sfs: %s: bfree_range: invalid blocks %u+%u\n",
+		      sfs->sfs_sb.sb_volname, start, count);
+	}
+
+	/* Do it one freemap block at a time */
+	while (count > 0) {
+		n = bitsperblock - start % bitsperblock;
+		if (n > count) {
+			n = count;
+		}
+		if (sfs_freemap_need(sfs, start) == 0) {
+			bitmap_unmark_range(sfs->sfs_freemap, start, n);
+			sfs_freesum_adjust(sfs, start, n);
+			sfs->sfs_freemapdirty = true;
+		}
+		else {
+			sfs_bleaked(sfs, start, n);
+		}
+		start += n;
+		count -= n;
+	}
+}
+
+/*
+ * Free batches. Blocks added to a batch are freed when the run they
+ * extend is broken or when the batch is flushed; the caller must
+ * flush before anything can allocate blocks again.
+ */
+void
+sfs_freebatch_init(struct sfs_freebatch *fb)
+{
+	fb->fb_start = 0;
+	fb->fb_len = 0;
+}
+
+void
+sfs_freebatch_add(struct sfs_fs *sfs, struct sfs_freebatch *fb,
+		  daddr_t diskblock)
+{
+	if (fb->fb_len > 0) {
+		if (diskblock == fb->fb_start + fb->fb_len) {
+			fb->fb_len++;
+			return;
+		}
+		if (diskblock + 1 == fb->fb_start) {
+			/* Blocks freed from the end backwards */
+			fb->fb_start--;
+			fb->fb_len++;
+			return;
+		}
+		sfs_freebatch_flush(sfs, fb);
+	}
+	fb->fb_start = diskblock;
+	fb->fb_len = 1;
+}
+
+void
+sfs_freebatch_flush(struct sfs_fs *sfs, struct sfs_freebatch *fb)
+{
+	sfs_bfree_range(sfs, fb->fb_start, fb->fb_len);
+	sfs_freebatch_init(fb);
+}
+
 /*
  * Check if a block is in use.
  */
@@ -98,6 +383,10 @@ sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
+	if (sfs_freemap_need(sfs, diskblock)) {
+		/* Can't tell; say it's in use */
+		return 1;
+	}
 	return bitmap_isset(sfs->sfs_freemap, diskblock);
 }
 
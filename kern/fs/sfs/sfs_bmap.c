@@ -39,15 +39,95 @@
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Number of file blocks mapped by one entry of an indirect block that
+ * sits LEVEL levels of indirection above the data (so 1 for an entry
+ * in a double indirect block, 0 for an entry naming a data block).
+ *
+ * This is 64 bits wide because with 8K blocks a triple indirect
+ * block maps 2^33 file blocks.
+ */
+static
+uint64_t
+sfs_bmap_span(uint32_t dbperidb, unsigned level)
+{
+	uint64_t span = 1;
+
+	while (level-- > 0) {
+		span *= dbperidb;
+	}
+	return span;
+}
+
+/*
+ * Return a pointer to the inode's top-level indirect block pointer
+ * with LEVEL levels of indirection (1, 2, or 3).
+ */
+static
+uint32_t *
+sfs_bmap_root(struct sfs_vnode *sv, unsigned level)
+{
+	switch (level) {
+	    case 1: return &sv->sv_i.sfi_indirect;
+	    case 2: return &sv->sv_i.sfi_dindirect;
+	    case 3: return &sv->sv_i.sfi_tindirect;
+	}
+	panic("sfs: bmap: invalid indirection level %u\n", level);
+	return NULL;
+}
+
+/*
+ * Count how many of the NUM block pointers starting at PTRS name
+ * consecutive disk blocks, that is, how many file blocks can be
+ * transferred with one device request. PTRS[0] must be nonzero.
+ */
+static
+uint32_t
+sfs_bmap_runlen(const uint32_t *ptrs, uint32_t num)
+{
+	uint32_t i;
+
+	KASSERT(ptrs[0] != 0);
+	for (i=1; i<num; i++) {
+		if (ptrs[i] != ptrs[0] + i) {
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * Drop the vnode's cached copy of its last-used leaf indirect block.
+ * This must be done whenever indirect blocks might be freed or
+ * changed other than by sfs_bmap.
+ */
+void
+sfs_bmap_invalidate(struct sfs_vnode *sv)
+{
+	sv->sv_idcacheblock = 0;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
  * allocated.
+ *
+ * If RUNLEN is not null, it receives the number of file blocks,
+ * starting with FILEBLOCK, that are stored consecutively on disk and
+ * can thus be transferred in one request. (For a hole it is 1.)
+ *
+ * Extent-mapped inodes are handed off to sfs_emap.
+ *
+ * Blocks past the direct blocks are found through the single, then
+ * the double, then the triple indirect block. The last leaf indirect
+ * block (the one whose entries name data blocks) is kept in the
+ * vnode, so sequential access to a large file only walks the chain
+ * of indirect blocks once per leaf rather than once per block.
  */
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-	 daddr_t *diskblock)
+	 daddr_t *diskblock, uint32_t *runlen)
 {
 	/*
 	 * I/O buffer for handling indirect blocks.
@@ -56,19 +136,32 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	 * you would get space from the disk buffer cache for this,
 	 * not use a static area.
 	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	static uint32_t idbuf[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-	daddr_t block;
-	daddr_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t blocksize = SFS_FS_BLOCKSIZE(sfs);
+	uint32_t dbperidb = SFS_DBPERIDB(blocksize);
+	uint32_t *leaf, *idptr;
+	daddr_t block, goal;
+	daddr_t idblock, nextblock;
+	uint64_t offset, span;
+	uint32_t idoff, leafbase;
+	unsigned level, l;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(sizeof(idbuf) >= blocksize);
 
 	/* Since we're using a static buffer, we'd better be locked. */
 	KASSERT(vfs_biglock_do_i_hold());
 
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_EXTENTS) {
+		return sfs_emap(sv, fileblock, doalloc, diskblock, runlen);
+	}
+
+	if (runlen != NULL) {
+		*runlen = 1;
+	}
+
 	/*
 	 * If the block we want is one of the direct blocks...
 	 */
@@ -82,7 +175,10 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			/* Try to put it after the previous block */
+			goal = fileblock > 0 ?
+				sv->sv_i.sfi_direct[fileblock-1] + 1 : 0;
+			result = sfs_balloc(sfs, goal, &block);
 			if (result) {
 				return result;
 			}
@@ -100,88 +196,146 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 			      "marked free\n", sfs->sfs_sb.sb_volname,
 			      block, fileblock, sv->sv_ino);
 		}
+		if (block != 0 && runlen != NULL) {
+			*runlen = sfs_bmap_runlen(&sv->sv_i.sfi_direct[fileblock],
+						  SFS_NDIRECT - fileblock);
+		}
 		*diskblock = block;
 		return 0;
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * It's not a direct block. Find which indirect tree it's in:
+	 * OFFSET becomes the block's position within the region mapped
+	 * by that tree, and LEVEL the tree's depth.
 	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum >= SFS_NINDIRECT) {
+	offset = fileblock - SFS_NDIRECT;
+	for (level = 1; level <= 3; level++) {
+		span = sfs_bmap_span(dbperidb, level);
+		if (offset < span) {
+			break;
+		}
+		offset -= span;
+	}
+	if (level > 3) {
+		/* Past what the triple indirect block can map */
 		return EFBIG;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+	/* Offset in the leaf, and the file block its first entry maps */
+	idoff = offset % dbperidb;
+	leafbase = fileblock - idoff;
 
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
+	if (sv->sv_idcacheblock != 0 && sv->sv_idcachebase == leafbase) {
+		/* We have the leaf already */
+		leaf = sv->sv_idcache;
+		idblock = sv->sv_idcacheblock;
+		goto haveleaf;
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
+
+	/*
+	 * Get the top-level indirect block, allocating it if needed.
+	 * Freshly allocated blocks are zeroed by sfs_balloc, so we
+	 * needn't read them.
+	 */
+	idptr = sfs_bmap_root(sv, level);
+	idblock = *idptr;
+	if (idblock == 0) {
+		if (!doalloc) {
+			/*
+			 * There's no indirect block allocated. We
+			 * weren't asked to allocate anything, so
+			 * pretend it was filled with all zeros.
+			 */
+			*diskblock = 0;
+			return 0;
+		}
+		result = sfs_balloc(sfs, 0, &idblock);
 		if (result) {
 			return result;
 		}
-
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
-
-		/* Mark the inode dirty */
+		*idptr = idblock;
 		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		bzero(idbuf, blocksize);
 	}
 	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+		result = sfs_readblock(sfs, idblock, idbuf, blocksize);
 		if (result) {
 			return result;
 		}
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/*
+	 * Walk down to the leaf, allocating intermediate indirect
+	 * blocks as we go if we're allowed to.
+	 */
+	for (l = level; l > 1; l--) {
+		uint32_t ix;
+
+		ix = (offset / sfs_bmap_span(dbperidb, l-1)) % dbperidb;
+		nextblock = idbuf[ix];
+		if (nextblock == 0) {
+			if (!doalloc) {
+				*diskblock = 0;
+				return 0;
+			}
+			result = sfs_balloc(sfs, 0, &nextblock);
+			if (result) {
+				return result;
+			}
+
+			/* Record it in the parent and write that back */
+			idbuf[ix] = nextblock;
+			result = sfs_writeblock(sfs, idblock, idbuf,
+						blocksize);
+			if (result) {
+				return result;
+			}
+			bzero(idbuf, blocksize);
+		}
+		else {
+			result = sfs_readblock(sfs, nextblock, idbuf,
+					       blocksize);
+			if (result) {
+				return result;
+			}
+		}
+		idblock = nextblock;
+	}
+
+	/*
+	 * IDBUF is now the leaf. Remember it in the vnode if we can;
+	 * if we can't get memory for that, just go without.
+	 */
+	leaf = idbuf;
+	if (sv->sv_idcache == NULL) {
+		sv->sv_idcache = kmalloc(blocksize);
+	}
+	if (sv->sv_idcache != NULL) {
+		memcpy(sv->sv_idcache, idbuf, blocksize);
+		sv->sv_idcacheblock = idblock;
+		sv->sv_idcachebase = leafbase;
+		leaf = sv->sv_idcache;
+	}
+
+ haveleaf:
+	/* Get the block out of the leaf indirect block */
+	block = leaf[idoff];
 
 	/* If there's no block there, allocate one */
 	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		/* Try to put it after the previous block */
+		goal = idoff > 0 ? leaf[idoff-1] + 1 : 0;
+		result = sfs_balloc(sfs, goal, &block);
 		if (result) {
 			return result;
 		}
 
 		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		leaf[idoff] = block;
 
 		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
+		result = sfs_writeblock(sfs, idblock, leaf, blocksize);
 		if (result) {
 			return result;
 		}
@@ -193,104 +347,171 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		      "marked free\n", sfs->sfs_sb.sb_volname,
 		      block, fileblock, sv->sv_ino);
 	}
+	if (block != 0 && runlen != NULL) {
+		*runlen = sfs_bmap_runlen(&leaf[idoff], dbperidb - idoff);
+	}
 	*diskblock = block;
 	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Discard the blocks at and past file block BLOCKLEN in the tree of
+ * indirect blocks named by *IDBLOCKP, which has LEVEL levels of
+ * indirection and whose first entry maps file block BASEBLOCK. If
+ * the indirect block ends up with no entries, free it too, clear
+ * *IDBLOCKP, and set *CHANGEDP. Freed blocks go into batch FB.
  */
+static
 int
-sfs_itrunc(struct sfs_vnode *sv, off_t len)
+sfs_itrunc_indirect(struct sfs_fs *sfs, uint32_t *idblockp, unsigned level,
+		    uint64_t baseblock, uint32_t blocklen,
+		    struct sfs_freebatch *fb, bool *changedp)
 {
 	/*
-	 * I/O buffer for handling the indirect block.
+	 * I/O buffers for handling indirect blocks, one per level
+	 * since we recurse.
 	 *
 	 * Note: in real life (and when you've done the fs assignment)
 	 * you would get space from the disk buffer cache for this,
 	 * not use a static area.
 	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	static uint32_t idbufs[3][SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
+
+	uint32_t blocksize = SFS_FS_BLOCKSIZE(sfs);
+	uint32_t dbperidb = SFS_DBPERIDB(blocksize);
+	uint64_t span = sfs_bmap_span(dbperidb, level-1);
+	uint32_t *idbuf;
+	uint32_t j;
+	bool hasnonzero, iddirty;
+	int result;
+
+	KASSERT(level >= 1 && level <= 3);
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (*idblockp == 0 || baseblock + span * dbperidb <= blocklen) {
+		/* Nothing here, or it all lies before the new EOF */
+		return 0;
+	}
 
+	idbuf = idbufs[level-1];
+	result = sfs_readblock(sfs, *idblockp, idbuf, blocksize);
+	if (result) {
+		return result;
+	}
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<dbperidb; j++) {
+		if (idbuf[j] == 0) {
+			continue;
+		}
+		if (level > 1) {
+			result = sfs_itrunc_indirect(sfs, &idbuf[j], level-1,
+						     baseblock + j*span,
+						     blocklen, fb, &iddirty);
+			if (result) {
+				return result;
+			}
+		}
+		else if (baseblock + j >= blocklen) {
+			/* Discard data blocks past the new EOF */
+			sfs_freebatch_add(sfs, fb, idbuf[j]);
+			idbuf[j] = 0;
+			iddirty = true;
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idbuf[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		sfs_freebatch_add(sfs, fb, *idblockp);
+		*idblockp = 0;
+		*changedp = true;
+	}
+	else if (iddirty) {
+		/* The indirect block is dirty; write it back */
+		result = sfs_writeblock(sfs, *idblockp, idbuf, blocksize);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Called for ftruncate() and from sfs_reclaim.
+ */
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t blocksize = SFS_FS_BLOCKSIZE(sfs);
+	uint32_t dbperidb = SFS_DBPERIDB(blocksize);
 
 	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+	uint32_t blocklen = DIVROUNDUP(len, blocksize);
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
+	struct sfs_freebatch fb;
+	uint32_t i;
+	daddr_t block;
+	uint64_t baseblock;
+	unsigned level;
+	bool changed;
 	int result;
-	int hasnonzero, iddirty;
-
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
 
 	vfs_biglock_acquire();
 
+	/* The cached leaf may be about to change or go away */
+	sfs_bmap_invalidate(sv);
+
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_EXTENTS) {
+		result = sfs_etrunc(sv, blocklen);
+		if (result) {
+			vfs_biglock_release();
+			return result;
+		}
+		goto done;
+	}
+
 	/*
 	 * Go through the direct blocks. Discard any that are
-	 * past the limit we're truncating to.
+	 * past the limit we're truncating to. Freed blocks are
+	 * collected into runs so the freemap is updated a run at a
+	 * time rather than a bit at a time.
 	 */
+	sfs_freebatch_init(&fb);
 	for (i=0; i<SFS_NDIRECT; i++) {
 		block = sv->sv_i.sfi_direct[i];
 		if (i >= blocklen && block != 0) {
-			sfs_bfree(sfs, block);
+			sfs_freebatch_add(sfs, &fb, block);
 			sv->sv_i.sfi_direct[i] = 0;
 			sv->sv_dirty = true;
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
+	/* Then the single, double, and triple indirect trees */
 	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+	for (level = 1; level <= 3; level++) {
+		changed = false;
+		result = sfs_itrunc_indirect(sfs, sfs_bmap_root(sv, level),
+					     level, baseblock, blocklen,
+					     &fb, &changed);
+		if (changed) {
+			sv->sv_dirty = true;
+		}
 		if (result) {
+			sfs_freebatch_flush(sfs, &fb);
 			vfs_biglock_release();
 			return result;
 		}
-
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
+		baseblock += sfs_bmap_span(dbperidb, level);
 	}
+	sfs_freebatch_flush(sfs, &fb);
 
+ done:
 	/* Set the file size */
 	sv->sv_i.sfi_size = len;
 
@@ -300,4 +521,3 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	vfs_biglock_release();
 	return 0;
 }
-
@@ -0,0 +1,650 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Extent-based block mapping, for inodes with SFS_IFLAG_EXTENTS set.
+ * See kern/sfs.h for the on-disk layout.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * I/O buffers for extent tree blocks.
+ *
+ * Note: in real life (and when you've done the fs assignment)
+ * you would get space from the disk buffer cache for this,
+ * not use a static area.
+ */
+static uint32_t extidxbuf[SFS_MAXBLOCKSIZE / sizeof(uint32_t)];
+static uint32_t extleafbuf[SFS_MAXBLOCKSIZE / sizeof(uint32_t)];
+static uint32_t extsplitbuf[SFS_MAXBLOCKSIZE / sizeof(uint32_t)];
+
+/* Parts of an extent tree block */
+#define EXTHDR(buf)	((struct sfs_extheader *)(buf))
+#define EXTIDX(buf)	((struct sfs_extindex *)(EXTHDR(buf) + 1))
+#define EXTENTS(buf)	((struct sfs_extent *)(EXTHDR(buf) + 1))
+
+/*
+ * Read extent tree block BLOCK of SV into BUF, checking that it is
+ * the kind of block we expect.
+ */
+static
+int
+sfs_ext_readblock(struct sfs_vnode *sv, daddr_t block, uint32_t magic,
+		  uint32_t *buf)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t blocksize = SFS_FS_BLOCKSIZE(sfs);
+	uint32_t max;
+	int result;
+
+	result = sfs_readblock(sfs, block, buf, blocksize);
+	if (result) {
+		return result;
+	}
+
+	max = magic == SFS_EXTMAGIC_INDEX ?
+		SFS_EXTIDXPERBLOCK(blocksize) : SFS_EXTPERBLOCK(blocksize);
+	if (EXTHDR(buf)->seh_magic != magic ||
+	    EXTHDR(buf)->seh_count == 0 || EXTHDR(buf)->seh_count > max) {
+		panic("sfs: %s: Bad extent tree block %u in file %u\n",
+		      sfs->sfs_sb.sb_volname, block, sv->sv_ino);
+	}
+	return 0;
+}
+
+/*
+ * Get leaf block LEAFBLOCK of SV into memory and return a pointer
+ * to its contents. The vnode keeps a copy of the last leaf it used
+ * in sv_idcache (which block-mapped files use for their last leaf
+ * indirect block), so runs of lookups in one leaf don't reread it.
+ */
+static
+int
+sfs_ext_getleaf(struct sfs_vnode *sv, daddr_t leafblock, uint32_t **ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t *buf;
+	int result;
+
+	if (sv->sv_idcacheblock == leafblock) {
+		*ret = sv->sv_idcache;
+		return 0;
+	}
+
+	if (sv->sv_idcache == NULL) {
+		sv->sv_idcache = kmalloc(SFS_FS_BLOCKSIZE(sfs));
+	}
+	buf = sv->sv_idcache != NULL ? sv->sv_idcache : extleafbuf;
+
+	sfs_bmap_invalidate(sv);
+	result = sfs_ext_readblock(sv, leafblock, SFS_EXTMAGIC_LEAF, buf);
+	if (result) {
+		return result;
+	}
+	if (buf == sv->sv_idcache) {
+		sv->sv_idcacheblock = leafblock;
+	}
+	*ret = buf;
+	return 0;
+}
+
+/*
+ * Load the tree's index block into extidxbuf and find the slot of
+ * the leaf that covers FILEBLOCK: the last one whose key is not past
+ * FILEBLOCK, or the first one if all are.
+ */
+static
+int
+sfs_ext_findslot(struct sfs_vnode *sv, uint32_t fileblock, unsigned *slotret)
+{
+	struct sfs_extindex *idx;
+	unsigned lo, hi, mid;
+	int result;
+
+	result = sfs_ext_readblock(sv, sv->sv_i.sfi_extroot,
+				   SFS_EXTMAGIC_INDEX, extidxbuf);
+	if (result) {
+		return result;
+	}
+	idx = EXTIDX(extidxbuf);
+
+	/* Binary search for the last key <= fileblock */
+	lo = 0;
+	hi = EXTHDR(extidxbuf)->seh_count;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (idx[mid].sei_fileblock <= fileblock) {
+			lo = mid;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	*slotret = lo;
+	return 0;
+}
+
+/*
+ * Look for the extent that maps FILEBLOCK. Failing that, look for
+ * the extent that ends right before it, which is the one a new
+ * block there should extend.
+ *
+ * On return *EXTRET is the extent found, or NULL if neither exists,
+ * and *FOUNDRET says whether it maps FILEBLOCK. *LEAFRET is the
+ * tree leaf the extent lives in (0 if it is in the inode); the
+ * extent pointer is only good until the next extent tree operation.
+ */
+static
+int
+sfs_ext_lookup(struct sfs_vnode *sv, uint32_t fileblock,
+	       struct sfs_extent **extret, bool *foundret, daddr_t *leafret)
+{
+	struct sfs_extent *ext, *prev;
+	daddr_t prevleaf, leafblock;
+	uint32_t *leaf;
+	unsigned i, slot, lo, hi, mid;
+	int result;
+
+	prev = NULL;
+	prevleaf = 0;
+
+	/* The inode's extents are unsorted; check them all */
+	for (i=0; i<sv->sv_i.sfi_nextents; i++) {
+		ext = &sv->sv_i.sfi_extents[i];
+		if (fileblock >= ext->sfe_fileblock &&
+		    fileblock - ext->sfe_fileblock < ext->sfe_len) {
+			*extret = ext;
+			*foundret = true;
+			*leafret = 0;
+			return 0;
+		}
+		if (ext->sfe_fileblock + ext->sfe_len == fileblock) {
+			prev = ext;
+		}
+	}
+
+	if (sv->sv_i.sfi_extroot != 0) {
+		result = sfs_ext_findslot(sv, fileblock, &slot);
+		if (result) {
+			return result;
+		}
+		leafblock = EXTIDX(extidxbuf)[slot].sei_block;
+		result = sfs_ext_getleaf(sv, leafblock, &leaf);
+		if (result) {
+			return result;
+		}
+
+		/* Binary search for the last extent starting <= fileblock */
+		ext = EXTENTS(leaf);
+		lo = 0;
+		hi = EXTHDR(leaf)->seh_count;
+		while (hi - lo > 1) {
+			mid = (lo + hi) / 2;
+			if (ext[mid].sfe_fileblock <= fileblock) {
+				lo = mid;
+			}
+			else {
+				hi = mid;
+			}
+		}
+		ext = &ext[lo];
+		if (fileblock >= ext->sfe_fileblock &&
+		    fileblock - ext->sfe_fileblock < ext->sfe_len) {
+			*extret = ext;
+			*foundret = true;
+			*leafret = leafblock;
+			return 0;
+		}
+		if (prev == NULL &&
+		    ext->sfe_fileblock + ext->sfe_len == fileblock) {
+			prev = ext;
+			prevleaf = leafblock;
+		}
+	}
+
+	*extret = prev;
+	*foundret = false;
+	*leafret = prevleaf;
+	return 0;
+}
+
+/*
+ * Insert NEWEXT into the sorted extents of leaf LEAF.
+ */
+static
+void
+sfs_ext_leafinsert(uint32_t *leaf, const struct sfs_extent *newext)
+{
+	struct sfs_extent *ext = EXTENTS(leaf);
+	unsigned i;
+
+	i = EXTHDR(leaf)->seh_count;
+	while (i > 0 && ext[i-1].sfe_fileblock > newext->sfe_fileblock) {
+		ext[i] = ext[i-1];
+		i--;
+	}
+	ext[i] = *newext;
+	EXTHDR(leaf)->seh_count++;
+}
+
+/*
+ * Add NEWEXT to the extent tree, creating the tree if necessary and
+ * splitting a leaf if it is full.
+ */
+static
+int
+sfs_ext_treeinsert(struct sfs_vnode *sv, const struct sfs_extent *newext)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t blocksize = SFS_FS_BLOCKSIZE(sfs);
+	struct sfs_extindex *idx;
+	struct sfs_extent *ext;
+	daddr_t root, leafblock, newblock;
+	uint32_t *leaf;
+	unsigned slot, split, i, count;
+	int result;
+
+	if (sv->sv_i.sfi_extroot == 0) {
+		/* No tree yet; make a root with one leaf */
+		result = sfs_balloc(sfs, 0, &root);
+		if (result) {
+			return result;
+		}
+		result = sfs_balloc(sfs, 0, &leafblock);
+		if (result) {
+			sfs_bfree(sfs, root);
+			return result;
+		}
+
+		bzero(extleafbuf, blocksize);
+		EXTHDR(extleafbuf)->seh_magic = SFS_EXTMAGIC_LEAF;
+		sfs_ext_leafinsert(extleafbuf, newext);
+
+		bzero(extidxbuf, blocksize);
+		EXTHDR(extidxbuf)->seh_magic = SFS_EXTMAGIC_INDEX;
+		EXTHDR(extidxbuf)->seh_count = 1;
+		EXTIDX(extidxbuf)[0].sei_fileblock = newext->sfe_fileblock;
+		EXTIDX(extidxbuf)[0].sei_block = leafblock;
+
+		result = sfs_writeblock(sfs, leafblock, extleafbuf, blocksize);
+		if (result == 0) {
+			result = sfs_writeblock(sfs, root, extidxbuf,
+						blocksize);
+		}
+		if (result) {
+			sfs_bfree(sfs, leafblock);
+			sfs_bfree(sfs, root);
+			return result;
+		}
+		sv->sv_i.sfi_extroot = root;
+		sv->sv_dirty = true;
+		return 0;
+	}
+
+	result = sfs_ext_findslot(sv, newext->sfe_fileblock, &slot);
+	if (result) {
+		return result;
+	}
+	idx = EXTIDX(extidxbuf);
+	leafblock = idx[slot].sei_block;
+	result = sfs_ext_getleaf(sv, leafblock, &leaf);
+	if (result) {
+		return result;
+	}
+
+	count = EXTHDR(leaf)->seh_count;
+	if (count < SFS_EXTPERBLOCK(blocksize)) {
+		/* There's room in the leaf */
+		sfs_ext_leafinsert(leaf, newext);
+		result = sfs_writeblock(sfs, leafblock, leaf, blocksize);
+		if (result) {
+			return result;
+		}
+		if (newext->sfe_fileblock < idx[slot].sei_fileblock) {
+			/* New first extent of the first leaf */
+			KASSERT(slot == 0);
+			idx[slot].sei_fileblock = newext->sfe_fileblock;
+			result = sfs_writeblock(sfs, sv->sv_i.sfi_extroot,
+						extidxbuf, blocksize);
+		}
+		return result;
+	}
+
+	/*
+	 * The leaf is full; split it, moving its upper part to a new
+	 * leaf that goes right after it in the index. The index has
+	 * only one level, so if it is full too the file is too
+	 * fragmented to grow.
+	 */
+	if (EXTHDR(extidxbuf)->seh_count >= SFS_EXTIDXPERBLOCK(blocksize)) {
+		return EFBIG;
+	}
+	result = sfs_balloc(sfs, 0, &newblock);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * Normally split down the middle. But files are mostly written
+	 * in order, forwards or backwards, so if the new extent goes
+	 * in the upper half, split right where it goes instead; that
+	 * keeps appends from leaving a trail of half-empty leaves.
+	 * Likewise if it goes at the very front.
+	 */
+	ext = EXTENTS(leaf);
+	for (split = 0; split < count; split++) {
+		if (ext[split].sfe_fileblock > newext->sfe_fileblock) {
+			break;
+		}
+	}
+	if (split > 0 && split < count / 2) {
+		split = count / 2;
+	}
+	bzero(extsplitbuf, blocksize);
+	EXTHDR(extsplitbuf)->seh_magic = SFS_EXTMAGIC_LEAF;
+	EXTHDR(extsplitbuf)->seh_count = count - split;
+	for (i=split; i<count; i++) {
+		EXTENTS(extsplitbuf)[i - split] = ext[i];
+		bzero(&ext[i], sizeof(ext[i]));
+	}
+	EXTHDR(leaf)->seh_count = split;
+
+	if (split > 0 &&
+	    (split == count ||
+	     newext->sfe_fileblock >= EXTENTS(extsplitbuf)[0].sfe_fileblock)) {
+		sfs_ext_leafinsert(extsplitbuf, newext);
+	}
+	else {
+		sfs_ext_leafinsert(leaf, newext);
+		if (newext->sfe_fileblock < idx[slot].sei_fileblock) {
+			KASSERT(slot == 0);
+			idx[slot].sei_fileblock = newext->sfe_fileblock;
+		}
+	}
+
+	/* Add the new leaf to the index */
+	for (i = EXTHDR(extidxbuf)->seh_count; i > slot + 1; i--) {
+		idx[i] = idx[i-1];
+	}
+	idx[slot+1].sei_fileblock = EXTENTS(extsplitbuf)[0].sfe_fileblock;
+	idx[slot+1].sei_block = newblock;
+	EXTHDR(extidxbuf)->seh_count++;
+
+	/* Write the new leaf before anything points to it */
+	result = sfs_writeblock(sfs, newblock, extsplitbuf, blocksize);
+	if (result) {
+		sfs_bfree(sfs, newblock);
+		sfs_bmap_invalidate(sv);
+		return result;
+	}
+	result = sfs_writeblock(sfs, sv->sv_i.sfi_extroot, extidxbuf,
+				blocksize);
+	if (result) {
+		sfs_bmap_invalidate(sv);
+		return result;
+	}
+	result = sfs_writeblock(sfs, leafblock, leaf, blocksize);
+	if (result) {
+		sfs_bmap_invalidate(sv);
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Extent version of sfs_bmap; see there for the interface. Blocks
+ * are allocated one at a time as the file grows, but each new block
+ * is placed right after the previous one if that is free, in which
+ * case the existing extent simply gets longer.
+ */
+int
+sfs_emap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+	 daddr_t *diskblock, uint32_t *runlen)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t blocksize = SFS_FS_BLOCKSIZE(sfs);
+	struct sfs_extent *ext, newext;
+	daddr_t leafblock, block, goal;
+	uint32_t *leaf;
+	bool found;
+	int result;
+
+	/* We use static buffers, so we'd better be locked. */
+	KASSERT(vfs_biglock_do_i_hold());
+
+	result = sfs_ext_lookup(sv, fileblock, &ext, &found, &leafblock);
+	if (result) {
+		return result;
+	}
+
+	if (found) {
+		block = ext->sfe_diskblock + (fileblock - ext->sfe_fileblock);
+		if (!sfs_bused(sfs, block)) {
+			panic("sfs: %s: Data block %u (block %u of file %u) "
+			      "marked free\n", sfs->sfs_sb.sb_volname,
+			      block, fileblock, sv->sv_ino);
+		}
+		if (runlen != NULL) {
+			*runlen = ext->sfe_len -
+				(fileblock - ext->sfe_fileblock);
+		}
+		*diskblock = block;
+		return 0;
+	}
+
+	if (runlen != NULL) {
+		*runlen = 1;
+	}
+
+	if (!doalloc) {
+		/* A hole */
+		*diskblock = 0;
+		return 0;
+	}
+
+	/* Try to extend the extent that ends here, if there is one */
+	goal = ext != NULL ? ext->sfe_diskblock + ext->sfe_len : 0;
+	result = sfs_balloc(sfs, goal, &block);
+	if (result) {
+		return result;
+	}
+
+	if (ext != NULL && block == goal) {
+		ext->sfe_len++;
+		if (leafblock == 0) {
+			sv->sv_dirty = true;
+		}
+		else {
+			/* The leaf was left in the vnode's cache */
+			leaf = sv->sv_idcacheblock == leafblock ?
+				sv->sv_idcache : extleafbuf;
+			result = sfs_writeblock(sfs, leafblock, leaf,
+						blocksize);
+			if (result) {
+				ext->sfe_len--;
+				sfs_bfree(sfs, block);
+				return result;
+			}
+		}
+		*diskblock = block;
+		return 0;
+	}
+
+	/* Otherwise start a new extent */
+	newext.sfe_fileblock = fileblock;
+	newext.sfe_diskblock = block;
+	newext.sfe_len = 1;
+	if (sv->sv_i.sfi_nextents < SFS_NIEXTENTS) {
+		sv->sv_i.sfi_extents[sv->sv_i.sfi_nextents++] = newext;
+		sv->sv_dirty = true;
+	}
+	else {
+		result = sfs_ext_treeinsert(sv, &newext);
+		if (result) {
+			sfs_bfree(sfs, block);
+			return result;
+		}
+	}
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Cut extent EXT so it ends at file block BLOCKLEN, freeing the disk
+ * blocks past that. Returns true if anything changed.
+ */
+static
+bool
+sfs_ext_trim(struct sfs_fs *sfs, struct sfs_extent *ext, uint32_t blocklen)
+{
+	uint32_t keep;
+
+	if (ext->sfe_fileblock + ext->sfe_len <= blocklen) {
+		return false;
+	}
+	keep = ext->sfe_fileblock >= blocklen ?
+		0 : blocklen - ext->sfe_fileblock;
+	sfs_bfree_range(sfs, ext->sfe_diskblock + keep, ext->sfe_len - keep);
+	ext->sfe_len = keep;
+	return true;
+}
+
+/*
+ * Extent version of the block-freeing part of sfs_itrunc: discard
+ * everything at and past file block BLOCKLEN. The caller has
+ * dropped the vnode's cached leaf.
+ */
+int
+sfs_etrunc(struct sfs_vnode *sv, uint32_t blocklen)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t blocksize = SFS_FS_BLOCKSIZE(sfs);
+	struct sfs_extent *ext;
+	struct sfs_extindex *idx;
+	unsigned i, n, slot;
+	bool idxdirty, leafdirty;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(sv->sv_idcacheblock == 0);
+
+	/* The inode's extents; drop any that become empty */
+	i = 0;
+	while (i < sv->sv_i.sfi_nextents) {
+		ext = &sv->sv_i.sfi_extents[i];
+		if (sfs_ext_trim(sfs, ext, blocklen)) {
+			sv->sv_dirty = true;
+		}
+		if (ext->sfe_len == 0) {
+			n = --sv->sv_i.sfi_nextents;
+			*ext = sv->sv_i.sfi_extents[n];
+			bzero(&sv->sv_i.sfi_extents[n], sizeof(*ext));
+			continue;
+		}
+		i++;
+	}
+
+	if (sv->sv_i.sfi_extroot == 0) {
+		return 0;
+	}
+
+	/*
+	 * The tree. Leaves are sorted, so work back from the last one
+	 * until we reach one that starts before the new EOF.
+	 */
+	result = sfs_ext_readblock(sv, sv->sv_i.sfi_extroot,
+				   SFS_EXTMAGIC_INDEX, extidxbuf);
+	if (result) {
+		return result;
+	}
+	idx = EXTIDX(extidxbuf);
+	idxdirty = false;
+
+	while (EXTHDR(extidxbuf)->seh_count > 0) {
+		slot = EXTHDR(extidxbuf)->seh_count - 1;
+		result = sfs_ext_readblock(sv, idx[slot].sei_block,
+					   SFS_EXTMAGIC_LEAF, extleafbuf);
+		if (result) {
+			return result;
+		}
+
+		leafdirty = false;
+		n = EXTHDR(extleafbuf)->seh_count;
+		ext = EXTENTS(extleafbuf);
+		while (n > 0 && sfs_ext_trim(sfs, &ext[n-1], blocklen)) {
+			leafdirty = true;
+			if (ext[n-1].sfe_len > 0) {
+				break;
+			}
+			bzero(&ext[n-1], sizeof(ext[n-1]));
+			n--;
+		}
+		EXTHDR(extleafbuf)->seh_count = n;
+
+		if (n > 0) {
+			if (leafdirty) {
+				result = sfs_writeblock(sfs,
+							idx[slot].sei_block,
+							extleafbuf, blocksize);
+				if (result) {
+					return result;
+				}
+			}
+			break;
+		}
+
+		/* The leaf is empty; free it and drop it from the index */
+		sfs_bfree(sfs, idx[slot].sei_block);
+		bzero(&idx[slot], sizeof(idx[slot]));
+		EXTHDR(extidxbuf)->seh_count--;
+		idxdirty = true;
+	}
+
+	if (EXTHDR(extidxbuf)->seh_count == 0) {
+		/* No leaves left; get rid of the tree */
+		sfs_bfree(sfs, sv->sv_i.sfi_extroot);
+		sv->sv_i.sfi_extroot = 0;
+		sv->sv_dirty = true;
+	}
+	else if (idxdirty) {
+		result = sfs_writeblock(sfs, sv->sv_i.sfi_extroot, extidxbuf,
+					blocksize);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
@@ -47,22 +47,28 @@
 
 /* Shortcuts for the size macros in kern/sfs.h */
 #define SFS_FS_NBLOCKS(sfs)        ((sfs)->sfs_sb.sb_nblocks)
-#define SFS_FS_FREEMAPBITS(sfs)    SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs))
-#define SFS_FS_FREEMAPBLOCKS(sfs)  SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs))
+#define SFS_FS_FREEMAPBITS(sfs) \
+	SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs), SFS_FS_BLOCKSIZE(sfs))
+#define SFS_FS_FREEMAPBLOCKS(sfs) \
+	SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs), SFS_FS_BLOCKSIZE(sfs))
 
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Reading loads the whole bitmap; writing writes back whatever parts
+ * of it have been loaded. (On volumes with free counts, the freemap
+ * is otherwise loaded a block at a time as needed; see sfs_balloc.c.)
+ * Writing only the blocks that changed might or might not be a
+ * worthwhile optimization.
  *
- * The free block bitmap consists of SFS_FREEMAPBLOCKS 512-byte
- * sectors of bits, one bit for each sector on the filesystem. The
- * number of blocks in the bitmap is thus rounded up to the nearest
- * multiple of 512*8 = 4096. (This rounded number is SFS_FREEMAPBITS.)
- * This means that the bitmap will (in general) contain space for some
- * number of invalid sectors that are actually beyond the end of the
- * disk device. This is ok. These sectors are supposed to be marked
- * "in use" by mksfs and never get marked "free".
+ * The free block bitmap consists of SFS_FREEMAPBLOCKS blocks of bits,
+ * one bit for each block on the filesystem. The number of blocks in
+ * the bitmap is thus rounded up to the nearest multiple of the number
+ * of bits in a block, e.g. 512*8 = 4096 for 512-byte blocks. (This
+ * rounded number is SFS_FREEMAPBITS.) This means that the bitmap will
+ * (in general) contain space for some number of invalid blocks that
+ * are actually beyond the end of the disk device. This is ok. These
+ * blocks are supposed to be marked "in use" by mksfs and never get
+ * marked "free".
  *
  * The sectors used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
@@ -72,6 +78,7 @@ int
 sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 {
 	uint32_t j, freemapblocks;
+	uint32_t blocksize = SFS_FS_BLOCKSIZE(sfs);
 	char *freemapdata;
 	int result;
 
@@ -85,16 +92,19 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 	for (j=0; j<freemapblocks; j++) {
 
 		/* Get a pointer to its data */
-		void *ptr = freemapdata + j*SFS_BLOCKSIZE;
+		void *ptr = freemapdata + j*blocksize;
 
-		/* and read or write it. The freemap starts at sector 2. */
+		/* and read or write it. The freemap starts at block 2. */
 		if (rw == UIO_READ) {
-			result = sfs_readblock(sfs, SFS_FREEMAP_START+j, ptr,
-					       SFS_BLOCKSIZE);
+			result = sfs_freemap_load(sfs, j);
+		}
+		else if (!bitmap_isset(sfs->sfs_freemaploaded, j)) {
+			/* Never loaded, so never changed */
+			result = 0;
 		}
 		else {
 			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j, ptr,
-						SFS_BLOCKSIZE);
+						blocksize);
 		}
 
 		/* If we failed, stop. */
@@ -262,6 +272,9 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
+	if (sfs->sfs_freemaploaded != NULL) {
+		bitmap_destroy(sfs->sfs_freemaploaded);
+	}
 	vnodearray_destroy(sfs->sfs_vnodes);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
@@ -277,9 +290,25 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
 	vfs_biglock_acquire();
 
+	/*
+	 * Finish freeing any removed files still waiting for the
+	 * reaper. That changes the freemap (and the free counts in the
+	 * superblock) after sfs_sync wrote them, so write them again.
+	 */
+	sfs_reap_drain(sfs);
+	result = sfs_sync_freemap(sfs);
+	if (result == 0) {
+		result = sfs_sync_superblock(sfs);
+	}
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* Do we have any files open? If so, can't unmount. */
 	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
 		vfs_biglock_release();
@@ -325,9 +354,9 @@ sfs_fs_create(void)
 	/*
 	 * Make sure our on-disk structures aren't messed up
 	 */
-	COMPILE_ASSERT(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
-	COMPILE_ASSERT(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
-	COMPILE_ASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	COMPILE_ASSERT(sizeof(struct sfs_superblock)==SFS_MINBLOCKSIZE);
+	COMPILE_ASSERT(sizeof(struct sfs_dinode)==SFS_MINBLOCKSIZE);
+	COMPILE_ASSERT(SFS_MINBLOCKSIZE % sizeof(struct sfs_direntry) == 0);
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
@@ -347,6 +376,9 @@ sfs_fs_create(void)
 	/* (ignore sfs_super, we'll read in over it shortly) */
 	sfs->sfs_superdirty = false;
 
+	/* enough of a block size to read the superblock with */
+	sfs->sfs_sb.sb_blocksize = SFS_MINBLOCKSIZE;
+
 	/* device we mount on */
 	sfs->sfs_device = NULL;
 
@@ -358,6 +390,7 @@ sfs_fs_create(void)
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
+	sfs->sfs_freemaploaded = NULL;
 	sfs->sfs_freemapdirty = false;
 
 	return sfs;
@@ -394,14 +427,16 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	(void)options;
 
 	/*
-	 * We can't mount on devices with the wrong sector size.
-	 *
-	 * (Note: for all intents and purposes here, "sector" and
-	 * "block" are interchangeable terms. Technically a filesystem
-	 * block may be composed of several hardware sectors, but we
-	 * don't do that in sfs.)
+	 * We can't mount on devices whose sectors don't fit evenly
+	 * into the smallest block. (An SFS block is composed of one
+	 * or more whole hardware sectors; the superblock and inodes
+	 * are SFS_MINBLOCKSIZE bytes, so that must be whole sectors
+	 * too.) The volume's own block size is checked once the
+	 * superblock is loaded.
 	 */
-	if (dev->d_blocksize != SFS_BLOCKSIZE) {
+	if (dev->d_blocksize == 0 ||
+	    dev->d_blocksize > SFS_MINBLOCKSIZE ||
+	    SFS_MINBLOCKSIZE % dev->d_blocksize != 0) {
 		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
@@ -440,23 +475,72 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return EINVAL;
 	}
 
-	if (sfs->sfs_sb.sb_nblocks > dev->d_blocks) {
-		kprintf("sfs: warning - fs has %u blocks, device has %u\n",
-			sfs->sfs_sb.sb_nblocks, dev->d_blocks);
+	/* Volumes from before the block size was recorded use 512 */
+	if (sfs->sfs_sb.sb_blocksize == 0) {
+		sfs->sfs_sb.sb_blocksize = SFS_MINBLOCKSIZE;
+	}
+
+	if (sfs->sfs_sb.sb_blocksize < SFS_MINBLOCKSIZE ||
+	    sfs->sfs_sb.sb_blocksize > SFS_MAXBLOCKSIZE ||
+	    (sfs->sfs_sb.sb_blocksize & (sfs->sfs_sb.sb_blocksize-1)) != 0) {
+		kprintf("sfs: Invalid block size %u in superblock\n",
+			sfs->sfs_sb.sb_blocksize);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		vfs_biglock_release();
+		return EINVAL;
+	}
+
+	if (sfs->sfs_sb.sb_features & ~SFS_FEATURE_ALL) {
+		kprintf("sfs: Unknown features 0x%x in superblock\n",
+			sfs->sfs_sb.sb_features & ~SFS_FEATURE_ALL);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		vfs_biglock_release();
+		return EINVAL;
+	}
+
+	if (sfs->sfs_sb.sb_nblocks >
+	    dev->d_blocks / (sfs->sfs_sb.sb_blocksize / dev->d_blocksize)) {
+		kprintf("sfs: warning - fs has %u blocks of %u bytes, "
+			"device has %u of %zu\n",
+			sfs->sfs_sb.sb_nblocks, sfs->sfs_sb.sb_blocksize,
+			dev->d_blocks, dev->d_blocksize);
 	}
 
 	/* Ensure null termination of the volume name */
 	sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
 
-	/* Load free block bitmap */
+	if (sfs->sfs_sb.sb_state & SFS_STATE_ERRORS) {
+		kprintf("sfs: %s: warning - volume has errors; run sfsck\n",
+			sfs->sfs_sb.sb_volname);
+	}
+
+	/*
+	 * Set up the free block bitmap. If the volume keeps free
+	 * counts, its blocks are loaded on demand; otherwise load it
+	 * all now.
+	 */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
-	if (sfs->sfs_freemap == NULL) {
+	sfs->sfs_freemaploaded = bitmap_create(SFS_FS_FREEMAPBLOCKS(sfs));
+	if (sfs->sfs_freemap == NULL || sfs->sfs_freemaploaded == NULL) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
 		vfs_biglock_release();
 		return ENOMEM;
 	}
-	result = sfs_freemapio(sfs, UIO_READ);
+	if ((sfs->sfs_sb.sb_features & SFS_FEATURE_FREESUM) == 0) {
+		result = sfs_freemapio(sfs, UIO_READ);
+		if (result) {
+			sfs->sfs_device = NULL;
+			sfs_fs_destroy(sfs);
+			vfs_biglock_release();
+			return result;
+		}
+	}
+
+	/* Make sure there's a thread to free removed files */
+	result = sfs_reap_start();
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
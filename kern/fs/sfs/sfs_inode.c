@@ -37,8 +37,16 @@
 #include <lib.h>
 #include <vfs.h>
 #include <sfs.h>
+#include <slab.h>
 #include "sfsprivate.h"
 
+/*
+ * In-memory vnodes, shared by all SFS volumes. (An sfs_vnode is a
+ * bit over half a kilobyte, so from kmalloc it would take a 1K block.)
+ */
+static struct slab_cache sfs_vnode_cache =
+	SLAB_CACHE_INITIALIZER("sfs_vnode", sizeof(struct sfs_vnode), 0,
+			       NULL, NULL);
 
 /*
  * Write an on-disk inode structure back out to disk.
@@ -93,8 +101,16 @@ sfs_reclaim(struct vnode *v)
 	}
 	spinlock_release(&v->vn_countlock);
 
-	/* If there are no on-disk references to the file either, erase it. */
+	/*
+	 * If there are no on-disk references to the file either, erase
+	 * it. Big files are left to the reaper, which takes over our
+	 * reference and brings the vnode back here once it's done.
+	 */
 	if (sv->sv_i.sfi_linkcount == 0) {
+		if (sfs_reap_defer(sv)) {
+			vfs_biglock_release();
+			return 0;
+		}
 		result = sfs_itrunc(sv, 0);
 		if (result) {
 			vfs_biglock_release();
@@ -136,7 +152,8 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	kfree(sv->sv_idcache);
+	slab_free(&sfs_vnode_cache, sv);
 
 	/* Done */
 	return 0;
@@ -184,7 +201,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = slab_alloc(&sfs_vnode_cache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -198,13 +215,18 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
-		kfree(sv);
+		slab_free(&sfs_vnode_cache, sv);
 		return result;
 	}
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* No indirect block cached yet */
+	sv->sv_idcache = NULL;
+	sv->sv_idcacheblock = 0;
+	sv->sv_idcachebase = 0;
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out by sfs_balloc and
@@ -235,7 +257,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		slab_free(&sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -246,7 +268,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
 	if (result) {
 		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
+		slab_free(&sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -269,7 +291,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, &ino);
 	if (result) {
 		return result;
 	}
@@ -281,8 +303,15 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	result = sfs_loadvnode(sfs, ino, type, ret);
 	if (result) {
 		sfs_bfree(sfs, ino);
+		return result;
 	}
-	return result;
+
+	/* On volumes made with extents, new objects use them */
+	if (sfs->sfs_sb.sb_features & SFS_FEATURE_EXTENTS) {
+		(*ret)->sv_i.sfi_flags |= SFS_IFLAG_EXTENTS;
+		(*ret)->sv_dirty = true;
+	}
+	return 0;
 }
 
 /*
@@ -49,7 +49,9 @@
  * Note: sfs_readblock is used to read the superblock
  * early in mount, before sfs is fully (or even mostly)
  * initialized, and so may not use anything from sfs
- * except sfs_device.
+ * except sfs_device and the block size. (The latter is
+ * preset to SFS_MINBLOCKSIZE by sfs_fs_create, which is
+ * enough to reach the superblock at the start of block 0.)
  */
 
 /*
@@ -66,7 +68,7 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
+	      uio->uio_offset / SFS_FS_BLOCKSIZE(sfs));
 
  retry:
 	result = DEVOP_IO(sfs->sfs_device, uio);
@@ -84,7 +86,7 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 			tries++;
 			kprintf("sfs: %s: block %llu I/O error, retrying\n",
 				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE);
+				uio->uio_offset / SFS_FS_BLOCKSIZE(sfs));
 			goto retry;
 		}
 		else if (tries < 10) {
@@ -95,7 +97,8 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 			kprintf("sfs: %s: block %llu I/O error, giving up "
 				"after %d retries\n",
 				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
+				uio->uio_offset / SFS_FS_BLOCKSIZE(sfs),
+				tries);
 		}
 	}
 	return result;
@@ -103,6 +106,10 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 
 /*
  * Read a block.
+ *
+ * LEN may be less than the block size, in which case only the
+ * beginning of the block is transferred. This is used for the
+ * superblock and inodes, which are always SFS_MINBLOCKSIZE bytes.
  */
 int
 sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
@@ -110,14 +117,16 @@ sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len <= SFS_FS_BLOCKSIZE(sfs));
+	KASSERT(len % SFS_MINBLOCKSIZE == 0);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
+	SFSUIO(sfs, &iov, &ku, data, len, block, UIO_READ);
 	return sfs_rwblock(sfs, &ku);
 }
 
 /*
- * Write a block.
+ * Write a block. As with sfs_readblock, LEN may be less than the
+ * block size to write only the beginning of the block.
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
@@ -125,9 +134,10 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len <= SFS_FS_BLOCKSIZE(sfs));
+	KASSERT(len % SFS_MINBLOCKSIZE == 0);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
+	SFSUIO(sfs, &iov, &ku, data, len, block, UIO_WRITE);
 	return sfs_rwblock(sfs, &ku);
 }
 
@@ -157,9 +167,10 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	 * you would get space from the disk buffer cache for this,
 	 * not use a static area.
 	 */
-	static char iobuf[SFS_BLOCKSIZE];
+	static char iobuf[SFS_MAXBLOCKSIZE];
 
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t blocksize = SFS_FS_BLOCKSIZE(sfs);
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -167,16 +178,16 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	/* Allocate missing blocks if and only if we're writing */
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
 
-	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
+	KASSERT(skipstart + len <= blocksize);
 
 	/* We're using a global static buffer; it had better be locked */
 	KASSERT(vfs_biglock_do_i_hold());
 
 	/* Compute the block offset of this block in the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	fileblock = uio->uio_offset / blocksize;
 
 	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, doalloc, &diskblock, NULL);
 	if (result) {
 		return result;
 	}
@@ -187,13 +198,13 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 		 * Zero the buffer.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+		bzero(iobuf, blocksize);
 	}
 	else {
 		/*
 		 * Read the block.
 		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
+		result = sfs_readblock(sfs, diskblock, iobuf, blocksize);
 		if (result) {
 			return result;
 		}
@@ -211,7 +222,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	 * If it was a write, write back the modified block.
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
+		result = sfs_writeblock(sfs, diskblock, iobuf, blocksize);
 		if (result) {
 			return result;
 		}
@@ -221,15 +232,19 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 }
 
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Do I/O (either read or write) of up to NBLOCKS whole blocks. As
+ * many of them as are stored consecutively on disk are transferred
+ * with one device request; the caller loops for the rest.
  */
 static
 int
-sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+sfs_blockio(struct sfs_vnode *sv, struct uio *uio, uint32_t nblocks)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t blocksize = SFS_FS_BLOCKSIZE(sfs);
 	daddr_t diskblock;
-	uint32_t fileblock;
+	daddr_t prevblock;
+	uint32_t fileblock, runlen, i;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
 	off_t saveoff;
@@ -237,11 +252,42 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	off_t saveres;
 	off_t diskres;
 
+	KASSERT(nblocks > 0);
+
 	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	fileblock = uio->uio_offset / blocksize;
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/*
+	 * If writing, allocate any missing blocks first, in order.
+	 * The allocator tries to place each one after its
+	 * predecessor, so they will usually form a single run. Stop
+	 * where the run breaks; that block starts the next call's
+	 * run, so each block is looked at about once per write. If
+	 * we run out of space partway, do what we have; the error
+	 * will come back on the next call.
+	 */
+	if (doalloc) {
+		prevblock = 0;
+		for (i=0; i<nblocks; i++) {
+			result = sfs_bmap(sv, fileblock + i, true,
+					  &diskblock, NULL);
+			if (result) {
+				if (i == 0) {
+					return result;
+				}
+				nblocks = i;
+				break;
+			}
+			if (i > 0 && diskblock != prevblock + 1) {
+				nblocks = i;
+				break;
+			}
+			prevblock = diskblock;
+		}
+	}
+
+	/* Look up the disk block number and the length of the run */
+	result = sfs_bmap(sv, fileblock, doalloc, &diskblock, &runlen);
 	if (result) {
 		return result;
 	}
@@ -254,7 +300,11 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		 * allocated a block for us.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+		return uiomovezeros(blocksize, uio);
+	}
+
+	if (runlen > nblocks) {
+		runlen = nblocks;
 	}
 
 	/*
@@ -262,15 +312,15 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	 * and substitute one that makes sense to the device.
 	 */
 	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
+	diskoff = (off_t)diskblock * blocksize;
 	uio->uio_offset = diskoff;
 
 	/*
-	 * Temporarily set the residue to be one block size.
+	 * Temporarily set the residue to the length of the run.
 	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
+	KASSERT(uio->uio_resid >= (size_t)runlen * blocksize);
 	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
+	diskres = (off_t)runlen * blocksize;
 	uio->uio_resid = diskres;
 
 	result = sfs_rwblock(sfs, uio);
@@ -291,8 +341,10 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t blocksize = SFS_FS_BLOCKSIZE(sfs);
 	uint32_t blkoff;
-	uint32_t nblocks, i;
+	uint32_t nblocks;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
 
@@ -318,17 +370,21 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			uio->uio_resid -= extraresid;
 		}
 	}
+	else if (uio->uio_offset + uio->uio_resid > SFS_MAXFILESIZE) {
+		/* The file size wouldn't fit in the inode */
+		return EFBIG;
+	}
 
 	/*
 	 * First, do any leading partial block.
 	 */
-	blkoff = uio->uio_offset % SFS_BLOCKSIZE;
+	blkoff = uio->uio_offset % blocksize;
 	if (blkoff != 0) {
 		/* Number of bytes at beginning of block to skip */
 		uint32_t skip = blkoff;
 
 		/* Number of bytes to read/write after that point */
-		uint32_t len = SFS_BLOCKSIZE - blkoff;
+		uint32_t len = blocksize - blkoff;
 
 		/* ...which might be less than the rest of the block */
 		if (len > uio->uio_resid) {
@@ -348,12 +404,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Now we should be block-aligned. Do the remaining whole blocks.
+	 * Now we should be block-aligned. Do the remaining whole
+	 * blocks, a run at a time.
 	 */
-	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
-	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+	KASSERT(uio->uio_offset % blocksize == 0);
+	while (uio->uio_resid >= blocksize) {
+		nblocks = uio->uio_resid / blocksize;
+		result = sfs_blockio(sv, uio, nblocks);
 		if (result) {
 			goto out;
 		}
@@ -362,7 +419,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * Now do any remaining partial block at the end.
 	 */
-	KASSERT(uio->uio_resid < SFS_BLOCKSIZE);
+	KASSERT(uio->uio_resid < blocksize);
 
 	if (uio->uio_resid > 0) {
 		result = sfs_partialio(sv, uio, 0, uio->uio_resid);
@@ -381,6 +438,21 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		sv->sv_dirty = true;
 	}
 
+	/*
+	 * If a write failed, blocks may have been allocated past what
+	 * got written. Don't leave them attached past EOF.
+	 */
+	if (result && uio->uio_rw == UIO_WRITE) {
+		int result2;
+
+		result2 = sfs_itrunc(sv, sv->sv_i.sfi_size);
+		if (result2) {
+			kprintf("sfs: %s: Cleaning up after failed write: "
+				"%s\n", sfs->sfs_sb.sb_volname,
+				strerror(result2));
+		}
+	}
+
 	/* Add in any extra amount we couldn't read because of EOF */
 	uio->uio_resid += extraresid;
 
@@ -407,6 +479,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	   enum uio_rw rw)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t blocksize = SFS_FS_BLOCKSIZE(sfs);
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
@@ -421,18 +494,18 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	 * would get space from the disk buffer cache for this, not use a
 	 * static area.
 	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
+	static char metaiobuf[SFS_MAXBLOCKSIZE];
 
 	/* We're using a global static buffer; it had better be locked */
 	KASSERT(vfs_biglock_do_i_hold());
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
-	vnblock = actualpos / SFS_BLOCKSIZE;
-	blockoffset = actualpos % SFS_BLOCKSIZE;
+	vnblock = actualpos / blocksize;
+	blockoffset = actualpos % blocksize;
 
 	/* Get the disk block number */
 	doalloc = (rw == UIO_WRITE);
-	result = sfs_bmap(sv, vnblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, vnblock, doalloc, &diskblock, NULL);
 	if (result) {
 		return result;
 	}
@@ -447,7 +520,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	}
 
 	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	result = sfs_readblock(sfs, diskblock, metaiobuf, blocksize);
 	if (result) {
 		return result;
 	}
@@ -461,8 +534,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		memcpy(metaiobuf + blockoffset, data, len);
 
 		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
+		result = sfs_writeblock(sfs, diskblock, metaiobuf, blocksize);
 		if (result) {
 			return result;
 		}
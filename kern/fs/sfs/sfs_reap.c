@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Background freeing of removed files.
+ *
+ * When the last reference to a file with no links goes away, its
+ * blocks have to be freed. For a big file that is a long walk over
+ * the block maps with vfs_biglock held, and it happens in whatever
+ * thread drops the reference -- typically the one calling remove().
+ * Instead, sfs_reclaim hands big files to the reaper thread, which
+ * truncates them a chunk at a time, letting go of the big lock in
+ * between, and then drops the reference so the inode is released in
+ * the usual way.
+ *
+ * The reaper is shared by all SFS volumes. Its queue holds the
+ * reference sfs_reclaim would otherwise have consumed, so queued
+ * vnodes stay in their volume's vnode table; unmount finishes off
+ * any that belong to it itself.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <proc.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Files with more blocks than this are freed in the background. */
+#define SFS_REAP_MINBLOCKS	64
+
+/* Number of blocks freed per acquisition of vfs_biglock. */
+#define SFS_REAP_CHUNK		256
+
+/*
+ * The queue. Changing it requires both vfs_biglock and sfs_reaplock;
+ * the reaper checks it for work with only sfs_reaplock.
+ */
+static struct lock *sfs_reaplock;
+static struct cv *sfs_reapcv;
+static struct vnodearray *sfs_reapq;
+
+/* Vnode being let go of by sfs_reap_remove (protected by vfs_biglock) */
+static struct vnode *sfs_reapdone;
+
+/*
+ * Take vnode IX off the queue and drop the queue's reference, which
+ * reclaims it. Whatever hasn't been freed yet is freed then, by
+ * sfs_reclaim itself.
+ */
+static
+void
+sfs_reap_remove(unsigned ix)
+{
+	struct vnode *v;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	lock_acquire(sfs_reaplock);
+	v = vnodearray_get(sfs_reapq, ix);
+	vnodearray_remove(sfs_reapq, ix);
+	lock_release(sfs_reaplock);
+
+	sfs_reapdone = v;
+	VOP_DECREF(v);
+	sfs_reapdone = NULL;
+}
+
+/*
+ * Free the next chunk of the file at the head of the queue.
+ */
+static
+void
+sfs_reap_step(void)
+{
+	struct vnode *v;
+	struct sfs_vnode *sv;
+	struct sfs_fs *sfs;
+	uint32_t blocksize, blocks;
+	off_t len;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (vnodearray_num(sfs_reapq) == 0) {
+		/* Unmount got here first */
+		return;
+	}
+	v = vnodearray_get(sfs_reapq, 0);
+	sv = v->vn_data;
+	sfs = v->vn_fs->fs_data;
+	blocksize = SFS_FS_BLOCKSIZE(sfs);
+
+	/* Cut the file back to the chunk boundary below its end */
+	blocks = DIVROUNDUP(sv->sv_i.sfi_size, blocksize);
+	if (blocks > SFS_REAP_CHUNK) {
+		len = (off_t)(blocks - SFS_REAP_CHUNK) * blocksize;
+	}
+	else {
+		len = 0;
+	}
+
+	result = sfs_itrunc(sv, len);
+	if (result) {
+		/* Give up; sfs_reclaim will try again */
+		kprintf("sfs: %s: reaping inode %u: %s\n",
+			sfs->sfs_sb.sb_volname, sv->sv_ino, strerror(result));
+		len = 0;
+	}
+
+	if (len == 0) {
+		sfs_reap_remove(0);
+	}
+}
+
+/*
+ * The reaper thread.
+ */
+static
+void
+sfs_reaper(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		lock_acquire(sfs_reaplock);
+		while (vnodearray_num(sfs_reapq) == 0) {
+			cv_wait(sfs_reapcv, sfs_reaplock);
+		}
+		lock_release(sfs_reaplock);
+
+		vfs_biglock_acquire();
+		sfs_reap_step();
+		vfs_biglock_release();
+	}
+}
+
+/*
+ * Start the reaper, if it isn't already running. Called at mount
+ * time.
+ */
+int
+sfs_reap_start(void)
+{
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs_reapq != NULL) {
+		return 0;
+	}
+
+	sfs_reaplock = lock_create("sfs_reap");
+	if (sfs_reaplock == NULL) {
+		goto nomem;
+	}
+	sfs_reapcv = cv_create("sfs_reap");
+	if (sfs_reapcv == NULL) {
+		goto nomem;
+	}
+	sfs_reapq = vnodearray_create();
+	if (sfs_reapq == NULL) {
+		goto nomem;
+	}
+
+	result = thread_fork("sfs reaper", kproc, sfs_reaper, NULL, 0);
+	if (result) {
+		goto fail;
+	}
+	return 0;
+
+ nomem:
+	result = ENOMEM;
+ fail:
+	if (sfs_reapq != NULL) {
+		vnodearray_destroy(sfs_reapq);
+		sfs_reapq = NULL;
+	}
+	if (sfs_reapcv != NULL) {
+		cv_destroy(sfs_reapcv);
+		sfs_reapcv = NULL;
+	}
+	if (sfs_reaplock != NULL) {
+		lock_destroy(sfs_reaplock);
+		sfs_reaplock = NULL;
+	}
+	return result;
+}
+
+/*
+ * Called from sfs_reclaim for a vnode with no links left. If the
+ * file is big enough to be worth it, queue it for the reaper and
+ * return true; the queue takes over the reference sfs_reclaim was
+ * given. Otherwise return false and let the caller free it.
+ */
+bool
+sfs_reap_defer(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t blocksize = SFS_FS_BLOCKSIZE(sfs);
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(sv->sv_i.sfi_linkcount == 0);
+
+	if (sfs_reapq == NULL || &sv->sv_absvn == sfs_reapdone ||
+	    DIVROUNDUP(sv->sv_i.sfi_size, blocksize) <= SFS_REAP_MINBLOCKS) {
+		return false;
+	}
+
+	lock_acquire(sfs_reaplock);
+	result = vnodearray_add(sfs_reapq, &sv->sv_absvn, NULL);
+	if (result == 0) {
+		cv_signal(sfs_reapcv, sfs_reaplock);
+	}
+	lock_release(sfs_reaplock);
+
+	return result == 0;
+}
+
+/*
+ * Free everything queued for volume SFS right now. Called at unmount
+ * time, so the queue doesn't keep the volume busy.
+ */
+void
+sfs_reap_drain(struct sfs_fs *sfs)
+{
+	struct vnode *v;
+	unsigned i;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs_reapq == NULL) {
+		return;
+	}
+
+	i = 0;
+	while (i < vnodearray_num(sfs_reapq)) {
+		v = vnodearray_get(sfs_reapq, i);
+		if (v->vn_fs != &sfs->sfs_absfs) {
+			i++;
+			continue;
+		}
+		sfs_reap_remove(i);
+	}
+}
@@ -154,6 +154,7 @@ int
 sfs_stat(struct vnode *v, struct stat *statbuf)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
 	/* Fill in the stat structure */
@@ -166,6 +167,7 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 
 	statbuf->st_size = sv->sv_i.sfi_size;
 	statbuf->st_nlink = sv->sv_i.sfi_linkcount;
+	statbuf->st_blksize = SFS_FS_BLOCKSIZE(sfs);
 
 	/* We don't support this yet */
 	statbuf->st_blocks = 0;
@@ -251,6 +253,9 @@ sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
+	if (len > SFS_MAXFILESIZE) {
+		return EFBIG;
+	}
 	return sfs_itrunc(sv, len);
 }
 
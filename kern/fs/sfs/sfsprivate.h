@@ -37,20 +37,53 @@
 extern const struct vnode_ops sfs_fileops;
 extern const struct vnode_ops sfs_dirops;
 
+/* Block size of a mounted volume */
+#define SFS_FS_BLOCKSIZE(sfs)      ((sfs)->sfs_sb.sb_blocksize)
+
+/* Largest file size the inode can record (sfi_size is 32 bits) */
+#define SFS_MAXFILESIZE            ((off_t)0xffffffff)
+
+/*
+ * A run of disk blocks waiting to be freed. Truncate collects the
+ * blocks it discards into one of these so that contiguous ones get
+ * cleared in the freemap with a single bitmap_unmark_range.
+ */
+struct sfs_freebatch {
+	daddr_t fb_start;		/* first block of the run */
+	uint32_t fb_len;		/* number of blocks in the run */
+};
+
 /* Macro for initializing a uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
+#define SFSUIO(sfs, iov, uio, ptr, len, block, rw) \
+    uio_kinit(iov, uio, ptr, len, ((off_t)(block))*SFS_FS_BLOCKSIZE(sfs), rw)
 
 
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
+void sfs_bfree_range(struct sfs_fs *sfs, daddr_t start, uint32_t count);
+void sfs_freebatch_init(struct sfs_freebatch *fb);
+void sfs_freebatch_add(struct sfs_fs *sfs, struct sfs_freebatch *fb,
+		daddr_t diskblock);
+void sfs_freebatch_flush(struct sfs_fs *sfs, struct sfs_freebatch *fb);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
+int sfs_freemap_load(struct sfs_fs *sfs, uint32_t mapblock);
 
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-		daddr_t *diskblock);
+		daddr_t *diskblock, uint32_t *runlen);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
+void sfs_bmap_invalidate(struct sfs_vnode *sv);
+
+/* Functions in sfs_extent.c */
+int sfs_emap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+		daddr_t *diskblock, uint32_t *runlen);
+int sfs_etrunc(struct sfs_vnode *sv, uint32_t blocklen);
+
+/* Functions in sfs_reap.c */
+int sfs_reap_start(void);
+bool sfs_reap_defer(struct sfs_vnode *sv);
+void sfs_reap_drain(struct sfs_fs *sfs);
 
 /* Functions in sfs_dir.c */
 int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
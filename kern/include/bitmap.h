@@ -38,9 +38,14 @@
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *     bitmap_alloc_range - same, but only look at COUNT bits from START.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
+ *     bitmap_unmark_range - clear a run of set bits, given the index of
+ *                      the first one and the count.
  *     bitmap_isset   - return whether a particular bit is set or not.
+ *     bitmap_count_clear - return how many of COUNT bits from START are
+ *                      clear.
  *     bitmap_destroy - destroy bitmap.
  */
 
@@ -50,9 +55,15 @@ struct bitmap;  /* Opaque. */
 struct bitmap *bitmap_create(unsigned nbits);
 void          *bitmap_getdata(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, unsigned *index);
+int            bitmap_alloc_range(struct bitmap *, unsigned start,
+                                  unsigned count, unsigned *index);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
+void           bitmap_unmark_range(struct bitmap *, unsigned start,
+                                   unsigned count);
 int            bitmap_isset(struct bitmap *, unsigned index);
+unsigned       bitmap_count_clear(struct bitmap *, unsigned start,
+                                  unsigned count);
 void           bitmap_destroy(struct bitmap *);
 
 
@@ -48,6 +48,12 @@
 void hardclock_bootstrap(void);
 void hardclock(void);
 
+/*
+ * For tests: if set, hardclock_hook is called from hardclock, in
+ * interrupt context, on every CPU.
+ */
+extern void (*volatile hardclock_hook)(void);
+
 /*
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
@@ -35,6 +35,9 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+/* Number of scheduler priority levels; see schedule() in thread.c */
+#define SCHED_NLEVELS 4
+
 
 /*
  * Per-cpu structure
@@ -53,12 +56,16 @@ struct cpu {
 	struct cpu *c_self;		/* Canonical address of this struct */
 	unsigned c_number;		/* This cpu's cpu number */
 	unsigned c_hardware_number;	/* Hardware-defined cpu number */
+	struct klog_cpu *c_klog;	/* Kernel message log (klog.c) */
+	struct kmalloc_cpu *c_kmalloc;	/* Free block magazines (kmalloc.c) */
+	struct workq *c_workq;		/* Deferred work queue (workqueue.c) */
 
 	/*
 	 * Accessed only by this cpu.
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_threadpool;	/* Exited threads kept for reuse */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
 
@@ -67,7 +74,7 @@ struct cpu {
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queues, by priority */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -112,6 +119,14 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Number of cpus, and the cpu with a given c_number. Meant for use
+ * once all the cpus have been found (e.g. by thread_fork_pinned
+ * callers); the answers don't change after that.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned num);
+
 /*
  * Produce a string describing the CPU type.
  */
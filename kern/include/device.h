@@ -34,8 +34,11 @@
  * Devices.
  */
 
+#include <kern/time.h>
+
 
 struct uio;  /* in <uio.h> */
+struct devreq;
 
 /*
  * Filesystem-namespace-accessible device.
@@ -56,11 +59,13 @@ struct device {
  *      devop_eachopen - called on each open call to allow denying the open
  *      devop_io - for both reads and writes (the uio indicates the direction)
  *      devop_ioctl - miscellaneous control operations
+ *      devop_submit - queue a block request (optional; see below)
  */
 struct device_ops {
 	int (*devop_eachopen)(struct device *, int flags_from_open);
 	int (*devop_io)(struct device *, struct uio *);
 	int (*devop_ioctl)(struct device *, int op, userptr_t data);
+	int (*devop_submit)(struct device *, struct devreq *);
 };
 
 /*
@@ -70,6 +75,86 @@ struct device_ops {
 #define DEVOP_IO(d, u)		((d)->d_ops->devop_io(d, u))
 #define DEVOP_IOCTL(d, op, p)	((d)->d_ops->devop_ioctl(d, op, p))
 
+/*
+ * Block requests.
+ *
+ * A block device may also accept I/O as requests that are queued and
+ * completed later, so the caller can go do something else (or queue
+ * more) while the transfer happens. Use dev_submit, which checks the
+ * request and works for devices without devop_submit too (by doing
+ * the transfer on the spot).
+ *
+ * When the transfer is finished the driver sets dr_result and calls
+ * dr_done. This may happen in the driver's interrupt handler, so the
+ * callback must not sleep; V() on a semaphore is the usual thing to
+ * do. The buffer must be kernel memory and must stay put until then.
+ *
+ * While a request is queued, dr_next belongs to the driver.
+ */
+struct devreq {
+	uint32_t dr_block;		/* first block */
+	uint32_t dr_nblocks;		/* number of blocks */
+	void *dr_buf;			/* data (kernel memory) */
+	bool dr_write;			/* true to write, false to read */
+	int dr_result;			/* error code, set on completion */
+	void (*dr_done)(struct devreq *);	/* completion callback */
+	void *dr_data;			/* for the submitter's use */
+	struct devreq *dr_next;		/* for the driver's use */
+	struct timespec dr_deadline;	/* for the driver's use */
+};
+
+/*
+ * Queue of pending requests, for drivers.
+ *
+ * The order requests come out in is decided by the queue's I/O
+ * scheduler, which can be changed at runtime with devsched_select
+ * (the "iosched" menu command). The policies are:
+ *
+ *    fifo      - in the order submitted
+ *    clook     - C-LOOK elevator: ascending block order from the
+ *                last block served, then wrap back to the lowest
+ *    deadline  - C-LOOK, except that a request that has waited too
+ *                long goes next
+ *
+ * The queue itself is not locked; the driver must use its own lock
+ * around devqueue_add and devqueue_remove. Queues are registered by
+ * name at init time and last forever, like devices, unless the device
+ * fails to attach, in which case devqueue_cleanup takes it back off.
+ */
+struct devsched;
+
+struct devqueue {
+	char dq_name[16];		/* name, for devsched_select */
+	const struct devsched *dq_sched;	/* policy */
+	struct devreq *dq_head;		/* pending, in submission order */
+	struct devreq *dq_tail;
+	uint32_t dq_headpos;		/* block after the last one served */
+	unsigned long dq_served;	/* requests served */
+	unsigned long long dq_seekdist;	/* total blocks of head travel */
+	struct devqueue *dq_nextqueue;	/* list of all queues */
+};
+
+void devqueue_init(struct devqueue *dq, const char *name);
+void devqueue_cleanup(struct devqueue *dq);
+bool devqueue_isempty(struct devqueue *dq);
+void devqueue_add(struct devqueue *dq, struct devreq *req);
+struct devreq *devqueue_remove(struct devqueue *dq);
+
+/* Change the policy of the named queue. */
+int devsched_select(const char *name, const char *policy);
+
+/* Print the queues, their policies and statistics. */
+void devsched_printstats(void);
+
+/* Check and submit a block request. */
+int dev_submit(struct device *dev, struct devreq *req);
+
+/*
+ * Carry out a uio by submitting block requests and waiting for them.
+ * Drivers with devop_submit can use this as their devop_io.
+ */
+int devreq_uio(struct device *dev, struct uio *uio);
+
 
 /* Create vnode for a vfs-level device. */
 struct vnode *dev_create_vnode(struct device *dev);
@@ -80,6 +165,17 @@ void dev_uncreate_vnode(struct vnode *vn);
 /* Initialization functions for builtin vfs-level devices. */
 void devnull_create(void);
 
+/* Create software RAID devices over existing devices (by name). */
+int devraid0_create(const char *name, uint32_t stripe,
+		    unsigned ndisks, char **disknames);
+int devraid1_create(const char *name, unsigned ndisks, char **disknames);
+
+/* Create a RAM disk of NBLOCKS 512-byte blocks. */
+int devram_create(const char *name, uint32_t nblocks);
+
+/* Create a block device over the file at PATH. */
+int devloop_create(const char *name, const char *path);
+
 /* Function that kicks off device probe and attach. */
 void dev_bootstrap(void);
 
@@ -37,6 +37,24 @@
 #include <fs.h>
 #include <vnode.h>
 
+/*
+ * File data cache parameters: the cache holds EMUFS_CACHEPAGES pieces
+ * of files, each EMUFS_PAGESIZE bytes long and aligned.
+ */
+#define EMUFS_PAGESIZE		4096
+#define EMUFS_CACHEPAGES	32
+
+/*
+ * Most emu units whose work one emufs can share out. The units must
+ * all be looking at the same host directory.
+ */
+#define EMUFS_MAXCHANS		4
+
+/* ev_chanstate values */
+#define EMUFS_CHAN_CLOSED	0	/* not opened on that unit yet */
+#define EMUFS_CHAN_OPEN		1	/* ev_chanhandle is valid */
+#define EMUFS_CHAN_FAILED	2	/* couldn't open; don't use that unit */
+
 /*
  * Our structures
  */
@@ -45,14 +63,58 @@ struct emufs_vnode {
 	struct vnode ev_v;		/* abstract vnode structure */
 	struct emu_softc *ev_emu;	/* device */
 	uint32_t ev_handle;		/* file handle */
+	char *ev_path;			/* path from the root, for reopening */
+
+	/* Handles on the other units; each protected by that unit's e_lock */
+	uint32_t ev_chanhandle[EMUFS_MAXCHANS];
+	unsigned char ev_chanstate[EMUFS_MAXCHANS];
+
+	/* Protected by ef_cachelock */
+	off_t ev_size;			/* file size, including cached writes */
+	bool ev_sizevalid;		/* true if ev_size has been fetched */
+	unsigned ev_npages;		/* number of pages in the cache */
 };
 
+struct emufs_page {
+	struct emufs_vnode *ep_vnode;	/* file it holds, or NULL if free */
+	off_t ep_offset;		/* where in the file */
+	uint32_t ep_dirtystart;		/* range not written back yet */
+	uint32_t ep_dirtyend;		/* (empty if start == end) */
+	bool ep_busy;			/* I/O in progress; hands off */
+	unsigned ep_lastuse;		/* for picking a page to reuse */
+	char *ep_data;			/* EMUFS_PAGESIZE bytes, or NULL */
+};
+
+/*
+ * ef_vnlock is held from opening a host file to finding or making its
+ * vnode, and by reclaim around closing the host handle, so a lookup
+ * can't get a handle that's being closed under it. It is taken before
+ * e_lock, and never with ef_cachelock held.
+ */
 struct emufs_fs {
 	struct fs ef_fs;		/* abstract filesystem structure */
 	struct emu_softc *ef_emu;	/* device */
 	struct emufs_vnode *ef_root;	/* root vnode */
 	struct vnodearray *ef_vnodes;	/* table of loaded vnodes */
+	struct lock *ef_vnlock;		/* protects ef_vnodes; see below */
+
+	/* Units to move file data with; ef_chans[0] is ef_emu */
+	unsigned ef_nchans;		/* protected by emufs_chanlock */
+	struct emu_softc *ef_chans[EMUFS_MAXCHANS];
+
+	struct lock *ef_cachelock;	/* protects the cache */
+	struct cv *ef_cachecv;		/* for waiting for busy pages */
+	unsigned ef_clock;		/* use counter for ep_lastuse */
+	struct emufs_page ef_pages[EMUFS_CACHEPAGES];	/* the cache */
+
+	struct emufs_fs *ef_next;	/* list of all emufs volumes */
 };
 
+/*
+ * Let the first emufs share its file I/O with the units of the
+ * others (by device name, e.g. "emu1"). For the "emupool" menu command.
+ */
+int emufs_pool(unsigned num, char **names);
+
 
 #endif /* _EMUFS_H_ */
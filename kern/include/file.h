@@ -22,4 +22,8 @@ struct file_handle {
     int fh_refcount;        /* managing memory life cycles. When fh_refcount reaches 0, the kernel can free the resources. */
 };
 
+/* File handles are allocated from this cache (in file.c) with slab_alloc/slab_free. */
+struct slab_cache;
+extern struct slab_cache file_handle_cache;
+
 #endif /* _FILE_H_ */
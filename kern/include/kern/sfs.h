@@ -37,30 +37,88 @@
  */
 
 #define SFS_MAGIC         0xabadf001    /* magic number identifying us */
-#define SFS_BLOCKSIZE     512           /* size of our blocks */
+#define SFS_MINBLOCKSIZE  512           /* smallest (and default) block size */
+#define SFS_MAXBLOCKSIZE  8192          /* largest block size */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_NINDIRECT     1             /* # of indirect blocks in inode */
-#define SFS_NDINDIRECT    0             /* # of 2x indirect blocks in inode */
-#define SFS_NTINDIRECT    0             /* # of 3x indirect blocks in inode */
-#define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
+#define SFS_NDINDIRECT    1             /* # of 2x indirect blocks in inode */
+#define SFS_NTINDIRECT    1             /* # of 3x indirect blocks in inode */
+#define SFS_NIEXTENTS     34            /* # of extents in inode */
+#define SFS_NFREESUM      112           /* # of free counts in superblock */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SUPER_BLOCK   0             /* block the superblock lives in */
 #define SFS_FREEMAP_START 2             /* 1st block of the freemap */
 #define SFS_NOINO         0             /* inode # for free dir entry */
 #define SFS_ROOTDIR_INO   1             /* loc'n of the root dir inode */
 
+/*
+ * The block size is chosen per volume by mksfs and recorded in the
+ * superblock. It is a power of two between SFS_MINBLOCKSIZE and
+ * SFS_MAXBLOCKSIZE; a volume is made of whole device sectors, so it
+ * must also be a multiple of the sector size. The superblock and the
+ * inodes are always SFS_MINBLOCKSIZE bytes and occupy the beginning
+ * of their block; the rest of such a block is unused.
+ *
+ * Volumes made before the block size was recorded have 0 in
+ * sb_blocksize; this means SFS_MINBLOCKSIZE.
+ */
+
 /* Number of bits in a block */
-#define SFS_BITSPERBLOCK (SFS_BLOCKSIZE * CHAR_BIT)
+#define SFS_BITSPERBLOCK(bs)   ((bs) * CHAR_BIT)
+
+/* Number of block pointers in an indirect block */
+#define SFS_DBPERIDB(bs)       ((bs) / sizeof(uint32_t))
 
 /* Utility macro */
-#define SFS_ROUNDUP(a,b)       ((((a)+(b)-1)/(b))*b)
+#define SFS_ROUNDUP(a,b)       ((((a)+(b)-1)/(b))*(b))
 
 /* Size of free block bitmap (in bits) */
-#define SFS_FREEMAPBITS(nblocks) SFS_ROUNDUP(nblocks, SFS_BITSPERBLOCK)
+#define SFS_FREEMAPBITS(nblocks, bs) \
+	SFS_ROUNDUP(nblocks, SFS_BITSPERBLOCK(bs))
 
 /* Size of free block bitmap (in blocks) */
-#define SFS_FREEMAPBLOCKS(nblocks)  (SFS_FREEMAPBITS(nblocks)/SFS_BITSPERBLOCK)
+#define SFS_FREEMAPBLOCKS(nblocks, bs) \
+	(SFS_FREEMAPBITS(nblocks, bs)/SFS_BITSPERBLOCK(bs))
+
+/*
+ * Superblock free block counts (SFS_FEATURE_FREESUM). The freemap
+ * blocks are split into up to SFS_NFREESUM groups of this many, and
+ * sb_freesum[i] is the number of free blocks covered by group i.
+ * Until a group's freemap blocks have been read, the kernel goes by
+ * the count; it is a hint, so being stale is harmless, and sfsck
+ * fixes it.
+ */
+#define SFS_FREESUMGROUP(nblocks, bs) \
+	((SFS_FREEMAPBLOCKS(nblocks, bs) + SFS_NFREESUM - 1) / SFS_NFREESUM)
+
+/* Number of entries in an extent tree index block */
+#define SFS_EXTIDXPERBLOCK(bs) \
+	(((bs) - sizeof(struct sfs_extheader)) / sizeof(struct sfs_extindex))
+
+/* Number of extents in an extent tree leaf block */
+#define SFS_EXTPERBLOCK(bs) \
+	(((bs) - sizeof(struct sfs_extheader)) / sizeof(struct sfs_extent))
+
+/* Feature flags for sb_features */
+#define SFS_FEATURE_EXTENTS 0x1   /* new inodes are extent-mapped */
+#define SFS_FEATURE_FREESUM 0x2   /* sb_freesum is maintained */
+#define SFS_FEATURE_ALL     0x3   /* all features this code knows */
+
+/*
+ * Flags for sb_state. The kernel sets SFS_STATE_ERRORS when it finds
+ * it has left the volume inconsistent (e.g. a block it couldn't mark
+ * free); sfsck clears it after a complete check.
+ */
+#define SFS_STATE_ERRORS    0x1   /* needs checking */
+#define SFS_STATE_ALL       0x1   /* all flags this code knows */
+
+/* Flags for sfi_flags */
+#define SFS_IFLAG_EXTENTS   0x1   /* blocks mapped by extents */
+
+/* Magic numbers for extent tree blocks */
+#define SFS_EXTMAGIC_INDEX 0xe7e71d00
+#define SFS_EXTMAGIC_LEAF  0xe7e71eaf
 
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
@@ -74,7 +132,41 @@ struct sfs_superblock {
 	uint32_t sb_magic;		/* Magic number; should be SFS_MAGIC */
 	uint32_t sb_nblocks;			/* Number of blocks in fs */
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];			/* unused, set to 0 */
+	uint32_t sb_blocksize;			/* Block size (bytes) */
+	uint32_t sb_features;			/* SFS_FEATURE_* flags */
+	uint32_t sb_freesum[SFS_NFREESUM];	/* Free blocks per group */
+	uint32_t sb_state;			/* SFS_STATE_* flags */
+	uint32_t reserved[3];			/* unused, set to 0 */
+};
+
+/*
+ * On-disk extent: LEN file blocks starting at file block FILEBLOCK,
+ * stored in consecutive disk blocks starting at DISKBLOCK.
+ */
+struct sfs_extent {
+	uint32_t sfe_fileblock;			/* First file block */
+	uint32_t sfe_diskblock;			/* First disk block */
+	uint32_t sfe_len;			/* Length (blocks) */
+};
+
+/*
+ * Extent-mapped inodes (SFS_IFLAG_EXTENTS) keep up to SFS_NIEXTENTS
+ * extents, in no particular order, in the inode itself. Further
+ * extents go in a two-level tree rooted at sfi_extroot: the root is
+ * an index block whose entries name leaf blocks, and each leaf holds
+ * extents. Both are sorted by file block, and an index entry's key
+ * is the first file block its leaf maps. Each tree block starts with
+ * a header giving its magic number and number of entries in use.
+ * Extent-mapped inodes do not use the direct and indirect fields.
+ */
+struct sfs_extheader {
+	uint32_t seh_magic;			/* SFS_EXTMAGIC_* */
+	uint32_t seh_count;			/* # of entries in use */
+};
+
+struct sfs_extindex {
+	uint32_t sei_fileblock;			/* First file block in leaf */
+	uint32_t sei_block;			/* Leaf block */
 };
 
 /*
@@ -86,7 +178,14 @@ struct sfs_dinode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_flags;			/* SFS_IFLAG_* flags */
+	uint32_t sfi_nextents;			/* # of extents in sfi_extents */
+	uint32_t sfi_extroot;			/* Extent tree root block */
+	struct sfs_extent sfi_extents[SFS_NIEXTENTS]; /* Extents */
+	uint32_t sfi_waste[128-8-SFS_NDIRECT-3*SFS_NIEXTENTS];
+						/* unused space, set to 0 */
 };
 
 /*
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KLOG_H_
+#define _KLOG_H_
+
+/*
+ * Kernel message log.
+ *
+ * Once the log is started, kprintf doesn't print; it adds its output
+ * to a ring buffer belonging to the current CPU and returns. A kernel
+ * thread copies new messages from the rings to the console, in time
+ * order. Writing a message takes no locks and never waits for the
+ * console, so it's cheap enough to leave debug output turned on. The
+ * catch is that if messages come faster than the console can print
+ * them, the oldest unprinted ones are overwritten and lost (with a
+ * note saying how much was lost).
+ *
+ * Whatever is still in the rings can be read back with the "dmesg"
+ * menu command or from the device "klog:".
+ *
+ * klog_cpu_create - set up the ring for a new CPU (from cpu_create).
+ * klog_bootstrap  - start the log; kprintf prints directly until then.
+ * klog_vprintf    - kprintf backend. If PRINTED, just keep a copy of
+ *                   output that kprintf already printed. Returns -1
+ *                   if the message wasn't logged.
+ * klog_kick       - make sure the console is being caught up. Called
+ *                   once a second from timerclock.
+ * klog_panic      - stop logging and print what hasn't been printed.
+ * klog_shutdown   - the same, at shutdown, with interrupts off; after
+ *                   this kprintf prints directly again.
+ * klog_dump       - print the whole log on the console, for dmesg.
+ */
+
+#include <stdarg.h>
+
+struct cpu;
+
+void klog_cpu_create(struct cpu *c);
+void klog_bootstrap(void);
+int klog_vprintf(bool printed, const char *fmt, va_list ap) __PF(2,0);
+void klog_kick(void);
+void klog_panic(void);
+void klog_shutdown(void);
+void klog_dump(void);
+
+#endif /* _KLOG_H_ */
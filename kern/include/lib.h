@@ -133,6 +133,12 @@ void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
 
+/*
+ * Set up the kmalloc per-cpu state for a new cpu (called by cpu_create).
+ */
+struct cpu;
+void kmalloc_cpu_create(struct cpu *c);
+
 /*
  * C string functions.
  *
@@ -162,6 +168,7 @@ const char *strerror(int errcode);
  * Low-level console access.
  */
 void putch(int ch);
+void putch_flush(void);
 int getch(void);
 void beep(void);
 
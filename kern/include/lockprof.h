@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LOCKPROF_H_
+#define _LOCKPROF_H_
+
+/*
+ * Lock contention profiling. Enable with "options lockprof" in the
+ * kernel config; without it, all of this compiles to nothing.
+ *
+ * Each spinlock, lock, semaphore, and CV carries a struct lockprof
+ * counting acquisitions (P calls and cv_wait calls for semaphores
+ * and CVs), how many of them had to wait, the total and longest
+ * wait, and (for spinlocks and locks) the total time held. The
+ * clock is only read for acquisitions that wait, and for every
+ * LOCKPROF_HOLDSAMPLE'th one to sample the hold time; the total
+ * time held is estimated from the samples. The
+ * counters are updated while holding the object, so they need no
+ * locking of their own. An object goes on the list of profiled
+ * objects the first time it's acquired and comes off when it's
+ * cleaned up, so statistics for an object go away with it.
+ *
+ * Counting starts at lockprof_bootstrap, as it needs the clock.
+ * The "lockstats" menu command prints the most contended objects,
+ * by name.
+ */
+
+#include "opt-lockprof.h"
+
+/* Kinds of object */
+#define LOCKPROF_SPINLOCK	0
+#define LOCKPROF_LOCK		1
+#define LOCKPROF_SEM		2
+#define LOCKPROF_CV		3
+
+#if OPT_LOCKPROF
+
+struct lockprof {
+	unsigned lp_kind;		/* LOCKPROF_* */
+	const char *lp_name;		/* name of the object, if any */
+	bool lp_listed;			/* on the list of profiled objects */
+	unsigned long lp_acquires;	/* times acquired */
+	unsigned long lp_contended;	/* times we had to wait */
+	uint64_t lp_waitns;		/* total time waiting */
+	uint64_t lp_maxwaitns;		/* longest wait */
+	uint64_t lp_holdns;		/* time held, in sampled holds */
+	unsigned long lp_holdsamples;	/* holds sampled */
+	uint64_t lp_since;		/* when the holder got it, if sampled */
+	struct lockprof *lp_next;	/* list of profiled objects */
+	struct lockprof *lp_prev;
+};
+
+void lockprof_init(struct lockprof *lp, unsigned kind, const char *name);
+void lockprof_cleanup(struct lockprof *lp);
+uint64_t lockprof_now(void);
+void lockprof_acquired(struct lockprof *lp, uint64_t waitstart);
+void lockprof_released(struct lockprof *lp);
+void lockprof_checkfree(const void *ptr, size_t len);
+
+void lockprof_bootstrap(void);
+void lockprof_printstats(void);
+void lockprof_reset(void);
+
+#define LOCKPROF(sym)			struct lockprof sym
+#define LOCKPROF_INIT(lp, kind, name)	lockprof_init(lp, kind, name)
+
+/* For SPINLOCK_INITIALIZER; has a leading comma as it's optional. */
+#define LOCKPROF_INITIALIZER		, { .lp_kind = LOCKPROF_SPINLOCK }
+#define LOCKPROF_CLEANUP(lp)		lockprof_cleanup(lp)
+
+/*
+ * In the acquire paths: declare a wait start time of 0, set it when
+ * we find we have to wait, and pass it to LOCKPROF_ACQUIRED once we
+ * have the object.
+ */
+#define LOCKPROF_WAITVAR(v)		uint64_t v = 0
+#define LOCKPROF_WAITING(v)		((v) == 0 ? (v) = lockprof_now() : 0)
+#define LOCKPROF_ACQUIRED(lp, v)	lockprof_acquired(lp, v)
+#define LOCKPROF_RELEASED(lp)		lockprof_released(lp)
+
+/* In allocators: panic if memory being freed holds a listed object */
+#define LOCKPROF_CHECKFREE(ptr, len)	lockprof_checkfree(ptr, len)
+
+#define LOCKPROF_BOOTSTRAP()		lockprof_bootstrap()
+
+#else
+
+#define LOCKPROF(sym)
+#define LOCKPROF_INIT(lp, kind, name)
+#define LOCKPROF_INITIALIZER
+#define LOCKPROF_CLEANUP(lp)
+
+#define LOCKPROF_WAITVAR(v)
+#define LOCKPROF_WAITING(v)
+#define LOCKPROF_ACQUIRED(lp, v)
+#define LOCKPROF_RELEASED(lp)
+
+#define LOCKPROF_CHECKFREE(ptr, len)
+
+#define LOCKPROF_BOOTSTRAP()
+
+#endif
+
+#endif /* _LOCKPROF_H_ */
@@ -56,6 +56,9 @@ struct sfs_vnode {
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	uint32_t *sv_idcache;           /* copy of last leaf indirect block */
+	daddr_t sv_idcacheblock;        /* its disk block (0 if none) */
+	uint32_t sv_idcachebase;        /* first file block it maps */
 };
 
 /*
@@ -68,6 +71,7 @@ struct sfs_fs {
 	struct device *sfs_device;      /* device mounted on */
 	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
+	struct bitmap *sfs_freemaploaded; /* freemap blocks read in so far */
 	bool sfs_freemapdirty;          /* true if freemap modified */
 };
 
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+/*
+ * Object caches ("slab" allocator).
+ *
+ * A slab cache hands out objects of one size, carved out of whole
+ * pages from alloc_kpages, so they pack better than with kmalloc's
+ * power-of-two sizes. Objects may be up to about half a page.
+ *
+ * If the cache has a constructor, it is run on each object when the
+ * page holding it is first set up, not on every allocation; likewise
+ * the destructor is run when the page is given back. Objects handed
+ * to slab_free must therefore be returned to their constructed state
+ * (e.g., spinlocks unlocked, lists empty), and slab_alloc hands back
+ * objects in that state. Without a constructor, objects come back
+ * with garbage in them, like kmalloc.
+ *
+ * The cache structure is public so caches can be static, with
+ * SLAB_CACHE_INITIALIZER; then they need no setup call and can be
+ * used from the very start of boot. slab_create makes one
+ * dynamically. Either way the layout is worked out on first use.
+ *
+ *    slab_create    - make a cache for objects of SIZE bytes aligned
+ *                     to ALIGN (0 for the default). CTOR and DTOR may
+ *                     be NULL. Returns NULL if out of memory.
+ *    slab_destroy   - destroy a cache from slab_create. All its
+ *                     objects must have been freed.
+ *    slab_alloc     - get an object. Returns NULL if out of memory.
+ *    slab_free      - put an object back.
+ *    slab_printstats - print all the caches in use.
+ */
+
+#include <spinlock.h>
+
+struct slab;	/* Opaque. */
+
+struct slab_cache {
+	/* Set at creation */
+	const char *sc_name;		/* for stats */
+	size_t sc_size;			/* object size */
+	size_t sc_align;		/* object alignment */
+	void (*sc_ctor)(void *obj);	/* constructor, or NULL */
+	void (*sc_dtor)(void *obj);	/* destructor, or NULL */
+	bool sc_dynamic;		/* from slab_create */
+
+	/* Protected by sc_lock */
+	struct spinlock sc_lock;
+	bool sc_ready;			/* layout worked out */
+	size_t sc_bufsize;		/* space per object */
+	size_t sc_linkoff;		/* where the freelist link goes */
+	unsigned sc_perslab;		/* objects per slab */
+	struct slab *sc_partial;	/* slabs with some objects free */
+	struct slab *sc_full;		/* slabs with none free */
+	struct slab *sc_empty;		/* slabs with all objects free */
+	unsigned sc_nslabs;		/* total slabs */
+	unsigned sc_nempty;		/* slabs on sc_empty */
+	unsigned long sc_inuse;		/* objects allocated */
+
+	/* Protected by the list lock in slab.c */
+	struct slab_cache *sc_next;	/* list of caches in use */
+};
+
+#define SLAB_CACHE_INITIALIZER(name, size, align, ctor, dtor) { \
+		.sc_name = (name),				\
+		.sc_size = (size),				\
+		.sc_align = (align),				\
+		.sc_ctor = (ctor),				\
+		.sc_dtor = (dtor),				\
+		.sc_dynamic = false,				\
+		.sc_lock = SPINLOCK_INITIALIZER,		\
+		.sc_ready = false,				\
+	}
+
+struct slab_cache *slab_create(const char *name, size_t size, size_t align,
+			       void (*ctor)(void *), void (*dtor)(void *));
+void slab_destroy(struct slab_cache *sc);
+void *slab_alloc(struct slab_cache *sc);
+void slab_free(struct slab_cache *sc, void *obj);
+void slab_printstats(void);
+
+
+#endif /* _SLAB_H_ */
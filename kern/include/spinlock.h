@@ -37,6 +37,7 @@
 
 #include <cdefs.h>
 #include <hangman.h>
+#include <lockprof.h>
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -51,24 +52,36 @@
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * These are ticket locks: a CPU that wants the lock takes the next
+ * number from splk_next and waits until splk_serving reaches it. So
+ * CPUs get the lock in the order they asked for it, and waiters only
+ * read the lock while they spin; the only write to it is the one
+ * release does to let the next CPU in.
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
-	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
+	volatile spinlock_data_t splk_next;    /* Next ticket to hand out. */
+	volatile spinlock_data_t splk_serving; /* Ticket holding the lock. */
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
 	HANGMAN_LOCKABLE(splk_hangman);     /* Deadlock detector hook. */
+	LOCKPROF(splk_prof);		    /* Contention profiling. */
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#ifdef OPT_HANGMAN
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, \
-				  HANGMAN_LOCKABLE_INITIALIZER }
+#if OPT_HANGMAN
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, NULL, \
+				  HANGMAN_LOCKABLE_INITIALIZER \
+				  LOCKPROF_INITIALIZER }
 #else
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, NULL \
+				  LOCKPROF_INITIALIZER }
 #endif
 
 /*
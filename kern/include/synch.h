@@ -48,6 +48,7 @@ struct semaphore {
         struct wchan *sem_wchan;
         struct spinlock sem_lock;
         volatile unsigned sem_count;
+        LOCKPROF(sem_prof);             /* Contention profiling. */
 };
 
 struct semaphore *sem_create(const char *name, unsigned initial_count);
@@ -78,6 +79,7 @@ struct lock {
         struct wchan *lk_wchan;
         struct spinlock lk_lock;
         struct thread *volatile lk_holder;
+        LOCKPROF(lk_prof);              /* Contention profiling. */
 };
 
 struct lock *lock_create(const char *name);
@@ -92,6 +94,14 @@ void lock_destroy(struct lock *);
  *    lock_do_i_hold - Return true if the current thread holds the lock;
  *                   false otherwise.
  *
+ * Locks are adaptive: a thread that finds the lock held by a thread
+ * that's running on another cpu spins for a while, since the holder
+ * will often be done sooner than a context switch would take, and
+ * only goes to sleep if the holder isn't running or takes too long.
+ * When a lock is released with threads asleep on it, it's handed
+ * straight to the first of them, so a sleeper can't be passed over
+ * indefinitely by threads that happen to be running.
+ *
  * These operations must be atomic. You get to write them.
  */
 void lock_acquire(struct lock *);
@@ -117,6 +127,7 @@ struct cv {
         char *cv_name;
         struct wchan *cv_wchan;
         struct spinlock cv_wchanlock;
+        LOCKPROF(cv_prof);              /* Contention profiling. */
 };
 
 struct cv *cv_create(const char *name);
@@ -140,4 +151,47 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of threads can hold the lock for reading at once, or
+ * one thread can hold it for writing. It's writer-preferring: once a
+ * writer is waiting, new readers wait behind it, so a steady stream
+ * of readers can't shut writers out. (The flip side is that a thread
+ * must not take the lock for reading again while it already holds
+ * it; if a writer came along in between, that would deadlock.)
+ *
+ * When a writer lets go, the next waiting writer goes ahead if there
+ * is one; otherwise all the waiting readers do.
+ */
+struct rwlock {
+        char *rw_name;
+        struct spinlock rw_lock;
+        struct wchan *rw_readwchan;	/* readers wait here */
+        struct wchan *rw_writewchan;	/* writers wait here */
+        unsigned rw_readers;		/* number holding it to read */
+        unsigned rw_writerswaiting;	/* number waiting to write */
+        struct thread *rw_writer;	/* holding it to write, or NULL */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading.
+ *    rwlock_release_read  - Let go of it after reading.
+ *    rwlock_acquire_write - Get the lock for writing.
+ *    rwlock_release_write - Let go of it after writing.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                   the lock for writing. (There's no way to ask
+ *                   about reading.)
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
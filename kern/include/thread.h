@@ -49,6 +49,9 @@ struct cpu;
 /* Size of kernel stacks; must be power of 2 */
 #define STACK_SIZE 4096
 
+/* Names shorter than this are stored in the thread itself */
+#define THREAD_NAMEBUF 24
+
 /* Mask for extracting the stack base address of a kernel stack pointer */
 #define STACK_MASK  (~(vaddr_t)(STACK_SIZE-1))
 
@@ -77,14 +80,25 @@ struct thread {
 	/*
 	 * Thread subsystem internal fields.
 	 */
+	char t_namebuf[THREAD_NAMEBUF];	/* Holds t_name if short enough */
 	struct thread_machdep t_machdep; /* Any machine-dependent goo */
 	struct threadlistnode t_listnode; /* Link for run/sleep/zombie lists */
 	void *t_stack;			/* Kernel-level stack */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
+	bool t_pinned;			/* Never moved off t_cpu */
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
+	/*
+	 * Scheduler fields. Changed only by the thread itself, or
+	 * while it isn't running and its cpu's run queue is locked
+	 * (or it's asleep, for the wakeup boost).
+	 */
+	unsigned t_priority;		/* Run queue level; 0 is highest */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+	unsigned t_waited;		/* schedule() calls spent ready */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -145,6 +159,14 @@ int thread_fork(const char *name, struct proc *proc,
                 void (*func)(void *, unsigned long),
                 void *data1, unsigned long data2);
 
+/*
+ * Like thread_fork, but the new thread runs on cpu C and stays there;
+ * migration and idle cpus leave it alone. For per-cpu service threads.
+ */
+int thread_fork_pinned(const char *name, struct proc *proc, struct cpu *c,
+                       void (*func)(void *, unsigned long),
+                       void *data1, unsigned long data2);
+
 /*
  * Cause the current thread to exit.
  * Interrupts need not be disabled.
@@ -158,6 +180,13 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge the current thread for a clock tick, and yield if its time
+ * slice is used up or a higher-priority thread is waiting. Called
+ * from the timer interrupt.
+ */
+void thread_tick(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
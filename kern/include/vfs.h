@@ -163,6 +163,12 @@ int vfs_getcwd(struct uio *buf);
  *                    previously returned by vfs_swapon should be
  *                    decref'd first. Similar to vfs_unmount.
  *
+ *    vfs_claimdevs - Look up a list of device names and mark them as in
+ *                    use by another device, so they can no longer be
+ *                    mounted, returning the devices themselves. Used
+ *                    by RAID devices to take their members. All or
+ *                    none are claimed; this cannot be undone.
+ *
  *    vfs_unmountall - Unmount all mounted filesystems.
  */
 
@@ -181,6 +187,7 @@ int vfs_mount(const char *devname, void *data,
 int vfs_unmount(const char *devname);
 int vfs_swapon(const char *devname, struct vnode **result);
 int vfs_swapoff(const char *devname);
+int vfs_claimdevs(char **devnames, unsigned num, struct device **result);
 int vfs_unmountall(void);
 
 /*
@@ -36,6 +36,7 @@
 
 
 struct spinlock; /* in spinlock.h */
+struct thread; /* in thread.h */
 struct wchan; /* Opaque */
 
 /*
@@ -72,8 +73,14 @@ void wchan_sleep(struct wchan *wc, struct spinlock *lk);
  *
  * The current implementation is FIFO but this is not promised by the
  * interface.
+ *
+ * wchan_wakeone returns the thread it woke, or NULL if there was
+ * none. The thread can't get past wchan_sleep until the spinlock is
+ * released, so the caller can tell it things (by way of fields
+ * protected by the spinlock) until then, but shouldn't look at it
+ * afterwards.
  */
-void wchan_wakeone(struct wchan *wc, struct spinlock *lk);
+struct thread *wchan_wakeone(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeall(struct wchan *wc, struct spinlock *lk);
 
 
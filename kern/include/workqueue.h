@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+/*
+ * Deferred work.
+ *
+ * A work item is a function to be called later, in a kernel thread,
+ * where it can sleep, take locks, and do I/O. Each CPU has a queue
+ * and a worker thread that stays on that CPU; work_queue puts the
+ * item on the current CPU's queue. Items on one queue run one at a
+ * time, in the order queued.
+ *
+ * work_queue never sleeps and can be called from interrupt handlers,
+ * which is the main point: an interrupt handler can hand the slow
+ * part of its job to a worker instead of making the waiting thread
+ * do it.
+ *
+ * An item is either idle, pending (queued, not yet started), or
+ * running. Queueing an item that is already pending does nothing, so
+ * an item queued several times before it gets to run runs once.
+ * Queueing it while it's running (including from its own function)
+ * makes it run again afterwards. Once the function has been called
+ * the worker doesn't touch the item again, so the function may free
+ * it.
+ *
+ * work_init      - set up an item to call FUNC. Only while it's idle.
+ * work_queue     - queue an item; returns false if it was already
+ *                  pending.
+ * work_cancel    - take an item off its queue if it's pending;
+ *                  returns true if it was. A running item isn't
+ *                  stopped; use work_flush to wait for it.
+ * work_flush     - wait until the item, if pending or running, has
+ *                  finished. May sleep.
+ * workqueue_flush - wait until everything queued before the call,
+ *                  on all CPUs, has finished. May sleep.
+ *
+ * Don't flush from a work function; the worker would wait for itself.
+ *
+ * workqueue_cpu_create - set up a CPU's queue (from cpu_create).
+ * workqueue_bootstrap  - start the workers. Items queued earlier
+ *                        wait until then.
+ */
+
+#include <spinlock.h>
+
+struct cpu;
+struct work;
+
+typedef void (*work_func_t)(struct work *);
+
+struct work {
+	work_func_t wk_func;		/* what to call */
+	void *wk_data;			/* for the owner's use */
+
+	/* Private to workqueue.c */
+	volatile spinlock_data_t wk_pending;	/* nonzero when queued */
+	struct workq *volatile wk_queue;	/* queue it's on */
+	struct work *wk_next;		/* next on that queue */
+	unsigned wk_seq;		/* when it was queued */
+};
+
+void work_init(struct work *wk, work_func_t func, void *data);
+bool work_queue(struct work *wk);
+bool work_cancel(struct work *wk);
+void work_flush(struct work *wk);
+void workqueue_flush(void);
+
+void workqueue_cpu_create(struct cpu *c);
+void workqueue_bootstrap(void);
+
+#endif /* _WORKQUEUE_H_ */
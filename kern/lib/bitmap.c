@@ -120,6 +120,41 @@ bitmap_alloc(struct bitmap *b, unsigned *index)
         return ENOSPC;
 }
 
+/*
+ * Like bitmap_alloc, but only considers bits START through
+ * START+COUNT-1. START and COUNT must be multiples of the word size.
+ */
+int
+bitmap_alloc_range(struct bitmap *b, unsigned start, unsigned count,
+                   unsigned *index)
+{
+        unsigned ix;
+        unsigned maxix;
+        unsigned offset;
+
+        KASSERT(start % BITS_PER_WORD == 0);
+        KASSERT(count % BITS_PER_WORD == 0);
+        KASSERT(start + count >= start);
+        KASSERT(start + count <= b->nbits);
+
+        maxix = (start + count) / BITS_PER_WORD;
+        for (ix=start/BITS_PER_WORD; ix<maxix; ix++) {
+                if (b->v[ix]!=WORD_ALLBITS) {
+                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
+                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
+
+                                if ((b->v[ix] & mask)==0) {
+                                        b->v[ix] |= mask;
+                                        *index = (ix*BITS_PER_WORD)+offset;
+                                        return 0;
+                                }
+                        }
+                        KASSERT(0);
+                }
+        }
+        return ENOSPC;
+}
+
 static
 inline
 void
@@ -157,6 +192,39 @@ bitmap_unmark(struct bitmap *b, unsigned index)
         b->v[ix] &= ~mask;
 }
 
+/*
+ * Clear COUNT bits starting at START. Whole words in the middle of
+ * the run are cleared at once rather than bit by bit, which matters
+ * when freeing large files.
+ */
+void
+bitmap_unmark_range(struct bitmap *b, unsigned start, unsigned count)
+{
+        unsigned ix, end;
+
+        KASSERT(start + count >= start);
+        KASSERT(start + count <= b->nbits);
+        end = start + count;
+
+        /* Leading bits, up to a word boundary */
+        while (start < end && start % BITS_PER_WORD != 0) {
+                bitmap_unmark(b, start);
+                start++;
+        }
+
+        /* Whole words */
+        for (ix = start / BITS_PER_WORD; start + BITS_PER_WORD <= end;
+             ix++, start += BITS_PER_WORD) {
+                KASSERT(b->v[ix] == WORD_ALLBITS);
+                b->v[ix] = 0;
+        }
+
+        /* Trailing bits */
+        while (start < end) {
+                bitmap_unmark(b, start);
+                start++;
+        }
+}
 
 int
 bitmap_isset(struct bitmap *b, unsigned index)
@@ -168,6 +236,35 @@ bitmap_isset(struct bitmap *b, unsigned index)
         return (b->v[ix] & mask);
 }
 
+unsigned
+bitmap_count_clear(struct bitmap *b, unsigned start, unsigned count)
+{
+        unsigned i, n;
+
+        KASSERT(start + count >= start);
+        KASSERT(start + count <= b->nbits);
+
+        n = 0;
+        for (i=start; i<start+count; i++) {
+                if (i % BITS_PER_WORD == 0 && i + BITS_PER_WORD <= start+count) {
+                        /* Whole word; skip ahead if it's all one way */
+                        if (b->v[i / BITS_PER_WORD] == 0) {
+                                n += BITS_PER_WORD;
+                                i += BITS_PER_WORD - 1;
+                                continue;
+                        }
+                        if (b->v[i / BITS_PER_WORD] == WORD_ALLBITS) {
+                                i += BITS_PER_WORD - 1;
+                                continue;
+                        }
+                }
+                if (!bitmap_isset(b, i)) {
+                        n++;
+                }
+        }
+        return n;
+}
+
 void
 bitmap_destroy(struct bitmap *b)
 {
@@ -0,0 +1,632 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Kernel message log. See klog.h.
+ *
+ * Each CPU has a ring of records, each a header and up to
+ * KLOG_MAXTEXT bytes of text (longer kprintfs use several). Only the
+ * CPU itself adds records, with interrupts off, so adding needs no
+ * lock. Positions in a ring count bytes ever written, and wrap around
+ * only at 2^32.
+ *
+ * To add a record, the writer first throws away enough of the oldest
+ * records to make room (moving kc_tail), then publishes how far it is
+ * about to write (kc_limit), writes, and then publishes the record
+ * (kc_head). Readers take no lock either: they copy a record out and
+ * then check against kc_limit that it wasn't being overwritten while
+ * they did.
+ *
+ * Records are stamped with the time, and readers merge the rings in
+ * time order.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <membar.h>
+#include <clock.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <uio.h>
+#include <vfs.h>
+#include <device.h>
+#include <klog.h>
+#include <platform/maxcpus.h>
+
+/* Size of each CPU's ring; must be a power of 2 */
+#define KLOG_RINGSIZE	16384
+
+/* Most text in one record */
+#define KLOG_MAXTEXT	120
+
+struct klog_header {
+	uint16_t kh_len;		/* bytes of text */
+	uint16_t kh_flags;		/* KLOG_PRINTED */
+	uint32_t kh_sec;		/* when */
+	uint32_t kh_nsec;
+};
+
+/* kh_flags: the text went straight to the console already */
+#define KLOG_PRINTED	1
+
+/* Space taken by a record with LEN bytes of text */
+#define KLOG_RECSIZE(len) \
+	((sizeof(struct klog_header) + (len) + 3) & ~(uint32_t)3)
+
+struct klog_cpu {
+	volatile uint32_t kc_tail;	/* start of the oldest record */
+	volatile uint32_t kc_head;	/* end of the newest record */
+	volatile uint32_t kc_limit;	/* end of the one being written */
+	char kc_ring[KLOG_RINGSIZE];
+};
+
+/*
+ * State for reading the rings in time order.
+ */
+struct klog_reader {
+	uint32_t kr_pos[MAXCPUS];		/* next record to look at */
+	bool kr_have[MAXCPUS];		/* kr_hdr/kr_text are loaded */
+	struct klog_header kr_hdr[MAXCPUS];
+	char kr_text[MAXCPUS][KLOG_MAXTEXT];
+	unsigned long kr_lost;			/* bytes skipped over */
+};
+
+/*
+ * A record being put together by klog_vprintf.
+ */
+struct klog_msg {
+	struct klog_cpu *km_kc;
+	struct klog_header km_hdr;
+	char km_text[KLOG_MAXTEXT];
+};
+
+/* All the rings, by CPU number; set up before the CPUs start */
+static struct klog_cpu *klog_cpus[MAXCPUS];
+static unsigned klog_ncpus;
+
+/* True once the drain thread is running */
+static volatile bool klog_running;
+
+/* True after a panic; kprintf goes back to printing directly */
+static volatile bool klog_panicking;
+
+/* The drain thread and how to wake it */
+static struct semaphore *klog_sem;
+static volatile bool klog_idle;
+static struct klog_reader klog_drainer;
+
+////////////////////////////////////////////////////////////
+// Rings
+
+/*
+ * Copy LEN bytes in or out of a ring at position POS, wrapping
+ * around the end.
+ */
+static
+void
+klog_copyin(struct klog_cpu *kc, uint32_t pos, const void *data, size_t len)
+{
+	const char *src = data;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		kc->kc_ring[(pos + i) & (KLOG_RINGSIZE - 1)] = src[i];
+	}
+}
+
+static
+void
+klog_copyout(struct klog_cpu *kc, uint32_t pos, void *data, size_t len)
+{
+	char *dest = data;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		dest[i] = kc->kc_ring[(pos + i) & (KLOG_RINGSIZE - 1)];
+	}
+}
+
+/*
+ * Add a record. Called on the ring's own CPU with interrupts off.
+ */
+static
+void
+klog_add(struct klog_cpu *kc, const struct klog_header *kh, const char *text)
+{
+	struct klog_header old;
+	uint32_t head, size;
+
+	head = kc->kc_head;
+	size = KLOG_RECSIZE(kh->kh_len);
+
+	/* Make room */
+	while (head + size - kc->kc_tail > KLOG_RINGSIZE) {
+		klog_copyout(kc, kc->kc_tail, &old, sizeof(old));
+		kc->kc_tail += KLOG_RECSIZE(old.kh_len);
+	}
+
+	kc->kc_limit = head + size;
+	membar_store_store();
+
+	klog_copyin(kc, head, kh, sizeof(*kh));
+	klog_copyin(kc, head + sizeof(*kh), text, kh->kh_len);
+
+	membar_store_store();
+	kc->kc_head = head + size;
+}
+
+/*
+ * Copy out the record at *POS in KC, if there is one. If records
+ * were overwritten before we got to them, skip ahead, and count the
+ * bytes in *LOST.
+ */
+static
+bool
+klog_peek(struct klog_cpu *kc, uint32_t *pos, struct klog_header *kh,
+	  char *text, unsigned long *lost)
+{
+	uint32_t tail, head;
+
+	while (1) {
+		tail = kc->kc_tail;
+		membar_load_load();
+		head = kc->kc_head;
+		membar_load_load();
+
+		if ((int32_t)(*pos - tail) < 0) {
+			*lost += tail - *pos;
+			*pos = tail;
+		}
+		if (*pos == head) {
+			return false;
+		}
+
+		klog_copyout(kc, *pos, kh, sizeof(*kh));
+		if (kh->kh_len <= KLOG_MAXTEXT) {
+			klog_copyout(kc, *pos + sizeof(*kh), text, kh->kh_len);
+		}
+
+		/* If it wasn't overwritten meanwhile, it's good */
+		membar_load_load();
+		if (kc->kc_limit - *pos <= KLOG_RINGSIZE) {
+			KASSERT(kh->kh_len <= KLOG_MAXTEXT);
+			return true;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Reading in time order
+
+/*
+ * Start reading at the oldest records still kept.
+ */
+static
+void
+klog_reader_init(struct klog_reader *kr)
+{
+	unsigned i;
+
+	for (i=0; i<klog_ncpus; i++) {
+		kr->kr_pos[i] = klog_cpus[i] != NULL ? klog_cpus[i]->kc_tail : 0;
+		kr->kr_have[i] = false;
+	}
+	kr->kr_lost = 0;
+}
+
+/*
+ * Get the next record in time order (ties go to the lower CPU
+ * number). Returns its index in the reader's arrays, or -1 if there
+ * are no more for now.
+ */
+static
+int
+klog_reader_next(struct klog_reader *kr)
+{
+	struct klog_header *kh, *best;
+	unsigned i;
+	int which;
+
+	which = -1;
+	best = NULL;
+	for (i=0; i<klog_ncpus; i++) {
+		if (klog_cpus[i] == NULL) {
+			continue;
+		}
+		kh = &kr->kr_hdr[i];
+		if (!kr->kr_have[i]) {
+			kr->kr_have[i] = klog_peek(klog_cpus[i], &kr->kr_pos[i],
+						   kh, kr->kr_text[i],
+						   &kr->kr_lost);
+		}
+		if (!kr->kr_have[i]) {
+			continue;
+		}
+		if (best == NULL || kh->kh_sec < best->kh_sec ||
+		    (kh->kh_sec == best->kh_sec &&
+		     kh->kh_nsec < best->kh_nsec)) {
+			best = kh;
+			which = i;
+		}
+	}
+
+	if (which >= 0) {
+		kr->kr_have[which] = false;
+		kr->kr_pos[which] += KLOG_RECSIZE(best->kh_len);
+	}
+	return which;
+}
+
+/*
+ * Send text to the console.
+ */
+static
+void
+klog_print(const char *text, size_t len)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		putch(text[i]);
+	}
+}
+
+/*
+ * Print whatever hasn't been printed yet.
+ */
+static
+void
+klog_drain(void)
+{
+	struct klog_reader *kr = &klog_drainer;
+	char buf[64];
+	int which;
+
+	while ((which = klog_reader_next(kr)) >= 0) {
+		if (kr->kr_lost > 0) {
+			snprintf(buf, sizeof(buf), "[klog: %lu bytes lost]\n",
+				 kr->kr_lost);
+			klog_print(buf, strlen(buf));
+			kr->kr_lost = 0;
+		}
+		if ((kr->kr_hdr[which].kh_flags & KLOG_PRINTED) == 0) {
+			klog_print(kr->kr_text[which],
+				   kr->kr_hdr[which].kh_len);
+		}
+	}
+}
+
+/*
+ * The drain thread.
+ */
+static
+void
+klog_thread(void *junk1, unsigned long junk2)
+{
+	unsigned i;
+
+	(void)junk1;
+	(void)junk2;
+
+	while (1) {
+		klog_drain();
+
+		/* Sleep, unless something came in while we were at it */
+		klog_idle = true;
+		membar_any_any();
+		for (i=0; i<klog_ncpus; i++) {
+			if (klog_cpus[i] != NULL &&
+			    klog_cpus[i]->kc_head != klog_drainer.kr_pos[i]) {
+				break;
+			}
+		}
+		if (i < klog_ncpus) {
+			klog_idle = false;
+			continue;
+		}
+		P(klog_sem);
+	}
+}
+
+void
+klog_kick(void)
+{
+	if (klog_idle) {
+		klog_idle = false;
+		V(klog_sem);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Writing
+
+/*
+ * Add what's been collected in KM as a record, and start another.
+ */
+static
+void
+klog_flushmsg(struct klog_msg *km)
+{
+	if (km->km_hdr.kh_len > 0) {
+		klog_add(km->km_kc, &km->km_hdr, km->km_text);
+		km->km_hdr.kh_len = 0;
+	}
+}
+
+/*
+ * Backend for __vprintf.
+ */
+static
+void
+klog_send(void *vkm, const char *data, size_t len)
+{
+	struct klog_msg *km = vkm;
+	size_t amt;
+
+	while (len > 0) {
+		if (km->km_hdr.kh_len == KLOG_MAXTEXT) {
+			klog_flushmsg(km);
+		}
+		amt = KLOG_MAXTEXT - km->km_hdr.kh_len;
+		if (amt > len) {
+			amt = len;
+		}
+		memcpy(km->km_text + km->km_hdr.kh_len, data, amt);
+		km->km_hdr.kh_len += amt;
+		data += amt;
+		len -= amt;
+	}
+}
+
+int
+klog_vprintf(bool printed, const char *fmt, va_list ap)
+{
+	struct klog_msg km;
+	struct timespec ts;
+	int chars, s;
+
+	if (klog_panicking || (!printed && !klog_running) ||
+	    !CURCPU_EXISTS()) {
+		return -1;
+	}
+
+	s = splhigh();
+	km.km_kc = curcpu->c_klog;
+	if (km.km_kc == NULL) {
+		splx(s);
+		return -1;
+	}
+
+	/* The clock may not be attached until the log is started */
+	if (klog_running) {
+		gettime(&ts);
+	}
+	else {
+		ts.tv_sec = 0;
+		ts.tv_nsec = 0;
+	}
+	km.km_hdr.kh_len = 0;
+	km.km_hdr.kh_flags = printed ? KLOG_PRINTED : 0;
+	km.km_hdr.kh_sec = ts.tv_sec;
+	km.km_hdr.kh_nsec = ts.tv_nsec;
+
+	chars = __vprintf(klog_send, &km, fmt, ap);
+	klog_flushmsg(&km);
+	splx(s);
+
+	/* Waking the drain thread takes spinlocks; avoid deadlock */
+	if (!printed && curcpu->c_spinlocks == 0) {
+		klog_kick();
+	}
+	return chars;
+}
+
+////////////////////////////////////////////////////////////
+// Reading it back
+
+void
+klog_dump(void)
+{
+	struct klog_reader *kr;
+	int which;
+
+	kr = kmalloc(sizeof(*kr));
+	if (kr == NULL) {
+		kprintf("dmesg: Out of memory\n");
+		return;
+	}
+	klog_reader_init(kr);
+	while ((which = klog_reader_next(kr)) >= 0) {
+		klog_print(kr->kr_text[which], kr->kr_hdr[which].kh_len);
+	}
+	kfree(kr);
+}
+
+/*
+ * The device reads back the log as it is at the time of each read;
+ * offsets count from the oldest message still kept.
+ */
+static
+int
+klog_eachopen(struct device *dev, int openflags)
+{
+	(void)dev;
+
+	if (openflags != O_RDONLY) {
+		return EIO;
+	}
+	return 0;
+}
+
+static
+int
+klog_io(struct device *dev, struct uio *uio)
+{
+	struct klog_reader *kr;
+	off_t pos, skip;
+	size_t len;
+	int which, result;
+
+	(void)dev;
+
+	if (uio->uio_rw != UIO_READ) {
+		return EIO;
+	}
+
+	kr = kmalloc(sizeof(*kr));
+	if (kr == NULL) {
+		return ENOMEM;
+	}
+	klog_reader_init(kr);
+
+	result = 0;
+	pos = 0;
+	while (uio->uio_resid > 0 && (which = klog_reader_next(kr)) >= 0) {
+		len = kr->kr_hdr[which].kh_len;
+		if (pos + (off_t)len <= uio->uio_offset) {
+			pos += len;
+			continue;
+		}
+		skip = uio->uio_offset > pos ? uio->uio_offset - pos : 0;
+		result = uiomove(kr->kr_text[which] + skip, len - skip, uio);
+		if (result) {
+			break;
+		}
+		pos += len;
+	}
+
+	kfree(kr);
+	return result;
+}
+
+static
+int
+klog_ioctl(struct device *dev, int op, userptr_t data)
+{
+	(void)dev;
+	(void)op;
+	(void)data;
+	return EIOCTL;
+}
+
+static const struct device_ops klog_devops = {
+	.devop_eachopen = klog_eachopen,
+	.devop_io = klog_io,
+	.devop_ioctl = klog_ioctl,
+};
+
+////////////////////////////////////////////////////////////
+// Setup
+
+void
+klog_cpu_create(struct cpu *c)
+{
+	struct klog_cpu *kc;
+
+	c->c_klog = NULL;
+	KASSERT(c->c_number < MAXCPUS);
+
+	/* If this fails, the cpu just prints directly */
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return;
+	}
+	kc->kc_tail = kc->kc_head = kc->kc_limit = 0;
+
+	klog_cpus[c->c_number] = kc;
+	if (c->c_number >= klog_ncpus) {
+		klog_ncpus = c->c_number + 1;
+	}
+	c->c_klog = kc;
+}
+
+void
+klog_bootstrap(void)
+{
+	struct device *dev;
+	int result;
+
+	klog_sem = sem_create("klog", 0);
+	if (klog_sem == NULL) {
+		panic("klog_bootstrap: Out of memory\n");
+	}
+	klog_reader_init(&klog_drainer);
+
+	result = thread_fork("klogd", NULL, klog_thread, NULL, 0);
+	if (result) {
+		panic("klog_bootstrap: thread_fork: %s\n", strerror(result));
+	}
+
+	dev = kmalloc(sizeof(*dev));
+	if (dev == NULL) {
+		panic("klog_bootstrap: Out of memory\n");
+	}
+	dev->d_ops = &klog_devops;
+	dev->d_blocks = 0;
+	dev->d_blocksize = 1;
+	dev->d_devnumber = 0; /* assigned by vfs_adddev */
+	dev->d_data = NULL;
+
+	result = vfs_adddev("klog", dev, 0);
+	if (result) {
+		panic("klog_bootstrap: vfs_adddev: %s\n", strerror(result));
+	}
+
+	membar_store_store();
+	klog_running = true;
+}
+
+void
+klog_panic(void)
+{
+	if (klog_panicking) {
+		return;
+	}
+	klog_panicking = true;
+	membar_any_any();
+
+	/* Interrupts are off, so this polls */
+	if (klog_running) {
+		klog_drain();
+	}
+}
+
+void
+klog_shutdown(void)
+{
+	/* Same thing; the other cpus are stopped and klogd can't run */
+	KASSERT(curthread->t_curspl > 0);
+	klog_panic();
+}
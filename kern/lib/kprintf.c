@@ -37,6 +37,7 @@
 #include <current.h>
 #include <synch.h>
 #include <mainbus.h>
+#include <klog.h>
 #include <vfs.h>          // for vfs_sync()
 #include <lamebus/ltrace.h> // for ltrace_stop()
 
@@ -99,6 +100,14 @@ kprintf(const char *fmt, ...)
 	va_list ap;
 	bool dolock;
 
+	/* Normally the message just goes into the log, to print later */
+	va_start(ap, fmt);
+	chars = klog_vprintf(false, fmt, ap);
+	va_end(ap);
+	if (chars >= 0) {
+		return chars;
+	}
+
 	dolock = kprintf_lock != NULL
 		&& curthread->t_in_interrupt == false
 		&& curthread->t_curspl == 0
@@ -122,6 +131,11 @@ kprintf(const char *fmt, ...)
 		spinlock_release(&kprintf_spinlock);
 	}
 
+	/* Keep it in the log too, if we can */
+	va_start(ap, fmt);
+	klog_vprintf(true, fmt, ap);
+	va_end(ap);
+
 	return chars;
 }
 
@@ -170,7 +184,8 @@ panic(const char *fmt, ...)
 	if (evil == 2) {
 		evil = 3;
 
-		/* Print the message. */
+		/* Print what's still in the log, then the message. */
+		klog_panic();
 		kprintf("panic: ");
 		va_start(ap, fmt);
 		__vprintf(console_send, NULL, fmt, ap);
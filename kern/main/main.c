@@ -48,6 +48,9 @@
 #include <device.h>
 #include <syscall.h>
 #include <test.h>
+#include <klog.h>
+#include <lockprof.h>
+#include <workqueue.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
 
@@ -127,7 +130,10 @@ boot(void)
 	/* Late phase of initialization. */
 	vm_bootstrap();
 	kprintf_bootstrap();
+	klog_bootstrap();
+	LOCKPROF_BOOTSTRAP();
 	thread_start_cpus();
+	workqueue_bootstrap();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
@@ -158,6 +164,14 @@ shutdown(void)
 	thread_shutdown();
 
 	splhigh();
+
+	/*
+	 * Print what's still in the log, by polling. First send what's
+	 * queued for the console, which is older and would otherwise
+	 * be overtaken (and then lost at poweroff).
+	 */
+	putch_flush();
+	klog_shutdown();
 }
 
 /*****************************************/
@@ -40,10 +40,15 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <device.h>
 #include <sfs.h>
+#include <emufs.h>
+#include <klog.h>
+#include <slab.h>
 #include <syscall.h>
 #include <test.h>
 #include "opt-sfs.h"
+#include "opt-lockprof.h"
 #include "opt-net.h"
 
 /*
@@ -453,6 +458,182 @@ cmd_bootfs(int nargs, char **args)
 	return vfs_setbootfs(device);
 }
 
+/*
+ * Command for showing or changing the disk I/O schedulers.
+ */
+static
+int
+cmd_iosched(int nargs, char **args)
+{
+	char *device;
+	int result;
+
+	if (nargs == 1) {
+		devsched_printstats();
+		return 0;
+	}
+	if (nargs != 3) {
+		kprintf("Usage: iosched [device policy]\n");
+		return EINVAL;
+	}
+
+	device = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (device[strlen(device)-1]==':') {
+		device[strlen(device)-1] = 0;
+	}
+
+	result = devsched_select(device, args[2]);
+	if (result == EINVAL) {
+		kprintf("Unknown policy %s\n", args[2]);
+	}
+	else if (result == ENODEV) {
+		kprintf("No I/O queue for device %s\n", device);
+	}
+	return result;
+}
+
+/*
+ * Command for building a striped device out of other disks.
+ */
+static
+int
+cmd_raid0(int nargs, char **args)
+{
+	int stripe, i;
+
+	if (nargs < 5) {
+		kprintf("Usage: raid0 name stripe-blocks device device...\n");
+		return EINVAL;
+	}
+
+	stripe = atoi(args[2]);
+	if (stripe <= 0) {
+		kprintf("raid0: Invalid stripe size %s\n", args[2]);
+		return EINVAL;
+	}
+
+	/* Allow (but do not require) colons after device names */
+	for (i=3; i<nargs; i++) {
+		if (args[i][strlen(args[i])-1]==':') {
+			args[i][strlen(args[i])-1] = 0;
+		}
+	}
+
+	return devraid0_create(args[1], stripe, nargs - 3, &args[3]);
+}
+
+/*
+ * Command for building a mirrored device out of other disks.
+ */
+static
+int
+cmd_raid1(int nargs, char **args)
+{
+	int i;
+
+	if (nargs < 4) {
+		kprintf("Usage: raid1 name device device...\n");
+		return EINVAL;
+	}
+
+	/* Allow (but do not require) colons after device names */
+	for (i=2; i<nargs; i++) {
+		if (args[i][strlen(args[i])-1]==':') {
+			args[i][strlen(args[i])-1] = 0;
+		}
+	}
+
+	return devraid1_create(args[1], nargs - 2, &args[2]);
+}
+
+/*
+ * Command for creating a RAM disk. To have one from boot, put this
+ * on the kernel command line ahead of whatever uses it.
+ */
+static
+int
+cmd_ramdisk(int nargs, char **args)
+{
+	int kbytes;
+
+	if (nargs != 3) {
+		kprintf("Usage: ramdisk name kbytes\n");
+		return EINVAL;
+	}
+
+	kbytes = atoi(args[2]);
+	if (kbytes <= 0 || kbytes > 0x7fffffff / 2) {
+		kprintf("ramdisk: Invalid size %s\n", args[2]);
+		return EINVAL;
+	}
+
+	/* Allow (but do not require) a colon after the device name */
+	if (args[1][strlen(args[1])-1]==':') {
+		args[1][strlen(args[1])-1] = 0;
+	}
+
+	/* 512-byte blocks */
+	return devram_create(args[1], kbytes * 2);
+}
+
+/*
+ * Command for making a disk out of a file (e.g. an SFS image).
+ */
+static
+int
+cmd_loop(int nargs, char **args)
+{
+	if (nargs != 3) {
+		kprintf("Usage: loop name file\n");
+		return EINVAL;
+	}
+
+	/* Allow (but do not require) a colon after the device name */
+	if (args[1][strlen(args[1])-1]==':') {
+		args[1][strlen(args[1])-1] = 0;
+	}
+
+	return devloop_create(args[1], args[2]);
+}
+
+/*
+ * Command for sharing an emufs's I/O among emu units.
+ */
+static
+int
+cmd_emupool(int nargs, char **args)
+{
+	int i;
+
+	if (nargs < 3) {
+		kprintf("Usage: emupool emufs emu-unit...\n");
+		return EINVAL;
+	}
+
+	/* Allow (but do not require) colons after device names */
+	for (i=1; i<nargs; i++) {
+		if (args[i][strlen(args[i])-1]==':') {
+			args[i][strlen(args[i])-1] = 0;
+		}
+	}
+
+	return emufs_pool(nargs - 1, &args[1]);
+}
+
+static
+int
+cmd_dmesg(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	klog_dump();
+
+	return 0;
+}
+
 static
 int
 cmd_kheapstats(int nargs, char **args)
@@ -465,6 +646,42 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+#if OPT_LOCKPROF
+	if (nargs == 1) {
+		lockprof_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockprof_reset();
+	}
+	else {
+		kprintf("Usage: lockstats [reset]\n");
+	}
+#else
+	(void)nargs;
+	(void)args;
+
+	kprintf("Lock profiling not compiled in (options lockprof)\n");
+#endif
+
+	return 0;
+}
+
+static
+int
+cmd_slabstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	slab_printstats();
+
+	return 0;
+}
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -529,6 +746,12 @@ static const char *opsmenu[] = {
 	"[mount]   Mount a filesystem        ",
 	"[unmount] Unmount a filesystem      ",
 	"[bootfs]  Set \"boot\" filesystem     ",
+	"[iosched] Disk I/O scheduler        ",
+	"[raid0]   Create striped device     ",
+	"[raid1]   Create mirrored device    ",
+	"[ramdisk] Create RAM disk           ",
+	"[loop]    Create disk from a file   ",
+	"[emupool] Share emufs I/O over units",
 	"[pf]      Print a file              ",
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
@@ -570,6 +793,9 @@ static const char *testmenu[] = {
 	"[sy2] Lock test                     ",
 	"[sy3] CV test                       ",
 	"[sy4] CV test #2                    ",
+	"[sy5] RW lock test                  ",
+	"[sy6] Spinlock stress/benchmark     ",
+	"[sy7] Workqueue test                ",
 	"[semu1-22] Semaphore unit tests     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress                ",
@@ -596,9 +822,12 @@ cmd_testmenu(int n, char **a)
 static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
+	"[dmesg] Print the kernel log        ",
 	"[kh] Kernel heap stats              ",
+	"[lockstats] Lock contention stats   ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[slab] Slab cache stats             ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -635,6 +864,12 @@ static struct {
 	{ "mount",	cmd_mount },
 	{ "unmount",	cmd_unmount },
 	{ "bootfs",	cmd_bootfs },
+	{ "iosched",	cmd_iosched },
+	{ "raid0",	cmd_raid0 },
+	{ "raid1",	cmd_raid1 },
+	{ "ramdisk",	cmd_ramdisk },
+	{ "loop",	cmd_loop },
+	{ "emupool",	cmd_emupool },
 	{ "pf",		printfile },
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
@@ -647,9 +882,12 @@ static struct {
 	{ "halt",	cmd_quit },
 
 	/* stats */
+	{ "dmesg",      cmd_dmesg },
 	{ "kh",         cmd_kheapstats },
+	{ "lockstats",  cmd_lockstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "slab",       cmd_slabstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -672,6 +910,9 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "sy5",	rwtest },
+	{ "sy6",	spinlocktest },
+	{ "sy7",	workqtest },
 
 	/* semaphore unit tests */
 	{ "semu1",	semu1 },
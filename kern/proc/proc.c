@@ -48,12 +48,31 @@
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
+#include <slab.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+/*
+ * Cache for proc structures. The constructor sets up p_lock, which
+ * proc_destroy leaves unlocked.
+ */
+static void proc_ctor(void *obj);
+static struct slab_cache proc_cache =
+	SLAB_CACHE_INITIALIZER("proc", sizeof(struct proc), 0,
+			       proc_ctor, NULL);
+
+static
+void
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	spinlock_init(&proc->p_lock);
+}
+
 /*
  * Create a proc structure.
  */
@@ -63,18 +82,17 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = slab_alloc(&proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		slab_free(&proc_cache, proc);
 		return NULL;
 	}
 
 	proc->p_numthreads = 0;
-	spinlock_init(&proc->p_lock);
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -174,7 +192,7 @@ proc_destroy(struct proc *proc)
 	spinlock_cleanup(&proc->p_lock);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	slab_free(&proc_cache, proc);
 }
 
 /*
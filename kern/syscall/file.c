@@ -12,6 +12,7 @@
 #include <vfs.h>
 #include <vnode.h>
 #include <file.h>
+#include <slab.h>
 #include <syscall.h>
 #include <copyinout.h>
 
@@ -19,6 +20,10 @@
  * Add your file-related functions here ...
  */
 
+struct slab_cache file_handle_cache =
+    SLAB_CACHE_INITIALIZER("file_handle", sizeof(struct file_handle), 0,
+                           NULL, NULL);
+
 int allocate_fd_for_current_proc(struct file_handle* fh) {
     for (int fd = 0; fd < MAX_FILES_PER_PROCESS; fd++) {
         if (curproc->file_table[fd] == NULL) {
@@ -46,7 +51,7 @@ int sys_open(const char *filename, int flags, int mode, int *retval) {
         return result;
     }
 
-    fh = kmalloc(sizeof(*fh));
+    fh = slab_alloc(&file_handle_cache);
     if (fh == NULL) {
         vfs_close(vn);
         return -ENOMEM;
@@ -60,7 +65,7 @@ int sys_open(const char *filename, int flags, int mode, int *retval) {
     fd = allocate_fd_for_current_proc(fh);
     if (fd < 0) {
         vfs_close(vn);
-        kfree(fh);
+        slab_free(&file_handle_cache, fh);
         return -EMFILE; /* too many files */
     }
 
@@ -82,7 +87,7 @@ int sys_close(int fd) {
 
     if (fh->fh_refcount == 0) {
         vfs_close(fh->fh_vnode);
-        kfree(fh);
+        slab_free(&file_handle_cache, fh);
     }
 
     curproc->file_table[fd] = NULL;
@@ -43,6 +43,7 @@
 #include <vm.h>
 #include <vfs.h>
 #include <syscall.h>
+#include <slab.h>
 #include <test.h>
 
 /*
@@ -55,7 +56,7 @@
 struct file_handle *create_file_handle(struct vnode *vn, int flags);
 
 struct file_handle *create_file_handle(struct vnode *vn, int flags) {
-    struct file_handle *fh = kmalloc(sizeof(struct file_handle));
+    struct file_handle *fh = slab_alloc(&file_handle_cache);
     if (fh == NULL) {
         return NULL;
     }
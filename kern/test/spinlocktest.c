@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Spinlock stress test and benchmark.
+ *
+ * One thread is pinned to each of the first N cpus, and they all
+ * hammer on one spinlock for a while, checking that they're alone
+ * inside it. This is done for N = 1, 2, 4, ... up to the number of
+ * cpus, and for each we print how many acquisitions got done per
+ * second in total and how evenly they were shared out among the cpus.
+ */
+
+#include <types.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+#include <platform/maxcpus.h>
+
+#define SLTEST_SECONDS	1
+#define SLTEST_CHECKTIME 32	/* acquisitions between clock checks */
+#define SLTEST_NOBODY	((unsigned long)-1)
+
+static struct spinlock sltest_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned long sltest_holder;
+static volatile unsigned long sltest_total;
+static volatile unsigned sltest_errors;
+
+static volatile bool sltest_go;
+static struct timespec sltest_deadline;
+static unsigned long sltest_counts[MAXCPUS];
+static struct semaphore *sltest_readysem;
+static struct semaphore *sltest_donesem;
+
+static
+bool
+sltest_timeup(void)
+{
+	struct timespec now;
+
+	gettime(&now);
+	if (now.tv_sec != sltest_deadline.tv_sec) {
+		return now.tv_sec > sltest_deadline.tv_sec;
+	}
+	return now.tv_nsec >= sltest_deadline.tv_nsec;
+}
+
+static
+void
+sltest_thread(void *junk, unsigned long num)
+{
+	unsigned long count;
+
+	(void)junk;
+
+	V(sltest_readysem);
+	while (!sltest_go) {
+		thread_yield();
+	}
+
+	count = 0;
+	while (count % SLTEST_CHECKTIME != 0 || !sltest_timeup()) {
+		spinlock_acquire(&sltest_lock);
+		if (sltest_holder != SLTEST_NOBODY) {
+			sltest_errors++;
+		}
+		sltest_holder = num;
+		sltest_total++;
+		if (sltest_holder != num) {
+			sltest_errors++;
+		}
+		sltest_holder = SLTEST_NOBODY;
+		spinlock_release(&sltest_lock);
+		count++;
+	}
+
+	sltest_counts[num] = count;
+	V(sltest_donesem);
+}
+
+/*
+ * Run the test on the first NCPUS cpus.
+ */
+static
+void
+sltest_run(unsigned ncpus)
+{
+	struct timespec start, end, diff;
+	unsigned long total, least, most;
+	uint64_t usecs;
+	unsigned i;
+	int result;
+
+	sltest_go = false;
+	sltest_holder = SLTEST_NOBODY;
+	sltest_total = 0;
+
+	for (i=0; i<ncpus; i++) {
+		sltest_counts[i] = 0;
+		result = thread_fork_pinned("sltest", NULL, cpu_get(i),
+					    sltest_thread, NULL, i);
+		if (result) {
+			panic("spinlocktest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<ncpus; i++) {
+		P(sltest_readysem);
+	}
+
+	gettime(&start);
+	sltest_deadline = start;
+	sltest_deadline.tv_sec += SLTEST_SECONDS;
+	sltest_go = true;
+
+	for (i=0; i<ncpus; i++) {
+		P(sltest_donesem);
+	}
+	gettime(&end);
+
+	total = 0;
+	least = most = sltest_counts[0];
+	for (i=0; i<ncpus; i++) {
+		total += sltest_counts[i];
+		if (sltest_counts[i] < least) {
+			least = sltest_counts[i];
+		}
+		if (sltest_counts[i] > most) {
+			most = sltest_counts[i];
+		}
+	}
+	if (total != sltest_total) {
+		kprintf("spinlocktest: %lu acquisitions but counter is %lu\n",
+			total, sltest_total);
+		sltest_errors++;
+	}
+
+	timespec_sub(&end, &start, &diff);
+	usecs = (uint64_t)diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+	if (usecs == 0) {
+		usecs = 1;
+	}
+	kprintf("%4u %10lu %10llu %10lu %10lu\n", ncpus, total,
+		(unsigned long long)(total * 1000000ULL / usecs),
+		least, most);
+}
+
+int
+spinlocktest(int nargs, char **args)
+{
+	unsigned n, ncpus;
+
+	(void)nargs;
+	(void)args;
+
+	ncpus = cpu_count();
+	KASSERT(ncpus <= MAXCPUS);
+
+	sltest_readysem = sem_create("sltest_ready", 0);
+	sltest_donesem = sem_create("sltest_done", 0);
+	if (sltest_readysem == NULL || sltest_donesem == NULL) {
+		panic("spinlocktest: sem_create failed\n");
+	}
+	sltest_errors = 0;
+
+	kprintf("Starting spinlock test...\n");
+	kprintf("cpus   acquires    per sec    min/cpu    max/cpu\n");
+	for (n=1; n<ncpus; n*=2) {
+		sltest_run(n);
+	}
+	sltest_run(ncpus);
+
+	sem_destroy(sltest_readysem);
+	sem_destroy(sltest_donesem);
+
+	if (sltest_errors > 0) {
+		kprintf("Spinlock test FAILED: %u errors\n", sltest_errors);
+		return 1;
+	}
+	kprintf("Spinlock test done.\n");
+	return 0;
+}
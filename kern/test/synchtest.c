@@ -399,3 +399,208 @@ cvtest2(int nargs, char **args)
 	kprintf("cvtest2 done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+
+/*
+ * RW lock test.
+ *
+ * Readers check that the test values are consistent and that no
+ * writer is in at the same time; writers check that they're alone
+ * and change the values. Then make sure a waiting writer keeps new
+ * readers out.
+ */
+
+#define NRWLOOPS 60
+#define NRWWRITERS 4
+
+static struct rwlock *testrw;
+static struct spinlock rwtest_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned rwtest_readers;
+static volatile unsigned rwtest_writers;
+static volatile unsigned rwtest_maxreaders;
+static volatile bool rwtest_failed;
+static volatile unsigned rwtest_order;
+
+static
+void
+rwtest_fail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	rwtest_failed = true;
+}
+
+static
+void
+rwtestreader(void *junk, unsigned long num)
+{
+	volatile int j;
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		rwlock_acquire_read(testrw);
+
+		spinlock_acquire(&rwtest_lock);
+		rwtest_readers++;
+		if (rwtest_readers > rwtest_maxreaders) {
+			rwtest_maxreaders = rwtest_readers;
+		}
+		if (rwtest_writers != 0) {
+			rwtest_fail(num, "Reader in with a writer");
+		}
+		spinlock_release(&rwtest_lock);
+
+		/* hang around a bit so other readers can come in */
+		for (j=0; j<500; j++);
+
+		if (testval2 != testval1*testval1 ||
+		    testval3 != testval1%3) {
+			rwtest_fail(num, "Reader saw inconsistent values");
+		}
+
+		spinlock_acquire(&rwtest_lock);
+		rwtest_readers--;
+		spinlock_release(&rwtest_lock);
+
+		rwlock_release_read(testrw);
+	}
+	V(donesem);
+}
+
+static
+void
+rwtestwriter(void *junk, unsigned long num)
+{
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		rwlock_acquire_write(testrw);
+
+		spinlock_acquire(&rwtest_lock);
+		rwtest_writers++;
+		if (rwtest_writers != 1 || rwtest_readers != 0) {
+			rwtest_fail(num, "Writer not alone");
+		}
+		spinlock_release(&rwtest_lock);
+
+		testval1 = num + i;
+		thread_yield();
+		testval2 = testval1*testval1;
+		testval3 = testval1%3;
+
+		spinlock_acquire(&rwtest_lock);
+		rwtest_writers--;
+		spinlock_release(&rwtest_lock);
+
+		rwlock_release_write(testrw);
+	}
+	V(donesem);
+}
+
+/*
+ * For the writer preference check: record the order things got in.
+ */
+static
+void
+rwtestlatewriter(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	rwlock_acquire_write(testrw);
+	rwtest_order = rwtest_order * 10 + 1;
+	rwlock_release_write(testrw);
+	V(donesem);
+}
+
+static
+void
+rwtestlatereader(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	rwlock_acquire_read(testrw);
+	rwtest_order = rwtest_order * 10 + 2;
+	rwlock_release_read(testrw);
+	V(donesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	if (testrw == NULL) {
+		testrw = rwlock_create("testrw");
+		if (testrw == NULL) {
+			panic("rwtest: rwlock_create failed\n");
+		}
+	}
+	kprintf("Starting rwlock test...\n");
+
+	testval1 = 0;
+	testval2 = 0;
+	testval3 = 0;
+	rwtest_readers = rwtest_writers = rwtest_maxreaders = 0;
+	rwtest_failed = false;
+
+	for (i=0; i<NTHREADS; i++) {
+		if (i < NRWWRITERS) {
+			result = thread_fork("rwtest", NULL, rwtestwriter,
+					     NULL, i);
+		}
+		else {
+			result = thread_fork("rwtest", NULL, rwtestreader,
+					     NULL, i);
+		}
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+	kprintf("Most readers at once: %u\n", rwtest_maxreaders);
+
+	/*
+	 * Hold it to read; start a writer, which has to wait; then a
+	 * reader, which should wait behind the writer even though
+	 * the lock is only held for reading.
+	 */
+	rwtest_order = 0;
+	rwlock_acquire_read(testrw);
+	result = thread_fork("rwtest", NULL, rwtestlatewriter, NULL, 0);
+	if (result) {
+		panic("rwtest: thread_fork failed: %s\n", strerror(result));
+	}
+	clocksleep(1);
+	result = thread_fork("rwtest", NULL, rwtestlatereader, NULL, 0);
+	if (result) {
+		panic("rwtest: thread_fork failed: %s\n", strerror(result));
+	}
+	clocksleep(1);
+	if (rwtest_order != 0) {
+		kprintf("Reader got in ahead of a waiting writer\n");
+		rwtest_failed = true;
+	}
+	rwlock_release_read(testrw);
+	P(donesem);
+	P(donesem);
+	if (rwtest_order != 12) {
+		kprintf("Wrong order after release: %u\n", rwtest_order);
+		rwtest_failed = true;
+	}
+
+	kprintf("RW lock test %s.\n", rwtest_failed ? "failed" : "done");
+	return 0;
+}
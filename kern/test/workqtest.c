@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Workqueue test.
+ *
+ * First, from a thread pinned to cpu 0 (so everything goes on one
+ * queue), check the individual rules: queueing a pending item merges
+ * it, queueing a running item runs it again, cancel takes off a
+ * pending item, and flush waits for the item to finish. Items are
+ * held pending by queueing a blocker ahead of them that waits on a
+ * semaphore.
+ *
+ * Then a thread on every cpu queues and cancels a shared set of
+ * items, while the hardclock hook queues them too from interrupts.
+ * Every successful work_queue not undone by work_cancel must produce
+ * exactly one run, which is checked after workqueue_flush.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <workqueue.h>
+#include <test.h>
+
+#define WT_NITEMS	16
+#define WT_ROUNDS	4000
+#define WT_CANCELEVERY	5	/* rounds between cancels */
+#define WT_YIELDEVERY	64	/* rounds between yields */
+
+struct wtitem {
+	struct work wi_work;
+	unsigned wi_queued;		/* successful queues less cancels */
+	unsigned wi_runs;		/* times run */
+};
+
+static struct spinlock wt_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned wt_errors;
+static volatile unsigned wt_hookcalls;
+
+static struct semaphore *wt_gate;
+static struct semaphore *wt_started;
+static struct semaphore *wt_donesem;
+
+static struct work wt_blocker;
+static struct wtitem wt_one;
+static struct wtitem wt_items[WT_NITEMS];
+
+static
+void
+wt_check(bool ok, const char *what)
+{
+	if (!ok) {
+		kprintf("workqtest: %s\n", what);
+		wt_errors++;
+	}
+}
+
+static
+unsigned
+wt_runs(struct wtitem *wi)
+{
+	unsigned ret;
+
+	spinlock_acquire(&wt_lock);
+	ret = wi->wi_runs;
+	spinlock_release(&wt_lock);
+	return ret;
+}
+
+/*
+ * Work functions.
+ */
+
+static
+void
+wt_block(struct work *wk)
+{
+	(void)wk;
+	P(wt_gate);
+}
+
+static
+void
+wt_count(struct work *wk)
+{
+	struct wtitem *wi = wk->wk_data;
+
+	spinlock_acquire(&wt_lock);
+	wi->wi_runs++;
+	spinlock_release(&wt_lock);
+}
+
+/* Says it has started, then waits to be let go */
+static
+void
+wt_held(struct work *wk)
+{
+	wt_count(wk);
+	V(wt_started);
+	P(wt_gate);
+}
+
+/* Queues itself again the first time */
+static
+void
+wt_requeue(struct work *wk)
+{
+	struct wtitem *wi = wk->wk_data;
+
+	wt_count(wk);
+	if (wt_runs(wi) == 1) {
+		wt_check(work_queue(wk), "requeue from own function failed");
+	}
+	V(wt_started);
+}
+
+/* Takes a while */
+static
+void
+wt_slow(struct work *wk)
+{
+	unsigned i;
+
+	for (i=0; i<100; i++) {
+		thread_yield();
+	}
+	wt_count(wk);
+}
+
+/*
+ * Part 1: the rules, one at a time, on cpu 0.
+ */
+static
+void
+wt_basic(void *junk, unsigned long junk2)
+{
+	(void)junk;
+	(void)junk2;
+
+	work_init(&wt_blocker, wt_block, NULL);
+
+	/* Merging */
+	kprintf("workqtest: merge\n");
+	work_init(&wt_one.wi_work, wt_count, &wt_one);
+	wt_one.wi_runs = 0;
+	wt_check(work_queue(&wt_blocker), "blocker not queued");
+	wt_check(work_queue(&wt_one.wi_work), "item not queued");
+	wt_check(!work_queue(&wt_one.wi_work), "pending item queued twice");
+	V(wt_gate);
+	work_flush(&wt_one.wi_work);
+	wt_check(wt_runs(&wt_one) == 1, "merged item didn't run once");
+
+	/* Cancel */
+	kprintf("workqtest: cancel\n");
+	wt_one.wi_runs = 0;
+	wt_check(work_queue(&wt_blocker), "blocker not queued");
+	wt_check(work_queue(&wt_one.wi_work), "item not queued");
+	wt_check(work_cancel(&wt_one.wi_work), "pending item not cancelled");
+	wt_check(!work_cancel(&wt_one.wi_work), "idle item cancelled");
+	V(wt_gate);
+	workqueue_flush();
+	wt_check(wt_runs(&wt_one) == 0, "cancelled item ran");
+	wt_check(work_queue(&wt_one.wi_work), "cancelled item not requeued");
+	work_flush(&wt_one.wi_work);
+	wt_check(wt_runs(&wt_one) == 1, "requeued item didn't run");
+
+	/* Queueing while running */
+	kprintf("workqtest: queue while running\n");
+	work_init(&wt_one.wi_work, wt_held, &wt_one);
+	wt_one.wi_runs = 0;
+	wt_check(work_queue(&wt_one.wi_work), "item not queued");
+	P(wt_started);
+	wt_check(work_queue(&wt_one.wi_work), "running item not queued");
+	wt_check(!work_queue(&wt_one.wi_work), "pending item queued twice");
+	V(wt_gate);
+	P(wt_started);
+	V(wt_gate);
+	work_flush(&wt_one.wi_work);
+	wt_check(wt_runs(&wt_one) == 2, "running item didn't run again");
+
+	/* Queueing from its own function */
+	kprintf("workqtest: requeue from work function\n");
+	work_init(&wt_one.wi_work, wt_requeue, &wt_one);
+	wt_one.wi_runs = 0;
+	wt_check(work_queue(&wt_one.wi_work), "item not queued");
+	P(wt_started);
+	P(wt_started);
+	work_flush(&wt_one.wi_work);
+	wt_check(wt_runs(&wt_one) == 2, "requeued item didn't run twice");
+
+	/* Flushing */
+	kprintf("workqtest: flush\n");
+	work_init(&wt_one.wi_work, wt_slow, &wt_one);
+	wt_one.wi_runs = 0;
+	wt_check(work_queue(&wt_one.wi_work), "item not queued");
+	work_flush(&wt_one.wi_work);
+	wt_check(wt_runs(&wt_one) == 1, "work_flush didn't wait");
+	wt_check(work_queue(&wt_one.wi_work), "item not queued");
+	workqueue_flush();
+	wt_check(wt_runs(&wt_one) == 2, "workqueue_flush didn't wait");
+
+	V(wt_donesem);
+}
+
+/*
+ * Part 2: everyone at once.
+ */
+
+static
+void
+wt_queue(struct wtitem *wi)
+{
+	if (work_queue(&wi->wi_work)) {
+		spinlock_acquire(&wt_lock);
+		wi->wi_queued++;
+		spinlock_release(&wt_lock);
+	}
+}
+
+static
+void
+wt_hook(void)
+{
+	KASSERT(curthread->t_in_interrupt);
+	wt_queue(&wt_items[curcpu->c_hardclocks % WT_NITEMS]);
+	wt_hookcalls++;
+}
+
+static
+void
+wt_stress(void *junk, unsigned long num)
+{
+	struct wtitem *wi;
+	unsigned i;
+
+	(void)junk;
+
+	for (i=0; i<WT_ROUNDS; i++) {
+		wt_queue(&wt_items[(i + num) % WT_NITEMS]);
+		if (i % WT_CANCELEVERY == 0) {
+			wi = &wt_items[(i * 3 + num) % WT_NITEMS];
+			if (work_cancel(&wi->wi_work)) {
+				spinlock_acquire(&wt_lock);
+				KASSERT(wi->wi_queued > 0);
+				wi->wi_queued--;
+				spinlock_release(&wt_lock);
+			}
+		}
+		if (i % WT_YIELDEVERY == 0) {
+			thread_yield();
+		}
+	}
+	V(wt_donesem);
+}
+
+int
+workqtest(int nargs, char **args)
+{
+	unsigned i, ncpus, queued, runs;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	wt_gate = sem_create("wt_gate", 0);
+	wt_started = sem_create("wt_started", 0);
+	wt_donesem = sem_create("wt_done", 0);
+	if (wt_gate == NULL || wt_started == NULL || wt_donesem == NULL) {
+		panic("workqtest: sem_create failed\n");
+	}
+	wt_errors = 0;
+
+	kprintf("Starting workqueue test...\n");
+
+	result = thread_fork_pinned("wt_basic", NULL, cpu_get(0),
+				    wt_basic, NULL, 0);
+	if (result) {
+		panic("workqtest: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+	P(wt_donesem);
+
+	kprintf("workqtest: all cpus and interrupts\n");
+	for (i=0; i<WT_NITEMS; i++) {
+		work_init(&wt_items[i].wi_work, wt_count, &wt_items[i]);
+		wt_items[i].wi_queued = 0;
+		wt_items[i].wi_runs = 0;
+	}
+	wt_hookcalls = 0;
+	hardclock_hook = wt_hook;
+
+	ncpus = cpu_count();
+	for (i=0; i<ncpus; i++) {
+		result = thread_fork_pinned("wt_stress", NULL, cpu_get(i),
+					    wt_stress, NULL, i);
+		if (result) {
+			panic("workqtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<ncpus; i++) {
+		P(wt_donesem);
+	}
+
+	/* Let a hook call that's under way finish */
+	hardclock_hook = NULL;
+	clocksleep(1);
+
+	workqueue_flush();
+	queued = runs = 0;
+	for (i=0; i<WT_NITEMS; i++) {
+		spinlock_acquire(&wt_lock);
+		if (wt_items[i].wi_queued != wt_items[i].wi_runs) {
+			kprintf("workqtest: item %u queued %u times, "
+				"ran %u\n", i, wt_items[i].wi_queued,
+				wt_items[i].wi_runs);
+			wt_errors++;
+		}
+		queued += wt_items[i].wi_queued;
+		runs += wt_items[i].wi_runs;
+		spinlock_release(&wt_lock);
+	}
+	wt_check(wt_hookcalls > 0, "hardclock hook never ran");
+	kprintf("workqtest: %u queued, %u runs, %u hook calls\n",
+		queued, runs, wt_hookcalls);
+
+	sem_destroy(wt_gate);
+	sem_destroy(wt_started);
+	sem_destroy(wt_donesem);
+
+	if (wt_errors > 0) {
+		kprintf("Workqueue test FAILED: %u errors\n", wt_errors);
+		return 1;
+	}
+	kprintf("Workqueue test done.\n");
+	return 0;
+}
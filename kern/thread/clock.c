@@ -34,6 +34,7 @@
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <klog.h>
 
 /*
  * Time handling.
@@ -59,6 +60,9 @@
 static struct wchan *lbolt;
 static struct spinlock lbolt_lock;
 
+/* For tests; see clock.h */
+void (*volatile hardclock_hook)(void);
+
 /*
  * Setup.
  */
@@ -79,10 +83,13 @@ hardclock_bootstrap(void)
 void
 timerclock(void)
 {
-	/* Just broadcast on lbolt */
+	/* Broadcast on lbolt */
 	spinlock_acquire(&lbolt_lock);
 	wchan_wakeall(lbolt, &lbolt_lock);
 	spinlock_release(&lbolt_lock);
+
+	/* Make sure the kernel log doesn't sit there undrained */
+	klog_kick();
 }
 
 /*
@@ -92,18 +99,24 @@ timerclock(void)
 void
 hardclock(void)
 {
+	void (*hook)(void);
+
 	/*
 	 * Collect statistics here as desired.
 	 */
 
 	curcpu->c_hardclocks++;
+	hook = hardclock_hook;
+	if (hook != NULL) {
+		hook();
+	}
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	thread_yield();
+	thread_tick();
 }
 
 /*
@@ -0,0 +1,378 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Lock contention profiling. See lockprof.h.
+ */
+#include <types.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <membar.h>
+#include <clock.h>
+#include <lockprof.h>
+
+/* How many objects lockstats shows */
+#define LOCKPROF_TOP	16
+
+/* Longest name shown */
+#define LOCKPROF_NAMELEN 24
+
+/* Hold time is sampled on one acquisition in this many */
+#define LOCKPROF_HOLDSAMPLE 16
+
+static const char *const lockprof_kindnames[] = {
+	"spinlock", "lock", "sem", "cv",
+};
+
+/* Set once the clock is there */
+static bool lockprof_enabled;
+
+/*
+ * The list of profiled objects. Since spinlock_acquire comes here,
+ * it's protected with a bare test-and-set lock rather than a
+ * spinlock.
+ */
+static struct lockprof *lockprof_list;
+static volatile spinlock_data_t lockprof_listlock = SPINLOCK_DATA_INITIALIZER;
+
+static
+void
+lockprof_list_lock(void)
+{
+	splraise(IPL_NONE, IPL_HIGH);
+	while (spinlock_data_get(&lockprof_listlock) != 0 ||
+	       spinlock_data_testandset(&lockprof_listlock) != 0) {
+		/* spin */
+	}
+	membar_store_any();
+}
+
+static
+void
+lockprof_list_unlock(void)
+{
+	membar_any_store();
+	spinlock_data_set(&lockprof_listlock, 0);
+	spllower(IPL_HIGH, IPL_NONE);
+}
+
+static
+void
+lockprof_zero(struct lockprof *lp)
+{
+	lp->lp_acquires = 0;
+	lp->lp_contended = 0;
+	lp->lp_waitns = 0;
+	lp->lp_maxwaitns = 0;
+	lp->lp_holdns = 0;
+	lp->lp_holdsamples = 0;
+	lp->lp_since = 0;
+}
+
+/*
+ * Take LP off the list. Call with the list locked.
+ */
+static
+void
+lockprof_unlink(struct lockprof *lp)
+{
+	KASSERT(lp->lp_listed);
+	if (lp->lp_prev != NULL) {
+		KASSERT(lp->lp_prev->lp_next == lp);
+		lp->lp_prev->lp_next = lp->lp_next;
+	}
+	else {
+		KASSERT(lockprof_list == lp);
+		lockprof_list = lp->lp_next;
+	}
+	if (lp->lp_next != NULL) {
+		KASSERT(lp->lp_next->lp_prev == lp);
+		lp->lp_next->lp_prev = lp->lp_prev;
+	}
+	lp->lp_next = lp->lp_prev = NULL;
+	lp->lp_listed = false;
+}
+
+/*
+ * Set up LP. It may be fresh memory, with anything in lp_listed, or
+ * an object being initialized again while still on the list; in the
+ * latter case, take it off first, or the list would be corrupted
+ * when it's put on again. Only the list itself can tell which.
+ */
+void
+lockprof_init(struct lockprof *lp, unsigned kind, const char *name)
+{
+	struct lockprof *p;
+
+	if (lp->lp_listed) {
+		lockprof_list_lock();
+		for (p = lockprof_list; p != NULL; p = p->lp_next) {
+			if (p == lp) {
+				lockprof_unlink(lp);
+				break;
+			}
+		}
+		lockprof_list_unlock();
+	}
+
+	lp->lp_kind = kind;
+	lp->lp_name = name;
+	lp->lp_listed = false;
+	lockprof_zero(lp);
+	lp->lp_next = lp->lp_prev = NULL;
+}
+
+/*
+ * Take an object off the list. Its counters start over if it's used
+ * again (as objects from slab caches are, without another init).
+ */
+void
+lockprof_cleanup(struct lockprof *lp)
+{
+	if (lp->lp_listed) {
+		lockprof_list_lock();
+		lockprof_unlink(lp);
+		lockprof_list_unlock();
+	}
+	KASSERT(!lp->lp_listed);
+	lockprof_zero(lp);
+}
+
+/*
+ * Memory from PTR for LEN bytes is being freed. If there's a listed
+ * object in it, it's about to be left dangling on the list; someone
+ * forgot to clean it up. This is a list search per free, but it's
+ * only with the option on.
+ */
+void
+lockprof_checkfree(const void *ptr, size_t len)
+{
+	struct lockprof *lp;
+	vaddr_t start = (vaddr_t)ptr;
+	unsigned kind;
+
+	lockprof_list_lock();
+	for (lp = lockprof_list; lp != NULL; lp = lp->lp_next) {
+		if ((vaddr_t)lp >= start && (vaddr_t)lp < start + len) {
+			kind = lp->lp_kind;
+			lockprof_list_unlock();
+			panic("lockprof: %p freed with a %s in it not "
+			      "cleaned up\n", ptr, lockprof_kindnames[kind]);
+		}
+	}
+	lockprof_list_unlock();
+}
+
+/*
+ * Current time in nanoseconds, or 0 if we're not counting yet.
+ */
+uint64_t
+lockprof_now(void)
+{
+	struct timespec ts;
+
+	if (!lockprof_enabled) {
+		return 0;
+	}
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * The caller now holds the object. WAITSTART is when it started
+ * waiting, or 0 if it didn't.
+ */
+void
+lockprof_acquired(struct lockprof *lp, uint64_t waitstart)
+{
+	uint64_t now, wait;
+
+	if (!lockprof_enabled) {
+		return;
+	}
+
+	/*
+	 * Semaphores can be held by several threads at once, so check
+	 * again with the list locked before putting it on.
+	 */
+	if (!lp->lp_listed) {
+		lockprof_list_lock();
+		if (!lp->lp_listed) {
+			lp->lp_prev = NULL;
+			lp->lp_next = lockprof_list;
+			if (lockprof_list != NULL) {
+				lockprof_list->lp_prev = lp;
+			}
+			lockprof_list = lp;
+			lp->lp_listed = true;
+		}
+		lockprof_list_unlock();
+	}
+
+	now = 0;
+	lp->lp_acquires++;
+	if (waitstart != 0) {
+		now = lockprof_now();
+		wait = now - waitstart;
+		lp->lp_contended++;
+		lp->lp_waitns += wait;
+		if (wait > lp->lp_maxwaitns) {
+			lp->lp_maxwaitns = wait;
+		}
+	}
+
+	if (lp->lp_acquires % LOCKPROF_HOLDSAMPLE == 0) {
+		lp->lp_since = now != 0 ? now : lockprof_now();
+	}
+	else {
+		lp->lp_since = 0;
+	}
+}
+
+/*
+ * The caller is about to let go of the object.
+ */
+void
+lockprof_released(struct lockprof *lp)
+{
+	if (!lockprof_enabled || lp->lp_since == 0) {
+		return;
+	}
+	lp->lp_holdns += lockprof_now() - lp->lp_since;
+	lp->lp_holdsamples++;
+	lp->lp_since = 0;
+}
+
+/*
+ * Estimated total time held, from the samples.
+ */
+static
+uint64_t
+lockprof_holdns(const struct lockprof *lp)
+{
+	if (lp->lp_holdsamples == 0) {
+		return 0;
+	}
+	return lp->lp_holdns / lp->lp_holdsamples * lp->lp_acquires;
+}
+
+void
+lockprof_bootstrap(void)
+{
+	lockprof_enabled = true;
+}
+
+/*
+ * Zero the counters of everything on the list.
+ */
+void
+lockprof_reset(void)
+{
+	struct lockprof *lp;
+
+	lockprof_list_lock();
+	for (lp = lockprof_list; lp != NULL; lp = lp->lp_next) {
+		lockprof_zero(lp);
+	}
+	lockprof_list_unlock();
+}
+
+/*
+ * Print the most contended objects. We copy them out with the list
+ * locked and print afterwards, as kprintf takes locks itself. (The
+ * counters may be changing as we copy; it's only statistics.)
+ */
+void
+lockprof_printstats(void)
+{
+	struct lockprof top[LOCKPROF_TOP];
+	char names[LOCKPROF_TOP][LOCKPROF_NAMELEN];
+	struct lockprof *lp;
+	unsigned i, j, ntop;
+
+	ntop = 0;
+	lockprof_list_lock();
+	for (lp = lockprof_list; lp != NULL; lp = lp->lp_next) {
+		if (lp->lp_contended == 0) {
+			continue;
+		}
+		/* Insertion sort by contention, then total wait */
+		for (i=0; i<ntop; i++) {
+			if (lp->lp_contended > top[i].lp_contended ||
+			    (lp->lp_contended == top[i].lp_contended &&
+			     lp->lp_waitns > top[i].lp_waitns)) {
+				break;
+			}
+		}
+		if (i == LOCKPROF_TOP) {
+			continue;
+		}
+		if (ntop < LOCKPROF_TOP) {
+			ntop++;
+		}
+		for (j=ntop-1; j>i; j--) {
+			top[j] = top[j-1];
+			memcpy(names[j], names[j-1], LOCKPROF_NAMELEN);
+		}
+		top[i] = *lp;
+		if (lp->lp_name != NULL) {
+			snprintf(names[i], LOCKPROF_NAMELEN, "%s", lp->lp_name);
+		}
+		else {
+			snprintf(names[i], LOCKPROF_NAMELEN, "%p", lp);
+		}
+	}
+	lockprof_list_unlock();
+
+	if (!lockprof_enabled) {
+		kprintf("lockprof: not counting yet\n");
+		return;
+	}
+
+	kprintf("%-8s %-23s %9s %9s %10s %10s %10s\n", "kind", "name",
+		"acquires", "waited", "wait(us)", "maxwait", "held(us)");
+	for (i=0; i<ntop; i++) {
+		kprintf("%-8s %-23s %9lu %9lu %10llu %10llu ",
+			lockprof_kindnames[top[i].lp_kind], names[i],
+			top[i].lp_acquires, top[i].lp_contended,
+			top[i].lp_waitns / 1000, top[i].lp_maxwaitns / 1000);
+		if (top[i].lp_kind == LOCKPROF_SPINLOCK ||
+		    top[i].lp_kind == LOCKPROF_LOCK) {
+			kprintf("%10llu\n", lockprof_holdns(&top[i]) / 1000);
+		}
+		else {
+			kprintf("%10s\n", "-");
+		}
+	}
+	if (ntop == 0) {
+		kprintf("(no contention seen)\n");
+	}
+}
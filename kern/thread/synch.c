@@ -34,41 +34,61 @@
 
 #include <types.h>
 #include <lib.h>
+#include <cpu.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <slab.h>
 
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
 
+/*
+ * Semaphores come from a cache whose constructor sets up sem_lock;
+ * sem_destroy requires it to be unlocked again.
+ */
+static void sem_ctor(void *obj);
+static struct slab_cache sem_cache =
+	SLAB_CACHE_INITIALIZER("semaphore", sizeof(struct semaphore), 0,
+			       sem_ctor, NULL);
+
+static
+void
+sem_ctor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_init(&sem->sem_lock);
+}
+
 struct semaphore *
 sem_create(const char *name, unsigned initial_count)
 {
 	struct semaphore *sem;
 	
-	sem = kmalloc(sizeof(*sem));
+	sem = slab_alloc(&sem_cache);
 	if (sem == NULL) {
 		return NULL;
 	}
 	
 	sem->sem_name = kstrdup(name);
 	if (sem->sem_name == NULL) {
-		kfree(sem);
+		slab_free(&sem_cache, sem);
 		return NULL;
 	}
 
 	sem->sem_wchan = wchan_create(sem->sem_name);
 	if (sem->sem_wchan == NULL) {
 		kfree(sem->sem_name);
-		kfree(sem);
+		slab_free(&sem_cache, sem);
 		return NULL;
 	}
 
-	spinlock_init(&sem->sem_lock);
 	sem->sem_count = initial_count;
+	LOCKPROF_INIT(&sem->sem_prof, LOCKPROF_SEM, sem->sem_name);
 
 	return sem;
 }
@@ -79,15 +99,18 @@ sem_destroy(struct semaphore *sem)
 	KASSERT(sem != NULL);
 
 	/* wchan_cleanup will assert if anyone's waiting on it */
+	LOCKPROF_CLEANUP(&sem->sem_prof);
 	spinlock_cleanup(&sem->sem_lock);
 	wchan_destroy(sem->sem_wchan);
 	kfree(sem->sem_name);
-	kfree(sem);
+	slab_free(&sem_cache, sem);
 }
 
 void
 P(struct semaphore *sem)
 {
+	LOCKPROF_WAITVAR(waitstart);
+
 	KASSERT(sem != NULL);
 
 	/*
@@ -113,10 +136,12 @@ P(struct semaphore *sem)
 		 * Exercise: how would you implement strict FIFO
 		 * ordering?
 		 */
+		LOCKPROF_WAITING(waitstart);
 		wchan_sleep(sem->sem_wchan, &sem->sem_lock);
 	}
 	KASSERT(sem->sem_count > 0);
 	sem->sem_count--;
+	LOCKPROF_ACQUIRED(&sem->sem_prof, waitstart);
 	spinlock_release(&sem->sem_lock);
 }
 
@@ -164,6 +189,7 @@ lock_create(const char *name)
 	}
 	spinlock_init(&lock->lk_lock);
 	lock->lk_holder = NULL;
+	LOCKPROF_INIT(&lock->lk_prof, LOCKPROF_LOCK, lock->lk_name);
 
 	return lock;
 }
@@ -174,6 +200,7 @@ lock_destroy(struct lock *lock)
 	KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
+	LOCKPROF_CLEANUP(&lock->lk_prof);
 	spinlock_cleanup(&lock->lk_lock);
 	wchan_destroy(lock->lk_wchan);
 
@@ -181,9 +208,33 @@ lock_destroy(struct lock *lock)
 	kfree(lock);
 }
 
+/*
+ * How long to spin on a lock before sleeping, and how often to stop
+ * and check the holder is still running, in loop iterations.
+ */
+#define LOCK_SPINMAX	4096
+#define LOCK_SPINCHECK	128
+
+/*
+ * Return true if it's worth spinning waiting for HOLDER to release a
+ * lock, that is, if it's running on another cpu. The lock's spinlock
+ * must be held, which keeps HOLDER from releasing the lock, and so
+ * from going away.
+ */
+static
+bool
+lock_holder_running(struct thread *holder)
+{
+	return holder->t_state == S_RUN && holder->t_cpu != curcpu->c_self;
+}
+
 void
 lock_acquire(struct lock *lock)
 {
+	struct thread *holder;
+	unsigned spins, i;
+	LOCKPROF_WAITVAR(waitstart);
+
 	DEBUGASSERT(lock != NULL);
 	KASSERT(curthread->t_in_interrupt == false);
 
@@ -193,11 +244,36 @@ lock_acquire(struct lock *lock)
 	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
 
 	KASSERT(lock->lk_holder != curthread);
-	while (lock->lk_holder != NULL) {
-		/* As in the semaphore. */
+	spins = 0;
+	while (lock->lk_holder != NULL && lock->lk_holder != curthread) {
+		LOCKPROF_WAITING(waitstart);
+		holder = lock->lk_holder;
+		if (spins < LOCK_SPINMAX && lock_holder_running(holder)) {
+			/*
+			 * Spin without the spinlock, only looking at
+			 * lk_holder, so as not to hold up the release.
+			 * We can't look at the holder itself without
+			 * the spinlock, so come back every so often
+			 * to make sure it's still running.
+			 */
+			spinlock_release(&lock->lk_lock);
+			for (i=0; i<LOCK_SPINCHECK &&
+				     lock->lk_holder == holder; i++) {
+				/* spin */
+			}
+			spins += i;
+			spinlock_acquire(&lock->lk_lock);
+			continue;
+		}
+
+		/*
+		 * As in the semaphore. If lock_release hands us the
+		 * lock, lk_holder is already set to us when we wake.
+		 */
 		wchan_sleep(lock->lk_wchan, &lock->lk_lock);
 	}
 	lock->lk_holder = curthread;
+	LOCKPROF_ACQUIRED(&lock->lk_prof, waitstart);
 
 	/* Call this (atomically) once the lock is acquired */
 	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
@@ -213,8 +289,10 @@ lock_release(struct lock *lock)
 	spinlock_acquire(&lock->lk_lock);
 
 	KASSERT(lock->lk_holder == curthread);
-	lock->lk_holder = NULL;
-	wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
+	LOCKPROF_RELEASED(&lock->lk_prof);
+
+	/* Hand the lock to the first sleeper, if there is one */
+	lock->lk_holder = wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
 
 	/* Call this (atomically) when the lock is released */
 	HANGMAN_RELEASE(&curthread->t_hangman, &lock->lk_hangman);
@@ -265,6 +343,7 @@ cv_create(const char *name)
 	}
 
 	spinlock_init(&cv->cv_wchanlock);
+	LOCKPROF_INIT(&cv->cv_prof, LOCKPROF_CV, cv->cv_name);
 	return cv;
 }
 
@@ -273,6 +352,7 @@ cv_destroy(struct cv *cv)
 {
 	KASSERT(cv != NULL);
 
+	LOCKPROF_CLEANUP(&cv->cv_prof);
 	spinlock_cleanup(&cv->cv_wchanlock);
 	wchan_destroy(cv->cv_wchan);
 
@@ -283,9 +363,13 @@ cv_destroy(struct cv *cv)
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
+	LOCKPROF_WAITVAR(waitstart);
+
 	spinlock_acquire(&cv->cv_wchanlock);
 	lock_release(lock);
+	LOCKPROF_WAITING(waitstart);
 	wchan_sleep(cv->cv_wchan, &cv->cv_wchanlock);
+	LOCKPROF_ACQUIRED(&cv->cv_prof, waitstart);
 	/*
 	 * It is kind of silly to acquire this spinlock in wchan_sleep
 	 * and then release it right away. If we were going for
@@ -315,3 +399,137 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	wchan_wakeall(cv->cv_wchan, &cv->cv_wchanlock);
 	spinlock_release(&cv->cv_wchanlock);
 }
+
+////////////////////////////////////////////////////////////
+//
+// RW lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_readwchan = wchan_create(rw->rw_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+	rw->rw_writewchan = wchan_create(rw->rw_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_writerswaiting = 0;
+	rw->rw_writer = NULL;
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writerswaiting == 0);
+	KASSERT(rw->rw_writer == NULL);
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	while (rw->rw_writer != NULL || rw->rw_writerswaiting > 0) {
+		wchan_sleep(rw->rw_readwchan, &rw->rw_lock);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_writerswaiting > 0) {
+		wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	rw->rw_writerswaiting++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		wchan_sleep(rw->rw_writewchan, &rw->rw_lock);
+	}
+	rw->rw_writerswaiting--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	rw->rw_writer = NULL;
+	if (rw->rw_writerswaiting > 0) {
+		wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+	}
+	else {
+		wchan_wakeall(rw->rw_readwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	bool ret;
+
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	ret = (rw->rw_writer == curthread);
+	spinlock_release(&rw->rw_lock);
+
+	return ret;
+}
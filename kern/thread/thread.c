@@ -50,6 +50,9 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <klog.h>
+#include <slab.h>
+#include <workqueue.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -69,6 +72,30 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/*
+ * Caches for threads and wait channels. The constructors set up the
+ * list node and the list, which are back to their initial (detached
+ * and empty) state by the time the objects are freed.
+ */
+static void thread_ctor(void *obj);
+static void wchan_ctor(void *obj);
+static struct slab_cache thread_cache =
+	SLAB_CACHE_INITIALIZER("thread", sizeof(struct thread), 0,
+			       thread_ctor, NULL);
+static struct slab_cache wchan_cache =
+	SLAB_CACHE_INITIALIZER("wchan", sizeof(struct wchan), 0,
+			       wchan_ctor, NULL);
+
+/*
+ * Most threads that exit have their struct thread and stack put in a
+ * per-cpu pool (c_threadpool) instead of being freed, so thread_fork
+ * can reuse them without going to the allocator. This is how many
+ * each cpu keeps; beyond that they're freed as before.
+ */
+#define THREAD_POOLMAX 16
+
+static void thread_destroy(struct thread *thread);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -109,45 +136,139 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Constructor for thread_cache.
  */
 static
-struct thread *
-thread_create(const char *name)
+void
+thread_ctor(void *obj)
 {
-	struct thread *thread;
+	struct thread *thread = obj;
 
-	DEBUGASSERT(name != NULL);
+	threadlistnode_init(&thread->t_listnode, thread);
+}
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
+/*
+ * Set a thread's name. Short names are kept in t_namebuf, so most
+ * threads don't need to allocate one.
+ */
+static
+int
+thread_setname(struct thread *thread, const char *name)
+{
+	if (strlen(name) < sizeof(thread->t_namebuf)) {
+		strcpy(thread->t_namebuf, name);
+		thread->t_name = thread->t_namebuf;
+		return 0;
 	}
-
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+		return ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * Release a thread's name.
+ */
+static
+void
+thread_freename(struct thread *thread)
+{
+	if (thread->t_name != thread->t_namebuf) {
+		kfree(thread->t_name);
 	}
+	thread->t_name = NULL;
+}
+
+/*
+ * Initialize the fields of a new or recycled thread, except the
+ * name and the stack.
+ */
+static
+void
+thread_init(struct thread *thread)
+{
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
-	/* Thread subsystem fields */
+	/* Thread subsystem fields (t_listnode is set up by thread_ctor) */
 	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
+	thread->t_pinned = false;
 	thread->t_proc = NULL;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
 
+	/* Scheduler fields: new threads start at the top */
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_waited = 0;
+
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
 	/* If you add to struct thread, be sure to initialize here */
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	DEBUGASSERT(name != NULL);
+
+	thread = slab_alloc(&thread_cache);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	if (thread_setname(thread, name)) {
+		slab_free(&thread_cache, thread);
+		return NULL;
+	}
+	thread->t_stack = NULL;
+	thread_init(thread);
+
+	return thread;
+}
+
+/*
+ * Get a thread, with its stack, from the current cpu's pool of
+ * exited threads (see exorcise), and set it up as if new. Returns
+ * NULL if the pool is empty.
+ */
+static
+struct thread *
+thread_recycle(const char *name)
+{
+	struct thread *thread;
+	int spl;
+
+	DEBUGASSERT(name != NULL);
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadpool);
+	splx(spl);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	/* The stack guard was set up when the stack was and is still good */
+	KASSERT(thread->t_stack != NULL);
+	thread_checkstack(thread);
+
+	if (thread_setname(thread, name)) {
+		thread_destroy(thread);
+		return NULL;
+	}
+	thread_init(thread);
 
 	return thread;
 }
@@ -164,6 +285,7 @@ struct cpu *
 cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
+	unsigned i;
 	int result;
 	char namebuf[16];
 
@@ -177,11 +299,14 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_threadpool);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
@@ -193,6 +318,10 @@ cpu_create(unsigned hardware_number)
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
 
+	klog_cpu_create(c);
+	kmalloc_cpu_create(c);
+	workqueue_cpu_create(c);
+
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
 	if (c->c_curthread == NULL) {
@@ -283,15 +412,17 @@ thread_destroy(struct thread *thread)
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
-	kfree(thread->t_name);
-	kfree(thread);
+	thread_freename(thread);
+	slab_free(&thread_cache, thread);
 }
 
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them.) Those with a stack go
+ * in the cpu's thread pool for thread_recycle if there's room.
  *
- * The list of zombies is per-cpu.
+ * The list of zombies and the pool are per-cpu. This is called with
+ * interrupts off, which is what protects the pool.
  */
 static
 void
@@ -302,7 +433,18 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		if (z->t_stack != NULL &&
+		    curcpu->c_threadpool.tl_count < THREAD_POOLMAX) {
+			KASSERT(z->t_proc == NULL);
+			thread_checkstack(z);
+			thread_machdep_cleanup(&z->t_machdep);
+			thread_freename(z);
+			z->t_wchan_name = "POOLED";
+			threadlist_addtail(&curcpu->c_threadpool, z);
+		}
+		else {
+			thread_destroy(z);
+		}
 	}
 }
 
@@ -314,6 +456,9 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	struct threadlist *rq;
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -328,9 +473,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		rq = &curcpu->c_runqueue[i];
+		rq->tl_count = 0;
+		rq->tl_head.tln_next = &rq->tl_tail;
+		rq->tl_tail.tln_prev = &rq->tl_head;
+	}
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -420,6 +568,19 @@ cpu_hatch(unsigned software_number)
 	thread_exit();
 }
 
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned num)
+{
+	KASSERT(num < cpuarray_num(&allcpus));
+	return cpuarray_get(&allcpus, num);
+}
+
 /*
  * Start up secondary cpus. Called from boot().
  */
@@ -442,6 +603,172 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue operations. There is one queue for each priority level;
+ * threads are taken from the highest-priority (lowest-numbered)
+ * queue that isn't empty. The caller must hold the run queue lock.
+ */
+
+/* Add T at the end of its level's queue. */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_priority < SCHED_NLEVELS);
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+}
+
+/* Take the next thread to run, or NULL. */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	unsigned i;
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			return threadlist_remhead(&c->c_runqueue[i]);
+		}
+	}
+	return NULL;
+}
+
+/* Take the thread that would run last, or NULL. */
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	unsigned i;
+
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			return threadlist_remtail(&c->c_runqueue[i]);
+		}
+	}
+	return NULL;
+}
+
+/* Number of threads waiting to run. */
+static
+unsigned
+runqueue_count(struct cpu *c)
+{
+	unsigned i, count;
+
+	count = 0;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		count += c->c_runqueue[i].tl_count;
+	}
+	return count;
+}
+
+/*
+ * Work stealing.
+ *
+ * A cpu that runs out of threads takes one from the busiest other
+ * cpu before going idle. It looks at the other queues' lengths
+ * without locking them (a stale count only means a poor choice), so
+ * the only cross-cpu lock taken is the victim's, once. It never
+ * holds its own run queue lock at the same time, so two cpus stealing
+ * from each other can't deadlock.
+ *
+ * So that idle cpus don't have to wait for the next clock tick to
+ * notice work elsewhere, thread_make_runnable nudges an idle cpu
+ * when it queues a thread on a busy one.
+ */
+
+/*
+ * Take a thread from the busiest other cpu and make it ours. The
+ * lowest-priority thread that's waiting goes, as with migration.
+ * Returns NULL if there's nothing to take.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct threadlist *rq;
+	struct thread *t;
+	unsigned i, n, most, numcpus;
+
+	victim = NULL;
+	most = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		n = runqueue_count(c);
+		if (n > most) {
+			most = n;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = NULL;
+	for (i=SCHED_NLEVELS; i-- > 0 && t == NULL; ) {
+		rq = &victim->c_runqueue[i];
+		THREADLIST_FORALL_REV(t, *rq) {
+			/*
+			 * The victim's curthread can be on its run
+			 * queue while the victim is idling on its
+			 * stack (see thread_consider_migration); it
+			 * can't be moved. Nor can pinned threads.
+			 */
+			if (t != victim->c_curthread && !t->t_pinned) {
+				break;
+			}
+		}
+		if (t != NULL) {
+			threadlist_remove(rq, t);
+			t->t_cpu = curcpu->c_self;
+		}
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t != NULL) {
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      t->t_name, victim->c_number, curcpu->c_number);
+	}
+	return t;
+}
+
+/*
+ * TARGETCPU, which is busy, has just had TARGET put on its run queue.
+ * If that means it has a thread waiting, wake up an idle cpu, if
+ * there is one, to come and steal it.
+ */
+static
+void
+thread_kick_idle(struct cpu *targetcpu, struct thread *target)
+{
+	struct cpu *c;
+	unsigned i, numcpus, waiting;
+
+	waiting = runqueue_count(targetcpu);
+	if (target == targetcpu->c_curthread) {
+		/* It's yielding, and one of the others will run */
+		waiting--;
+	}
+	if (waiting == 0) {
+		return;
+	}
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c->c_isidle && c != targetcpu && c != curcpu->c_self) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
 /*
  * Make a thread runnable.
  *
@@ -466,7 +793,8 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	target->t_waited = 0;
+	runqueue_add(targetcpu, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -475,6 +803,9 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else if (!targetcpu->c_isidle) {
+		thread_kick_idle(targetcpu, target);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -488,37 +819,43 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
  * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
  *
  * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * process is inherited from the caller. It starts on cpu C, and if
+ * PINNED, stays there.
  */
+static
 int
-thread_fork(const char *name,
-	    struct proc *proc,
-	    void (*entrypoint)(void *data1, unsigned long data2),
-	    void *data1, unsigned long data2)
+thread_fork_oncpu(const char *name,
+		  struct proc *proc, struct cpu *c, bool pinned,
+		  void (*entrypoint)(void *data1, unsigned long data2),
+		  void *data1, unsigned long data2)
 {
 	struct thread *newthread;
 	int result;
 
-	newthread = thread_create(name);
+	/* Reuse an exited thread and its stack if we can */
+	newthread = thread_recycle(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
 	 */
 
 	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_cpu = c;
+	newthread->t_pinned = pinned;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -541,12 +878,35 @@ thread_fork(const char *name,
 	/* Set up the switchframe so entrypoint() gets called */
 	switchframe_init(newthread, entrypoint, data1, data2);
 
-	/* Lock the current cpu's run queue and make the new thread runnable */
+	/* Lock the target cpu's run queue and make the new thread runnable */
 	thread_make_runnable(newthread, false);
 
 	return 0;
 }
 
+/*
+ * The new thread starts on the same CPU as the caller, unless the
+ * scheduler intervenes first.
+ */
+int
+thread_fork(const char *name,
+	    struct proc *proc,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2)
+{
+	return thread_fork_oncpu(name, proc, curthread->t_cpu, false,
+				 entrypoint, data1, data2);
+}
+
+int
+thread_fork_pinned(const char *name, struct proc *proc, struct cpu *c,
+		   void (*entrypoint)(void *data1, unsigned long data2),
+		   void *data1, unsigned long data2)
+{
+	return thread_fork_oncpu(name, proc, c, true,
+				 entrypoint, data1, data2);
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -588,7 +948,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && runqueue_count(curcpu) == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -622,10 +982,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call cpu_idle().
+	 * Get the next thread. While there isn't one, try to steal one
+	 * from another cpu, and failing that call cpu_idle().
 	 * curcpu->c_isidle must be true when cpu_idle is
-	 * called. Unlock the runqueue while idling too, to make sure
-	 * things can be added to it.
+	 * called. Unlock the runqueue while stealing and idling too,
+	 * to make sure things can be added to it.
 	 *
 	 * Note that we don't need to unlock the runqueue atomically
 	 * with idling; becoming unidle requires receiving an
@@ -641,10 +1002,13 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -814,17 +1178,120 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each CPU has SCHED_NLEVELS
+ * run queues, and always runs a thread from the highest-priority
+ * one that isn't empty; within a level it's round robin. The time
+ * slice doubles at each level down.
+ *
+ *    - New threads start at the top level.
+ *    - A thread that uses up its time slice drops a level. So CPU
+ *      hogs sink to the bottom, and threads that mostly wait (for
+ *      I/O, for requests) stay near the top and get the CPU quickly
+ *      when they need it.
+ *    - A thread woken up from a wait channel goes up a level.
+ *    - A thread that has been waiting to run for SCHED_AGE calls of
+ *      schedule() goes up a level, so nothing starves, and a thread
+ *      that was busy for a while can come back up after.
+ *    - A thread is preempted at the next tick if a higher-priority
+ *      thread is waiting on its cpu.
  */
 
+/* Time slice at the top level, in hardclocks */
+#define SCHED_QUANTUM	1
+
+/* Aging interval, in calls to schedule() */
+#define SCHED_AGE	25
+
+static
+unsigned
+sched_quantum(unsigned priority)
+{
+	return SCHED_QUANTUM << priority;
+}
+
+/*
+ * Wakeup boost, for wchan_wake*. The thread is asleep, so nobody
+ * else is using its scheduler fields.
+ */
+static
+void
+thread_boost(struct thread *t)
+{
+	if (t->t_priority > 0) {
+		t->t_priority--;
+		t->t_ticks = 0;
+	}
+}
+
+void
+thread_tick(void)
+{
+	struct thread *cur = curthread;
+	bool preempt;
+	unsigned i;
+
+	if (curcpu->c_isidle) {
+		return;
+	}
+
+	cur->t_ticks++;
+	if (cur->t_ticks >= sched_quantum(cur->t_priority)) {
+		/* Used up its time slice; drop a level */
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		thread_yield();
+		return;
+	}
+
+	/* Otherwise, only give way to something more important */
+	preempt = false;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=0; i<cur->t_priority; i++) {
+		if (!threadlist_isempty(&curcpu->c_runqueue[i])) {
+			preempt = true;
+			break;
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+/*
+ * This is called periodically from hardclock(). It ages the threads
+ * waiting in the lower run queues.
+ */
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct threadlist *rq;
+	struct threadlistnode *tln;
+	struct thread *t;
+	unsigned i;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<SCHED_NLEVELS; i++) {
+		rq = &curcpu->c_runqueue[i];
+		tln = rq->tl_head.tln_next;
+		while (tln->tln_self != NULL) {
+			t = tln->tln_self;
+			tln = tln->tln_next;
+
+			t->t_waited++;
+			if (t->t_waited >= SCHED_AGE) {
+				threadlist_remove(rq, t);
+				t->t_priority = i - 1;
+				t->t_ticks = 0;
+				t->t_waited = 0;
+				runqueue_add(curcpu, t);
+			}
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
@@ -858,9 +1325,9 @@ thread_consider_migration(void)
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
 		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_count += runqueue_count(c);
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = runqueue_count(c);
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
@@ -874,7 +1341,8 @@ thread_consider_migration(void)
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+		/* The lowest-priority threads go */
+		t = runqueue_remtail(curcpu);
 		threadlist_addhead(&victims, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
@@ -885,7 +1353,7 @@ thread_consider_migration(void)
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
+		while (runqueue_count(c) < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
 			/*
 			 * Ordinarily, curthread will not appear on
@@ -907,16 +1375,17 @@ thread_consider_migration(void)
 			 * Why? And what?) so shuffle it to the end of
 			 * the list and decrement to_send in order to
 			 * skip it. Then it goes back on our own run
-			 * queue below.
+			 * queue below. Pinned threads get the same
+			 * treatment.
 			 */
-			if (t == curthread) {
+			if (t == curthread || t->t_pinned) {
 				threadlist_addtail(&victims, t);
 				to_send--;
 				continue;
 			}
 
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			runqueue_add(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -940,7 +1409,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_add(curcpu, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -955,6 +1424,18 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+/*
+ * Constructor for wchan_cache.
+ */
+static
+void
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	threadlist_init(&wc->wc_threads);
+}
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -968,11 +1449,10 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = slab_alloc(&wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 
 	return wc;
@@ -986,7 +1466,7 @@ void
 wchan_destroy(struct wchan *wc)
 {
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	slab_free(&wchan_cache, wc);
 }
 
 /*
@@ -1015,7 +1495,7 @@ wchan_sleep(struct wchan *wc, struct spinlock *lk)
 /*
  * Wake up one thread sleeping on a wait channel.
  */
-void
+struct thread *
 wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *target;
@@ -1027,7 +1507,7 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 
 	if (target == NULL) {
 		/* Nobody was sleeping. */
-		return;
+		return NULL;
 	}
 
 	/*
@@ -1038,7 +1518,9 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	 * in thread_switch.
 	 */
 
+	thread_boost(target);
 	thread_make_runnable(target, false);
+	return target;
 }
 
 /*
@@ -1068,6 +1550,7 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_boost(target);
 		thread_make_runnable(target, false);
 	}
 
@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Deferred work. See workqueue.h.
+ *
+ * Each queue is a FIFO list under a spinlock, so items can be queued
+ * with interrupts off. Every item queued gets the next sequence
+ * number for its queue; since a queue runs its items in order, "has
+ * everything up to sequence number N finished" is a matter of looking
+ * at the head of the list and at the item being run, which is how the
+ * flush functions wait.
+ *
+ * Whether an item is pending is kept in the item itself and set with
+ * test-and-set, so that two CPUs queueing the same item at once (on
+ * their own queues) don't both put it on. It's only changed with a
+ * queue lock held, and wk_queue is set (or cleared) under the same
+ * lock hold, so anyone who sees it pending without a queue has only
+ * a moment to wait.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <membar.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <wchan.h>
+#include <workqueue.h>
+
+struct workq {
+	struct spinlock wq_lock;
+	struct work *wq_head;		/* pending items, oldest first */
+	struct work *wq_tail;
+	unsigned wq_seq;		/* sequence number last handed out */
+	const struct work *wq_current;	/* item running, or NULL */
+	unsigned wq_curseq;		/* its sequence number */
+	struct wchan *wq_wchan;		/* worker waits here for work */
+	struct wchan *wq_flushwchan;	/* flushers wait here */
+	struct thread *wq_worker;	/* the worker */
+	struct cpu *wq_cpu;		/* the cpu it stays on */
+	struct workq *wq_next;		/* list of all queues */
+};
+
+/* All the queues; added to as CPUs are found, before they start */
+static struct workq *workqueues;
+
+/*
+ * Compare sequence numbers, allowing for wraparound.
+ */
+static
+bool
+workq_seq_after(unsigned a, unsigned b)
+{
+	return (int)(a - b) > 0;
+}
+
+/*
+ * Check if everything on WQ up to sequence number SEQ has finished.
+ */
+static
+bool
+workq_done(struct workq *wq, unsigned seq)
+{
+	KASSERT(spinlock_do_i_hold(&wq->wq_lock));
+
+	if (wq->wq_current != NULL && !workq_seq_after(wq->wq_curseq, seq)) {
+		return false;
+	}
+	if (wq->wq_head != NULL && !workq_seq_after(wq->wq_head->wk_seq, seq)) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Wait for everything on WQ up to sequence number SEQ to finish.
+ */
+static
+void
+workq_wait(struct workq *wq, unsigned seq)
+{
+	KASSERT(spinlock_do_i_hold(&wq->wq_lock));
+	KASSERT(wq->wq_worker != curthread);
+
+	while (!workq_done(wq, seq)) {
+		wchan_sleep(wq->wq_flushwchan, &wq->wq_lock);
+	}
+}
+
+/*
+ * Worker thread; DATA1 is its queue.
+ */
+static
+void
+workq_thread(void *data1, unsigned long data2)
+{
+	struct workq *wq = data1;
+	struct work *wk;
+	work_func_t func;
+
+	(void)data2;
+
+	spinlock_acquire(&wq->wq_lock);
+	wq->wq_worker = curthread;
+	while (1) {
+		wk = wq->wq_head;
+		if (wk == NULL) {
+			wchan_sleep(wq->wq_wchan, &wq->wq_lock);
+			continue;
+		}
+		wq->wq_head = wk->wk_next;
+		if (wq->wq_head == NULL) {
+			wq->wq_tail = NULL;
+		}
+		wq->wq_current = wk;
+		wq->wq_curseq = wk->wk_seq;
+		func = wk->wk_func;
+
+		/*
+		 * Once the pending flag is clear the item can be queued
+		 * again, on any cpu, so finish with it first.
+		 */
+		wk->wk_next = NULL;
+		wk->wk_queue = NULL;
+		membar_store_store();
+		spinlock_data_set(&wk->wk_pending, 0);
+		spinlock_release(&wq->wq_lock);
+
+		func(wk);
+
+		spinlock_acquire(&wq->wq_lock);
+		wq->wq_current = NULL;
+		wchan_wakeall(wq->wq_flushwchan, &wq->wq_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+void
+work_init(struct work *wk, work_func_t func, void *data)
+{
+	KASSERT(func != NULL);
+
+	wk->wk_func = func;
+	wk->wk_data = data;
+	spinlock_data_set(&wk->wk_pending, 0);
+	wk->wk_queue = NULL;
+	wk->wk_next = NULL;
+	wk->wk_seq = 0;
+}
+
+/*
+ * Set the pending flag if it's clear; return false if it was set.
+ * Test-and-set can fail without the flag having been set (if the
+ * LL/SC pair is interrupted), so look again before believing it.
+ */
+static
+bool
+work_setpending(struct work *wk)
+{
+	while (1) {
+		if (spinlock_data_get(&wk->wk_pending) != 0) {
+			return false;
+		}
+		if (spinlock_data_testandset(&wk->wk_pending) == 0) {
+			return true;
+		}
+	}
+}
+
+bool
+work_queue(struct work *wk)
+{
+	struct workq *wq;
+
+	/* If we get moved to another cpu before locking, no matter */
+	wq = curcpu->c_workq;
+	KASSERT(wq != NULL);
+
+	spinlock_acquire(&wq->wq_lock);
+	if (!work_setpending(wk)) {
+		spinlock_release(&wq->wq_lock);
+		return false;
+	}
+	KASSERT(wk->wk_queue == NULL);
+	wk->wk_queue = wq;
+	wk->wk_next = NULL;
+	wk->wk_seq = ++wq->wq_seq;
+	if (wq->wq_tail == NULL) {
+		wq->wq_head = wk;
+	}
+	else {
+		wq->wq_tail->wk_next = wk;
+	}
+	wq->wq_tail = wk;
+	wchan_wakeone(wq->wq_wchan, &wq->wq_lock);
+	spinlock_release(&wq->wq_lock);
+	return true;
+}
+
+bool
+work_cancel(struct work *wk)
+{
+	struct workq *wq;
+	struct work *p, *prev;
+
+	/*
+	 * wk_queue only changes to or from a queue under that queue's
+	 * lock, so once we hold it, we can tell if it's still there.
+	 * If it isn't, it's been run or moved; look again.
+	 */
+	while (1) {
+		wq = wk->wk_queue;
+		if (wq == NULL) {
+			if (spinlock_data_get(&wk->wk_pending) == 0) {
+				return false;
+			}
+			/* Being queued or started right now */
+			continue;
+		}
+
+		spinlock_acquire(&wq->wq_lock);
+		if (wk->wk_queue == wq) {
+			break;
+		}
+		spinlock_release(&wq->wq_lock);
+	}
+
+	prev = NULL;
+	for (p = wq->wq_head; p != wk; p = p->wk_next) {
+		KASSERT(p != NULL);
+		prev = p;
+	}
+	if (prev == NULL) {
+		wq->wq_head = wk->wk_next;
+	}
+	else {
+		prev->wk_next = wk->wk_next;
+	}
+	if (wq->wq_tail == wk) {
+		wq->wq_tail = prev;
+	}
+	wk->wk_next = NULL;
+	wk->wk_queue = NULL;
+	membar_store_store();
+	spinlock_data_set(&wk->wk_pending, 0);
+
+	/* A flusher may have been waiting for it */
+	wchan_wakeall(wq->wq_flushwchan, &wq->wq_lock);
+	spinlock_release(&wq->wq_lock);
+	return true;
+}
+
+void
+work_flush(struct work *wk)
+{
+	struct workq *wq;
+
+	KASSERT(!curthread->t_in_interrupt);
+
+	/* It may be pending on one queue and running on another. */
+	for (wq = workqueues; wq != NULL; wq = wq->wq_next) {
+		spinlock_acquire(&wq->wq_lock);
+		if (wk->wk_queue == wq) {
+			workq_wait(wq, wk->wk_seq);
+		}
+		else if (wq->wq_current == wk) {
+			workq_wait(wq, wq->wq_curseq);
+		}
+		spinlock_release(&wq->wq_lock);
+	}
+}
+
+void
+workqueue_flush(void)
+{
+	struct workq *wq;
+
+	KASSERT(!curthread->t_in_interrupt);
+
+	for (wq = workqueues; wq != NULL; wq = wq->wq_next) {
+		spinlock_acquire(&wq->wq_lock);
+		workq_wait(wq, wq->wq_seq);
+		spinlock_release(&wq->wq_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Setup
+
+void
+workqueue_cpu_create(struct cpu *c)
+{
+	struct workq *wq, **pp;
+
+	wq = kmalloc(sizeof(*wq));
+	if (wq == NULL) {
+		panic("workqueue_cpu_create: Out of memory\n");
+	}
+	spinlock_init(&wq->wq_lock);
+	wq->wq_head = wq->wq_tail = NULL;
+	wq->wq_seq = 0;
+	wq->wq_current = NULL;
+	wq->wq_curseq = 0;
+	wq->wq_wchan = wchan_create("workq");
+	wq->wq_flushwchan = wchan_create("workflush");
+	if (wq->wq_wchan == NULL || wq->wq_flushwchan == NULL) {
+		panic("workqueue_cpu_create: Out of memory\n");
+	}
+	wq->wq_worker = NULL;
+	wq->wq_cpu = c;
+	wq->wq_next = NULL;
+
+	/* Keep them in cpu order */
+	for (pp = &workqueues; *pp != NULL; pp = &(*pp)->wq_next) {
+		/* nothing */
+	}
+	*pp = wq;
+
+	c->c_workq = wq;
+}
+
+void
+workqueue_bootstrap(void)
+{
+	struct workq *wq;
+	char name[16];
+	int result;
+
+	for (wq = workqueues; wq != NULL; wq = wq->wq_next) {
+		snprintf(name, sizeof(name), "worker/%u", wq->wq_cpu->c_number);
+		result = thread_fork_pinned(name, NULL, wq->wq_cpu,
+					    workq_thread, wq, 0);
+		if (result) {
+			panic("workqueue_bootstrap: thread_fork: %s\n",
+			      strerror(result));
+		}
+	}
+}
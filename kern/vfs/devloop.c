@@ -0,0 +1,370 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Loop devices: a block device whose blocks are the contents of a
+ * file on some other filesystem (an emufs file, or an SFS file).
+ * This lets a filesystem image kept as a file be mounted without
+ * setting it up as a disk in the simulator.
+ *
+ * Device I/O turns into VOP_READ and VOP_WRITE on the file. Since
+ * going through the file's filesystem is expensive, the device keeps
+ * a cache of recently used chunks of the file. The cache is
+ * write-through: a write updates the cached chunk and goes straight
+ * on to the file, so nothing is lost if the device is never synced.
+ * A write of a whole chunk doesn't need to read it first.
+ *
+ * The file's size is fixed when the device is created; the device
+ * has as many whole blocks as fit in it.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <stat.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <device.h>
+
+/* Block size, the same as lhd's so disk images are interchangeable */
+#define LOOP_BLOCKSIZE		512
+
+/* Size of a cached chunk of the file, and how many to keep */
+#define LOOP_CHUNKSIZE		4096
+#define LOOP_NCHUNKS		32
+
+struct loop_chunk {
+	bool lc_valid;			/* holds data */
+	uint32_t lc_num;		/* which chunk of the file */
+	unsigned lc_lastuse;		/* for LRU replacement */
+	char *lc_data;			/* LOOP_CHUNKSIZE bytes */
+};
+
+struct loopdev {
+	struct device ld_dev;		/* our VFS device */
+	struct vnode *ld_vn;		/* the file */
+	off_t ld_filesize;		/* its size at creation */
+	struct lock *ld_lock;		/* protects the cache */
+	unsigned ld_clock;		/* counter for lc_lastuse */
+	struct loop_chunk ld_chunks[LOOP_NCHUNKS];
+};
+
+/*
+ * Find chunk NUM in the cache, or take the least recently used slot
+ * for it (which is returned not valid).
+ */
+static
+struct loop_chunk *
+loop_findchunk(struct loopdev *ld, uint32_t num)
+{
+	struct loop_chunk *lc, *victim;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(ld->ld_lock));
+
+	victim = NULL;
+	for (i=0; i<LOOP_NCHUNKS; i++) {
+		lc = &ld->ld_chunks[i];
+		if (lc->lc_valid && lc->lc_num == num) {
+			lc->lc_lastuse = ++ld->ld_clock;
+			return lc;
+		}
+		if (victim == NULL || !lc->lc_valid ||
+		    (victim->lc_valid &&
+		     lc->lc_lastuse < victim->lc_lastuse)) {
+			victim = lc;
+		}
+	}
+
+	victim->lc_valid = false;
+	victim->lc_num = num;
+	victim->lc_lastuse = ++ld->ld_clock;
+	return victim;
+}
+
+/*
+ * Read chunk LC->lc_num from the file. The part past the end of the
+ * file reads as zeros.
+ */
+static
+int
+loop_readchunk(struct loopdev *ld, struct loop_chunk *lc)
+{
+	struct iovec iov;
+	struct uio u;
+	off_t pos;
+	size_t len;
+	int result;
+
+	pos = (off_t)lc->lc_num * LOOP_CHUNKSIZE;
+	len = LOOP_CHUNKSIZE;
+	if (pos + (off_t)len > ld->ld_filesize) {
+		len = ld->ld_filesize - pos;
+	}
+
+	uio_kinit(&iov, &u, lc->lc_data, len, pos, UIO_READ);
+	result = VOP_READ(ld->ld_vn, &u);
+	if (result) {
+		return result;
+	}
+	len -= u.uio_resid;
+	bzero(lc->lc_data + len, LOOP_CHUNKSIZE - len);
+	lc->lc_valid = true;
+	return 0;
+}
+
+/*
+ * Write LEN bytes at offset CHUNKOFF within chunk LC to the file.
+ */
+static
+int
+loop_writechunk(struct loopdev *ld, struct loop_chunk *lc,
+		size_t chunkoff, size_t len)
+{
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	uio_kinit(&iov, &u, lc->lc_data + chunkoff, len,
+		  (off_t)lc->lc_num * LOOP_CHUNKSIZE + chunkoff, UIO_WRITE);
+	result = VOP_WRITE(ld->ld_vn, &u);
+	if (result == 0 && u.uio_resid > 0) {
+		/* The file can't grow past where it was; shouldn't happen */
+		result = EIO;
+	}
+	return result;
+}
+
+static
+int
+loop_eachopen(struct device *d, int openflags)
+{
+	(void)d;
+	(void)openflags;
+	return 0;
+}
+
+static
+int
+loop_io(struct device *d, struct uio *uio)
+{
+	struct loopdev *ld = d->d_data;
+	struct loop_chunk *lc;
+	off_t endblock;
+	uint32_t num;
+	size_t chunkoff, len;
+	int result;
+
+	/* Don't allow I/O that isn't block-aligned. */
+	if (uio->uio_offset % LOOP_BLOCKSIZE != 0 ||
+	    uio->uio_resid % LOOP_BLOCKSIZE != 0) {
+		return EINVAL;
+	}
+
+	/* Don't allow I/O past the end of the disk. */
+	endblock = (uio->uio_offset + uio->uio_resid) / LOOP_BLOCKSIZE;
+	if (endblock > d->d_blocks) {
+		return EINVAL;
+	}
+
+	/*
+	 * The file's filesystem may take the big lock, and a filesystem
+	 * mounted on us may be holding it already; take it first so the
+	 * order is always the same.
+	 */
+	result = 0;
+	vfs_biglock_acquire();
+	lock_acquire(ld->ld_lock);
+	while (uio->uio_resid > 0) {
+		num = uio->uio_offset / LOOP_CHUNKSIZE;
+		chunkoff = uio->uio_offset % LOOP_CHUNKSIZE;
+		len = LOOP_CHUNKSIZE - chunkoff;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+
+		lc = loop_findchunk(ld, num);
+		if (!lc->lc_valid &&
+		    (uio->uio_rw == UIO_READ || len < LOOP_CHUNKSIZE)) {
+			result = loop_readchunk(ld, lc);
+			if (result) {
+				break;
+			}
+		}
+
+		result = uiomove(lc->lc_data + chunkoff, len, uio);
+		if (result) {
+			/* A write may have left it half-updated */
+			if (uio->uio_rw == UIO_WRITE) {
+				lc->lc_valid = false;
+			}
+			break;
+		}
+
+		if (uio->uio_rw == UIO_WRITE) {
+			lc->lc_valid = true;
+			result = loop_writechunk(ld, lc, chunkoff, len);
+			if (result) {
+				lc->lc_valid = false;
+				break;
+			}
+		}
+	}
+	lock_release(ld->ld_lock);
+	vfs_biglock_release();
+
+	return result;
+}
+
+static
+int
+loop_ioctl(struct device *d, int op, userptr_t data)
+{
+	(void)d;
+	(void)op;
+	(void)data;
+	return EIOCTL;
+}
+
+static const struct device_ops loop_devops = {
+	.devop_eachopen = loop_eachopen,
+	.devop_io = loop_io,
+	.devop_ioctl = loop_ioctl,
+};
+
+/*
+ * Give back the memory for a loop device that didn't get attached.
+ */
+static
+void
+loop_destroy(struct loopdev *ld)
+{
+	unsigned i;
+
+	for (i=0; i<LOOP_NCHUNKS; i++) {
+		if (ld->ld_chunks[i].lc_data != NULL) {
+			kfree(ld->ld_chunks[i].lc_data);
+		}
+	}
+	if (ld->ld_lock != NULL) {
+		lock_destroy(ld->ld_lock);
+	}
+	if (ld->ld_vn != NULL) {
+		vfs_close(ld->ld_vn);
+	}
+	kfree(ld);
+}
+
+/*
+ * Create a loop device called NAME over the regular file at PATH.
+ * It is added to VFS as a mountable device. The file stays open for
+ * good.
+ */
+int
+devloop_create(const char *name, const char *path)
+{
+	struct loopdev *ld;
+	struct stat st;
+	char *pathcopy;
+	unsigned i;
+	int result;
+
+	ld = kmalloc(sizeof(*ld));
+	if (ld == NULL) {
+		return ENOMEM;
+	}
+	ld->ld_vn = NULL;
+	ld->ld_lock = NULL;
+	ld->ld_clock = 0;
+	for (i=0; i<LOOP_NCHUNKS; i++) {
+		ld->ld_chunks[i].lc_valid = false;
+		ld->ld_chunks[i].lc_lastuse = 0;
+		ld->ld_chunks[i].lc_data = NULL;
+	}
+
+	/* vfs_open may scribble on the path */
+	pathcopy = kstrdup(path);
+	if (pathcopy == NULL) {
+		loop_destroy(ld);
+		return ENOMEM;
+	}
+	result = vfs_open(pathcopy, O_RDWR, 0, &ld->ld_vn);
+	kfree(pathcopy);
+	if (result) {
+		ld->ld_vn = NULL;
+		loop_destroy(ld);
+		return result;
+	}
+
+	result = VOP_STAT(ld->ld_vn, &st);
+	if (result) {
+		loop_destroy(ld);
+		return result;
+	}
+	if ((st.st_mode & _S_IFMT) != _S_IFREG) {
+		loop_destroy(ld);
+		return EINVAL;
+	}
+	if (st.st_size < LOOP_BLOCKSIZE) {
+		loop_destroy(ld);
+		return EINVAL;
+	}
+	ld->ld_filesize = st.st_size;
+
+	ld->ld_lock = lock_create(name);
+	if (ld->ld_lock == NULL) {
+		loop_destroy(ld);
+		return ENOMEM;
+	}
+	for (i=0; i<LOOP_NCHUNKS; i++) {
+		ld->ld_chunks[i].lc_data = kmalloc(LOOP_CHUNKSIZE);
+		if (ld->ld_chunks[i].lc_data == NULL) {
+			loop_destroy(ld);
+			return ENOMEM;
+		}
+	}
+
+	ld->ld_dev.d_ops = &loop_devops;
+	ld->ld_dev.d_blocks = ld->ld_filesize / LOOP_BLOCKSIZE;
+	ld->ld_dev.d_blocksize = LOOP_BLOCKSIZE;
+	ld->ld_dev.d_devnumber = 0; /* assigned by vfs_adddev */
+	ld->ld_dev.d_data = ld;
+
+	result = vfs_adddev(name, &ld->ld_dev, 1);
+	if (result) {
+		loop_destroy(ld);
+		return result;
+	}
+
+	kprintf("%s: Loop device over %s, %u blocks\n", name, path,
+		(unsigned)ld->ld_dev.d_blocks);
+	return 0;
+}
@@ -0,0 +1,697 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Software RAID devices, built out of other block devices.
+ *
+ * RAID-0 ("striping") spreads the blocks across its members in
+ * stripe units of a configurable number of blocks: unit 0 goes on
+ * the first member, unit 1 on the second, and so on round, so a long
+ * sequential transfer keeps all the members busy at once. A request
+ * is split into one piece per stripe unit it touches, and all the
+ * pieces are submitted to the members together.
+ *
+ * RAID-1 ("mirroring") keeps a full copy of the data on every
+ * member. Writes go to all the members at once. Each read goes to
+ * just one member: the one with the fewest requests outstanding,
+ * and among those the one whose head was last nearest. A member that
+ * returns an error is dropped from the set; a read that fails is
+ * retried on another member, and a write succeeds as long as one
+ * member took it. The retry is done from a workqueue, since the
+ * failure is usually reported in an interrupt handler and the next
+ * member may be one (like a loop device) that sleeps in dev_submit.
+ *
+ * Either way the original request is completed when the last piece
+ * is, which is usually in some member's interrupt handler.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <workqueue.h>
+#include <uio.h>
+#include <vfs.h>
+#include <device.h>
+
+/*
+ * State of a mirror member.
+ */
+struct raid_mirror {
+	uint32_t rm_headpos;		/* block after the last one done */
+	unsigned rm_inflight;		/* requests outstanding */
+	bool rm_failed;			/* has returned an error */
+};
+
+struct raid {
+	struct device r_dev;		/* our VFS device */
+	char *r_name;			/* name, for messages */
+	unsigned r_ndisks;		/* number of members */
+	struct device **r_disks;	/* the members */
+	uint32_t r_stripe;		/* RAID-0: stripe unit, in blocks */
+	struct spinlock r_lock;		/* RAID-1: protects r_mirrors */
+	struct raid_mirror *r_mirrors;	/* RAID-1: member state */
+};
+
+/*
+ * One piece of a request, and the member it goes to.
+ */
+struct raid_piece {
+	struct devreq rp_req;
+	unsigned rp_member;
+};
+
+/*
+ * A request in progress, split into pieces.
+ */
+struct raid_io {
+	struct raid *ri_raid;
+	struct devreq *ri_req;		/* the original request */
+	struct spinlock ri_lock;	/* protects the next three */
+	unsigned ri_pending;		/* pieces not done yet */
+	unsigned ri_nok;		/* pieces that succeeded */
+	int ri_result;			/* first error from a piece */
+	unsigned ri_npieces;
+	struct raid_piece ri_pieces[];	/* requests to the members */
+};
+
+/*
+ * A read in progress on a mirror.
+ */
+struct raid_read {
+	struct raid *rr_raid;
+	struct devreq *rr_req;		/* the original request */
+	struct raid_piece rr_piece;	/* the current attempt */
+	struct work rr_retry;		/* to try another member */
+};
+
+////////////////////////////////////////////////////////////
+// Mirror members
+
+/*
+ * Note that a request has been sent to member M.
+ */
+static
+void
+raid_mirror_start(struct raid *r, unsigned m)
+{
+	spinlock_acquire(&r->r_lock);
+	r->r_mirrors[m].rm_inflight++;
+	spinlock_release(&r->r_lock);
+}
+
+/*
+ * Note that PIECE is finished; if it failed, drop its member.
+ */
+static
+void
+raid_mirror_done(struct raid *r, struct raid_piece *rp)
+{
+	struct raid_mirror *rm = &r->r_mirrors[rp->rp_member];
+	bool newfail = false;
+
+	spinlock_acquire(&r->r_lock);
+	KASSERT(rm->rm_inflight > 0);
+	rm->rm_inflight--;
+	rm->rm_headpos = rp->rp_req.dr_block + rp->rp_req.dr_nblocks;
+	if (rp->rp_req.dr_result && !rm->rm_failed) {
+		rm->rm_failed = true;
+		newfail = true;
+	}
+	spinlock_release(&r->r_lock);
+
+	if (newfail) {
+		kprintf("%s: member %u failed: %s\n", r->r_name,
+			rp->rp_member, strerror(rp->rp_req.dr_result));
+	}
+}
+
+/*
+ * Choose a member to read BLOCK from: the least busy working member,
+ * the nearest one if there's a tie. Returns false if there are none.
+ */
+static
+bool
+raid_mirror_choose(struct raid *r, uint32_t block, unsigned *ret)
+{
+	struct raid_mirror *rm;
+	uint32_t dist, bestdist = 0;
+	unsigned i, best;
+
+	best = r->r_ndisks;
+	spinlock_acquire(&r->r_lock);
+	for (i=0; i<r->r_ndisks; i++) {
+		rm = &r->r_mirrors[i];
+		if (rm->rm_failed) {
+			continue;
+		}
+		dist = rm->rm_headpos > block ?
+			rm->rm_headpos - block : block - rm->rm_headpos;
+		if (best == r->r_ndisks ||
+		    rm->rm_inflight < r->r_mirrors[best].rm_inflight ||
+		    (rm->rm_inflight == r->r_mirrors[best].rm_inflight &&
+		     dist < bestdist)) {
+			best = i;
+			bestdist = dist;
+		}
+	}
+	if (best < r->r_ndisks) {
+		/* Count it now, so concurrent readers spread out */
+		r->r_mirrors[best].rm_inflight++;
+	}
+	spinlock_release(&r->r_lock);
+
+	*ret = best;
+	return best < r->r_ndisks;
+}
+
+////////////////////////////////////////////////////////////
+// Split requests
+
+/*
+ * Account for one finished piece; finish the whole request if it was
+ * the last.
+ */
+static
+void
+raid_io_piecedone(struct raid_io *ri, int result)
+{
+	struct devreq *req;
+	bool last;
+
+	spinlock_acquire(&ri->ri_lock);
+	if (result && ri->ri_result == 0) {
+		ri->ri_result = result;
+	}
+	KASSERT(ri->ri_pending > 0);
+	ri->ri_pending--;
+	last = ri->ri_pending == 0;
+	spinlock_release(&ri->ri_lock);
+
+	if (last) {
+		req = ri->ri_req;
+		if (ri->ri_raid->r_mirrors != NULL && ri->ri_nok > 0) {
+			/* A mirrored write only needs one copy to work */
+			req->dr_result = 0;
+		}
+		else {
+			req->dr_result = ri->ri_result;
+		}
+		spinlock_cleanup(&ri->ri_lock);
+		kfree(ri);
+		req->dr_done(req);
+	}
+}
+
+/*
+ * Completion callback for pieces.
+ */
+static
+void
+raid_piece_done(struct devreq *piece)
+{
+	struct raid_piece *rp = (struct raid_piece *)piece;
+	struct raid_io *ri = piece->dr_data;
+
+	if (ri->ri_raid->r_mirrors != NULL) {
+		raid_mirror_done(ri->ri_raid, rp);
+	}
+	if (piece->dr_result == 0) {
+		spinlock_acquire(&ri->ri_lock);
+		ri->ri_nok++;
+		spinlock_release(&ri->ri_lock);
+	}
+	raid_io_piecedone(ri, piece->dr_result);
+}
+
+/*
+ * Set up a request to be split into NPIECES pieces.
+ */
+static
+struct raid_io *
+raid_io_create(struct raid *r, struct devreq *req, unsigned npieces)
+{
+	struct raid_io *ri;
+	unsigned i;
+
+	ri = kmalloc(sizeof(*ri) + npieces * sizeof(ri->ri_pieces[0]));
+	if (ri == NULL) {
+		return NULL;
+	}
+	ri->ri_raid = r;
+	ri->ri_req = req;
+	spinlock_init(&ri->ri_lock);
+	/* One extra, held by the submitter until everything is sent */
+	ri->ri_pending = npieces + 1;
+	ri->ri_nok = 0;
+	ri->ri_result = 0;
+	ri->ri_npieces = npieces;
+	for (i=0; i<npieces; i++) {
+		ri->ri_pieces[i].rp_req.dr_write = req->dr_write;
+		ri->ri_pieces[i].rp_req.dr_done = raid_piece_done;
+		ri->ri_pieces[i].rp_req.dr_data = ri;
+	}
+	return ri;
+}
+
+/*
+ * Send all the pieces to their members, then drop the submitter's
+ * hold. A piece that can't be submitted counts as failed.
+ */
+static
+void
+raid_io_start(struct raid_io *ri)
+{
+	struct raid *r = ri->ri_raid;
+	struct raid_piece *rp;
+	unsigned i, npieces;
+	int result;
+
+	/* Once the last piece is sent, RI may vanish at any moment */
+	npieces = ri->ri_npieces;
+	for (i=0; i<npieces; i++) {
+		rp = &ri->ri_pieces[i];
+		if (r->r_mirrors != NULL) {
+			raid_mirror_start(r, rp->rp_member);
+		}
+		result = dev_submit(r->r_disks[rp->rp_member], &rp->rp_req);
+		if (result) {
+			rp->rp_req.dr_result = result;
+			raid_piece_done(&rp->rp_req);
+		}
+	}
+	raid_io_piecedone(ri, 0);
+}
+
+////////////////////////////////////////////////////////////
+// RAID-0
+
+static
+int
+raid0_submit(struct device *d, struct devreq *req)
+{
+	struct raid *r = d->d_data;
+	struct raid_io *ri;
+	struct raid_piece *rp;
+	uint32_t block, unit, offset, len, done;
+	unsigned npieces;
+
+	/* Count the stripe units touched */
+	offset = req->dr_block % r->r_stripe;
+	npieces = (offset + req->dr_nblocks + r->r_stripe - 1) / r->r_stripe;
+
+	ri = raid_io_create(r, req, npieces);
+	if (ri == NULL) {
+		return ENOMEM;
+	}
+
+	block = req->dr_block;
+	done = 0;
+	for (rp = ri->ri_pieces; done < req->dr_nblocks; rp++) {
+		unit = block / r->r_stripe;
+		offset = block % r->r_stripe;
+		len = r->r_stripe - offset;
+		if (len > req->dr_nblocks - done) {
+			len = req->dr_nblocks - done;
+		}
+
+		rp->rp_member = unit % r->r_ndisks;
+		rp->rp_req.dr_block = (unit / r->r_ndisks) * r->r_stripe +
+			offset;
+		rp->rp_req.dr_nblocks = len;
+		rp->rp_req.dr_buf = (char *)req->dr_buf +
+			done * d->d_blocksize;
+
+		block += len;
+		done += len;
+	}
+	KASSERT(rp == &ri->ri_pieces[npieces]);
+
+	raid_io_start(ri);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// RAID-1
+
+/*
+ * Send a mirrored read to a member, or if none is left, fail it.
+ */
+static
+void
+raid1_read_start(struct raid_read *rr)
+{
+	struct raid *r = rr->rr_raid;
+	struct devreq *req = rr->rr_req;
+	unsigned m;
+	int result;
+
+	while (raid_mirror_choose(r, req->dr_block, &m)) {
+		rr->rr_piece.rp_member = m;
+		result = dev_submit(r->r_disks[m], &rr->rr_piece.rp_req);
+		if (result == 0) {
+			return;
+		}
+		rr->rr_piece.rp_req.dr_result = result;
+		raid_mirror_done(r, &rr->rr_piece);
+	}
+
+	req->dr_result = EIO;
+	kfree(rr);
+	req->dr_done(req);
+}
+
+/*
+ * Work function for retrying a mirrored read, in thread context.
+ */
+static
+void
+raid1_read_retry(struct work *wk)
+{
+	raid1_read_start(wk->wk_data);
+}
+
+/*
+ * Completion callback for mirrored reads: finish, or try elsewhere.
+ */
+static
+void
+raid1_read_done(struct devreq *piece)
+{
+	struct raid_read *rr = piece->dr_data;
+	struct devreq *req = rr->rr_req;
+
+	raid_mirror_done(rr->rr_raid, &rr->rr_piece);
+	if (piece->dr_result) {
+		work_queue(&rr->rr_retry);
+		return;
+	}
+
+	req->dr_result = 0;
+	kfree(rr);
+	req->dr_done(req);
+}
+
+static
+int
+raid1_submit(struct device *d, struct devreq *req)
+{
+	struct raid *r = d->d_data;
+	struct raid_read *rr;
+	struct raid_io *ri;
+	struct raid_piece *rp;
+	unsigned i;
+
+	if (!req->dr_write) {
+		rr = kmalloc(sizeof(*rr));
+		if (rr == NULL) {
+			return ENOMEM;
+		}
+		rr->rr_raid = r;
+		rr->rr_req = req;
+		rr->rr_piece.rp_req = *req;
+		rr->rr_piece.rp_req.dr_done = raid1_read_done;
+		rr->rr_piece.rp_req.dr_data = rr;
+		work_init(&rr->rr_retry, raid1_read_retry, rr);
+		raid1_read_start(rr);
+		return 0;
+	}
+
+	/* Write to every member that's still working */
+	ri = raid_io_create(r, req, r->r_ndisks);
+	if (ri == NULL) {
+		return ENOMEM;
+	}
+	rp = ri->ri_pieces;
+	spinlock_acquire(&r->r_lock);
+	for (i=0; i<r->r_ndisks; i++) {
+		if (r->r_mirrors[i].rm_failed) {
+			continue;
+		}
+		rp->rp_member = i;
+		rp->rp_req.dr_block = req->dr_block;
+		rp->rp_req.dr_nblocks = req->dr_nblocks;
+		rp->rp_req.dr_buf = req->dr_buf;
+		rp++;
+	}
+	spinlock_release(&r->r_lock);
+
+	ri->ri_npieces = rp - ri->ri_pieces;
+	if (ri->ri_npieces == 0) {
+		spinlock_cleanup(&ri->ri_lock);
+		kfree(ri);
+		return EIO;
+	}
+	ri->ri_pending = ri->ri_npieces + 1;
+
+	raid_io_start(ri);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Common code
+
+static
+int
+raid_eachopen(struct device *d, int openflags)
+{
+	(void)d;
+	(void)openflags;
+	return 0;
+}
+
+static
+int
+raid_io(struct device *d, struct uio *uio)
+{
+	return devreq_uio(d, uio);
+}
+
+static
+int
+raid_ioctl(struct device *d, int op, userptr_t data)
+{
+	(void)d;
+	(void)op;
+	(void)data;
+	return EIOCTL;
+}
+
+static const struct device_ops raid0_devops = {
+	.devop_eachopen = raid_eachopen,
+	.devop_io = raid_io,
+	.devop_ioctl = raid_ioctl,
+	.devop_submit = raid0_submit,
+};
+
+static const struct device_ops raid1_devops = {
+	.devop_eachopen = raid_eachopen,
+	.devop_io = raid_io,
+	.devop_ioctl = raid_ioctl,
+	.devop_submit = raid1_submit,
+};
+
+/*
+ * Give back the memory for a struct raid that didn't get attached.
+ * Any members already claimed stay that way; there's no way to
+ * return them.
+ */
+static
+void
+raid_destroy(struct raid *r)
+{
+	if (r->r_mirrors != NULL) {
+		spinlock_cleanup(&r->r_lock);
+		kfree(r->r_mirrors);
+	}
+	kfree(r->r_disks);
+	kfree(r->r_name);
+	kfree(r);
+}
+
+/*
+ * Claim the NDISKS devices named in DISKNAMES, check that they go
+ * together, and set up a struct raid called NAME over them. The
+ * caller still has to fill in d_ops and d_blocks.
+ */
+static
+int
+raid_create(const char *name, unsigned ndisks, char **disknames,
+	    struct raid **ret)
+{
+	struct raid *r;
+	unsigned i;
+	int result;
+
+	if (ndisks < 2) {
+		return EINVAL;
+	}
+
+	r = kmalloc(sizeof(*r));
+	if (r == NULL) {
+		return ENOMEM;
+	}
+	r->r_name = kstrdup(name);
+	if (r->r_name == NULL) {
+		kfree(r);
+		return ENOMEM;
+	}
+	r->r_disks = kmalloc(ndisks * sizeof(r->r_disks[0]));
+	if (r->r_disks == NULL) {
+		kfree(r->r_name);
+		kfree(r);
+		return ENOMEM;
+	}
+	r->r_ndisks = ndisks;
+	r->r_stripe = 0;
+	r->r_mirrors = NULL;
+
+	result = vfs_claimdevs(disknames, ndisks, r->r_disks);
+	if (result) {
+		raid_destroy(r);
+		return result;
+	}
+
+	/* The members must have the same block size */
+	for (i=1; i<ndisks; i++) {
+		if (r->r_disks[i]->d_blocksize != r->r_disks[0]->d_blocksize) {
+			raid_destroy(r);
+			return EINVAL;
+		}
+	}
+
+	r->r_dev.d_blocks = 0;
+	r->r_dev.d_blocksize = r->r_disks[0]->d_blocksize;
+	r->r_dev.d_devnumber = 0; /* assigned by vfs_adddev */
+	r->r_dev.d_data = r;
+
+	*ret = r;
+	return 0;
+}
+
+/*
+ * The size of the smallest member.
+ */
+static
+uint32_t
+raid_minblocks(struct raid *r)
+{
+	uint32_t min;
+	unsigned i;
+
+	min = r->r_disks[0]->d_blocks;
+	for (i=1; i<r->r_ndisks; i++) {
+		if (r->r_disks[i]->d_blocks < min) {
+			min = r->r_disks[i]->d_blocks;
+		}
+	}
+	return min;
+}
+
+/*
+ * Create a RAID-0 device called NAME, with a stripe unit of STRIPE
+ * blocks, over the NDISKS (mountable, unmounted) devices named in
+ * DISKNAMES. It is added to VFS as a mountable device.
+ */
+int
+devraid0_create(const char *name, uint32_t stripe,
+		unsigned ndisks, char **disknames)
+{
+	struct raid *r;
+	uint32_t perdisk;
+	int result;
+
+	if (stripe == 0) {
+		return EINVAL;
+	}
+
+	result = raid_create(name, ndisks, disknames, &r);
+	if (result) {
+		return result;
+	}
+	r->r_stripe = stripe;
+
+	/* Only whole stripe units count */
+	perdisk = raid_minblocks(r) / stripe * stripe;
+	r->r_dev.d_ops = &raid0_devops;
+	r->r_dev.d_blocks = perdisk * ndisks;
+
+	result = vfs_adddev(name, &r->r_dev, 1);
+	if (result) {
+		raid_destroy(r);
+		return result;
+	}
+
+	kprintf("%s: RAID-0 over %u devices, stripe unit %u blocks, "
+		"%u blocks\n", name, ndisks, stripe,
+		(unsigned)r->r_dev.d_blocks);
+	return 0;
+}
+
+/*
+ * Create a RAID-1 device called NAME mirroring the NDISKS devices
+ * named in DISKNAMES, which should all hold the same data already
+ * (e.g. be freshly made). It is added to VFS as a mountable device.
+ */
+int
+devraid1_create(const char *name, unsigned ndisks, char **disknames)
+{
+	struct raid *r;
+	unsigned i;
+	int result;
+
+	result = raid_create(name, ndisks, disknames, &r);
+	if (result) {
+		return result;
+	}
+
+	r->r_mirrors = kmalloc(ndisks * sizeof(r->r_mirrors[0]));
+	if (r->r_mirrors == NULL) {
+		raid_destroy(r);
+		return ENOMEM;
+	}
+	spinlock_init(&r->r_lock);
+	for (i=0; i<ndisks; i++) {
+		r->r_mirrors[i].rm_headpos = 0;
+		r->r_mirrors[i].rm_inflight = 0;
+		r->r_mirrors[i].rm_failed = false;
+	}
+
+	r->r_dev.d_ops = &raid1_devops;
+	r->r_dev.d_blocks = raid_minblocks(r);
+
+	result = vfs_adddev(name, &r->r_dev, 1);
+	if (result) {
+		raid_destroy(r);
+		return result;
+	}
+
+	kprintf("%s: RAID-1 over %u devices, %u blocks\n", name, ndisks,
+		(unsigned)r->r_dev.d_blocks);
+	return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * RAM disks: block devices whose blocks are just kernel memory.
+ *
+ * There is no seek or rotational delay and no interrupt; a transfer
+ * is a copy done on the spot. This makes a fast scratch volume, and
+ * a way to time the filesystem code without the disk's cost mixed
+ * in. The contents are lost on reboot.
+ *
+ * The memory is taken a page at a time, so a large disk doesn't need
+ * a large contiguous piece of memory, and is never given back.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <vm.h>
+#include <vfs.h>
+#include <device.h>
+
+/* Block size, the same as lhd's so disk images are interchangeable */
+#define DEVRAM_BLOCKSIZE	512
+
+#define DEVRAM_BLOCKSPERPAGE	(PAGE_SIZE / DEVRAM_BLOCKSIZE)
+
+struct ramdisk {
+	struct device rd_dev;		/* our VFS device */
+	unsigned rd_npages;		/* number of pages */
+	vaddr_t *rd_pages;		/* the pages */
+};
+
+static
+int
+devram_eachopen(struct device *d, int openflags)
+{
+	(void)d;
+	(void)openflags;
+	return 0;
+}
+
+/*
+ * Copy between the uio and the pages, a page at a time.
+ */
+static
+int
+devram_io(struct device *d, struct uio *uio)
+{
+	struct ramdisk *rd = d->d_data;
+	off_t endblock;
+	unsigned page;
+	size_t pageoff, len;
+	int result;
+
+	/* Don't allow I/O that isn't block-aligned. */
+	if (uio->uio_offset % DEVRAM_BLOCKSIZE != 0 ||
+	    uio->uio_resid % DEVRAM_BLOCKSIZE != 0) {
+		return EINVAL;
+	}
+
+	/* Don't allow I/O past the end of the disk. */
+	endblock = (uio->uio_offset + uio->uio_resid) / DEVRAM_BLOCKSIZE;
+	if (endblock > d->d_blocks) {
+		return EINVAL;
+	}
+
+	while (uio->uio_resid > 0) {
+		page = uio->uio_offset / PAGE_SIZE;
+		pageoff = uio->uio_offset % PAGE_SIZE;
+		len = PAGE_SIZE - pageoff;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+		KASSERT(page < rd->rd_npages);
+		result = uiomove((char *)rd->rd_pages[page] + pageoff,
+				 len, uio);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+static
+int
+devram_ioctl(struct device *d, int op, userptr_t data)
+{
+	(void)d;
+	(void)op;
+	(void)data;
+	return EIOCTL;
+}
+
+static const struct device_ops devram_devops = {
+	.devop_eachopen = devram_eachopen,
+	.devop_io = devram_io,
+	.devop_ioctl = devram_ioctl,
+};
+
+/*
+ * Give back the memory for a ramdisk that didn't get attached.
+ */
+static
+void
+devram_destroy(struct ramdisk *rd)
+{
+	unsigned i;
+
+	for (i=0; i<rd->rd_npages; i++) {
+		if (rd->rd_pages[i] != 0) {
+			free_kpages(rd->rd_pages[i]);
+		}
+	}
+	kfree(rd->rd_pages);
+	kfree(rd);
+}
+
+/*
+ * Create a RAM disk called NAME holding NBLOCKS 512-byte blocks,
+ * initially all zeros. It is added to VFS as a mountable device.
+ */
+int
+devram_create(const char *name, uint32_t nblocks)
+{
+	struct ramdisk *rd;
+	unsigned i;
+	int result;
+
+	if (nblocks == 0) {
+		return EINVAL;
+	}
+
+	rd = kmalloc(sizeof(*rd));
+	if (rd == NULL) {
+		return ENOMEM;
+	}
+	rd->rd_npages = DIVROUNDUP(nblocks, DEVRAM_BLOCKSPERPAGE);
+	rd->rd_pages = kmalloc(rd->rd_npages * sizeof(rd->rd_pages[0]));
+	if (rd->rd_pages == NULL) {
+		kfree(rd);
+		return ENOMEM;
+	}
+	for (i=0; i<rd->rd_npages; i++) {
+		rd->rd_pages[i] = 0;
+	}
+	for (i=0; i<rd->rd_npages; i++) {
+		rd->rd_pages[i] = alloc_kpages(1);
+		if (rd->rd_pages[i] == 0) {
+			devram_destroy(rd);
+			return ENOMEM;
+		}
+		bzero((void *)rd->rd_pages[i], PAGE_SIZE);
+	}
+
+	rd->rd_dev.d_ops = &devram_devops;
+	rd->rd_dev.d_blocks = nblocks;
+	rd->rd_dev.d_blocksize = DEVRAM_BLOCKSIZE;
+	rd->rd_dev.d_devnumber = 0; /* assigned by vfs_adddev */
+	rd->rd_dev.d_data = rd;
+
+	result = vfs_adddev(name, &rd->rd_dev, 1);
+	if (result) {
+		devram_destroy(rd);
+		return result;
+	}
+
+	kprintf("%s: RAM disk, %u blocks\n", name, (unsigned)nblocks);
+	return 0;
+}
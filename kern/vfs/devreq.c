@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Block requests for VFS devices. See device.h.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <device.h>
+
+/* Size of the buffer used for I/O to and from user memory */
+#define DEVREQ_BOUNCESIZE	4096
+
+/*
+ * Submit a request. Returns an error (and does not call dr_done) if
+ * the request is bad or can't be queued.
+ */
+int
+dev_submit(struct device *dev, struct devreq *req)
+{
+	struct iovec iov;
+	struct uio u;
+
+	if (dev->d_blocks == 0 || req->dr_nblocks == 0 ||
+	    req->dr_block >= dev->d_blocks ||
+	    req->dr_nblocks > dev->d_blocks - req->dr_block) {
+		return EINVAL;
+	}
+
+	if (dev->d_ops->devop_submit != NULL) {
+		return dev->d_ops->devop_submit(dev, req);
+	}
+
+	/* No queue; just do it */
+	uio_kinit(&iov, &u, req->dr_buf, req->dr_nblocks * dev->d_blocksize,
+		  (off_t)req->dr_block * dev->d_blocksize,
+		  req->dr_write ? UIO_WRITE : UIO_READ);
+	req->dr_result = DEVOP_IO(dev, &u);
+	req->dr_done(req);
+	return 0;
+}
+
+/*
+ * Completion callback for devreq_uio.
+ */
+static
+void
+devreq_uio_done(struct devreq *req)
+{
+	V((struct semaphore *)req->dr_data);
+}
+
+/*
+ * Submit NREQS requests and wait for them all. Returns the first
+ * error.
+ */
+static
+int
+devreq_run(struct device *dev, struct devreq *reqs, unsigned nreqs,
+	   struct semaphore *sem)
+{
+	unsigned i, nsubmitted;
+	int result;
+
+	result = 0;
+	nsubmitted = 0;
+	for (i=0; i<nreqs; i++) {
+		reqs[i].dr_done = devreq_uio_done;
+		reqs[i].dr_data = sem;
+		result = dev_submit(dev, &reqs[i]);
+		if (result) {
+			break;
+		}
+		nsubmitted++;
+	}
+
+	for (i=0; i<nsubmitted; i++) {
+		P(sem);
+	}
+	for (i=0; i<nsubmitted && result == 0; i++) {
+		result = reqs[i].dr_result;
+	}
+	return result;
+}
+
+/*
+ * Move a kernel-space uio along by LEN bytes, as if uiomove had been
+ * used to transfer them.
+ */
+static
+void
+devreq_uioskip(struct uio *uio, size_t len)
+{
+	struct iovec *iov;
+	size_t amt;
+
+	KASSERT(len <= uio->uio_resid);
+	uio->uio_resid -= len;
+	uio->uio_offset += len;
+	while (len > 0) {
+		iov = uio->uio_iov;
+		amt = iov->iov_len < len ? iov->iov_len : len;
+		iov->iov_kbase = (char *)iov->iov_kbase + amt;
+		iov->iov_len -= amt;
+		len -= amt;
+		if (iov->iov_len == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+		}
+	}
+}
+
+/*
+ * Kernel buffers: send the device straight at the memory, with all
+ * the pieces queued at once. Returns EAGAIN if the pieces aren't
+ * whole blocks, to fall back to the buffered path.
+ */
+static
+int
+devreq_uio_direct(struct device *dev, struct uio *uio, struct semaphore *sem)
+{
+	struct devreq onereq, *reqs;
+	uint32_t block;
+	unsigned i, nreqs;
+	int result;
+
+	nreqs = 0;
+	for (i=0; i<uio->uio_iovcnt; i++) {
+		if (uio->uio_iov[i].iov_len % dev->d_blocksize != 0) {
+			return EAGAIN;
+		}
+		if (uio->uio_iov[i].iov_len > 0) {
+			nreqs++;
+		}
+	}
+	if (nreqs == 0) {
+		return 0;
+	}
+
+	if (nreqs == 1) {
+		reqs = &onereq;
+	}
+	else {
+		reqs = kmalloc(nreqs * sizeof(*reqs));
+		if (reqs == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	block = uio->uio_offset / dev->d_blocksize;
+	nreqs = 0;
+	for (i=0; i<uio->uio_iovcnt; i++) {
+		if (uio->uio_iov[i].iov_len == 0) {
+			continue;
+		}
+		reqs[nreqs].dr_block = block;
+		reqs[nreqs].dr_nblocks =
+			uio->uio_iov[i].iov_len / dev->d_blocksize;
+		reqs[nreqs].dr_buf = uio->uio_iov[i].iov_kbase;
+		reqs[nreqs].dr_write = uio->uio_rw == UIO_WRITE;
+		block += reqs[nreqs].dr_nblocks;
+		nreqs++;
+	}
+
+	result = devreq_run(dev, reqs, nreqs, sem);
+	if (result == 0) {
+		devreq_uioskip(uio, uio->uio_resid);
+	}
+
+	if (reqs != &onereq) {
+		kfree(reqs);
+	}
+	return result;
+}
+
+/*
+ * User buffers (or odd-sized kernel pieces): copy through a bounce
+ * buffer, a chunk at a time.
+ */
+static
+int
+devreq_uio_bounce(struct device *dev, struct uio *uio, struct semaphore *sem)
+{
+	struct devreq req;
+	size_t chunk, len;
+	void *buf;
+	int result;
+
+	chunk = DEVREQ_BOUNCESIZE - DEVREQ_BOUNCESIZE % dev->d_blocksize;
+	if (chunk == 0) {
+		chunk = dev->d_blocksize;
+	}
+	buf = kmalloc(chunk);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	result = 0;
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid < chunk ? uio->uio_resid : chunk;
+
+		req.dr_block = uio->uio_offset / dev->d_blocksize;
+		req.dr_nblocks = len / dev->d_blocksize;
+		req.dr_buf = buf;
+		req.dr_write = uio->uio_rw == UIO_WRITE;
+
+		if (req.dr_write) {
+			result = uiomove(buf, len, uio);
+			if (result) {
+				break;
+			}
+		}
+		result = devreq_run(dev, &req, 1, sem);
+		if (result) {
+			break;
+		}
+		if (!req.dr_write) {
+			result = uiomove(buf, len, uio);
+			if (result) {
+				break;
+			}
+		}
+	}
+
+	kfree(buf);
+	return result;
+}
+
+int
+devreq_uio(struct device *dev, struct uio *uio)
+{
+	struct semaphore *sem;
+	off_t endblock;
+	int result;
+
+	/* Don't allow I/O that isn't block-aligned. */
+	if (uio->uio_offset % dev->d_blocksize != 0 ||
+	    uio->uio_resid % dev->d_blocksize != 0) {
+		return EINVAL;
+	}
+
+	/* Don't allow I/O past the end of the disk. */
+	endblock = (uio->uio_offset + uio->uio_resid) / dev->d_blocksize;
+	if (endblock > dev->d_blocks) {
+		return EINVAL;
+	}
+
+	sem = sem_create("devreq", 0);
+	if (sem == NULL) {
+		return ENOMEM;
+	}
+
+	result = EAGAIN;
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		result = devreq_uio_direct(dev, uio, sem);
+	}
+	if (result == EAGAIN) {
+		result = devreq_uio_bounce(dev, uio, sem);
+	}
+
+	sem_destroy(sem);
+	return result;
+}
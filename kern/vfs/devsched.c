@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * I/O scheduling for block request queues. See device.h.
+ *
+ * Pending requests are kept in submission order; each policy is just
+ * a way of picking which one to take off next. That means switching
+ * policies is only a pointer assignment and needs no reshuffling.
+ * Picking is a linear scan, which is fine for the queue lengths we
+ * see.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <device.h>
+
+/*
+ * How long (in milliseconds) a request may wait under the deadline
+ * policy before it is served out of order. Reads are usually what
+ * someone is waiting for, so they get the shorter limit.
+ */
+#define DEVSCHED_READ_EXPIRE	500
+#define DEVSCHED_WRITE_EXPIRE	5000
+
+struct devsched {
+	const char *ds_name;
+	struct devreq *(*ds_pick)(struct devqueue *dq);
+};
+
+/* List of all queues */
+static struct spinlock devsched_lock = SPINLOCK_INITIALIZER;
+static struct devqueue *devsched_queues;
+
+////////////////////////////////////////////////////////////
+// Policies
+
+/*
+ * FIFO: the oldest request.
+ */
+static
+struct devreq *
+devsched_fifo_pick(struct devqueue *dq)
+{
+	return dq->dq_head;
+}
+
+/*
+ * C-LOOK: the lowest block at or past the head position; if there
+ * isn't one, the lowest block of all.
+ */
+static
+struct devreq *
+devsched_clook_pick(struct devqueue *dq)
+{
+	struct devreq *req, *ahead, *lowest;
+
+	ahead = lowest = NULL;
+	for (req = dq->dq_head; req != NULL; req = req->dr_next) {
+		if (req->dr_block >= dq->dq_headpos &&
+		    (ahead == NULL || req->dr_block < ahead->dr_block)) {
+			ahead = req;
+		}
+		if (lowest == NULL || req->dr_block < lowest->dr_block) {
+			lowest = req;
+		}
+	}
+	return ahead != NULL ? ahead : lowest;
+}
+
+/*
+ * Deadline: the expired request with the earliest deadline, or if
+ * none has expired, whatever C-LOOK would choose.
+ */
+static
+struct devreq *
+devsched_deadline_pick(struct devqueue *dq)
+{
+	struct devreq *req, *expired;
+	struct timespec now;
+
+	gettime(&now);
+
+	expired = NULL;
+	for (req = dq->dq_head; req != NULL; req = req->dr_next) {
+		if (req->dr_deadline.tv_sec > now.tv_sec ||
+		    (req->dr_deadline.tv_sec == now.tv_sec &&
+		     req->dr_deadline.tv_nsec > now.tv_nsec)) {
+			continue;
+		}
+		if (expired == NULL ||
+		    req->dr_deadline.tv_sec < expired->dr_deadline.tv_sec ||
+		    (req->dr_deadline.tv_sec == expired->dr_deadline.tv_sec &&
+		     req->dr_deadline.tv_nsec < expired->dr_deadline.tv_nsec)) {
+			expired = req;
+		}
+	}
+	if (expired != NULL) {
+		return expired;
+	}
+	return devsched_clook_pick(dq);
+}
+
+static const struct devsched devsched_policies[] = {
+	{ "fifo", devsched_fifo_pick },
+	{ "clook", devsched_clook_pick },
+	{ "deadline", devsched_deadline_pick },
+};
+#define NPOLICIES (sizeof(devsched_policies) / sizeof(devsched_policies[0]))
+
+/* Policy for new queues */
+#define DEVSCHED_DEFAULT	(&devsched_policies[2])
+
+////////////////////////////////////////////////////////////
+// Queues
+
+void
+devqueue_init(struct devqueue *dq, const char *name)
+{
+	snprintf(dq->dq_name, sizeof(dq->dq_name), "%s", name);
+	dq->dq_sched = DEVSCHED_DEFAULT;
+	dq->dq_head = NULL;
+	dq->dq_tail = NULL;
+	dq->dq_headpos = 0;
+	dq->dq_served = 0;
+	dq->dq_seekdist = 0;
+
+	spinlock_acquire(&devsched_lock);
+	dq->dq_nextqueue = devsched_queues;
+	devsched_queues = dq;
+	spinlock_release(&devsched_lock);
+}
+
+/*
+ * Take a queue off the list again, for drivers whose device didn't
+ * get attached after all. It must be empty.
+ */
+void
+devqueue_cleanup(struct devqueue *dq)
+{
+	struct devqueue **pp;
+
+	KASSERT(dq->dq_head == NULL);
+
+	spinlock_acquire(&devsched_lock);
+	for (pp = &devsched_queues; *pp != dq; pp = &(*pp)->dq_nextqueue) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = dq->dq_nextqueue;
+	spinlock_release(&devsched_lock);
+}
+
+bool
+devqueue_isempty(struct devqueue *dq)
+{
+	return dq->dq_head == NULL;
+}
+
+/*
+ * Add a request at the tail, stamping it with its deadline.
+ */
+void
+devqueue_add(struct devqueue *dq, struct devreq *req)
+{
+	struct timespec expire;
+	unsigned ms;
+
+	ms = req->dr_write ? DEVSCHED_WRITE_EXPIRE : DEVSCHED_READ_EXPIRE;
+	expire.tv_sec = ms / 1000;
+	expire.tv_nsec = (ms % 1000) * 1000000;
+	gettime(&req->dr_deadline);
+	timespec_add(&req->dr_deadline, &expire, &req->dr_deadline);
+
+	req->dr_next = NULL;
+	if (dq->dq_tail == NULL) {
+		dq->dq_head = req;
+	}
+	else {
+		dq->dq_tail->dr_next = req;
+	}
+	dq->dq_tail = req;
+}
+
+/*
+ * Take off whichever request the policy picks, and move the head
+ * position past it.
+ */
+struct devreq *
+devqueue_remove(struct devqueue *dq)
+{
+	struct devreq *req, *prev, *pick;
+
+	if (dq->dq_head == NULL) {
+		return NULL;
+	}
+	pick = dq->dq_sched->ds_pick(dq);
+	KASSERT(pick != NULL);
+
+	prev = NULL;
+	for (req = dq->dq_head; req != pick; req = req->dr_next) {
+		prev = req;
+	}
+	if (prev == NULL) {
+		dq->dq_head = pick->dr_next;
+	}
+	else {
+		prev->dr_next = pick->dr_next;
+	}
+	if (dq->dq_tail == pick) {
+		dq->dq_tail = prev;
+	}
+	pick->dr_next = NULL;
+
+	if (pick->dr_block >= dq->dq_headpos) {
+		dq->dq_seekdist += pick->dr_block - dq->dq_headpos;
+	}
+	else {
+		dq->dq_seekdist += dq->dq_headpos - pick->dr_block;
+	}
+	dq->dq_headpos = pick->dr_block + pick->dr_nblocks;
+	dq->dq_served++;
+
+	return pick;
+}
+
+////////////////////////////////////////////////////////////
+// Control
+
+int
+devsched_select(const char *name, const char *policy)
+{
+	const struct devsched *ds;
+	struct devqueue *dq;
+	unsigned i;
+
+	ds = NULL;
+	for (i=0; i<NPOLICIES; i++) {
+		if (!strcmp(devsched_policies[i].ds_name, policy)) {
+			ds = &devsched_policies[i];
+		}
+	}
+	if (ds == NULL) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&devsched_lock);
+	for (dq = devsched_queues; dq != NULL; dq = dq->dq_nextqueue) {
+		if (!strcmp(dq->dq_name, name)) {
+			/* A single store; any policy can read any queue */
+			dq->dq_sched = ds;
+			break;
+		}
+	}
+	spinlock_release(&devsched_lock);
+
+	return dq != NULL ? 0 : ENODEV;
+}
+
+void
+devsched_printstats(void)
+{
+	struct devqueue *dq;
+	unsigned i;
+
+	kprintf("Policies:");
+	for (i=0; i<NPOLICIES; i++) {
+		kprintf(" %s", devsched_policies[i].ds_name);
+	}
+	kprintf("\n");
+
+	spinlock_acquire(&devsched_lock);
+	for (dq = devsched_queues; dq != NULL; dq = dq->dq_nextqueue) {
+		kprintf("%-8s %-8s %lu requests, %llu blocks of seeking\n",
+			dq->dq_name, dq->dq_sched->ds_name,
+			dq->dq_served, dq->dq_seekdist);
+	}
+	spinlock_release(&devsched_lock);
+}
@@ -29,8 +29,12 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -160,10 +164,9 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the page lists. Most allocations and frees
+ * don't touch them, though: each cpu keeps a magazine of free blocks
+ * of each size, which it refills and empties in batches. See below.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -347,6 +350,92 @@ static struct pageref *allbase;
 
 ////////////////////////////////////////
 
+/*
+ * Map from physical page number to the pageref for that page, so
+ * kfree can find the pageref for a block without searching allbase.
+ * Each entry holds the index of the pageref plus one, or 0 if the
+ * page isn't a subpage page. This is sized for 16M of RAM like the
+ * pagerefs themselves; pages past that aren't in the map and get
+ * found by searching, as before.
+ *
+ * Entries are set and cleared with kmalloc_spinlock held, and only
+ * while none of the blocks on the page are allocated. So whoever owns
+ * a block can look up its entry without the lock.
+ */
+
+#define PAGEREFMAP_SIZE TOTAL_PAGEREFS
+
+static uint16_t pagerefmap[PAGEREFMAP_SIZE];
+
+/*
+ * Set the map entry for PRPAGE to PR (which may be NULL).
+ */
+static
+void
+pagerefmap_set(vaddr_t prpage, struct pageref *pr)
+{
+	unsigned whichroot;
+	size_t pn, j;
+	struct pagerefpage *page;
+
+	pn = KVADDR_TO_PADDR(prpage) / PAGE_SIZE;
+	if (pn >= PAGEREFMAP_SIZE) {
+		return;
+	}
+	if (pr == NULL) {
+		pagerefmap[pn] = 0;
+		return;
+	}
+
+	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
+		page = kheaproots[whichroot].page;
+		if (page == NULL) {
+			continue;
+		}
+		j = pr - page->refs;
+		/* note: j is unsigned, don't test < 0 */
+		if (j < NPAGEREFS_PER_PAGE) {
+			pagerefmap[pn] = whichroot * NPAGEREFS_PER_PAGE + j + 1;
+			return;
+		}
+	}
+	/* pageref wasn't on any of the pages */
+	KASSERT(0);
+}
+
+/*
+ * Look up the pageref for the page ADDR is on. Returns NULL if it
+ * isn't a subpage page or isn't in the map; *INMAP tells which.
+ */
+static
+struct pageref *
+pagerefmap_get(vaddr_t addr, bool *inmap)
+{
+	size_t pn;
+	unsigned ix;
+	struct pageref *pr;
+
+	/* Addresses outside the direct-mapped segment wrap to huge pn */
+	pn = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	if (pn >= PAGEREFMAP_SIZE) {
+		*inmap = false;
+		return NULL;
+	}
+	*inmap = true;
+
+	ix = pagerefmap[pn];
+	if (ix == 0) {
+		return NULL;
+	}
+	ix--;
+	pr = &kheaproots[ix / NPAGEREFS_PER_PAGE].page->refs[
+		ix % NPAGEREFS_PER_PAGE];
+	KASSERT(PR_PAGEADDR(pr) == (addr & PAGE_FRAME));
+	return pr;
+}
+
+////////////////////////////////////////
+
 #ifdef GUARDS
 
 /* Space returned to the client is filled with GUARD_RETBYTE */
@@ -794,6 +883,10 @@ subpage_stats(struct pageref *pr)
 	kprintf("\n");
 }
 
+#ifdef MAGAZINES
+static void mag_printstats(void);
+#endif
+
 /*
  * Print the whole heap.
  */
@@ -810,6 +903,9 @@ kheap_printstats(void)
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		subpage_stats(pr);
 	}
+#ifdef MAGAZINES
+	mag_printstats();
+#endif
 
 	spinlock_release(&kmalloc_spinlock);
 }
@@ -866,6 +962,42 @@ int blocktype(size_t clientsz)
 	return 0;
 }
 
+/*
+ * Take a block off the freelist of page PR, which must have one.
+ */
+static
+void *
+subpage_getblock(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+	return retptr;
+}
+
 /*
  * Allocate a block of size SZ, where SZ is not large enough to
  * warrant a whole-page allocation.
@@ -921,25 +1053,7 @@ subpage_kmalloc(size_t sz
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_getblock(pr);
 #ifdef GUARDS
 			retptr = establishguardband(retptr, clientsz, sz);
 #endif
@@ -1013,83 +1127,29 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
+	pagerefmap_set(prpage, pr);
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
 /*
- * Free a pointer previously returned from subpage_kmalloc. If the
- * pointer is not on any heap page we recognize, return -1.
+ * Check a block that's being freed, and clear it. PTR is the client
+ * pointer, for the message if it's bad.
  */
 static
-int
-subpage_kfree(void *ptr)
+void
+subpage_checkblock(struct pageref *pr, vaddr_t ptraddr, void *ptr)
 {
 	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr;	// pageref for page we're freeing in
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
 #endif
 
-	ptraddr = (vaddr_t)ptr;
-#ifdef GUARDS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/*
-		 * With guard bands, all client-facing subpage
-		 * pointers are offset by GUARD_PTROFFSET (which is 4)
-		 * from the underlying blocks and are therefore not
-		 * page-aligned. So a page-aligned pointer is not one
-		 * of ours. Catch this up front, as otherwise
-		 * subtracting GUARD_PTROFFSET could give a pointer on
-		 * a page we *do* own, and then we'll panic because
-		 * it's not a valid one.
-		 */
-		return -1;
-	}
-	ptraddr -= GUARD_PTROFFSET;
-#endif
-#ifdef LABELS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/* ditto */
-		return -1;
-	}
-	ptraddr -= LABEL_PTROFFSET;
-#endif
-
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
-		return -1;
-	}
-
-	offset = ptraddr - prpage;
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype >= 0 && blktype < NSIZES);
+	offset = ptraddr - PR_PAGEADDR(pr);
 
 	/* Check for proper positioning and alignment */
 	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
@@ -1102,11 +1162,37 @@ subpage_kfree(void *ptr)
 	checkguardband(ptraddr, smallerblocksize, blocksize);
 #endif
 
+	/* Don't let go of a lock that's still being profiled */
+	LOCKPROF_CHECKFREE((void *)ptraddr, sizes[blktype]);
+
 	/*
 	 * Clear the block to 0xdeadbeef to make it easier to detect
 	 * uses of dangling pointers.
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
+}
+
+/*
+ * Put a (checked) block back on the freelist of page PR. If that
+ * makes the whole page free, take the page off the lists and return
+ * its address, for the caller to hand to free_kpages once it has
+ * released kmalloc_spinlock. Otherwise return 0.
+ */
+static
+vaddr_t
+subpage_putblock(struct pageref *pr, vaddr_t ptraddr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = ptraddr - prpage;
 
 	/*
 	 * We probably ought to check for free twice by seeing if the block
@@ -1141,13 +1227,92 @@ subpage_kfree(void *ptr)
 	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
+		pagerefmap_set(prpage, NULL);
 		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+		return prpage;
+	}
+	return 0;
+}
+
+/*
+ * Free a pointer previously returned from subpage_kmalloc. If the
+ * pointer is not on any heap page we recognize, return -1.
+ */
+static
+int
+subpage_kfree(void *ptr)
+{
+	vaddr_t ptraddr;	// same as ptr
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	bool inmap;		// page is covered by pagerefmap
+
+	ptraddr = (vaddr_t)ptr;
+#ifdef GUARDS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/*
+		 * With guard bands, all client-facing subpage
+		 * pointers are offset by GUARD_PTROFFSET (which is 4)
+		 * from the underlying blocks and are therefore not
+		 * page-aligned. So a page-aligned pointer is not one
+		 * of ours. Catch this up front, as otherwise
+		 * subtracting GUARD_PTROFFSET could give a pointer on
+		 * a page we *do* own, and then we'll panic because
+		 * it's not a valid one.
+		 */
+		return -1;
+	}
+	ptraddr -= GUARD_PTROFFSET;
+#endif
+#ifdef LABELS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/* ditto */
+		return -1;
+	}
+	ptraddr -= LABEL_PTROFFSET;
+#endif
+
+	/* We own the block, so its map entry can't change under us. */
+	pr = pagerefmap_get(ptraddr, &inmap);
+	if (inmap && pr == NULL) {
+		/* Not a subpage page */
+		return -1;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	if (!inmap) {
+		for (pr = allbase; pr; pr = pr->next_all) {
+			prpage = PR_PAGEADDR(pr);
+
+			/* check for corruption */
+			KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+			checksubpage(pr);
+
+			if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+				break;
+			}
+		}
+
+		if (pr==NULL) {
+			/* Not on any of our pages - not a subpage allocation */
+			spinlock_release(&kmalloc_spinlock);
+			return -1;
+		}
 	}
 	else {
-		spinlock_release(&kmalloc_spinlock);
+		checksubpage(pr);
+	}
+
+	subpage_checkblock(pr, ptraddr, ptr);
+	prpage = subpage_putblock(pr, ptraddr);
+	spinlock_release(&kmalloc_spinlock);
+
+	if (prpage != 0) {
+		/* Call free_kpages without kmalloc_spinlock. */
+		free_kpages(prpage);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
@@ -1159,6 +1324,267 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+////////////////////////////////////////
+
+/*
+ * Per-cpu magazines.
+ *
+ * Each cpu keeps, for each block size, a stack of free blocks (a
+ * "magazine"). kmalloc takes a block off the current cpu's magazine
+ * and kfree pushes one on, with interrupts off but without taking
+ * kmalloc_spinlock. When the magazine runs empty it is refilled with
+ * a batch of blocks from the page freelists, and when it fills up a
+ * batch is sent back, so the shared lock is taken once per batch
+ * rather than once per call. Blocks in a magazine count as allocated
+ * as far as their page is concerned.
+ *
+ * The bigger sizes get smaller magazines so as not to strand too
+ * much memory on each cpu; each one holds at most a couple of pages
+ * worth. A batch is half a magazine.
+ *
+ * Guard bands and labels are set up and checked per allocation in
+ * subpage_kmalloc and subpage_kfree, so with those on we go straight
+ * there.
+ */
+
+#if !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+
+#ifdef MAGAZINES
+
+#define MAG_MAX 16
+
+static const unsigned maglimits[NSIZES] = { 16, 16, 16, 16, 16, 16, 8, 4 };
+
+struct kmalloc_mag {
+	unsigned km_count;
+	void *km_blocks[MAG_MAX];
+};
+
+struct kmalloc_cpu {
+	struct kmalloc_mag kc_mags[NSIZES];
+};
+
+/* For kheap_printstats */
+static struct kmalloc_cpu *kmalloc_cpus[MAXCPUS];
+static unsigned kmalloc_ncpus;
+
+/*
+ * Get the current cpu's magazine for BLKTYPE, or NULL if it doesn't
+ * have one (yet). Call with interrupts off.
+ */
+static
+struct kmalloc_mag *
+mag_get(unsigned blktype)
+{
+	if (!CURCPU_EXISTS() || curcpu->c_kmalloc == NULL) {
+		return NULL;
+	}
+	return &curcpu->c_kmalloc->kc_mags[blktype];
+}
+
+/*
+ * Allocate a block of type BLKTYPE from the current cpu's magazine.
+ * Returns NULL if there's no magazine or no free block on any page;
+ * then subpage_kmalloc must do it.
+ */
+static
+void *
+mag_kmalloc(unsigned blktype)
+{
+	struct kmalloc_mag *mag;
+	struct pageref *pr;
+	unsigned batch;
+	void *retptr;
+	int spl;
+
+	spl = splhigh();
+	mag = mag_get(blktype);
+	if (mag == NULL) {
+		splx(spl);
+		return NULL;
+	}
+
+	if (mag->km_count == 0) {
+		/* Refill with a batch from the pages. */
+		batch = maglimits[blktype] / 2;
+		spinlock_acquire(&kmalloc_spinlock);
+		checksubpages();
+		for (pr = sizebases[blktype];
+		     pr != NULL && mag->km_count < batch;
+		     pr = pr->next_samesize) {
+			KASSERT(PR_BLOCKTYPE(pr) == blktype);
+			checksubpage(pr);
+			while (pr->nfree > 0 && mag->km_count < batch) {
+				mag->km_blocks[mag->km_count++] =
+					subpage_getblock(pr);
+			}
+		}
+		spinlock_release(&kmalloc_spinlock);
+	}
+
+	retptr = NULL;
+	if (mag->km_count > 0) {
+		retptr = mag->km_blocks[--mag->km_count];
+	}
+	splx(spl);
+	return retptr;
+}
+
+/*
+ * Send N blocks from a magazine back to their pages.
+ */
+static
+void
+mag_flush(void **blocks, unsigned n)
+{
+	vaddr_t freepages[MAG_MAX];
+	unsigned i, nfreepages;
+	struct pageref *pr;
+	vaddr_t prpage;
+	bool inmap;
+
+	KASSERT(n <= MAG_MAX);
+	nfreepages = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	for (i=0; i<n; i++) {
+		pr = pagerefmap_get((vaddr_t)blocks[i], &inmap);
+		KASSERT(pr != NULL);
+		prpage = subpage_putblock(pr, (vaddr_t)blocks[i]);
+		if (prpage != 0) {
+			freepages[nfreepages++] = prpage;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+/*
+ * Free a block into the current cpu's magazine. Returns -1 if it's
+ * not a subpage block on a page in pagerefmap, or if there's no
+ * magazine; then subpage_kfree must do it.
+ */
+static
+int
+mag_kfree(void *ptr)
+{
+	struct kmalloc_mag *mag;
+	struct pageref *pr;
+	void *flush[MAG_MAX];
+	unsigned blktype, i, nflush;
+	bool inmap;
+	int spl;
+
+	/* We own the block, so its map entry can't change under us. */
+	pr = pagerefmap_get((vaddr_t)ptr, &inmap);
+	if (pr == NULL) {
+		return -1;
+	}
+	blktype = PR_BLOCKTYPE(pr);
+
+	spl = splhigh();
+	mag = mag_get(blktype);
+	if (mag == NULL) {
+		splx(spl);
+		return -1;
+	}
+
+	subpage_checkblock(pr, (vaddr_t)ptr, ptr);
+
+	/*
+	 * If the magazine is full, take out the oldest batch to send
+	 * back. The flush itself happens with interrupts back on.
+	 */
+	nflush = 0;
+	if (mag->km_count == maglimits[blktype]) {
+		nflush = maglimits[blktype] / 2;
+		for (i=0; i<nflush; i++) {
+			flush[i] = mag->km_blocks[i];
+		}
+		for (i=nflush; i<mag->km_count; i++) {
+			mag->km_blocks[i - nflush] = mag->km_blocks[i];
+		}
+		mag->km_count -= nflush;
+	}
+	mag->km_blocks[mag->km_count++] = ptr;
+	splx(spl);
+
+	if (nflush > 0) {
+		mag_flush(flush, nflush);
+	}
+	return 0;
+}
+
+/*
+ * Print how many blocks of each size each cpu has cached. (Other
+ * cpus' counts may be changing as we look; it's only statistics.)
+ */
+static
+void
+mag_printstats(void)
+{
+	unsigned i, j;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	kprintf("Per-cpu magazines (cached blocks by size):\n");
+	for (i=0; i<kmalloc_ncpus; i++) {
+		if (kmalloc_cpus[i] == NULL) {
+			continue;
+		}
+		kprintf("   cpu%u:", i);
+		for (j=0; j<NSIZES; j++) {
+			kprintf(" %lu:%u", (unsigned long) sizes[j],
+				kmalloc_cpus[i]->kc_mags[j].km_count);
+		}
+		kprintf("\n");
+	}
+}
+
+#endif /* MAGAZINES */
+
+/*
+ * Set up the magazines for a new cpu. If this fails (or there are
+ * too many cpus) the cpu just uses the page lists directly.
+ */
+void
+kmalloc_cpu_create(struct cpu *c)
+{
+#ifdef MAGAZINES
+	struct kmalloc_cpu *kc;
+	unsigned i;
+#endif
+
+	c->c_kmalloc = NULL;
+#ifdef MAGAZINES
+	KASSERT(c->c_number < MAXCPUS);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return;
+	}
+	for (i=0; i<NSIZES; i++) {
+		kc->kc_mags[i].km_count = 0;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	kmalloc_cpus[c->c_number] = kc;
+	if (c->c_number >= kmalloc_ncpus) {
+		kmalloc_ncpus = c->c_number + 1;
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	c->c_kmalloc = kc;
+#endif
+}
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -1173,6 +1599,9 @@ kmalloc(size_t sz)
 #ifdef LABELS
 	vaddr_t label;
 #endif
+#ifdef MAGAZINES
+	void *ptr;
+#endif
 
 #ifdef LABELS
 #ifdef __GNUC__
@@ -1198,6 +1627,13 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
+#ifdef MAGAZINES
+	ptr = mag_kmalloc(blocktype(sz));
+	if (ptr != NULL) {
+		return ptr;
+	}
+#endif
+
 #ifdef LABELS
 	return subpage_kmalloc(sz, label);
 #else
@@ -1216,7 +1652,13 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#ifdef MAGAZINES
+	if (mag_kfree(ptr) == 0) {
+		return;
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
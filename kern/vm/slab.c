@@ -0,0 +1,388 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Object caches. See slab.h.
+ *
+ * Each slab is one page. The objects are laid out from the start of
+ * the page and the slab header sits at the end, so the slab for an
+ * object is found by rounding its address down to the page.
+ *
+ * Free objects in a slab are chained through a link word. If the
+ * cache has a constructor, the link word goes after the object so it
+ * doesn't disturb the constructed state; otherwise it overlaps the
+ * start of the object, as in kmalloc.
+ */
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <slab.h>
+
+/* Alignment when the cache doesn't ask for one (enough for doubles) */
+#define SLAB_MINALIGN	8
+
+/* Completely free slabs each cache keeps rather than giving back */
+#define SLAB_MAXEMPTY	1
+
+struct slab {
+	struct slab_cache *sl_cache;	/* cache we belong to */
+	struct slab *sl_next;		/* list we're on */
+	struct slab *sl_prev;
+	void *sl_free;			/* first free object */
+	unsigned sl_inuse;		/* objects allocated */
+};
+
+#define SLAB_OF(obj) \
+	((struct slab *)(((vaddr_t)(obj) & PAGE_FRAME) + \
+			 PAGE_SIZE - sizeof(struct slab)))
+#define SLAB_LINK(sc, obj) \
+	(*(void **)((char *)(obj) + (sc)->sc_linkoff))
+
+/* All caches that have been used, for slab_printstats */
+static struct slab_cache *slab_caches;
+static struct spinlock slab_listlock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////////////////////////
+// slab lists
+
+static
+void
+slab_link(struct slab **head, struct slab *sl)
+{
+	sl->sl_prev = NULL;
+	sl->sl_next = *head;
+	if (*head != NULL) {
+		(*head)->sl_prev = sl;
+	}
+	*head = sl;
+}
+
+static
+void
+slab_unlink(struct slab **head, struct slab *sl)
+{
+	if (sl->sl_prev != NULL) {
+		sl->sl_prev->sl_next = sl->sl_next;
+	}
+	else {
+		KASSERT(*head == sl);
+		*head = sl->sl_next;
+	}
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prev = sl->sl_prev;
+	}
+	sl->sl_next = sl->sl_prev = NULL;
+}
+
+////////////////////////////////////////////////////////////
+// setup
+
+/*
+ * Work out the layout for a cache, and add it to the list of caches.
+ * Called with the cache locked on first use.
+ */
+static
+void
+slab_setup(struct slab_cache *sc)
+{
+	size_t align;
+
+	KASSERT(spinlock_do_i_hold(&sc->sc_lock));
+	KASSERT(!sc->sc_ready);
+
+	align = sc->sc_align != 0 ? sc->sc_align : SLAB_MINALIGN;
+	KASSERT((align & (align - 1)) == 0);
+	if (align < sizeof(void *)) {
+		align = sizeof(void *);
+	}
+
+	if (sc->sc_ctor != NULL) {
+		sc->sc_linkoff = ROUNDUP(sc->sc_size, sizeof(void *));
+		sc->sc_bufsize = ROUNDUP(sc->sc_linkoff + sizeof(void *),
+					 align);
+	}
+	else {
+		sc->sc_linkoff = 0;
+		sc->sc_bufsize = ROUNDUP(sc->sc_size > sizeof(void *) ?
+					 sc->sc_size : sizeof(void *), align);
+	}
+	sc->sc_perslab = (PAGE_SIZE - sizeof(struct slab)) / sc->sc_bufsize;
+	if (sc->sc_perslab == 0) {
+		panic("slab: %s: objects of size %zu don't fit in a page\n",
+		      sc->sc_name, sc->sc_size);
+	}
+
+	sc->sc_partial = sc->sc_full = sc->sc_empty = NULL;
+	sc->sc_nslabs = 0;
+	sc->sc_nempty = 0;
+	sc->sc_inuse = 0;
+	sc->sc_ready = true;
+
+	spinlock_acquire(&slab_listlock);
+	sc->sc_next = slab_caches;
+	slab_caches = sc;
+	spinlock_release(&slab_listlock);
+}
+
+struct slab_cache *
+slab_create(const char *name, size_t size, size_t align,
+	    void (*ctor)(void *), void (*dtor)(void *))
+{
+	struct slab_cache *sc;
+
+	sc = kmalloc(sizeof(*sc));
+	if (sc == NULL) {
+		return NULL;
+	}
+	sc->sc_name = name;
+	sc->sc_size = size;
+	sc->sc_align = align;
+	sc->sc_ctor = ctor;
+	sc->sc_dtor = dtor;
+	sc->sc_dynamic = true;
+	spinlock_init(&sc->sc_lock);
+	sc->sc_ready = false;
+	sc->sc_next = NULL;
+	return sc;
+}
+
+////////////////////////////////////////////////////////////
+// slabs
+
+/*
+ * Get a page and make a slab of it, running the constructor on each
+ * object. Called without the cache locked, as both of those may take
+ * a while.
+ */
+static
+struct slab *
+slab_grow(struct slab_cache *sc)
+{
+	struct slab *sl;
+	vaddr_t page;
+	char *obj;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	KASSERT(page % PAGE_SIZE == 0);
+
+	sl = SLAB_OF(page);
+	sl->sl_cache = sc;
+	sl->sl_next = sl->sl_prev = NULL;
+	sl->sl_free = NULL;
+	sl->sl_inuse = 0;
+
+	/* Chain them backwards so they come out in address order */
+	for (i=sc->sc_perslab; i-- > 0; ) {
+		obj = (char *)page + i * sc->sc_bufsize;
+		if (sc->sc_ctor != NULL) {
+			sc->sc_ctor(obj);
+		}
+		SLAB_LINK(sc, obj) = sl->sl_free;
+		sl->sl_free = obj;
+	}
+	return sl;
+}
+
+/*
+ * Give back a slab that's been taken off the lists, running the
+ * destructor on each object. Called without the cache locked.
+ */
+static
+void
+slab_release(struct slab_cache *sc, struct slab *sl)
+{
+	vaddr_t page;
+	unsigned i;
+
+	KASSERT(sl->sl_inuse == 0);
+	page = (vaddr_t)sl & PAGE_FRAME;
+	if (sc->sc_dtor != NULL) {
+		for (i=0; i<sc->sc_perslab; i++) {
+			sc->sc_dtor((char *)page + i * sc->sc_bufsize);
+		}
+	}
+	free_kpages(page);
+}
+
+////////////////////////////////////////////////////////////
+// objects
+
+void *
+slab_alloc(struct slab_cache *sc)
+{
+	struct slab *sl;
+	void *obj;
+
+	spinlock_acquire(&sc->sc_lock);
+	if (!sc->sc_ready) {
+		slab_setup(sc);
+	}
+
+	/* Prefer partly used slabs, to let empty ones go back */
+	sl = sc->sc_partial;
+	if (sl == NULL && sc->sc_empty != NULL) {
+		sl = sc->sc_empty;
+		slab_unlink(&sc->sc_empty, sl);
+		sc->sc_nempty--;
+		slab_link(&sc->sc_partial, sl);
+	}
+	if (sl == NULL) {
+		spinlock_release(&sc->sc_lock);
+		sl = slab_grow(sc);
+		if (sl == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&sc->sc_lock);
+		sc->sc_nslabs++;
+		slab_link(&sc->sc_partial, sl);
+	}
+
+	obj = sl->sl_free;
+	KASSERT(obj != NULL);
+	sl->sl_free = SLAB_LINK(sc, obj);
+	sl->sl_inuse++;
+	if (sl->sl_free == NULL) {
+		KASSERT(sl->sl_inuse == sc->sc_perslab);
+		slab_unlink(&sc->sc_partial, sl);
+		slab_link(&sc->sc_full, sl);
+	}
+	sc->sc_inuse++;
+
+	spinlock_release(&sc->sc_lock);
+	return obj;
+}
+
+void
+slab_free(struct slab_cache *sc, void *obj)
+{
+	struct slab *sl;
+	vaddr_t offset;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	sl = SLAB_OF(obj);
+	offset = (vaddr_t)obj & ~PAGE_FRAME;
+	LOCKPROF_CHECKFREE(obj, sc->sc_size);
+
+	spinlock_acquire(&sc->sc_lock);
+
+	KASSERT(sc->sc_ready);
+	if (sl->sl_cache != sc || offset % sc->sc_bufsize != 0 ||
+	    offset / sc->sc_bufsize >= sc->sc_perslab) {
+		panic("slab_free: %s: invalid object %p\n", sc->sc_name, obj);
+	}
+	KASSERT(sl->sl_inuse > 0);
+
+	if (sl->sl_free == NULL) {
+		/* Was full */
+		slab_unlink(&sc->sc_full, sl);
+		slab_link(&sc->sc_partial, sl);
+	}
+	SLAB_LINK(sc, obj) = sl->sl_free;
+	sl->sl_free = obj;
+	sl->sl_inuse--;
+	sc->sc_inuse--;
+
+	if (sl->sl_inuse == 0) {
+		slab_unlink(&sc->sc_partial, sl);
+		if (sc->sc_nempty >= SLAB_MAXEMPTY) {
+			sc->sc_nslabs--;
+			spinlock_release(&sc->sc_lock);
+			slab_release(sc, sl);
+			return;
+		}
+		slab_link(&sc->sc_empty, sl);
+		sc->sc_nempty++;
+	}
+
+	spinlock_release(&sc->sc_lock);
+}
+
+////////////////////////////////////////////////////////////
+// teardown and stats
+
+void
+slab_destroy(struct slab_cache *sc)
+{
+	struct slab_cache **scp;
+	struct slab *sl;
+
+	KASSERT(sc->sc_dynamic);
+
+	if (sc->sc_ready) {
+		KASSERT(sc->sc_inuse == 0);
+		KASSERT(sc->sc_partial == NULL);
+		KASSERT(sc->sc_full == NULL);
+
+		spinlock_acquire(&slab_listlock);
+		for (scp = &slab_caches; *scp != NULL; scp = &(*scp)->sc_next) {
+			if (*scp == sc) {
+				*scp = sc->sc_next;
+				break;
+			}
+		}
+		spinlock_release(&slab_listlock);
+
+		while ((sl = sc->sc_empty) != NULL) {
+			slab_unlink(&sc->sc_empty, sl);
+			slab_release(sc, sl);
+		}
+	}
+
+	spinlock_cleanup(&sc->sc_lock);
+	kfree(sc);
+}
+
+void
+slab_printstats(void)
+{
+	struct slab_cache *sc;
+	size_t used;
+
+	/* The counts may change as we look; it's only statistics. */
+	spinlock_acquire(&slab_listlock);
+	kprintf("%-16s %6s %6s %8s %6s %6s\n",
+		"cache", "size", "bufsz", "inuse", "slabs", "usage");
+	for (sc = slab_caches; sc != NULL; sc = sc->sc_next) {
+		used = sc->sc_inuse * sc->sc_size;
+		kprintf("%-16s %6zu %6zu %8lu %6u %5u%%\n",
+			sc->sc_name, sc->sc_size, sc->sc_bufsize,
+			sc->sc_inuse, sc->sc_nslabs,
+			sc->sc_nslabs == 0 ? 0 :
+			(unsigned)(used * 100 / (sc->sc_nslabs * PAGE_SIZE)));
+	}
+	spinlock_release(&slab_listlock);
+}
@@ -73,6 +73,9 @@ static bool dofiles, dodirs;
 static bool doindirect;
 static bool recurse;
 
+/* volume block size, from the superblock */
+static uint32_t blocksize;
+
 ////////////////////////////////////////////////////////////
 // printouts
 
@@ -132,16 +135,46 @@ dumplval(const char *desc, const char *lval)
 
 static void dumpinode(uint32_t ino, const char *name);
 
+/*
+ * Read the beginning of block BLOCK, for objects that are smaller
+ * than a block (the superblock and inodes).
+ */
+static
+void
+readpartial(void *data, size_t len, uint32_t block)
+{
+	static uint8_t blockbuf[SFS_MAXBLOCKSIZE];
+
+	assert(len <= blocksize);
+	diskread(blockbuf, block);
+	memcpy(data, blockbuf, len);
+}
+
+/*
+ * Read the superblock and switch to the volume's block size. Until
+ * then the disk is read in sectors, which is enough to get the
+ * superblock.
+ */
 static
 uint32_t
 readsb(void)
 {
 	struct sfs_superblock sb;
 
+	assert(diskblocksize() == sizeof(sb));
 	diskread(&sb, SFS_SUPER_BLOCK);
 	if (SWAP32(sb.sb_magic) != SFS_MAGIC) {
 		errx(1, "Not an sfs filesystem");
 	}
+	blocksize = SWAP32(sb.sb_blocksize);
+	if (blocksize == 0) {
+		blocksize = SFS_MINBLOCKSIZE;
+	}
+	if (blocksize < SFS_MINBLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    (blocksize & (blocksize - 1)) != 0) {
+		errx(1, "Invalid block size %u", blocksize);
+	}
+	disksetblocksize(blocksize);
 	return SWAP32(sb.sb_nblocks);
 }
 
@@ -152,7 +185,7 @@ dumpsb(void)
 	struct sfs_superblock sb;
 	unsigned i;
 
-	diskread(&sb, SFS_SUPER_BLOCK);
+	readpartial(&sb, sizeof(sb), SFS_SUPER_BLOCK);
 	sb.sb_volname[sizeof(sb.sb_volname)-1] = 0;
 
 	printf("Superblock\n");
@@ -160,9 +193,28 @@ dumpsb(void)
 	dumpvalf("Magic", "0x%8x", SWAP32(sb.sb_magic));
 	dumpvalf("Size", "%u blocks", SWAP32(sb.sb_nblocks));
 	dumpvalf("Freemap size", "%u blocks",
-		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks)));
-	dumpvalf("Block size", "%u bytes", SFS_BLOCKSIZE);
+		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks), blocksize));
+	dumpvalf("Block size", "%u bytes", blocksize);
+	dumpvalf("Features", "0x%x%s%s", SWAP32(sb.sb_features),
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_EXTENTS) ?
+		 " (extents)" : "",
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_FREESUM) ?
+		 " (free counts)" : "");
 	dumplval("Volume name", sb.sb_volname);
+	dumpvalf("State", "0x%x%s", SWAP32(sb.sb_state),
+		 (SWAP32(sb.sb_state) & SFS_STATE_ERRORS) ?
+		 " (has errors)" : "");
+
+	if (SWAP32(sb.sb_features) & SFS_FEATURE_FREESUM) {
+		printf("    Free blocks per %u freemap blocks:\n",
+		       SFS_FREESUMGROUP(SWAP32(sb.sb_nblocks), blocksize));
+		for (i=0; i<SFS_NFREESUM; i++) {
+			if (sb.sb_freesum[i] != 0) {
+				printf("    @%-3u %u\n",
+				       i, SWAP32(sb.sb_freesum[i]));
+			}
+		}
+	}
 
 	for (i=0; i<ARRAYCOUNT(sb.reserved); i++) {
 		if (sb.reserved[i] != 0) {
@@ -177,9 +229,10 @@ static
 void
 dumpfreemap(uint32_t fsblocks)
 {
-	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks, blocksize);
+	uint32_t bitsperblock = SFS_BITSPERBLOCK(blocksize);
 	uint32_t i, j, k, bn;
-	uint8_t data[SFS_BLOCKSIZE], mask;
+	uint8_t data[SFS_MAXBLOCKSIZE], mask;
 	char tmp[16];
 
 	printf("Free block bitmap\n");
@@ -189,16 +242,16 @@ dumpfreemap(uint32_t fsblocks)
 		printf("    Freemap block #%u in disk block %u: blocks %u - %u"
 		       " (0x%x - 0x%x)\n",
 		       i, SFS_FREEMAP_START+i,
-		       i*SFS_BITSPERBLOCK, (i+1)*SFS_BITSPERBLOCK - 1,
-		       i*SFS_BITSPERBLOCK, (i+1)*SFS_BITSPERBLOCK - 1);
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		       i*bitsperblock, (i+1)*bitsperblock - 1,
+		       i*bitsperblock, (i+1)*bitsperblock - 1);
+		for (j=0; j<blocksize; j++) {
 			if (j % 8 == 0) {
 				snprintf(tmp, sizeof(tmp), "0x%x",
-					 i*SFS_BITSPERBLOCK + j*8);
+					 i*bitsperblock + j*8);
 				printf("%-7s ", tmp);
 			}
 			for (k=0; k<8; k++) {
-				bn = i*SFS_BITSPERBLOCK + j*8 + k;
+				bn = i*bitsperblock + j*8 + k;
 				mask = 1U << k;
 				if (bn >= fsblocks) {
 					if (data[j] & mask) {
@@ -230,19 +283,20 @@ dumpfreemap(uint32_t fsblocks)
 
 static
 void
-dumpindirect(uint32_t block)
+dumpindirect(uint32_t block, unsigned level)
 {
-	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	static const char *const names[] = { "", "", "Double ", "Triple " };
+	uint32_t ib[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 	char tmp[128];
 	unsigned i;
 
 	if (block == 0) {
 		return;
 	}
-	printf("Indirect block %u\n", block);
+	printf("%sIndirect block %u\n", names[level], block);
 
 	diskread(ib, block);
-	for (i=0; i<ARRAYCOUNT(ib); i++) {
+	for (i=0; i<SFS_DBPERIDB(blocksize); i++) {
 		if (i % 4 == 0) {
 			printf("@%-3u   ", i);
 		}
@@ -253,14 +307,24 @@ dumpindirect(uint32_t block)
 			printf("\n");
 		}
 	}
+	if (level > 1) {
+		for (i=0; i<SFS_DBPERIDB(blocksize); i++) {
+			dumpindirect(SWAP32(ib[i]), level - 1);
+		}
+	}
 }
 
+/*
+ * Walk the file blocks mapped by indirect block BLOCK, which has
+ * LEVEL levels of indirection below it (1 for a single indirect
+ * block). A zero block is treated as a block of zero entries.
+ */
 static
 uint32_t
 traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
-	    void (*doblock)(uint32_t, uint32_t))
+	    unsigned level, void (*doblock)(uint32_t, uint32_t))
 {
-	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	uint32_t ib[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 	unsigned i;
 
 	if (block == 0) {
@@ -269,12 +333,159 @@ traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
 	else {
 		diskread(ib, block);
 	}
-	for (i=0; i<ARRAYCOUNT(ib) && fileblock < numblocks; i++) {
-		doblock(fileblock++, SWAP32(ib[i]));
+	for (i=0; i<SFS_DBPERIDB(blocksize) && fileblock < numblocks; i++) {
+		if (level > 1) {
+			fileblock = traverse_ib(fileblock, numblocks,
+						SWAP32(ib[i]), level - 1,
+						doblock);
+		}
+		else {
+			doblock(fileblock++, SWAP32(ib[i]));
+		}
 	}
 	return fileblock;
 }
 
+/*
+ * Print the extent tree rooted at index block ROOT.
+ */
+static
+void
+dumpextenttree(uint32_t root)
+{
+	uint32_t idxbuf[SFS_MAXBLOCKSIZE / sizeof(uint32_t)];
+	uint32_t leafbuf[SFS_MAXBLOCKSIZE / sizeof(uint32_t)];
+	const struct sfs_extheader *ih = (const void *)idxbuf;
+	const struct sfs_extindex *idx = (const void *)(ih + 1);
+	const struct sfs_extheader *lh = (const void *)leafbuf;
+	const struct sfs_extent *ext = (const void *)(lh + 1);
+	unsigned i, j, ni, nl;
+
+	if (root == 0) {
+		return;
+	}
+	diskread(idxbuf, root);
+	ni = SWAP32(ih->seh_count);
+	printf("Extent index block %u: magic 0x%x, %u leaves\n",
+	       root, SWAP32(ih->seh_magic), ni);
+	if (ni > SFS_EXTIDXPERBLOCK(blocksize)) {
+		ni = SFS_EXTIDXPERBLOCK(blocksize);
+	}
+	for (i=0; i<ni; i++) {
+		diskread(leafbuf, SWAP32(idx[i].sei_block));
+		nl = SWAP32(lh->seh_count);
+		printf("  Leaf %u (key %u): magic 0x%x, %u extents\n",
+		       SWAP32(idx[i].sei_block), SWAP32(idx[i].sei_fileblock),
+		       SWAP32(lh->seh_magic), nl);
+		if (nl > SFS_EXTPERBLOCK(blocksize)) {
+			nl = SFS_EXTPERBLOCK(blocksize);
+		}
+		for (j=0; j<nl; j++) {
+			printf("    @%-5u  file %u -> disk %u, %u blocks\n", j,
+			       SWAP32(ext[j].sfe_fileblock),
+			       SWAP32(ext[j].sfe_diskblock),
+			       SWAP32(ext[j].sfe_len));
+		}
+	}
+}
+
+static
+int
+extentcmp(const void *av, const void *bv)
+{
+	const struct sfs_extent *a = av, *b = bv;
+
+	if (a->sfe_fileblock < b->sfe_fileblock) {
+		return -1;
+	}
+	if (a->sfe_fileblock > b->sfe_fileblock) {
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Walk the blocks of an extent-mapped file: gather up the extents
+ * from the inode and the tree, sort them, and fill in the holes.
+ */
+static
+void
+traverse_extents(const struct sfs_dinode *sfi, uint32_t numblocks,
+		 void (*doblock)(uint32_t, uint32_t))
+{
+	uint32_t idxbuf[SFS_MAXBLOCKSIZE / sizeof(uint32_t)];
+	uint32_t leafbuf[SFS_MAXBLOCKSIZE / sizeof(uint32_t)];
+	const struct sfs_extheader *ih = (const void *)idxbuf;
+	const struct sfs_extindex *idx = (const void *)(ih + 1);
+	const struct sfs_extheader *lh = (const void *)leafbuf;
+	const struct sfs_extent *lext = (const void *)(lh + 1);
+	struct sfs_extent *exts;
+	uint32_t root, fileblock, fb, db, len;
+	unsigned i, j, n, max, ni, nl;
+
+	n = SWAP32(sfi->sfi_nextents);
+	if (n > SFS_NIEXTENTS) {
+		n = SFS_NIEXTENTS;
+	}
+	max = n;
+	root = SWAP32(sfi->sfi_extroot);
+	ni = 0;
+	if (root != 0) {
+		diskread(idxbuf, root);
+		ni = SWAP32(ih->seh_count);
+		if (ni > SFS_EXTIDXPERBLOCK(blocksize)) {
+			ni = SFS_EXTIDXPERBLOCK(blocksize);
+		}
+		max += ni * SFS_EXTPERBLOCK(blocksize);
+	}
+
+	exts = malloc((max > 0 ? max : 1) * sizeof(*exts));
+	if (exts == NULL) {
+		err(1, "malloc");
+	}
+	for (i=0; i<n; i++) {
+		exts[i].sfe_fileblock = SWAP32(sfi->sfi_extents[i].sfe_fileblock);
+		exts[i].sfe_diskblock = SWAP32(sfi->sfi_extents[i].sfe_diskblock);
+		exts[i].sfe_len = SWAP32(sfi->sfi_extents[i].sfe_len);
+	}
+	for (i=0; i<ni; i++) {
+		diskread(leafbuf, SWAP32(idx[i].sei_block));
+		nl = SWAP32(lh->seh_count);
+		if (nl > SFS_EXTPERBLOCK(blocksize)) {
+			nl = SFS_EXTPERBLOCK(blocksize);
+		}
+		for (j=0; j<nl; j++) {
+			exts[n].sfe_fileblock = SWAP32(lext[j].sfe_fileblock);
+			exts[n].sfe_diskblock = SWAP32(lext[j].sfe_diskblock);
+			exts[n].sfe_len = SWAP32(lext[j].sfe_len);
+			n++;
+		}
+	}
+	qsort(exts, n, sizeof(*exts), extentcmp);
+
+	fileblock = 0;
+	for (i=0; i<n && fileblock < numblocks; i++) {
+		fb = exts[i].sfe_fileblock;
+		db = exts[i].sfe_diskblock;
+		len = exts[i].sfe_len;
+		if (fb + len <= fileblock) {
+			/* overlaps what we've done; ignore */
+			continue;
+		}
+		while (fileblock < fb && fileblock < numblocks) {
+			doblock(fileblock++, 0);
+		}
+		while (fileblock < fb + len && fileblock < numblocks) {
+			doblock(fileblock, db + (fileblock - fb));
+			fileblock++;
+		}
+	}
+	while (fileblock < numblocks) {
+		doblock(fileblock++, 0);
+	}
+	free(exts);
+}
+
 static
 void
 traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
@@ -283,7 +494,12 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	uint32_t numblocks;
 	unsigned i;
 
-	numblocks = DIVROUNDUP(SWAP32(sfi->sfi_size), SFS_BLOCKSIZE);
+	numblocks = DIVROUNDUP(SWAP32(sfi->sfi_size), blocksize);
+
+	if (SWAP32(sfi->sfi_flags) & SFS_IFLAG_EXTENTS) {
+		traverse_extents(sfi, numblocks, doblock);
+		return;
+	}
 
 	fileblock = 0;
 	for (i=0; i<SFS_NDIRECT && fileblock < numblocks; i++) {
@@ -291,7 +507,15 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	}
 	if (fileblock < numblocks) {
 		fileblock = traverse_ib(fileblock, numblocks,
-					SWAP32(sfi->sfi_indirect), doblock);
+					SWAP32(sfi->sfi_indirect), 1, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_dindirect), 2, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_tindirect), 3, doblock);
 	}
 	assert(fileblock == numblocks);
 }
@@ -300,8 +524,8 @@ static
 void
 dumpdirblock(uint32_t fileblock, uint32_t diskblock)
 {
-	struct sfs_direntry sds[SFS_BLOCKSIZE/sizeof(struct sfs_direntry)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	struct sfs_direntry sds[SFS_MAXBLOCKSIZE/sizeof(struct sfs_direntry)];
+	int nsds = blocksize/sizeof(struct sfs_direntry);
 	int i;
 
 	(void)fileblock;
@@ -342,8 +566,8 @@ static
 void
 recursedirblock(uint32_t fileblock, uint32_t diskblock)
 {
-	struct sfs_direntry sds[SFS_BLOCKSIZE/sizeof(struct sfs_direntry)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	struct sfs_direntry sds[SFS_MAXBLOCKSIZE/sizeof(struct sfs_direntry)];
+	int nsds = blocksize/sizeof(struct sfs_direntry);
 	int i;
 
 	(void)fileblock;
@@ -377,20 +601,20 @@ recursedir(uint32_t ino, const struct sfs_dinode *sfi)
 static
 void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
 {
-	uint8_t data[SFS_BLOCKSIZE];
+	uint8_t data[SFS_MAXBLOCKSIZE];
 	unsigned i, j;
 	char tmp[128];
 
 	if (diskblock == 0) {
-		printf("    0x%6x  [sparse]\n", fileblock * SFS_BLOCKSIZE);
+		printf("    0x%6x  [sparse]\n", fileblock * blocksize);
 		return;
 	}
 
 	diskread(data, diskblock);
-	for (i=0; i<SFS_BLOCKSIZE; i++) {
+	for (i=0; i<blocksize; i++) {
 		if (i % 16 == 0) {
 			snprintf(tmp, sizeof(tmp), "0x%x",
-				 fileblock * SFS_BLOCKSIZE + i);
+				 fileblock * blocksize + i);
 			printf("%8s", tmp);
 		}
 		if (i % 8 == 0) {
@@ -432,7 +656,7 @@ dumpinode(uint32_t ino, const char *name)
 	char tmp[128];
 	unsigned i;
 
-	diskread(&sfi, ino);
+	readpartial(&sfi, sizeof(sfi), ino);
 
 	printf("Inode %u", ino);
 	if (name != NULL) {
@@ -476,6 +700,23 @@ dumpinode(uint32_t ino, const char *name)
 	}
 	printf("    Indirect block: %u (0x%x)\n",
 	       SWAP32(sfi.sfi_indirect), SWAP32(sfi.sfi_indirect));
+	printf("    Double indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_dindirect), SWAP32(sfi.sfi_dindirect));
+	printf("    Triple indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_tindirect), SWAP32(sfi.sfi_tindirect));
+	printf("    Flags: 0x%x%s\n", SWAP32(sfi.sfi_flags),
+	       (SWAP32(sfi.sfi_flags) & SFS_IFLAG_EXTENTS) ?
+	       " (extent-mapped)" : "");
+	if (SWAP32(sfi.sfi_flags) & SFS_IFLAG_EXTENTS) {
+		printf("    Extents: %u in inode, tree root %u\n",
+		       SWAP32(sfi.sfi_nextents), SWAP32(sfi.sfi_extroot));
+		for (i=0; i<SWAP32(sfi.sfi_nextents) && i<SFS_NIEXTENTS; i++) {
+			printf("    @%-2u    file %u -> disk %u, %u blocks\n",
+			       i, SWAP32(sfi.sfi_extents[i].sfe_fileblock),
+			       SWAP32(sfi.sfi_extents[i].sfe_diskblock),
+			       SWAP32(sfi.sfi_extents[i].sfe_len));
+		}
+	}
 	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
 		if (sfi.sfi_waste[i] != 0) {
 			printf("    Word %u in waste area: 0x%x\n",
@@ -484,7 +725,10 @@ dumpinode(uint32_t ino, const char *name)
 	}
 
 	if (doindirect) {
-		dumpindirect(SWAP32(sfi.sfi_indirect));
+		dumpindirect(SWAP32(sfi.sfi_indirect), 1);
+		dumpindirect(SWAP32(sfi.sfi_dindirect), 2);
+		dumpindirect(SWAP32(sfi.sfi_tindirect), 3);
+		dumpextenttree(SWAP32(sfi.sfi_extroot));
 	}
 
 	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR && dodirs) {
@@ -41,14 +41,15 @@
 #include "disk.h"
 
 #define HOSTSTRING "System/161 Disk Image"
-#define BLOCKSIZE  512
+#define SECTORSIZE 512
 
 #ifndef EINTR
 #define EINTR 0
 #endif
 
 static int fd=-1;
-static uint32_t nblocks;
+static uint32_t nsectors;
+static uint32_t blocksize = SECTORSIZE;
 
 /*
  * Open a disk. If we're built for the host OS, check that it's a
@@ -68,10 +69,11 @@ opendisk(const char *path)
 		err(1, "%s: fstat", path);
 	}
 
-	nblocks = statbuf.st_size / BLOCKSIZE;
+	nsectors = statbuf.st_size / SECTORSIZE;
+	blocksize = SECTORSIZE;
 
 #ifdef HOST
-	nblocks--;
+	nsectors--;
 
 	{
 		char buf[64];
@@ -95,23 +97,45 @@ opendisk(const char *path)
 }
 
 /*
- * Return the block size. (This is fixed, but still...)
+ * Return the sector size. (This is fixed, but still...)
+ */
+uint32_t
+disksectorsize(void)
+{
+	assert(fd>=0);
+	return SECTORSIZE;
+}
+
+/*
+ * Set the size of the blocks diskread and diskwrite transfer. This
+ * starts out as the sector size; it must be a multiple of it.
+ */
+void
+disksetblocksize(uint32_t size)
+{
+	assert(fd>=0);
+	assert(size >= SECTORSIZE && size % SECTORSIZE == 0);
+	blocksize = size;
+}
+
+/*
+ * Return the current block size.
  */
 uint32_t
 diskblocksize(void)
 {
 	assert(fd>=0);
-	return BLOCKSIZE;
+	return blocksize;
 }
 
 /*
- * Return the device/image size in blocks.
+ * Return the device/image size in (current-size) blocks.
  */
 uint32_t
 diskblocks(void)
 {
 	assert(fd>=0);
-	return nblocks;
+	return nsectors / (blocksize / SECTORSIZE);
 }
 
 /*
@@ -122,21 +146,24 @@ diskwrite(const void *data, uint32_t block)
 {
 	const char *cdata = data;
 	uint32_t tot=0;
+	off_t offset;
 	int len;
 
 	assert(fd>=0);
 
+	offset = (off_t)block * blocksize;
+
 #ifdef HOST
 	// skip over disk file header
-	block++;
+	offset += SECTORSIZE;
 #endif
 
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
+	if (lseek(fd, offset, SEEK_SET)<0) {
 		err(1, "lseek");
 	}
 
-	while (tot < BLOCKSIZE) {
-		len = write(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < blocksize) {
+		len = write(fd, cdata + tot, blocksize - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -158,21 +185,24 @@ diskread(void *data, uint32_t block)
 {
 	char *cdata = data;
 	uint32_t tot=0;
+	off_t offset;
 	int len;
 
 	assert(fd>=0);
 
+	offset = (off_t)block * blocksize;
+
 #ifdef HOST
 	// skip over disk file header
-	block++;
+	offset += SECTORSIZE;
 #endif
 
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
+	if (lseek(fd, offset, SEEK_SET)<0) {
 		err(1, "lseek");
 	}
 
-	while (tot < BLOCKSIZE) {
-		len = read(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < blocksize) {
+		len = read(fd, cdata + tot, blocksize - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -180,7 +210,7 @@ diskread(void *data, uint32_t block)
 			err(1, "read");
 		}
 		if (len==0) {
-			err(1, "unexpected EOF in mid-sector");
+			err(1, "unexpected EOF in mid-block");
 		}
 		tot += len;
 	}
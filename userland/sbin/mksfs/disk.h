@@ -29,6 +29,8 @@
 
 void opendisk(const char *path);
 
+uint32_t disksectorsize(void);
+void disksetblocksize(uint32_t size);
 uint32_t diskblocksize(void);
 uint32_t diskblocks(void);
 
@@ -29,6 +29,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
@@ -57,11 +58,20 @@
 
 #include "disk.h"
 
-/* Maximum size of freemap we support */
-#define MAXFREEMAPBLOCKS 32
+/* Maximum size of freemap we support (in bytes) */
+#define MAXFREEMAPBYTES (32 * SFS_MAXBLOCKSIZE)
+
+/* Block size of the volume we're making */
+static uint32_t blocksize = SFS_MINBLOCKSIZE;
+
+/* Feature flags for the volume we're making */
+static uint32_t features;
 
 /* Free block bitmap */
-static char freemapbuf[MAXFREEMAPBLOCKS * SFS_BLOCKSIZE];
+static char freemapbuf[MAXFREEMAPBYTES];
+
+/* Buffer for writing out objects smaller than a block */
+static char blockbuf[SFS_MAXBLOCKSIZE];
 
 /*
  * Assert that the on-disk data structures are correctly sized.
@@ -70,9 +80,23 @@ static
 void
 check(void)
 {
-	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
-	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
-	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_superblock)==SFS_MINBLOCKSIZE);
+	assert(sizeof(struct sfs_dinode)==SFS_MINBLOCKSIZE);
+	assert(SFS_MINBLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+}
+
+/*
+ * Write an object that is smaller than a block (the superblock or
+ * an inode) to the beginning of block BLOCK, zeroing the rest.
+ */
+static
+void
+writepartial(const void *data, size_t len, uint32_t block)
+{
+	assert(len <= blocksize);
+	bzero(blockbuf, blocksize);
+	memcpy(blockbuf, data, len);
+	diskwrite(blockbuf, block);
 }
 
 /*
@@ -96,13 +120,13 @@ static
 void
 initfreemap(uint32_t fsblocks)
 {
-	uint32_t freemapbits = SFS_FREEMAPBITS(fsblocks);
-	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	uint32_t freemapbits = SFS_FREEMAPBITS(fsblocks, blocksize);
+	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks, blocksize);
 	uint32_t i;
 
-	if (freemapblocks > MAXFREEMAPBLOCKS) {
-		errx(1, "Filesystem too large -- "
-		     "increase MAXFREEMAPBLOCKS and recompile");
+	if (freemapblocks * blocksize > MAXFREEMAPBYTES) {
+		errx(1, "Filesystem too large -- use a larger block size "
+		     "or increase MAXFREEMAPBYTES and recompile");
 	}
 
 	/* mark the superblock and root inode in use */
@@ -120,6 +144,19 @@ initfreemap(uint32_t fsblocks)
 	}
 }
 
+/*
+ * Check if a block is marked allocated.
+ */
+static
+int
+blockinuse(uint32_t block)
+{
+	uint32_t mapbyte = block/CHAR_BIT;
+	unsigned char mask = (1<<(block % CHAR_BIT));
+
+	return (freemapbuf[mapbyte] & mask) != 0;
+}
+
 /*
  * Initialize and write out the superblock.
  */
@@ -128,6 +165,7 @@ void
 writesuper(const char *volname, uint32_t nblocks)
 {
 	struct sfs_superblock sb;
+	uint32_t groupbits, freecount, i;
 
 	/* The cast is required on some outdated host systems. */
 	bzero((void *)&sb, sizeof(sb));
@@ -140,9 +178,21 @@ writesuper(const char *volname, uint32_t nblocks)
 	sb.sb_magic = SWAP32(SFS_MAGIC);
 	sb.sb_nblocks = SWAP32(nblocks);
 	strcpy(sb.sb_volname, volname);
+	sb.sb_blocksize = SWAP32(blocksize);
+	sb.sb_features = SWAP32(features | SFS_FEATURE_FREESUM);
+
+	/* Count the free blocks covered by each group of freemap blocks */
+	groupbits = SFS_FREESUMGROUP(nblocks, blocksize) *
+		SFS_BITSPERBLOCK(blocksize);
+	for (i=0; i<nblocks; i++) {
+		if (!blockinuse(i)) {
+			freecount = SWAP32(sb.sb_freesum[i / groupbits]);
+			sb.sb_freesum[i / groupbits] = SWAP32(freecount + 1);
+		}
+	}
 
 	/* and write it out. */
-	diskwrite(&sb, SFS_SUPER_BLOCK);
+	writepartial(&sb, sizeof(sb), SFS_SUPER_BLOCK);
 }
 
 /*
@@ -157,9 +207,9 @@ writefreemap(uint32_t fsblocks)
 	uint32_t i;
 
 	/* Write out each of the blocks in the free block bitmap. */
-	freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	freemapblocks = SFS_FREEMAPBLOCKS(fsblocks, blocksize);
 	for (i=0; i<freemapblocks; i++) {
-		ptr = freemapbuf + i*SFS_BLOCKSIZE;
+		ptr = freemapbuf + i*blocksize;
 		diskwrite(ptr, SFS_FREEMAP_START+i);
 	}
 }
@@ -180,7 +230,18 @@ writerootdir(void)
 	sfi.sfi_linkcount = SWAP16(1);
 
 	/* Write it out */
-	diskwrite(&sfi, SFS_ROOTDIR_INO);
+	writepartial(&sfi, sizeof(sfi), SFS_ROOTDIR_INO);
+}
+
+/*
+ * Print usage and exit.
+ */
+static
+void
+usage(void)
+{
+	errx(1, "Usage: mksfs [-b blocksize] [-e] device/diskfile "
+	     "volume-name");
 }
 
 /*
@@ -189,19 +250,41 @@ writerootdir(void)
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, sectorsize;
 	char *volname, *s;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	while (argc > 1 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-b") && argc > 2) {
+			blocksize = atoi(argv[2]);
+			argc -= 2;
+			argv += 2;
+		}
+		else if (!strcmp(argv[1], "-e")) {
+			features |= SFS_FEATURE_EXTENTS;
+			argc--;
+			argv++;
+		}
+		else {
+			usage();
+		}
+	}
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		usage();
 	}
 
 	check();
 
+	if (blocksize < SFS_MINBLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    (blocksize & (blocksize - 1)) != 0) {
+		errx(1, "Invalid block size %u (must be a power of 2 "
+		     "from %u to %u)", blocksize,
+		     SFS_MINBLOCKSIZE, SFS_MAXBLOCKSIZE);
+	}
+
 	volname = argv[2];
 
 	/* Remove one trailing colon from volname, if present */
@@ -220,12 +303,13 @@ main(int argc, char **argv)
 	}
 
 	opendisk(argv[1]);
-	blocksize = diskblocksize();
+	sectorsize = disksectorsize();
 
-	if (blocksize!=SFS_BLOCKSIZE) {
-		errx(1, "Device has wrong blocksize %u (should be %u)\n",
-		     blocksize, SFS_BLOCKSIZE);
+	if (blocksize % sectorsize != 0) {
+		errx(1, "Block size %u is not a multiple of the device "
+		     "sector size %u\n", blocksize, sectorsize);
 	}
+	disksetblocksize(blocksize);
 	size = diskblocks();
 
 	/* Write out the on-disk structures */
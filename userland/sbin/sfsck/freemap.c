@@ -56,11 +56,12 @@ void
 freemap_setup(void)
 {
 	size_t i, mapbytes;
-	uint32_t fsblocks, mapblocks;
+	uint32_t fsblocks, mapblocks, blocksize;
 
 	fsblocks = sb_totalblocks();
 	mapblocks = sb_freemapblocks();
-	mapbytes = mapblocks * SFS_BLOCKSIZE;
+	blocksize = sb_blocksize();
+	mapbytes = mapblocks * blocksize;
 
 	freemapdata = domalloc(mapbytes * sizeof(uint8_t));
 	tofreedata = domalloc(mapbytes * sizeof(uint8_t));
@@ -69,7 +70,7 @@ freemap_setup(void)
 	}
 
 	/* Mark off what's in the freemap but past the volume end. */
-	for (i=fsblocks; i < mapblocks*SFS_BITSPERBLOCK; i++) {
+	for (i=fsblocks; i < mapblocks*SFS_BITSPERBLOCK(blocksize); i++) {
 		freemap_blockinuse(i, B_PASTEND, 0);
 	}
 
@@ -207,7 +208,7 @@ reportfreemap(uint32_t mapblock, uint32_t byte, uint8_t val, const char *what)
 
 	for (x=1, y=0; x; x<<=1, y++) {
 		if (val & x) {
-			blocknum = mapblock*SFS_BITSPERBLOCK +
+			blocknum = mapblock*SFS_BITSPERBLOCK(sb_blocksize()) +
 				byte*CHAR_BIT + y;
 			warnx("Block %lu erroneously shown %s in freemap",
 			      (unsigned long) blocknum, what);
@@ -224,20 +225,26 @@ reportfreemap(uint32_t mapblock, uint32_t byte, uint8_t val, const char *what)
 void
 freemap_check(void)
 {
-	uint8_t actual[SFS_BLOCKSIZE], *expected, *tofree, tmp;
+	uint8_t actual[SFS_MAXBLOCKSIZE], *expected, *tofree, tmp;
 	uint32_t alloccount=0, freecount=0, i, j;
+	uint32_t freesum[SFS_NFREESUM], groupsize;
 	int bchanged;
-	uint32_t bitblocks;
+	uint32_t bitblocks, blocksize;
 
 	bitblocks = sb_freemapblocks();
+	blocksize = sb_blocksize();
+	groupsize = SFS_FREESUMGROUP(sb_totalblocks(), blocksize);
+	for (i=0; i<SFS_NFREESUM; i++) {
+		freesum[i] = 0;
+	}
 
 	for (i=0; i<bitblocks; i++) {
 		sfs_readfreemapblock(i, actual);
-		expected = freemapdata + i*SFS_BLOCKSIZE;
-		tofree = tofreedata + i*SFS_BLOCKSIZE;
+		expected = freemapdata + i*blocksize;
+		tofree = tofreedata + i*blocksize;
 		bchanged = 0;
 
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		for (j=0; j<blocksize; j++) {
 			/* we shouldn't have blocks marked both ways */
 			assert((expected[j] & tofree[j])==0);
 
@@ -285,7 +292,13 @@ freemap_check(void)
 		if (bchanged) {
 			sfs_writefreemapblock(i, actual);
 		}
+
+		/* count what's free, for the superblock's free counts */
+		for (j=0; j<blocksize; j++) {
+			freesum[i / groupsize] += CHAR_BIT - countbits(actual[j]);
+		}
 	}
+	sb_checkfreesum(freesum);
 
 	if (alloccount > 0) {
 		warnx("%lu blocks erroneously shown free in freemap (fixed)",
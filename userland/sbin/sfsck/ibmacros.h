@@ -30,6 +30,8 @@
 #ifndef IBMACROS_H
 #define IBMACROS_H
 
+#include "sb.h"
+
 /*
  * Indirect block access macros
  *
@@ -141,19 +143,23 @@
 #define SET1_x(sfi, field, i)	(*((void)(i), &(sfi)->field))
 #define SETN_x(sfi, field, i)	((sfi)->field[(i)])
 
-/* region sizes */
+/* entries per indirect block (depends on the volume's block size) */
+
+#define DBPERIDB	((uint32_t)SFS_DBPERIDB(sb_blocksize()))
+
+/* region sizes (64-bit: a triple indirect block can map 2^33 blocks) */
 
-#define RANGE_D		1
-#define RANGE_I		(RANGE_D * SFS_DBPERIDB)
-#define RANGE_II	(RANGE_I * SFS_DBPERIDB)
-#define RANGE_III	(RANGE_II * SFS_DBPERIDB)
+#define RANGE_D		((uint64_t)1)
+#define RANGE_I		(RANGE_D * DBPERIDB)
+#define RANGE_II	(RANGE_I * DBPERIDB)
+#define RANGE_III	(RANGE_II * DBPERIDB)
 
 /* max blocks */
 
 #define INOMAX_D 	NUM_D
-#define INOMAX_I 	(INOMAX_D + SFS_DBPERIDB * NUM_I)
-#define INOMAX_II	(INOMAX_I + SFS_DBPERIDB * NUM_II)
-#define INOMAX_III	(INOMAX_II + SFS_DBPERIDB * NUM_III)
+#define INOMAX_I 	(INOMAX_D + RANGE_I * NUM_I)
+#define INOMAX_II	(INOMAX_I + RANGE_II * NUM_II)
+#define INOMAX_III	(INOMAX_II + RANGE_III * NUM_III)
 
 
 #endif /* IBMACROS_H */
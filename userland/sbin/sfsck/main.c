@@ -91,6 +91,10 @@ main(int argc, char **argv)
 	printf("Phase 3 -- check reference counts\n");
 	inode_adjust_filelinks();
 
+	if (badness != EXIT_UNRECOV) {
+		sb_clearerrors();
+	}
+
 	closedisk();
 
 	warnx("%lu blocks used (of %lu); %lu directories; %lu files",
@@ -54,7 +54,7 @@ static unsigned long count_dirs=0, count_files=0;
  */
 struct ibstate {
 	uint32_t ino;		/* inode we're doing (constant) */
-	uint32_t curfileblock;	/* current block offset in the file */
+	uint64_t curfileblock;	/* current block offset in the file */
 	uint32_t fileblocks;	/* file size in blocks (constant) */
 	uint32_t volblocks;	/* volume size in blocks (constant) */
 	unsigned pasteofcount;	/* number of blocks found past eof */
@@ -81,9 +81,9 @@ void
 check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 		     int indirection)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 	uint32_t i, ct;
-	uint32_t coveredblocks;
+	uint64_t coveredblocks;
 	int localchanged = 0;
 	int j;
 
@@ -105,14 +105,14 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 		}
 		coveredblocks = 1;
 		for (j=0; j<indirection; j++) {
-			coveredblocks *= SFS_DBPERIDB;
+			coveredblocks *= DBPERIDB;
 		}
 		ibs->curfileblock += coveredblocks;
 		return;
 	}
 
 	if (indirection > 1) {
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<DBPERIDB; i++) {
 			check_indirect_block(ibs, &entries[i], &localchanged,
 					     indirection-1);
 		}
@@ -120,7 +120,7 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 	else {
 		assert(indirection==1);
 
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<DBPERIDB; i++) {
 			if (entries[i] >= ibs->volblocks) {
 				setbadness(EXIT_RECOV);
 				warnx("Inode %lu: direct block pointer for "
@@ -151,7 +151,7 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 	}
 
 	ct=0;
-	for (i=ct=0; i<SFS_DBPERIDB; i++) {
+	for (i=ct=0; i<DBPERIDB; i++) {
 		if (entries[i]!=0) ct++;
 	}
 	if (ct==0) {
@@ -172,6 +172,225 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 	}
 }
 
+/*
+ * Check one extent: clear it if it points outside the volume, and cut
+ * off any part of it past EOF; record the rest of its blocks as in
+ * use. Returns nonzero if *EXT was changed. An extent left with zero
+ * length should be dropped by the caller.
+ */
+static
+int
+check_extent(struct ibstate *ibs, struct sfs_extent *ext)
+{
+	uint32_t keep, i;
+
+	if (ext->sfe_len == 0) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: empty extent for block %lu (dropped)",
+		      (unsigned long)ibs->ino,
+		      (unsigned long)ext->sfe_fileblock);
+		return 1;
+	}
+	if (ext->sfe_diskblock == 0 || ext->sfe_diskblock >= ibs->volblocks ||
+	    ext->sfe_len > ibs->volblocks - ext->sfe_diskblock) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: extent for block %lu outside of volume: "
+		      "%lu+%lu (cleared)",
+		      (unsigned long)ibs->ino,
+		      (unsigned long)ext->sfe_fileblock,
+		      (unsigned long)ext->sfe_diskblock,
+		      (unsigned long)ext->sfe_len);
+		ext->sfe_len = 0;
+		return 1;
+	}
+
+	keep = 0;
+	if (ext->sfe_fileblock < ibs->fileblocks) {
+		keep = ibs->fileblocks - ext->sfe_fileblock;
+		if (keep > ext->sfe_len) {
+			keep = ext->sfe_len;
+		}
+	}
+	for (i=0; i<keep; i++) {
+		freemap_blockinuse(ext->sfe_diskblock + i, ibs->usagetype,
+				   ibs->ino);
+	}
+	if (keep == ext->sfe_len) {
+		return 0;
+	}
+
+	setbadness(EXIT_RECOV);
+	for (i=keep; i<ext->sfe_len; i++) {
+		freemap_blockfree(ext->sfe_diskblock + i);
+	}
+	ibs->pasteofcount += ext->sfe_len - keep;
+	ext->sfe_len = keep;
+	return 1;
+}
+
+/*
+ * Check the extent tree rooted at *ROOTP: the index block, each leaf
+ * it names, and each extent in the leaves. Bad leaves are dropped
+ * along with their extents; if nothing is left, the whole tree is
+ * dropped and *ROOTP cleared. Sets *CHANGEDP if *ROOTP changes.
+ *
+ * XXX: like the rest of sfsck, this does not detect two extents
+ * mapping the same file block.
+ */
+static
+void
+check_extent_tree(struct ibstate *ibs, uint32_t *rootp, int *changedp)
+{
+	uint32_t idxbuf[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
+	uint32_t leafbuf[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
+	struct sfs_extheader *ih = (void *)idxbuf;
+	struct sfs_extindex *idx = (void *)(ih + 1);
+	struct sfs_extheader *lh = (void *)leafbuf;
+	struct sfs_extent *ext = (void *)(lh + 1);
+	uint32_t maxidx = SFS_EXTIDXPERBLOCK(sb_blocksize());
+	uint32_t maxext = SFS_EXTPERBLOCK(sb_blocksize());
+	uint32_t i, j, n, m;
+	int idxchanged = 0, leafchanged;
+
+	if (*rootp == 0) {
+		return;
+	}
+	if (*rootp >= ibs->volblocks) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: extent tree root outside of volume: %lu "
+		      "(cleared)", (unsigned long)ibs->ino,
+		      (unsigned long)*rootp);
+		*rootp = 0;
+		*changedp = 1;
+		return;
+	}
+
+	sfs_readextblock(*rootp, idxbuf);
+	if (ih->seh_magic != SFS_EXTMAGIC_INDEX ||
+	    ih->seh_count == 0 || ih->seh_count > maxidx) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: invalid extent tree root %lu (cleared)",
+		      (unsigned long)ibs->ino, (unsigned long)*rootp);
+		*rootp = 0;
+		*changedp = 1;
+		return;
+	}
+	freemap_blockinuse(*rootp, B_IBLOCK, ibs->ino);
+
+	for (i=n=0; i<ih->seh_count; i++) {
+		if (idx[i].sei_block == 0 || idx[i].sei_block >= ibs->volblocks) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: extent leaf outside of volume: %lu "
+			      "(dropped)", (unsigned long)ibs->ino,
+			      (unsigned long)idx[i].sei_block);
+			idxchanged = 1;
+			continue;
+		}
+		sfs_readextblock(idx[i].sei_block, leafbuf);
+		if (lh->seh_magic != SFS_EXTMAGIC_LEAF ||
+		    lh->seh_count == 0 || lh->seh_count > maxext) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: invalid extent leaf %lu (dropped)",
+			      (unsigned long)ibs->ino,
+			      (unsigned long)idx[i].sei_block);
+			idxchanged = 1;
+			continue;
+		}
+
+		leafchanged = 0;
+		for (j=m=0; j<lh->seh_count; j++) {
+			if (check_extent(ibs, &ext[j])) {
+				leafchanged = 1;
+			}
+			if (ext[j].sfe_len > 0) {
+				ext[m++] = ext[j];
+			}
+		}
+		for (j=m; j<lh->seh_count; j++) {
+			memset(&ext[j], 0, sizeof(ext[j]));
+		}
+		lh->seh_count = m;
+
+		if (m == 0) {
+			/* nothing left in this leaf */
+			freemap_blockfree(idx[i].sei_block);
+			idxchanged = 1;
+			continue;
+		}
+		freemap_blockinuse(idx[i].sei_block, B_IBLOCK, ibs->ino);
+		if (leafchanged) {
+			sfs_writeextblock(idx[i].sei_block, leafbuf);
+		}
+		if (idx[i].sei_fileblock != ext[0].sfe_fileblock) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: wrong key for extent leaf %lu "
+			      "(fixed)", (unsigned long)ibs->ino,
+			      (unsigned long)idx[i].sei_block);
+			idx[i].sei_fileblock = ext[0].sfe_fileblock;
+			idxchanged = 1;
+		}
+		idx[n++] = idx[i];
+	}
+	for (i=n; i<ih->seh_count; i++) {
+		memset(&idx[i], 0, sizeof(idx[i]));
+	}
+	ih->seh_count = n;
+
+	if (n == 0) {
+		freemap_blockfree(*rootp);
+		*rootp = 0;
+		*changedp = 1;
+	}
+	else if (idxchanged) {
+		sfs_writeextblock(*rootp, idxbuf);
+	}
+}
+
+/*
+ * Check the extents of an extent-mapped inode, in the inode and in
+ * the extent tree. Returns nonzero if SFI was changed.
+ */
+static
+int
+check_inode_extents(struct ibstate *ibs, struct sfs_dinode *sfi)
+{
+	int changed = 0;
+	uint32_t i, n;
+
+	if (sfi->sfi_nextents > SFS_NIEXTENTS) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: extent count %lu too large (fixed)",
+		      (unsigned long)ibs->ino,
+		      (unsigned long)sfi->sfi_nextents);
+		sfi->sfi_nextents = SFS_NIEXTENTS;
+		changed = 1;
+	}
+	if (checkzeroed(&sfi->sfi_extents[sfi->sfi_nextents],
+			(SFS_NIEXTENTS - sfi->sfi_nextents) *
+			sizeof(sfi->sfi_extents[0]))) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: unused extent slots not zeroed (fixed)",
+		      (unsigned long)ibs->ino);
+		changed = 1;
+	}
+
+	for (i=n=0; i<sfi->sfi_nextents; i++) {
+		if (check_extent(ibs, &sfi->sfi_extents[i])) {
+			changed = 1;
+		}
+		if (sfi->sfi_extents[i].sfe_len > 0) {
+			sfi->sfi_extents[n++] = sfi->sfi_extents[i];
+		}
+	}
+	for (i=n; i<SFS_NIEXTENTS; i++) {
+		memset(&sfi->sfi_extents[i], 0, sizeof(sfi->sfi_extents[i]));
+	}
+	sfi->sfi_nextents = n;
+
+	check_extent_tree(ibs, &sfi->sfi_extroot, &changed);
+	return changed;
+}
+
 /*
  * Check the blocks belonging to inode INO, whose inode has already
  * been loaded into SFI. ISDIR is a shortcut telling us if the inode
@@ -189,17 +408,22 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	int changed;
 	int i;
 
-	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
+	size = SFS_ROUNDUP(sfi->sfi_size, sb_blocksize());
 
 	ibs.ino = ino;
 	/*ibs.curfileblock = 0;*/
-	ibs.fileblocks = size/SFS_BLOCKSIZE;
+	ibs.fileblocks = size/sb_blocksize();
 	ibs.volblocks = sb_totalblocks();
 	ibs.pasteofcount = 0;
 	ibs.usagetype = isdir ? B_DIRDATA : B_DATA;
 
 	changed = 0;
 
+	if (sfi->sfi_flags & SFS_IFLAG_EXTENTS) {
+		changed = check_inode_extents(&ibs, sfi);
+		goto done;
+	}
+
 	for (ibs.curfileblock=0; ibs.curfileblock<NUM_D; ibs.curfileblock++) {
 		datablock = GET_D(sfi, ibs.curfileblock);
 		if (datablock >= ibs.volblocks) {
@@ -238,6 +462,7 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 		check_indirect_block(&ibs, &SET_III(sfi, i), &changed, 3);
 	}
 
+ done:
 	if (ibs.pasteofcount > 0) {
 		warnx("Inode %lu: %u blocks after EOF (freed)",
 		     (unsigned long) ibs.ino, ibs.pasteofcount);
@@ -277,6 +502,38 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 		changed = 1;
 	}
 
+	if (sfi->sfi_flags & ~SFS_IFLAG_EXTENTS) {
+		warnx("Inode %lu: unknown flags 0x%lx (cleared)",
+		      (unsigned long) ino,
+		      (unsigned long) (sfi->sfi_flags & ~SFS_IFLAG_EXTENTS));
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= SFS_IFLAG_EXTENTS;
+		changed = 1;
+	}
+
+	if (sfi->sfi_flags & SFS_IFLAG_EXTENTS) {
+		/* The block pointer fields are unused */
+		if (checkzeroed(sfi->sfi_direct, sizeof(sfi->sfi_direct)) |
+		    checkzeroed(&sfi->sfi_indirect,
+				3 * sizeof(sfi->sfi_indirect))) {
+			warnx("Inode %lu: block pointers in extent-mapped "
+			      "inode not zeroed (fixed)", (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			changed = 1;
+		}
+	}
+	else {
+		/* The extent fields are unused */
+		if (checkzeroed(&sfi->sfi_nextents,
+				2 * sizeof(sfi->sfi_nextents)) |
+		    checkzeroed(sfi->sfi_extents, sizeof(sfi->sfi_extents))) {
+			warnx("Inode %lu: extent fields in block-mapped "
+			      "inode not zeroed (fixed)", (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			changed = 1;
+		}
+	}
+
 	if (check_inode_blocks(ino, sfi, isdir)) {
 		changed = 1;
 	}
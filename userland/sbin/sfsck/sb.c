@@ -36,6 +36,7 @@
 #include "compat.h"
 #include <kern/sfs.h>
 
+#include "disk.h"
 #include "utils.h"
 #include "sfs.h"
 #include "sb.h"
@@ -43,9 +44,12 @@
 #include "main.h"
 
 static struct sfs_superblock sb;
+static uint32_t blocksize;
 
 /*
- * Load the superblock.
+ * Load the superblock, and switch the disk over to the volume's
+ * block size. (Until then it is read in sectors, which is enough to
+ * get the superblock.)
  */
 void
 sb_load(void)
@@ -55,8 +59,23 @@ sb_load(void)
 		errx(EXIT_FATAL, "Not an sfs filesystem");
 	}
 
+	/* Volumes from before the block size was recorded use 512 */
+	blocksize = sb.sb_blocksize == 0 ? SFS_MINBLOCKSIZE : sb.sb_blocksize;
+	if (blocksize < SFS_MINBLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    (blocksize & (blocksize - 1)) != 0 ||
+	    blocksize % disksectorsize() != 0) {
+		errx(EXIT_FATAL, "Invalid block size %lu",
+		     (unsigned long) blocksize);
+	}
+	disksetblocksize(blocksize);
+
+	if (sb.sb_features & ~SFS_FEATURE_ALL) {
+		errx(EXIT_FATAL, "Unknown features 0x%lx",
+		     (unsigned long) (sb.sb_features & ~SFS_FEATURE_ALL));
+	}
+
 	assert(sb.sb_nblocks > 0);
-	assert(SFS_FREEMAPBLOCKS(sb.sb_nblocks) > 0);
+	assert(SFS_FREEMAPBLOCKS(sb.sb_nblocks, blocksize) > 0);
 }
 
 /*
@@ -83,6 +102,16 @@ sb_check(void)
 		setbadness(EXIT_RECOV);
 		schanged = 1;
 	}
+	if (sb.sb_state & SFS_STATE_ERRORS) {
+		warnx("Volume was marked as having errors");
+	}
+	if (sb.sb_state & ~SFS_STATE_ALL) {
+		warnx("Unknown state flags 0x%lx in superblock (cleared)",
+		      (unsigned long) (sb.sb_state & ~SFS_STATE_ALL));
+		setbadness(EXIT_RECOV);
+		sb.sb_state &= SFS_STATE_ALL;
+		schanged = 1;
+	}
 	if (checkzeroed(sb.reserved, sizeof(sb.reserved))) {
 		warnx("Reserved section of superblock not zeroed (fixed)");
 		setbadness(EXIT_RECOV);
@@ -95,6 +124,49 @@ sb_check(void)
 	}
 }
 
+/*
+ * Check the free block counts, if the volume has them. The kernel
+ * treats them as hints, so a wrong count is not serious.
+ */
+void
+sb_checkfreesum(const uint32_t *freesum)
+{
+	unsigned i;
+	int schanged=0;
+
+	if ((sb.sb_features & SFS_FEATURE_FREESUM) == 0) {
+		return;
+	}
+	for (i=0; i<SFS_NFREESUM; i++) {
+		if (sb.sb_freesum[i] != freesum[i]) {
+			warnx("Free block count %u is %lu, should be %lu "
+			      "(fixed)", i, (unsigned long)sb.sb_freesum[i],
+			      (unsigned long)freesum[i]);
+			setbadness(EXIT_RECOV);
+			sb.sb_freesum[i] = freesum[i];
+			schanged = 1;
+		}
+	}
+	if (schanged) {
+		sfs_writesb(SFS_SUPER_BLOCK, &sb);
+	}
+}
+
+/*
+ * After a complete check, clear the mark saying the volume has
+ * errors.
+ */
+void
+sb_clearerrors(void)
+{
+	if ((sb.sb_state & SFS_STATE_ERRORS) == 0) {
+		return;
+	}
+	sb.sb_state &= ~SFS_STATE_ERRORS;
+	sfs_writesb(SFS_SUPER_BLOCK, &sb);
+	setbadness(EXIT_RECOV);
+}
+
 /*
  * Return the total number of blocks in the volume.
  */
@@ -111,7 +183,16 @@ sb_totalblocks(void)
 uint32_t
 sb_freemapblocks(void)
 {
-	return SFS_FREEMAPBLOCKS(sb.sb_nblocks);
+	return SFS_FREEMAPBLOCKS(sb.sb_nblocks, blocksize);
+}
+
+/*
+ * Return the block size.
+ */
+uint32_t
+sb_blocksize(void)
+{
+	return blocksize;
 }
 
 /*
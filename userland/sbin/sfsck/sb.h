@@ -46,10 +46,25 @@ uint32_t sb_totalblocks(void);
 /* After the superblock is loaded: return number of freemap blocks. */
 uint32_t sb_freemapblocks(void);
 
+/* After the superblock is loaded: return the block size. */
+uint32_t sb_blocksize(void);
+
 /* After the superblock is loaded: return volume name. */
 const char *sb_volname(void);
 
 /* Check the superblock. Must load it first. */
 void sb_check(void);
 
+/*
+ * Check the superblock's free block counts against the number of
+ * free blocks in each group of freemap blocks.
+ */
+void sb_checkfreesum(const uint32_t *freesum);
+
+/*
+ * After everything else is checked and fixed: clear the superblock's
+ * mark that the kernel left the volume with errors.
+ */
+void sb_clearerrors(void);
+
 #endif /* SB_H */
@@ -40,6 +40,7 @@
 #include "utils.h"
 #include "ibmacros.h"
 #include "sfs.h"
+#include "sb.h"
 #include "main.h"
 
 ////////////////////////////////////////////////////////////
@@ -48,9 +49,39 @@
 void
 sfs_setup(void)
 {
-	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
-	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
-	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_superblock)==SFS_MINBLOCKSIZE);
+	assert(sizeof(struct sfs_dinode)==SFS_MINBLOCKSIZE);
+	assert(SFS_MINBLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+}
+
+////////////////////////////////////////////////////////////
+// partial-block I/O
+
+/*
+ * The superblock and inodes are smaller than a block (unless the
+ * block size is the minimum) and live at the beginning of their
+ * blocks. Read and write them through a block-sized buffer.
+ */
+
+static uint8_t partialbuf[SFS_MAXBLOCKSIZE];
+
+static
+void
+readpartial(void *data, size_t len, uint32_t block)
+{
+	assert(len <= diskblocksize());
+	diskread(partialbuf, block);
+	memcpy(data, partialbuf, len);
+}
+
+static
+void
+writepartial(const void *data, size_t len, uint32_t block)
+{
+	assert(len <= diskblocksize());
+	diskread(partialbuf, block);
+	memcpy(partialbuf, data, len);
+	diskwrite(partialbuf, block);
 }
 
 ////////////////////////////////////////////////////////////
@@ -60,8 +91,16 @@ static
 void
 swapsb(struct sfs_superblock *sb)
 {
+	unsigned i;
+
 	sb->sb_magic = SWAP32(sb->sb_magic);
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
+	sb->sb_blocksize = SWAP32(sb->sb_blocksize);
+	sb->sb_features = SWAP32(sb->sb_features);
+	sb->sb_state = SWAP32(sb->sb_state);
+	for (i=0; i<SFS_NFREESUM; i++) {
+		sb->sb_freesum[i] = SWAP32(sb->sb_freesum[i]);
+	}
 }
 
 static
@@ -97,6 +136,18 @@ swapinode(struct sfs_dinode *sfi)
 	for (i=0; i<NUM_III; i++) {
 		SET_III(sfi, i) = SWAP32(GET_III(sfi, i));
 	}
+
+	sfi->sfi_flags = SWAP32(sfi->sfi_flags);
+	sfi->sfi_nextents = SWAP32(sfi->sfi_nextents);
+	sfi->sfi_extroot = SWAP32(sfi->sfi_extroot);
+	for (i=0; i<SFS_NIEXTENTS; i++) {
+		sfi->sfi_extents[i].sfe_fileblock =
+			SWAP32(sfi->sfi_extents[i].sfe_fileblock);
+		sfi->sfi_extents[i].sfe_diskblock =
+			SWAP32(sfi->sfi_extents[i].sfe_diskblock);
+		sfi->sfi_extents[i].sfe_len =
+			SWAP32(sfi->sfi_extents[i].sfe_len);
+	}
 }
 
 static
@@ -110,8 +161,8 @@ static
 void
 swapindir(uint32_t *entries)
 {
-	int i;
-	for (i=0; i<SFS_DBPERIDB; i++) {
+	unsigned i;
+	for (i=0; i<DBPERIDB; i++) {
 		entries[i] = SWAP32(entries[i]);
 	}
 }
@@ -132,7 +183,7 @@ static
 uint32_t
 ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 
 	if (iblock == 0) {
 		return 0;
@@ -144,14 +195,68 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 	if (entrysize > 1) {
 		uint32_t index = offset / entrysize;
 		offset %= entrysize;
-		return ibmap(entries[index], offset, entrysize/SFS_DBPERIDB);
+		return ibmap(entries[index], offset, entrysize/DBPERIDB);
 	}
 	else {
-		assert(offset < SFS_DBPERIDB);
+		assert(offset < DBPERIDB);
 		return entries[offset];
 	}
 }
 
+/*
+ * Extent bmap: find the extent of an extent-mapped inode that maps
+ * FILEBLOCK, looking first in the inode and then in the extent tree.
+ */
+static
+uint32_t
+ebmap(const struct sfs_dinode *sfi, uint32_t fileblock)
+{
+	uint32_t buf[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
+	const struct sfs_extheader *hdr = (const void *)buf;
+	const struct sfs_extindex *idx = (const void *)(hdr + 1);
+	const struct sfs_extent *ext;
+	uint32_t i, n, leaf;
+
+	for (i=0; i<sfi->sfi_nextents && i<SFS_NIEXTENTS; i++) {
+		ext = &sfi->sfi_extents[i];
+		if (fileblock >= ext->sfe_fileblock &&
+		    fileblock - ext->sfe_fileblock < ext->sfe_len) {
+			return ext->sfe_diskblock +
+				(fileblock - ext->sfe_fileblock);
+		}
+	}
+
+	if (sfi->sfi_extroot == 0) {
+		return 0;
+	}
+	sfs_readextblock(sfi->sfi_extroot, buf);
+	if (hdr->seh_magic != SFS_EXTMAGIC_INDEX || hdr->seh_count == 0) {
+		return 0;
+	}
+	n = hdr->seh_count;
+	if (n > SFS_EXTIDXPERBLOCK(sb_blocksize())) {
+		n = SFS_EXTIDXPERBLOCK(sb_blocksize());
+	}
+	for (i=1; i<n && idx[i].sei_fileblock <= fileblock; i++) {
+		/* nothing */
+	}
+	leaf = idx[i-1].sei_block;
+
+	sfs_readextblock(leaf, buf);
+	if (hdr->seh_magic != SFS_EXTMAGIC_LEAF) {
+		return 0;
+	}
+	ext = (const void *)(hdr + 1);
+	for (i=0; i<hdr->seh_count && i<SFS_EXTPERBLOCK(sb_blocksize()); i++) {
+		if (fileblock >= ext[i].sfe_fileblock &&
+		    fileblock - ext[i].sfe_fileblock < ext[i].sfe_len) {
+			return ext[i].sfe_diskblock +
+				(fileblock - ext[i].sfe_fileblock);
+		}
+	}
+	return 0;
+}
+
 /*
  * bmap() for SFS.
  *
@@ -163,6 +268,10 @@ bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 {
 	uint32_t iblock, offset;
 
+	if (sfi->sfi_flags & SFS_IFLAG_EXTENTS) {
+		return ebmap(sfi, fileblock);
+	}
+
 	if (fileblock < INOMAX_D) {
 		return GET_D(sfi, fileblock);
 	}
@@ -194,7 +303,7 @@ bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 void
 sfs_readsb(uint32_t blocknum, struct sfs_superblock *sb)
 {
-	diskread(sb, blocknum);
+	readpartial(sb, sizeof(*sb), blocknum);
 	swapsb(sb);
 }
 
@@ -202,7 +311,7 @@ void
 sfs_writesb(uint32_t blocknum, struct sfs_superblock *sb)
 {
 	swapsb(sb);
-	diskwrite(sb, blocknum);
+	writepartial(sb, sizeof(*sb), blocknum);
 	swapsb(sb);
 }
 
@@ -233,7 +342,7 @@ sfs_writefreemapblock(uint32_t whichblock, uint8_t *bits)
 void
 sfs_readinode(uint32_t ino, struct sfs_dinode *sfi)
 {
-	diskread(sfi, ino);
+	readpartial(sfi, sizeof(*sfi), ino);
 	swapinode(sfi);
 }
 
@@ -241,7 +350,7 @@ void
 sfs_writeinode(uint32_t ino, struct sfs_dinode *sfi)
 {
 	swapinode(sfi);
-	diskwrite(sfi, ino);
+	writepartial(sfi, sizeof(*sfi), ino);
 	swapinode(sfi);
 }
 
@@ -264,6 +373,23 @@ sfs_writeindirect(uint32_t blocknum, uint32_t *entries)
 	swapindir(entries);
 }
 
+/*
+ *  extent tree blocks - blocknum is a disk block number. These are
+ *  made entirely of 32-bit words, so they swap like indirect blocks.
+ */
+
+void
+sfs_readextblock(uint32_t blocknum, uint32_t *words)
+{
+	sfs_readindirect(blocknum, words);
+}
+
+void
+sfs_writeextblock(uint32_t blocknum, uint32_t *words)
+{
+	sfs_writeindirect(blocknum, words);
+}
+
 ////////////////////////////////////////////////////////////
 // directory I/O
 
@@ -274,7 +400,7 @@ static
 void
 sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = sb_blocksize()/sizeof(struct sfs_direntry);
 	unsigned j;
 
 	if (diskblock != 0) {
@@ -285,7 +411,7 @@ sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 	}
 	else {
 		warnx("Warning: sparse directory found");
-		bzero(d, SFS_BLOCKSIZE);
+		bzero(d, sb_blocksize());
 	}
 }
 
@@ -297,7 +423,7 @@ sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 void
 sfs_readdir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = sb_blocksize()/sizeof(struct sfs_direntry);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j;
 	unsigned left, thismany;
@@ -330,7 +456,7 @@ static
 void
 sfs_writedirblock(struct sfs_direntry *d, uint32_t diskblock)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = sb_blocksize()/sizeof(struct sfs_direntry);
 	unsigned j, bad;
 
 	if (diskblock != 0) {
@@ -362,7 +488,7 @@ sfs_writedirblock(struct sfs_direntry *d, uint32_t diskblock)
 void
 sfs_writedir(const struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = sb_blocksize()/sizeof(struct sfs_direntry);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j;
 	unsigned left, thismany;